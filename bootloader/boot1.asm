@@ -1,7 +1,17 @@
 org 0x7C00 ; Bootloader starts at memory address 0x7C00
 bits 16
 
-start: 
+; boot manifest (written by build.sh, layout described there)
+MANIFEST_ADDR    equ 0x7E00
+MANIFEST_MAGIC   equ 0x4E414D42   ; "BMAN"
+MANIFEST_ENTRIES equ 16
+ENT_LBA          equ 8
+ENT_SECTORS      equ 16
+ENT_CHECKSUM     equ 24
+
+BOOT1_STAMP_ADDR equ 0x500        ; boot1's rdtsc, picked up by boot2
+
+start:
   xor ax, ax
   mov ds, ax
   mov es, ax
@@ -12,15 +22,49 @@ start:
   sti
 
   mov [boot_drive], dl
+
+  ; boot2 moves it into the boot timeline (rdtsc clobbers dl, saved above)
+  rdtsc
+  mov [BOOT1_STAMP_ADDR], eax
+  mov [BOOT1_STAMP_ADDR + 4], edx
+
+  mov ah, 0x42
+  mov dl, [boot_drive]
+  mov si, dap_manifest
+  int 0x13
+  jc disk_error
+
+  ; the first entry is boot2
+  cmp dword [MANIFEST_ADDR], MANIFEST_MAGIC
+  jne disk_error
+  mov eax, [MANIFEST_ADDR + MANIFEST_ENTRIES + ENT_LBA]
+  mov [dap_boot2 + 8], eax
+  mov eax, [MANIFEST_ADDR + MANIFEST_ENTRIES + ENT_LBA + 4]
+  mov [dap_boot2 + 12], eax
+  mov ax, [MANIFEST_ADDR + MANIFEST_ENTRIES + ENT_SECTORS]
+  mov [dap_boot2 + 2], ax
+
   mov ah, 0x42
   mov dl, [boot_drive]
   mov si, dap_boot2
   int 0x13
   jc disk_error
-  
+
+  ; sum of boot2's dwords must match the manifest
+  mov cx, [MANIFEST_ADDR + MANIFEST_ENTRIES + ENT_SECTORS]
+  shl cx, 7                       ; 128 dwords per sector
+  mov si, 0x8000
+  xor ebx, ebx
+.sum:
+  add ebx, [si]
+  add si, 4
+  loop .sum
+  cmp ebx, [MANIFEST_ADDR + MANIFEST_ENTRIES + ENT_CHECKSUM]
+  jne disk_error
+
   cli
   mov dl, [boot_drive]; to ENSURE dl contains the boot drive for stage 2
-  jmp 0x800:0x0000; jump to stage 2 bootloader 
+  jmp 0x800:0x0000; jump to stage 2 bootloader
 
 disk_error:
   hlt
@@ -28,14 +72,21 @@ disk_error:
 
 boot_drive: db 0
 
-dap_boot2: 
+dap_manifest:
+  db 16 ;size
+  db 0; reserved 0
+  dw 1; how many sectors to store
+  dw MANIFEST_ADDR; destination offset
+  dw 0; destination segment
+  dq 1; disk sector location (lba)
+
+dap_boot2:
   db 16 ;size
   db 0; reserved 0
-  dw 32; how many sectors to store 
+  dw 0; how many sectors to store (from the manifest)
   dw 0; destination offset
   dw 0x800; destination segment
-  dq 1; disk sector location (lba)
+  dq 0; disk sector location (lba, from the manifest)
 
 times 510 - ($ - $$) db 0
 dw 0xAA55
- 
@@ -6,6 +6,43 @@ E820_ENTRY_SIZE equ 24
 
 VBE_MODE equ 0x118
 
+; boot manifest, read by boot1 (layout described in build.sh)
+MANIFEST_ADDR    equ 0x7E00
+MANIFEST_MAGIC   equ 0x4E414D42   ; "BMAN"
+MANIFEST_COUNT   equ 6
+MANIFEST_ENTRIES equ 16
+MANIFEST_ID_LOADER equ 2
+ENT_SIZE         equ 32
+ENT_ID           equ 0
+ENT_LOAD         equ 4
+ENT_LBA          equ 8
+ENT_SECTORS      equ 16
+ENT_CHECKSUM     equ 24
+
+; boot timeline slots, same ids as boot_stamp_t (kernel/common.h)
+BOOT_STAMP_BOOT1       equ 0
+BOOT_STAMP_BOOT2       equ 1
+BOOT_STAMP_LOADER_READ equ 2
+BOOT_STAMP_E820        equ 3
+BOOT_STAMP_VBE         equ 4
+BOOT_STAMP_LONG_MODE   equ 5
+BOOT_STAMP_MAX         equ 16
+BOOT1_STAMP_ADDR       equ 0x500
+
+; rdtsc into the timeline (16 / 32-bit code, clobbers eax, edx)
+%macro BOOT_STAMP 1
+  rdtsc
+  mov [boot_stamps + (%1) * 8], eax
+  mov [boot_stamps + (%1) * 8 + 4], edx
+%endmacro
+
+; sectors per int 0x13 extended read: the most every EDD BIOS takes
+EDD_MAX_SECTORS  equ 127
+DAP_COUNT        equ 2
+DAP_OFF          equ 4
+DAP_SEG          equ 6
+DAP_LBA          equ 8
+
 start:
   xor ax, ax
   mov ds, ax
@@ -17,14 +54,24 @@ start:
   sti 
 
   mov [boot_drive], dl
-  mov ah, 0x42
-  mov dl, [boot_drive]
-  mov si, dap_kernel 
-  int 0x13
+  BOOT_STAMP BOOT_STAMP_BOOT2
+  mov eax, [BOOT1_STAMP_ADDR]
+  mov [boot_stamps + BOOT_STAMP_BOOT1 * 8], eax
+  mov eax, [BOOT1_STAMP_ADDR + 4]
+  mov [boot_stamps + BOOT_STAMP_BOOT1 * 8 + 4], eax
+
+  mov eax, MANIFEST_ID_LOADER
+  call manifest_find
+  jc disk_error
+  mov [loader_entry], si
+  call load_component
   jc disk_error
+  BOOT_STAMP BOOT_STAMP_LOADER_READ
 
   call get_e820_map
+  BOOT_STAMP BOOT_STAMP_E820
   call get_vbe
+  BOOT_STAMP BOOT_STAMP_VBE
   
 enter_protected_mode:
   cli
@@ -41,6 +88,75 @@ enter_protected_mode:
 
   jmp 0x08:protected_entry
 
+; eax = component id -> si = its manifest entry, carry set if there is none
+manifest_find:
+  cmp dword [MANIFEST_ADDR], MANIFEST_MAGIC
+  jne .fail
+  mov cx, [MANIFEST_ADDR + MANIFEST_COUNT]
+  mov si, MANIFEST_ADDR + MANIFEST_ENTRIES
+.next:
+  jcxz .fail
+  cmp [si + ENT_ID], eax
+  je .found
+  add si, ENT_SIZE
+  dec cx
+  jmp .next
+.found:
+  clc
+  ret
+.fail:
+  stc
+  ret
+
+; si = manifest entry. reads it to its load address (below 1 MiB, paragraph
+; aligned) in EDD_MAX_SECTORS chunks, carry set on a disk error
+load_component:
+  mov eax, [si + ENT_LBA]
+  mov [dap_load + DAP_LBA], eax
+  mov eax, [si + ENT_LBA + 4]
+  mov [dap_load + DAP_LBA + 4], eax
+  mov eax, [si + ENT_LOAD]
+  shr eax, 4
+  mov [dap_load + DAP_SEG], ax
+  mov word [dap_load + DAP_OFF], 0
+  mov ecx, [si + ENT_SECTORS]
+
+.chunk:
+  test ecx, ecx
+  jz .done
+  mov eax, ecx
+  cmp eax, EDD_MAX_SECTORS
+  jbe .fits
+  mov eax, EDD_MAX_SECTORS
+.fits:
+  mov [dap_load + DAP_COUNT], ax
+
+  push eax
+  push ecx
+  push si
+  mov ah, 0x42
+  mov dl, [boot_drive]
+  mov si, dap_load
+  int 0x13
+  pop si
+  pop ecx
+  pop eax
+  jc .fail
+
+  sub ecx, eax
+  add [dap_load + DAP_LBA], eax
+  adc dword [dap_load + DAP_LBA + 4], 0
+  shl ax, 5                       ; 32 paragraphs per sector
+  add [dap_load + DAP_SEG], ax
+  jmp .chunk
+
+.done:
+  clc
+  ret
+.fail:
+  stc
+  ret
+
 get_e820_map:
   xor ebx, ebx
   xor bp, bp
@@ -122,6 +238,21 @@ protected_entry:
 
   mov esp, 0x00009800
 
+; the loader's dwords must add up to the manifest checksum (flat addressing here)
+verify_loader:
+  movzx esi, word [loader_entry]
+  mov edi, [esi + ENT_LOAD]
+  mov ecx, [esi + ENT_SECTORS]
+  shl ecx, 7                      ; 128 dwords per sector
+  xor eax, eax
+.sum:
+  add eax, [edi]
+  add edi, 4
+  dec ecx
+  jnz .sum
+  cmp eax, [esi + ENT_CHECKSUM]
+  jne checksum_error
+
 enter_long_mode:
 ;cr's = 32 bit
 ;step 1: force disable paging -> cr0.pg (bit 31)
@@ -157,6 +288,11 @@ long_entry:
   mov ds, ax
   mov es, ax
   mov ss, ax
+
+  rdtsc
+  shl rdx, 32
+  or rax, rdx
+  mov [rel boot_stamps + BOOT_STAMP_LONG_MODE * 8], rax
  
   lea rdi, [rel bootinfo]         ; ptr for kernel use
 
@@ -167,7 +303,13 @@ disk_error:
   hlt
   jmp disk_error
 
+bits 32
+checksum_error:
+  hlt
+  jmp checksum_error
+
 boot_drive db 0
+loader_entry dw 0
 
 bootinfo:
 e820_count dw 0
@@ -180,16 +322,20 @@ vbe_pitch dw 0
 vbe_bpp  db 0
 align 4
 vbe_fb   dd 0
+boot_tsc_hz dq 0                  ; set by the kernelLoader
+boot_stamps times (BOOT_STAMP_MAX * 8) db 0
+boot_initrd_phys dq 0             ; set by the kernelLoader
+boot_initrd_size dq 0
 
 vbe_mode_info times 256 db 0
 
-dap_kernel:
+dap_load:
   db 16
   db 0;
-  dw 16;
+  dw 0;                          ; sectors this call
   dw 0;
-  dw 0x2000;
-  dq 33;
+  dw 0;                          ; segment, moves along with each chunk
+  dq 0;
  
 gdt_desc:
   dw gdt_end - gdt - 1 ;limit (bytes - 1)
@@ -4,11 +4,59 @@ set -e
 # directories
 BOOT_DIR="bootloader"
 LOADER_DIR="kernelLoader"
+# code built into both the kernelLoader and the kernel, each against its own common.h
+SHARED_DIR="shared"
 KERNEL_DIR="kernel"
 BUILD_DIR="build"
 
 mkdir -p "$BUILD_DIR"
 
+# ./build.sh host: the kernel's drivers as a Linux program against a simulated
+# PC (host/sim.c: IDE controller with bus master DMA, PICs, PIT), then its tests
+# and benchmarks. nothing else is built. ./build.sh host <name> runs the tests
+# whose name contains <name>, ./build.sh host bench only the benchmarks
+if [ "${1:-}" = host ]; then
+  echo "[+] Building host tests"
+  HOST_DIR="host"
+  HOST_BUILD_DIR="$BUILD_DIR/host"
+  HOST_KERNEL_SRCS=(ata_driver_irq bcache blk blk_qos blk_queue blk_ring discard pci pit raid0 readahead)
+  HOST_SHARED_SRCS=(pit_calibrate serial)
+  HOST_CFLAGS=(
+    -DKERNEL_HOST
+    -O2
+    -g
+    -mgeneral-regs-only
+    -fno-omit-frame-pointer
+    -Wall -Wextra -Wpedantic
+    -Wno-unused-parameter
+    -Wno-missing-field-initializers
+    -I "$KERNEL_DIR"
+    -I "$SHARED_DIR"
+  )
+  mkdir -p "$HOST_BUILD_DIR"
+
+  HOST_OBJS=()
+  for name in "${HOST_KERNEL_SRCS[@]}"; do
+    obj="$HOST_BUILD_DIR/kernel_$name.o"
+    gcc "${HOST_CFLAGS[@]}" -c "$KERNEL_DIR/$name.c" -o "$obj"
+    HOST_OBJS+=("$obj")
+  done
+  for name in "${HOST_SHARED_SRCS[@]}"; do
+    obj="$HOST_BUILD_DIR/shared_$name.o"
+    gcc "${HOST_CFLAGS[@]}" -c "$SHARED_DIR/$name.c" -o "$obj"
+    HOST_OBJS+=("$obj")
+  done
+  for src in "$HOST_DIR"/*.c; do
+    obj="$HOST_BUILD_DIR/host_$(basename "${src%.c}").o"
+    gcc "${HOST_CFLAGS[@]}" -c "$src" -o "$obj"
+    HOST_OBJS+=("$obj")
+  done
+  gcc "${HOST_OBJS[@]}" -o "$HOST_BUILD_DIR/ata_host"
+
+  "$HOST_BUILD_DIR/ata_host" "${@:2}"
+  exit $?
+fi
+
 echo "[+] Building kernelLoader (C/ASM → ELF → BIN)"
 
 CFLAGS=(
@@ -31,10 +79,10 @@ CFLAGS=(
 
 # ---- build kernelLoader ----
 LOADER_C_OBJS=()
-for src in "$LOADER_DIR"/*.c; do
+for src in "$LOADER_DIR"/*.c "$SHARED_DIR"/*.c; do
   [ -e "$src" ] || continue
   obj="$BUILD_DIR/loader_$(basename "${src%.c}").o"
-  gcc "${CFLAGS[@]}" -c "$src" -o "$obj"
+  gcc "${CFLAGS[@]}" -I "$LOADER_DIR" -I "$SHARED_DIR" -c "$src" -o "$obj"
   LOADER_C_OBJS+=("$obj")
 done
 
@@ -59,11 +107,33 @@ objcopy -O binary \
 echo "[+] Building kernel (C/ASM → ELF → BIN)"
 
 # ---- build kernel (the one loaded by kernelLoader) ----
+# KEXEC=1: once booted, the kernel reloads itself from disk through kexec and the
+# second one reports the restart time with its boot timeline
+# HIBERNATE=1: it hibernates to the boot disk and powers off, QEMU is started
+# again on the same disk and the resumed kernel reports the round trip
+# BENCH=1: the boot also times the block layers (md0 striped against one member,
+# a batch of ata0 reads through ring0) and prints the results; a normal boot does
+# no benchmark I/O
+KERNEL_DEFS=()
+if [ "${KEXEC:-0}" = 1 ]; then
+  KERNEL_DEFS+=(-DKEXEC_TEST)
+fi
+if [ "${HIBERNATE:-0}" = 1 ]; then
+  KERNEL_DEFS+=(-DHIBERNATE_TEST)
+fi
+if [ "${BENCH:-0}" = 1 ]; then
+  KERNEL_DEFS+=(-DBLK_BENCH)
+fi
+# ata2 is only TRIMmed when build.sh made it the scratch disk (IDE_SECOND_DISK)
+if [ "${DISK_IF:-ide}" = ide ] && [ -n "${IDE_SECOND_DISK:-}" ]; then
+  KERNEL_DEFS+=(-DSCRATCH_TRIM_TEST)
+fi
+
 KERNEL_C_OBJS=()
-for src in "$KERNEL_DIR"/*.c; do
+for src in "$KERNEL_DIR"/*.c "$SHARED_DIR"/*.c; do
   [ -e "$src" ] || continue
   obj="$BUILD_DIR/kernel_$(basename "${src%.c}").o"
-  gcc "${CFLAGS[@]}" -c "$src" -o "$obj"
+  gcc "${CFLAGS[@]}" "${KERNEL_DEFS[@]}" -I "$KERNEL_DIR" -I "$SHARED_DIR" -c "$src" -o "$obj"
   KERNEL_C_OBJS+=("$obj")
 done
 
@@ -79,9 +149,30 @@ ld -nostdlib -z max-page-size=0x1000 -T "$KERNEL_DIR/link.ld" \
   "${KERNEL_ASM_OBJS[@]}" "${KERNEL_C_OBJS[@]}" \
   -o "$BUILD_DIR/kernel.elf"
 
-objcopy -O binary \
-  -j .text -j .rodata -j .data -j .bss \
-  "$BUILD_DIR/kernel.elf" "$BUILD_DIR/kernel.bin"
+# the loader reads the ELF itself: only PT_LOAD file bytes are on disk, bss is
+# zeroed in memory. symbols and debug info stay in build/kernel.elf
+objcopy --strip-all "$BUILD_DIR/kernel.elf" "$BUILD_DIR/kernel.load.elf"
+
+# compressed payload (KERNEL_LZ4=0 writes the plain ELF instead): one header
+# sector { "KLZ4", original size, compressed size, cksum of the ELF } (u32 LE),
+# then the lz4 legacy stream. the loader decompresses while it reads
+le32() {
+  printf '\\x%02x\\x%02x\\x%02x\\x%02x' \
+    $(($1 & 0xFF)) $((($1 >> 8) & 0xFF)) $((($1 >> 16) & 0xFF)) $((($1 >> 24) & 0xFF))
+}
+
+if [ "${KERNEL_LZ4:-1}" = 1 ]; then
+  lz4 -l -9 -f -q "$BUILD_DIR/kernel.load.elf" "$BUILD_DIR/kernel.lz4"
+  orig_size=$(stat -c %s "$BUILD_DIR/kernel.load.elf")
+  lz4_size=$(stat -c %s "$BUILD_DIR/kernel.lz4")
+  sum=$(cksum < "$BUILD_DIR/kernel.load.elf" | cut -d' ' -f1)
+
+  printf "KLZ4$(le32 "$orig_size")$(le32 "$lz4_size")$(le32 "$sum")" > "$BUILD_DIR/kernel.img"
+  truncate -s 512 "$BUILD_DIR/kernel.img"
+  cat "$BUILD_DIR/kernel.lz4" >> "$BUILD_DIR/kernel.img"
+else
+  cp "$BUILD_DIR/kernel.load.elf" "$BUILD_DIR/kernel.img"
+fi
 
 
 echo "[+] Building bootloaders (NASM)"
@@ -94,43 +185,235 @@ stat -c "%n %s" \
   "$BUILD_DIR/boot1.bin" \
   "$BUILD_DIR/boot2.bin" \
   "$BUILD_DIR/kernelLoader.bin" \
-  "$BUILD_DIR/kernel.bin"
+  "$BUILD_DIR/kernel.load.elf" \
+  "$BUILD_DIR/kernel.img"
 
 echo "[+] Checking boot signature (must be 55aa)"
 tail -c 2 "$BUILD_DIR/boot1.bin" | xxd -p
 
-# Pad boot2 to 16 KiB (32 sectors)
-truncate -s 16384 "$BUILD_DIR/boot2.bin"
-
 echo "[+] Creating disk image"
 
-# Fixed layout (for now):
+# Layout, worked out from the component sizes:
 # LBA 0           : boot1 (1 sector)
-# LBA 1–32        : boot2 (32 sectors)
-# LBA 33–(33+N1)  : kernelLoader.bin
-# LBA 2048+       : kernel.bin  (1 MiB offset, easy to reason about)
+# LBA 1           : boot manifest (where everything else is, see below)
+# LBA 2..         : boot2
+# next            : kernelLoader.bin
+# next 1 MiB mark : kernel.img, LZ4 or plain ELF
+# next 1 MiB mark : initrd (only with INITRD=<file>, at most 8 MiB)
+# past those       : hibernation area, HIBERNATE_MB (default 256, 0 = none) MiB
+#                    the kernel writes a suspended system's memory to
 #
-# 2048 sectors * 512 = 1 MiB
+# manifest sector, all little endian:
+#   0  "BMAN", u16 version (1), u16 entry count, 8 reserved bytes
+#   16 entries of 32 bytes: u32 id, u32 load address (0 = a later stage loads
+#      it), u64 lba, u32 sectors, u32 bytes, u32 checksum, u32 flags
+# ids: 1 boot2, 2 kernelLoader, 3 kernel, 4 initrd, 5 hibernation area (no
+# contents: bytes and checksum 0). checksum: 32-bit sum of the component's dwords
+# over whole sectors (zero padded)
+# boot1 loads boot2 from it, boot2 the kernelLoader, the loader the kernel
+
+MANIFEST_LBA=1
+BOOT2_ADDR=0x8000
+LOADER_ADDR=0x20000
+INITRD_ADDR=0x800000     # above the kernel's segments, in boot2's 16 MiB identity map
+
+sectors_of() {
+  echo $(( ($(stat -c %s "$1") + 511) / 512 ))
+}
+
+sum32() {
+  local padded="$BUILD_DIR/sum32.tmp"
+  cp "$1" "$padded"
+  truncate -s $(( $(sectors_of "$1") * 512 )) "$padded"
+  od -An -v -tu4 "$padded" | awk '{ for (i = 1; i <= NF; i++) s = (s + $i) % 4294967296 } END { printf "%.0f\n", s }'
+  rm -f "$padded"
+}
 
-LOADER_LBA=33
-KERNEL_LBA=2048
+manifest_entry() {   # id load_address lba file
+  printf "$(le32 "$1")$(le32 "$2")$(le32 "$3")$(le32 0)"
+  printf "$(le32 "$(sectors_of "$4")")$(le32 "$(stat -c %s "$4")")$(le32 "$(sum32 "$4")")$(le32 0)"
+}
 
-# big enough for loader+kernel growth
+BOOT2_LBA=$((MANIFEST_LBA + 1))
+BOOT2_SECTORS=$(sectors_of "$BUILD_DIR/boot2.bin")
+LOADER_LBA=$((BOOT2_LBA + BOOT2_SECTORS))
+LOADER_SECTORS=$(sectors_of "$BUILD_DIR/kernelLoader.bin")
+KERNEL_LBA=$(( (LOADER_LBA + LOADER_SECTORS + 2047) / 2048 * 2048 ))
+KERNEL_SECTORS=$(sectors_of "$BUILD_DIR/kernel.img")
+MANIFEST_COUNT=3
+if [ -n "${INITRD:-}" ]; then
+  INITRD_LBA=$(( (KERNEL_LBA + KERNEL_SECTORS + 2047) / 2048 * 2048 ))
+  INITRD_SECTORS=$(sectors_of "$INITRD")
+  MANIFEST_COUNT=4
+fi
+
+# room for the kernel to grow and for whatever the kernel writes past it
 DISK_SECTORS=$((KERNEL_LBA + 32768))   # +16 MiB after kernel start
+if [ -n "${INITRD:-}" ] && [ $((INITRD_LBA + INITRD_SECTORS)) -gt "$DISK_SECTORS" ]; then
+  DISK_SECTORS=$((INITRD_LBA + INITRD_SECTORS))
+fi
+
+HIBERNATE_MB=${HIBERNATE_MB:-256}
+if [ "$HIBERNATE_MB" -gt 0 ]; then
+  HIBERNATE_LBA=$(( (DISK_SECTORS + 2047) / 2048 * 2048 ))
+  HIBERNATE_SECTORS=$((HIBERNATE_MB * 2048))
+  DISK_SECTORS=$((HIBERNATE_LBA + HIBERNATE_SECTORS))
+  MANIFEST_COUNT=$((MANIFEST_COUNT + 1))
+fi
+
+# boot1 reads boot2 in one call and sums it with 16-bit offsets: at most 32 KiB.
+# the loader is read in real mode and must stay below the EBDA (with its bss)
+if [ "$BOOT2_SECTORS" -gt 64 ]; then
+  echo "boot2.bin is larger than 32 KiB" >&2
+  exit 1
+fi
+if [ $((LOADER_ADDR + LOADER_SECTORS * 512)) -gt $((0x80000)) ]; then
+  echo "kernelLoader.bin does not fit between $LOADER_ADDR and 0x80000" >&2
+  exit 1
+fi
+if [ -n "${INITRD:-}" ] && [ $((INITRD_ADDR + INITRD_SECTORS * 512)) -gt $((0x1000000)) ]; then
+  echo "$INITRD does not fit between $INITRD_ADDR and 16 MiB" >&2
+  exit 1
+fi
+if [ "${HIBERNATE:-0}" = 1 ] && [ "$HIBERNATE_MB" -eq 0 ]; then
+  echo "HIBERNATE=1 needs a hibernation area (HIBERNATE_MB > 0)" >&2
+  exit 1
+fi
+
+{
+  printf "BMAN$(le32 $((1 | (MANIFEST_COUNT << 16))))$(le32 0)$(le32 0)"
+  manifest_entry 1 $BOOT2_ADDR  $BOOT2_LBA  "$BUILD_DIR/boot2.bin"
+  manifest_entry 2 $LOADER_ADDR $LOADER_LBA "$BUILD_DIR/kernelLoader.bin"
+  manifest_entry 3 0            $KERNEL_LBA "$BUILD_DIR/kernel.img"
+  if [ -n "${INITRD:-}" ]; then
+    manifest_entry 4 $INITRD_ADDR $INITRD_LBA "$INITRD"
+  fi
+  if [ "$HIBERNATE_MB" -gt 0 ]; then
+    printf "$(le32 5)$(le32 0)$(le32 "$HIBERNATE_LBA")$(le32 0)"
+    printf "$(le32 "$HIBERNATE_SECTORS")$(le32 0)$(le32 0)$(le32 0)"
+  fi
+} > "$BUILD_DIR/manifest.bin"
+truncate -s 512 "$BUILD_DIR/manifest.bin"
+
+echo "boot2 @ $BOOT2_LBA ($BOOT2_SECTORS), kernelLoader @ $LOADER_LBA ($LOADER_SECTORS), kernel @ $KERNEL_LBA ($KERNEL_SECTORS)"
+if [ -n "${INITRD:-}" ]; then
+  echo "initrd @ $INITRD_LBA ($INITRD_SECTORS)"
+fi
+if [ "$HIBERNATE_MB" -gt 0 ]; then
+  echo "hibernation area @ $HIBERNATE_LBA ($HIBERNATE_SECTORS)"
+fi
 
 truncate -s $((DISK_SECTORS * 512)) "$BUILD_DIR/disk.img"
 
-dd if="$BUILD_DIR/boot1.bin"        of="$BUILD_DIR/disk.img" bs=512 seek=0          conv=notrunc status=none
-dd if="$BUILD_DIR/boot2.bin"        of="$BUILD_DIR/disk.img" bs=512 seek=1          conv=notrunc status=none
+dd if="$BUILD_DIR/boot1.bin"        of="$BUILD_DIR/disk.img" bs=512 seek=0             conv=notrunc status=none
+dd if="$BUILD_DIR/manifest.bin"     of="$BUILD_DIR/disk.img" bs=512 seek=$MANIFEST_LBA conv=notrunc status=none
+dd if="$BUILD_DIR/boot2.bin"        of="$BUILD_DIR/disk.img" bs=512 seek=$BOOT2_LBA    conv=notrunc status=none
 dd if="$BUILD_DIR/kernelLoader.bin" of="$BUILD_DIR/disk.img" bs=512 seek=$LOADER_LBA conv=notrunc status=none
-dd if="$BUILD_DIR/kernel.bin"       of="$BUILD_DIR/disk.img" bs=512 seek=$KERNEL_LBA conv=notrunc status=none
+dd if="$BUILD_DIR/kernel.img"       of="$BUILD_DIR/disk.img" bs=512 seek=$KERNEL_LBA conv=notrunc status=none
+if [ -n "${INITRD:-}" ]; then
+  dd if="$INITRD"                   of="$BUILD_DIR/disk.img" bs=512 seek=$INITRD_LBA conv=notrunc status=none
+fi
+# a rebuilt image never resumes what an older kernel left in the area
+if [ "$HIBERNATE_MB" -gt 0 ]; then
+  dd if=/dev/zero                   of="$BUILD_DIR/disk.img" bs=512 seek=$HIBERNATE_LBA count=1 conv=notrunc status=none
+fi
 
 stat -c "%n %s" "$BUILD_DIR/disk.img"
 
+# the image is sparse: allocated size vs apparent size. TRIM from the guest
+# (discard=unmap below) punches holes, so the first number shrinks after a run
+disk_usage() {
+  echo "$1: $(du -k "$1" | cut -f1) KiB allocated of $(du -k --apparent-size "$1" | cut -f1) KiB"
+}
+disk_usage "$BUILD_DIR/disk.img"
+
 echo "[+] Running QEMU"
 
-qemu-system-x86_64 \
-  -drive format=raw,file=build/disk.img,if=ide \
-  -serial mon:stdio \
-  -no-reboot \
-  -no-shutdown
+# the boot disk is always the primary IDE master: boot2 and the kernelLoader only
+# read through the legacy IDE ports. DISK_IF picks where a second, blank data
+# disk of DATA_DISK_MB MiB (default 64) goes:
+# DISK_IF=ide (default) no data disk,
+# DISK_IF=ahci attaches it to an AHCI controller (ahci0 in the kernel),
+# DISK_IF=virtio on a modern-only virtio-blk device with VIRTIO_QUEUES queues
+# (vblkq0.. in the kernel)
+# IDE_SECOND_DISK=<MiB> (ide only) adds a scratch disk as secondary master (ata2).
+# its first 8 MiB are filled here and TRIMmed by the kernel at boot, see the
+# allocated size of disk2.img before and after the run
+# RAID0_MB=<MiB> (ide only) adds blank primary and secondary slaves (ata1, ata3),
+# which the kernel stripes as md0 (with BENCH=1 it reads md0 and one drive to compare)
+# IDE drives take TRIM (discard=unmap): freed ranges become holes in the image
+DISK_IF="${DISK_IF:-ide}"
+
+data_disk() {
+  rm -f "$BUILD_DIR/disk_$1.img"
+  truncate -s "${DATA_DISK_MB:-64}M" "$BUILD_DIR/disk_$1.img"
+}
+
+QEMU_DISK=(-drive format=raw,file=build/disk.img,if=ide,index=0,discard=unmap)
+case "$DISK_IF" in
+  ide)
+    if [ -n "${IDE_SECOND_DISK:-}" ]; then
+      rm -f "$BUILD_DIR/disk2.img"
+      truncate -s "${IDE_SECOND_DISK}M" "$BUILD_DIR/disk2.img"
+      dd if=/dev/urandom of="$BUILD_DIR/disk2.img" bs=1M count=8 conv=notrunc status=none
+      disk_usage "$BUILD_DIR/disk2.img"
+      QEMU_DISK+=(-drive format=raw,file=build/disk2.img,if=ide,index=2,discard=unmap)
+    fi
+    if [ -n "${RAID0_MB:-}" ]; then
+      for index in 1 3; do
+        rm -f "$BUILD_DIR/disk$index.img"
+        truncate -s "${RAID0_MB}M" "$BUILD_DIR/disk$index.img"
+        QEMU_DISK+=(-drive format=raw,file=build/disk$index.img,if=ide,index=$index,discard=unmap)
+      done
+    fi
+    ;;
+  ahci)
+    data_disk ahci
+    QEMU_DISK+=(
+      -drive id=data0,format=raw,file=build/disk_ahci.img,if=none
+      -device ahci,id=ahci0
+      -device ide-hd,drive=data0,bus=ahci0.0
+    )
+    ;;
+  virtio)
+    data_disk virtio
+    QEMU_DISK+=(
+      -drive id=data0,format=raw,file=build/disk_virtio.img,if=none
+      -device virtio-blk-pci,drive=data0,disable-legacy=on,num-queues="${VIRTIO_QUEUES:-1}"
+    )
+    ;;
+  *)
+    echo "unknown DISK_IF=$DISK_IF" >&2
+    exit 1
+    ;;
+esac
+
+# HEADLESS=1: no window, the serial log (loader report, boot timeline) goes to
+# stdout and QEMU is stopped after HEADLESS_SECONDS (default 10)
+QEMU_RUN=(qemu-system-x86_64)
+QEMU_DISPLAY=()
+if [ "${HEADLESS:-0}" = 1 ]; then
+  QEMU_RUN=(timeout --foreground "${HEADLESS_SECONDS:-10}" qemu-system-x86_64)
+  QEMU_DISPLAY=(-display none)
+fi
+
+qemu_run() {
+  "${QEMU_RUN[@]}" \
+    "${QEMU_DISK[@]}" \
+    "${QEMU_DISPLAY[@]}" \
+    -serial mon:stdio \
+    -no-reboot \
+    "$@" || [ "${HEADLESS:-0}" = 1 ]
+}
+
+# the hibernating run ends when the guest powers off (no -no-shutdown)
+if [ "${HIBERNATE:-0}" = 1 ]; then
+  qemu_run
+  echo "[+] Running QEMU again (resume)"
+fi
+qemu_run -no-shutdown
+
+disk_usage "$BUILD_DIR/disk.img"
+if [ "$DISK_IF" = ide ] && [ -n "${IDE_SECOND_DISK:-}" ]; then
+  disk_usage "$BUILD_DIR/disk2.img"
+fi
@@ -0,0 +1,116 @@
+#include "test.h"
+#include "ata_driver_irq.h"
+#include "pit.h"
+#include "blk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_SECTORS   65536
+#define BENCH_REQUESTS  1000
+
+typedef struct bench_mode_t {
+    const char* name;
+    uint8_t dma;                // 0: odd buffer, the adapter falls back to PIO
+    uint8_t irq_xfer;
+    uint32_t flags;
+} bench_mode_t;
+
+static const bench_mode_t g_modes[] = {
+    { "pio irq, blocks in tick_ata", 0, 0, 0 },
+    { "pio irq, blocks in the IRQ",  0, 1, 0 },
+    { "pio poll",                    0, 1, BLK_REQ_F_POLL },
+    { "pio hybrid",                  0, 1, BLK_REQ_F_HYBRID },
+    { "dma irq",                     1, 1, 0 },
+    { "dma poll",                    1, 1, BLK_REQ_F_POLL },
+    { "dma hybrid",                  1, 1, BLK_REQ_F_HYBRID },
+};
+
+// the drive's own time per request, what is left over is the driver's
+static uint64_t g_drive_ns;
+
+static int bench_cmp(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_mode(blk_device_t* dev, const bench_mode_t* m, uint32_t count, uint8_t* buf) {
+    ata_context_t* ata = ata_context_get(0, 0);
+    ata->irq_xfer = m->irq_xfer;
+    uint8_t* p = m->dma ? buf : buf + 1;
+    blk_request_t req;
+
+    // a few requests first so hybrid has a service time to go on
+    for (int i = 0; i < 8; i++) {
+        memset(&req, 0, sizeof(req));
+        req = (blk_request_t){ BLK_OP_READ, (uint64_t)i * count, count, p, m->flags };
+        if (!blk_request_wait(dev, &req)) sim_fail("%s: warmup read failed", m->name);
+    }
+
+    uint64_t irqs = sim_irq_count(PIC_IRQ_ATA_PRIMARY) + sim_irq_count(PIC_IRQ_PIT);
+    uint64_t wakeups = sim_wakeups();
+    static uint64_t samples[BENCH_REQUESTS];
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < BENCH_REQUESTS; i++) {
+        uint64_t t = rdtsc();
+        req = (blk_request_t){ BLK_OP_READ, (uint64_t)i * count % (BENCH_SECTORS - count), count, p, m->flags };
+        if (!blk_request_wait(dev, &req)) sim_fail("%s: read failed", m->name);
+        samples[i] = rdtsc() - t;
+    }
+    uint64_t ns = sim_tsc_to_ns(rdtsc() - t0);
+    // the median: the host's scheduler adds outliers the mean would keep
+    qsort(samples, BENCH_REQUESTS, sizeof(samples[0]), bench_cmp);
+    irqs = sim_irq_count(PIC_IRQ_ATA_PRIMARY) + sim_irq_count(PIC_IRQ_PIT) - irqs;
+    wakeups = sim_wakeups() - wakeups;
+
+    uint64_t bytes = (uint64_t)BENCH_REQUESTS * count * 512;
+    // PIO pays its overhead per DRQ block, DMA once per request
+    uint64_t blocks = m->dma ? 1 : (count + ata->multiple - 1) / ata->multiple;
+    uint64_t req_ns = sim_tsc_to_ns(samples[BENCH_REQUESTS / 2]);
+    uint64_t block_ns = (req_ns > g_drive_ns ? req_ns - g_drive_ns : 0) / blocks;
+    printf("  %-30s %6lu us/req (median) %5lu MB/s %5lu.%02lu irq/req %5lu.%02lu hlt/req %5lu.%01lu us/block over the drive\n", m->name,
+           req_ns / 1000, bytes * 1000 / ns,
+           irqs / BENCH_REQUESTS, irqs * 100 / BENCH_REQUESTS % 100,
+           wakeups / BENCH_REQUESTS, wakeups * 100 / BENCH_REQUESTS % 100,
+           block_ns / 1000, block_ns / 100 % 10);
+}
+
+// one drive at QEMU-like speed: cmd_us before the first block, sector_ns per sector
+static void bench_drive(uint32_t cmd_us, uint32_t sector_ns, uint32_t irq_latency_us, uint32_t count) {
+    sim_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.drive[0] = sim_drive_default(BENCH_SECTORS);
+    cfg.drive[0].cmd_us = cmd_us;
+    cfg.drive[0].sector_ns = sector_ns;
+    cfg.irq_latency_us = irq_latency_us;
+    sim_init(&cfg);
+
+    sim_vector_set(PIC_REMAP_MASTER + PIC_IRQ_PIT, irq0_pit);
+    sim_vector_set(PIC_REMAP_MASTER + PIC_IRQ_ATA_PRIMARY, irq14_ata);
+    sim_vector_set(PIC_REMAP_MASTER + PIC_IRQ_ATA_SECONDARY, irq15_ata);
+    setup_ata_irq();
+    irq_enable();
+    ata_irq_routed_set(1);
+    pit_init(0);
+    ata_dma_init();
+
+    ata_context_t* ata = ata_context_get(0, 0);
+    ata_wait_mode_set(ata, ATA_WAIT_IRQ);
+    begin_init_ata_48_irq(ata);
+    while (is_ata_irq_busy(ata)) tick_ata(ata);
+    if (!is_ata_init_done(ata)) sim_fail("bench drive init failed");
+    blk_device_t* dev = ata_blk_device_get(ata);
+
+    g_drive_ns = (uint64_t)cmd_us * 1000 + (uint64_t)count * sector_ns;
+    uint8_t* buf = sim_phys_alloc((uint64_t)count * 512 + PAGE_SIZE);
+    printf(" %u-sector reads, %u us command + %u ns/sector, %u us IRQ latency:\n", count, cmd_us, sector_ns, irq_latency_us);
+    for (uint32_t i = 0; i < sizeof(g_modes) / sizeof(g_modes[0]); i++) bench_mode(dev, &g_modes[i], count, buf);
+}
+
+void ata_bench_run(void) {
+    bench_drive(100, 0, 2, 8);
+    bench_drive(50, 2000, 2, 128);
+    // interrupts that take long to arrive, as under virtualization
+    bench_drive(100, 0, 40, 8);
+}
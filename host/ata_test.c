@@ -0,0 +1,482 @@
+#include "test.h"
+#include "ata_driver_irq.h"
+#include "pit.h"
+#include "blk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+sim_cfg_t test_cfg(void) {
+    sim_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.drive[0] = sim_drive_default(TEST_SECTORS);
+    return cfg;
+}
+
+void test_irq_setup(void) {
+    sim_vector_set(PIC_REMAP_MASTER + PIC_IRQ_PIT, irq0_pit);
+    sim_vector_set(PIC_REMAP_MASTER + PIC_IRQ_ATA_PRIMARY, irq14_ata);
+    sim_vector_set(PIC_REMAP_MASTER + PIC_IRQ_ATA_SECONDARY, irq15_ata);
+    setup_ata_irq();
+    irq_enable();
+    ata_irq_routed_set(1);
+    blk_clock_init(sim_tsc_hz());
+}
+
+uint8_t test_drive_init(ata_context_t* ata, ata_wait_mode_t mode) {
+    ata_wait_mode_set(ata, mode);
+    CHECK(begin_init_ata_48_irq(ata));
+    while (is_ata_irq_busy(ata)) tick_ata(ata);
+    return is_ata_init_done(ata);
+}
+
+blk_device_t* test_blk(uint8_t channel, ata_wait_mode_t mode) {
+    ata_context_t* ata = ata_context_get(channel, 0);
+    CHECK(test_drive_init(ata, mode));
+    return ata_blk_device_get(ata);
+}
+
+uint8_t test_io(blk_device_t* dev, blk_op_t op, uint64_t lba, void* buf, uint32_t count, uint32_t flags) {
+    blk_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.lba = lba;
+    req.count = count;
+    req.addr = buf;
+    req.flags = flags;
+    return blk_request_wait(dev, &req);
+}
+
+void test_fill(uint8_t* buf, uint64_t bytes, uint32_t seed) {
+    for (uint64_t i = 0; i < bytes; i++) buf[i] = (uint8_t)(seed * 131 + i * 7 + (i >> 9));
+}
+
+// write a pattern, check it on the model's disk, read it back into a clean buffer
+static void test_round_trip(blk_device_t* dev, uint8_t drive, uint64_t lba, uint32_t count, uint32_t flags) {
+    uint64_t bytes = (uint64_t)count * 512;
+    uint8_t* out = sim_phys_alloc(bytes);
+    uint8_t* in = sim_phys_alloc(bytes);
+    test_fill(out, bytes, (uint32_t)lba);
+
+    CHECK(test_io(dev, BLK_OP_WRITE, lba, out, count, flags));
+    CHECK(memcmp(sim_disk(drive) + lba * 512, out, bytes) == 0);
+    CHECK(test_io(dev, BLK_OP_READ, lba, in, count, flags));
+    CHECK(memcmp(in, out, bytes) == 0);
+    CHECK(sim_stats(drive)->violations == 0);
+}
+
+static void test_init_poll(void) {
+    sim_cfg_t cfg = test_cfg();
+    sim_init(&cfg);
+
+    // no IDT, interrupts off: the way kmain probes the drives
+    ata_context_t* ata = ata_context_get(0, 0);
+    CHECK(test_drive_init(ata, ATA_WAIT_POLL));
+    const ata_device_info_t* info = ata_device_info_get(ata);
+    CHECK(info->lba48 && info->sectors_48 == TEST_SECTORS);
+    CHECK(info->dma && info->fua && info->trim && info->flush_ext);
+    CHECK(info->write_cache_on);
+    CHECK(ata->multiple == 16);
+    CHECK(sim_irq_count(PIC_IRQ_ATA_PRIMARY) == 0);
+}
+
+static void test_init_absent(void) {
+    sim_cfg_t cfg = test_cfg();
+    sim_init(&cfg);
+    test_irq_setup();
+
+    CHECK(!test_drive_init(ata_context_get(0, 1), ATA_WAIT_IRQ));   // no slave
+    CHECK(!test_drive_init(ata_context_get(1, 0), ATA_WAIT_IRQ));   // empty channel
+    CHECK(test_drive_init(ata_context_get(0, 0), ATA_WAIT_IRQ));
+    CHECK(sim_irq_count(PIC_IRQ_ATA_PRIMARY) >= 3);
+}
+
+// PIC remapped and interrupts on, but no IDT gate for the ATA vectors yet (an
+// IRQ reaching one fails the test): requests of every mode are polled until
+// the driver is told the IRQs are routed
+static void test_unrouted_polls(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].cmd_us = 50;
+    sim_init(&cfg);
+    setup_ata_irq();
+    irq_enable();
+    CHECK(ata_dma_init());
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    test_round_trip(dev, 0, 0, 64, 0);
+    test_round_trip(dev, 0, 100, 8, BLK_REQ_F_HYBRID);
+    CHECK(sim_irq_count(PIC_IRQ_ATA_PRIMARY) == 0);
+
+    sim_vector_set(PIC_REMAP_MASTER + PIC_IRQ_ATA_PRIMARY, irq14_ata);
+    ata_irq_routed_set(1);
+    test_round_trip(dev, 0, 200, 64, 0);
+    CHECK(sim_irq_count(PIC_IRQ_ATA_PRIMARY) == 2);
+}
+
+static void test_pio(uint8_t irq_xfer) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].cmd_us = 20;
+    sim_init(&cfg);
+    test_irq_setup();
+
+    ata_context_t* ata = ata_context_get(0, 0);
+    ata->irq_xfer = irq_xfer;
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    test_round_trip(dev, 0, 100, 1, 0);
+    test_round_trip(dev, 0, 1000, 37, 0);
+    test_round_trip(dev, 0, 2000, 600, 0);
+    // one command per request, one IRQ per DRQ block (16 sectors) either way
+    CHECK(sim_irq_count(PIC_IRQ_ATA_PRIMARY) >= 2 * (1 + 3 + 38));
+}
+
+static void test_pio_irq_xfer(void) { test_pio(1); }
+static void test_pio_tick_xfer(void) { test_pio(0); }
+
+static void test_dma(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].cmd_us = 20;
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    uint64_t cmds = sim_stats(0)->commands;
+    test_round_trip(dev, 0, 8, 1, 0);
+    test_round_trip(dev, 0, 4000, 2048, 0);
+    CHECK(sim_stats(0)->commands - cmds == 4);
+}
+
+static void test_poll_no_irq(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].cmd_us = 20;
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_POLL);
+    test_round_trip(dev, 0, 50, 100, BLK_REQ_F_POLL);
+    CHECK(sim_irq_count(PIC_IRQ_ATA_PRIMARY) == 0);
+    CHECK(sim_wakeups() == 0);
+}
+
+static void test_hybrid(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].cmd_us = 300;
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(pit_init(0));
+    CHECK(ata_dma_init());
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    for (int i = 0; i < 8; i++) test_round_trip(dev, 0, (uint64_t)i * 64, 64, BLK_REQ_F_HYBRID);
+    // the learned service time is close to what the drive takes
+    ata_context_t* ata = ata_context_get(0, 0);
+    uint64_t us = sim_tsc_to_ns(ata->svc_tsc[0]) / 1000;
+    CHECK(us >= 250 && us < 3000);
+    CHECK(sim_wakeups() > 0);
+}
+
+static uint64_t test_median_us(blk_device_t* dev, uint32_t flags) {
+    uint64_t t[33];
+    uint8_t* buf = sim_phys_alloc(8 * 512);
+    for (int i = 0; i < 33; i++) {
+        uint64_t t0 = rdtsc();
+        CHECK(test_io(dev, BLK_OP_READ, (uint64_t)i * 8, buf, 8, flags));
+        t[i] = rdtsc() - t0;
+    }
+    // 33 samples: the 17th smallest
+    for (int i = 0; i < 33; i++) {
+        for (int j = i + 1; j < 33; j++) {
+            if (t[j] < t[i]) { uint64_t x = t[i]; t[i] = t[j]; t[j] = x; }
+        }
+    }
+    return sim_tsc_to_ns(t[16]) / 1000;
+}
+
+// a slow interrupt path (a VM exit, say): hybrid is back on the drive well
+// before the IRQ would have arrived
+static void test_hybrid_latency(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].cmd_us = 200;
+    cfg.irq_latency_us = 60;
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(pit_init(0));
+    CHECK(ata_dma_init());
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    uint64_t irq_us = test_median_us(dev, 0);
+    uint64_t hybrid_us = test_median_us(dev, BLK_REQ_F_HYBRID);
+    printf("\n    irq %lu us, hybrid %lu us per 8-sector read", irq_us, hybrid_us);
+    CHECK(irq_us >= 255);
+    CHECK(hybrid_us + 30 < irq_us);
+}
+
+// no PIT one-shot: the drive's IRQ ends the sleep, the request still completes
+static void test_hybrid_no_pit(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].cmd_us = 100;
+    cfg.pit_stuck = 1;
+    sim_init(&cfg);
+    test_irq_setup();
+    // calibration gives up instead of spinning forever
+    CHECK(!pit_init(0) && !pit_is_ready());
+    CHECK(ata_dma_init());
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    for (int i = 0; i < 4; i++) test_round_trip(dev, 0, (uint64_t)i * 16, 16, BLK_REQ_F_HYBRID);
+    CHECK(sim_irq_count(PIC_IRQ_PIT) == 0);
+}
+
+static void test_error(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].err_lba = 500;
+    cfg.drive[0].err_count = 4;
+    sim_init(&cfg);
+    test_irq_setup();
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    uint8_t* buf = sim_phys_alloc(64 * 512);
+    CHECK(!test_io(dev, BLK_OP_READ, 480, buf, 64, 0));
+    CHECK(!test_io(dev, BLK_OP_WRITE, 502, buf, 1, 0));
+    CHECK(sim_stats(0)->errors == 2);
+    // the drive and the driver carry on
+    test_round_trip(dev, 0, 504, 64, 0);
+    CHECK(!test_io(dev, BLK_OP_READ, TEST_SECTORS - 1, buf, 2, 0));
+}
+
+static void test_error_dma(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].err_lba = 500;
+    cfg.drive[0].err_count = 4;
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    uint8_t* buf = sim_phys_alloc(64 * 512);
+    CHECK(!test_io(dev, BLK_OP_READ, 480, buf, 64, 0));
+    CHECK(!test_io(dev, BLK_OP_READ, 480, buf, 64, BLK_REQ_F_POLL));
+    test_round_trip(dev, 0, 504, 64, 0);
+}
+
+static void test_lba28(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].lba48 = 0;
+    cfg.drive[0].fua = 0;
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    CHECK(dev->max_sectors == ATA_MAX_SECTORS_28);
+    test_round_trip(dev, 0, 0x123, 256, 0);
+    test_round_trip(dev, 0, 7, 3, BLK_REQ_F_POLL);
+    uint8_t* buf = sim_phys_alloc(512);
+    CHECK(test_io(dev, BLK_OP_FLUSH, 0, NULL, 0, 0));
+    CHECK(test_io(dev, BLK_OP_WRITE, 9, buf, 1, BLK_REQ_F_FUA));
+}
+
+// 48-bit begins refuse the drive up front instead of sending EXT commands it aborts
+static void test_lba28_rejects_48(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].lba48 = 0;
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+
+    ata_context_t* ata = ata_context_get(0, 0);
+    CHECK(test_drive_init(ata, ATA_WAIT_IRQ));
+    uint64_t cmds = sim_stats(0)->commands;
+    uint8_t* buf = sim_phys_alloc(8 * 512);
+    blk_segment_t seg = { (phys_addr_t)(uintptr_t)buf, 0, 8 * 512 };
+    blk_sg_list_t sg = { &seg, 1 };
+
+    CHECK(!begin_read_from_disk_ata_48_irq(ata, 0, buf, 8));
+    CHECK(!begin_write_to_disk_ata_48_irq(ata, 0, buf, 8));
+    CHECK(!begin_write_to_disk_ata_48_fua_irq(ata, 0, buf, 8));
+    CHECK(!begin_read_from_disk_ata_48_dma(ata, 0, buf, 8));
+    CHECK(!begin_write_to_disk_ata_48_dma(ata, 0, buf, 8));
+    CHECK(!begin_write_to_disk_ata_48_dma_fua(ata, 0, buf, 8));
+    CHECK(!begin_read_from_disk_ata_48_sg(ata, 0, &sg, 8));
+    CHECK(!begin_write_to_disk_ata_48_sg(ata, 0, &sg, 8));
+    CHECK(!begin_read_from_disk_ata_48_dma_sg(ata, 0, &sg, 8));
+    CHECK(!begin_write_to_disk_ata_48_dma_sg(ata, 0, &sg, 8));
+    CHECK(!is_ata_irq_busy(ata));
+
+    // 28-bit commands and the flush still go through
+    CHECK(begin_read_from_disk_ata_28_irq(ata, 0, buf, 8));
+    while (is_ata_irq_busy(ata)) tick_ata(ata);
+    CHECK(is_ata_irq_done(ata));
+    CHECK(begin_flush_ata_irq(ata));
+    while (is_ata_irq_busy(ata)) tick_ata(ata);
+    CHECK(is_ata_irq_done(ata));
+    CHECK(sim_stats(0)->commands - cmds == 2 && sim_stats(0)->errors == 0);
+}
+
+// a drive without DMA on a channel with a bus master: the DMA begins refuse it,
+// the blk adapter moves the request with PIO instead
+static void test_no_dma_drive(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].dma = 0;
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+
+    ata_context_t* ata = ata_context_get(0, 0);
+    CHECK(test_drive_init(ata, ATA_WAIT_IRQ));
+    CHECK(!ata_device_info_get(ata)->dma);
+    uint64_t cmds = sim_stats(0)->commands;
+    uint8_t* buf = sim_phys_alloc(8 * 512);
+    blk_segment_t seg = { (phys_addr_t)(uintptr_t)buf, 0, 8 * 512 };
+    blk_sg_list_t sg = { &seg, 1 };
+
+    CHECK(!begin_read_from_disk_ata_48_dma(ata, 0, buf, 8));
+    CHECK(!begin_write_to_disk_ata_48_dma(ata, 0, buf, 8));
+    CHECK(!begin_write_to_disk_ata_48_dma_fua(ata, 0, buf, 8));
+    CHECK(!begin_read_from_disk_ata_48_dma_sg(ata, 0, &sg, 8));
+    CHECK(!begin_write_to_disk_ata_48_dma_sg(ata, 0, &sg, 8));
+    CHECK(!is_ata_irq_busy(ata));
+    CHECK(sim_stats(0)->commands == cmds);
+
+    test_round_trip(ata_blk_device_get(ata), 0, 64, 8, 0);
+}
+
+static void test_multiple_refused(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].max_multiple = 12;         // not a power of two: SET MULTIPLE aborts
+    sim_init(&cfg);
+    test_irq_setup();
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    CHECK(ata_context_get(0, 0)->multiple == 1);
+    test_round_trip(dev, 0, 10, 40, 0);
+}
+
+static void test_fua_flush(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].flush_us = 200;
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    uint8_t* buf = sim_phys_alloc(8 * 512);
+    CHECK(test_io(dev, BLK_OP_WRITE, 0, buf, 8, BLK_REQ_F_FUA));
+    CHECK(sim_stats(0)->fua_writes == 1 && sim_stats(0)->flushes == 0);
+    CHECK(test_io(dev, BLK_OP_WRITE, 8, buf, 8, BLK_REQ_F_PREFLUSH));
+    CHECK(test_io(dev, BLK_OP_FLUSH, 0, NULL, 0, 0));
+    CHECK(sim_stats(0)->flushes == 2);
+}
+
+static void test_trim(void) {
+    sim_cfg_t cfg = test_cfg();
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    uint8_t* buf = sim_phys_alloc(256 * 512);
+    memset(buf, 0xA5, 256 * 512);
+    CHECK(test_io(dev, BLK_OP_WRITE, 0, buf, 256, 0));
+
+    blk_discard_range_t ranges[2] = { { 10, 20 }, { 100, 50 } };
+    blk_discard_list_t list = { ranges, 2 };
+    CHECK(test_io(dev, BLK_OP_DISCARD, 10, &list, 140, 0));
+    CHECK(sim_stats(0)->trimmed == 70);
+    CHECK(sim_disk(0)[10 * 512] == 0 && sim_disk(0)[149 * 512 + 511] == 0);
+    CHECK(sim_disk(0)[9 * 512] == 0xA5 && sim_disk(0)[30 * 512] == 0xA5);
+}
+
+// both channels busy at once, each on its own IRQ line
+static void test_two_channels(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].cmd_us = 200;
+    cfg.drive[2] = sim_drive_default(TEST_SECTORS);
+    cfg.drive[2].cmd_us = 200;
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+
+    blk_device_t* a = test_blk(0, ATA_WAIT_IRQ);
+    blk_device_t* b = test_blk(1, ATA_WAIT_IRQ);
+    uint8_t* buf_a = sim_phys_alloc(128 * 512);
+    uint8_t* buf_b = sim_phys_alloc(128 * 512);
+    test_fill(buf_a, 128 * 512, 1);
+    test_fill(buf_b, 128 * 512, 2);
+
+    blk_request_t ra = { BLK_OP_WRITE, 0, 128, buf_a, 0 };
+    blk_request_t rb = { BLK_OP_WRITE, 0, 128, buf_b, 0 };
+    CHECK(a->submit(a, &ra) && b->submit(b, &rb));
+    while (ra.status == BLK_REQ_PENDING || rb.status == BLK_REQ_PENDING) {
+        a->tick(a);
+        b->tick(b);
+    }
+    CHECK(ra.status == BLK_REQ_DONE && rb.status == BLK_REQ_DONE);
+    CHECK(memcmp(sim_disk(0), buf_a, 128 * 512) == 0);
+    CHECK(memcmp(sim_disk(2), buf_b, 128 * 512) == 0);
+    CHECK(sim_irq_count(PIC_IRQ_ATA_SECONDARY) > 0);
+}
+
+// random requests in every mode against a shadow copy of the disk
+static void test_fuzz(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].cmd_us = 5;
+    cfg.drive[0].sector_ns = 100;
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(pit_init(0));
+    CHECK(ata_dma_init());
+
+    blk_device_t* dev = test_blk(0, ATA_WAIT_IRQ);
+    uint8_t* shadow = calloc(TEST_SECTORS, 512);
+    uint8_t* buf = sim_phys_alloc(512 * 512);
+    static const uint32_t modes[3] = { 0, BLK_REQ_F_POLL, BLK_REQ_F_HYBRID };
+    srand(41);
+
+    for (int i = 0; i < 400; i++) {
+        uint32_t count = 1 + (uint32_t)rand() % 300;
+        uint64_t lba = (uint64_t)rand() % (TEST_SECTORS - count);
+        uint32_t flags = modes[rand() % 3] | (rand() % 8 == 0 ? BLK_REQ_F_FUA : 0);
+        ata_context_get(0, 0)->irq_xfer = (uint8_t)(rand() & 1);
+        // odd buffers go through PIO
+        uint8_t* p = buf + ((rand() & 3) == 0 ? 1 : 0);
+
+        if (rand() & 1) {
+            test_fill(p, (uint64_t)count * 512, (uint32_t)i);
+            CHECK(test_io(dev, BLK_OP_WRITE, lba, p, count, flags));
+            memcpy(shadow + lba * 512, p, (uint64_t)count * 512);
+        } else {
+            CHECK(test_io(dev, BLK_OP_READ, lba, p, count, flags & ~BLK_REQ_F_FUA));
+            CHECK(memcmp(p, shadow + lba * 512, (uint64_t)count * 512) == 0);
+        }
+    }
+    CHECK(memcmp(sim_disk(0), shadow, (uint64_t)TEST_SECTORS * 512) == 0);
+    CHECK(sim_stats(0)->violations == 0);
+}
+
+const host_test_t g_ata_tests[] = {
+    { "init polled, no IDT",            test_init_poll },
+    { "init: absent drive, empty channel", test_init_absent },
+    { "polled until the IRQ is routed", test_unrouted_polls },
+    { "pio, blocks moved in the IRQ",   test_pio_irq_xfer },
+    { "pio, blocks moved by tick_ata",  test_pio_tick_xfer },
+    { "dma round trip",                 test_dma },
+    { "poll mode takes no IRQ",         test_poll_no_irq },
+    { "hybrid learns the service time", test_hybrid },
+    { "hybrid beats a slow IRQ",        test_hybrid_latency },
+    { "hybrid without the PIT",         test_hybrid_no_pit },
+    { "pio error and recovery",         test_error },
+    { "dma error and recovery",         test_error_dma },
+    { "lba28-only drive",               test_lba28 },
+    { "lba28 drive refuses 48-bit begins", test_lba28_rejects_48 },
+    { "drive without DMA refuses DMA begins", test_no_dma_drive },
+    { "SET MULTIPLE refused",           test_multiple_refused },
+    { "fua, preflush, flush",           test_fua_flush },
+    { "trim",                           test_trim },
+    { "two channels at once",           test_two_channels },
+    { "fuzz against a shadow disk",     test_fuzz },
+};
+
+const uint32_t g_ata_test_count = sizeof(g_ata_tests) / sizeof(g_ata_tests[0]);
@@ -0,0 +1,61 @@
+#include "test.h"
+#include "raid0.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_SECTORS   65536
+#define BENCH_REQUESTS  200
+
+static int bench_cmp(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// count-sector reads one after the other, median time per request
+static void bench_reads(const char* name, blk_device_t* dev, uint32_t count, uint8_t* buf) {
+    static uint64_t samples[BENCH_REQUESTS];
+    blk_request_t req;
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < BENCH_REQUESTS; i++) {
+        uint64_t t = rdtsc();
+        memset(&req, 0, sizeof(req));
+        req = (blk_request_t){ BLK_OP_READ, (uint64_t)i * count % (BENCH_SECTORS - count), count, buf, 0 };
+        if (!blk_request_wait(dev, &req)) sim_fail("%s: read failed", name);
+        samples[i] = rdtsc() - t;
+    }
+    uint64_t ns = sim_tsc_to_ns(rdtsc() - t0);
+    qsort(samples, BENCH_REQUESTS, sizeof(samples[0]), bench_cmp);
+    uint64_t bytes = (uint64_t)BENCH_REQUESTS * count * 512;
+    printf("  %-30s %6lu us/req (median) %5lu MB/s\n", name,
+           sim_tsc_to_ns(samples[BENCH_REQUESTS / 2]) / 1000, bytes * 1000 / ns);
+}
+
+// md0 against one of its members: a request of one chunk per member is split
+// and both channels move their half at the same time
+static void bench_raid0(uint32_t cmd_us, uint32_t sector_ns) {
+    sim_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    for (int d = 0; d < SIM_DRIVES; d += 2) {
+        cfg.drive[d] = sim_drive_default(BENCH_SECTORS);
+        cfg.drive[d].cmd_us = cmd_us;
+        cfg.drive[d].sector_ns = sector_ns;
+    }
+    sim_init(&cfg);
+    test_irq_setup();
+    if (!ata_dma_init()) sim_fail("no bus master");
+    blk_device_t* members[2] = { test_blk(0, ATA_WAIT_IRQ), test_blk(1, ATA_WAIT_IRQ) };
+
+    static raid0_t r;
+    if (!raid0_init(&r, members, 2, RAID0_DEFAULT_CHUNK)) sim_fail("raid0_init failed");
+    uint32_t count = RAID0_DEFAULT_CHUNK * 2;
+    uint8_t* buf = sim_phys_alloc((uint64_t)count * 512);
+    printf(" %u-sector dma reads, %u us command + %u ns/sector:\n", count, cmd_us, sector_ns);
+    bench_reads("ata0", members[0], count, buf);
+    bench_reads("md0 = ata0 + ata2", raid0_device_get(&r), count, buf);
+}
+
+void blk_bench_run(void) {
+    bench_raid0(50, 2000);
+}
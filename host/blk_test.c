@@ -0,0 +1,491 @@
+#include "test.h"
+#include "blk_queue.h"
+#include "bcache.h"
+#include "raid0.h"
+#include "discard.h"
+#include "blk_qos.h"
+#include "blk_ring.h"
+#include "readahead.h"
+
+#include <string.h>
+
+#define TEST_CHUNK 16
+
+// ata0 and ata2, the masters of both channels, on their IRQs with DMA
+static void test_two_drives(blk_device_t** devs) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[2] = sim_drive_default(TEST_SECTORS);
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+    devs[0] = test_blk(0, ATA_WAIT_IRQ);
+    devs[1] = test_blk(1, ATA_WAIT_IRQ);
+}
+
+// count-sector requests back to back from lba on, all submitted before any is
+// waited for. 1 if every one succeeded
+static uint8_t test_batch(blk_device_t* dev, blk_op_t op, uint64_t lba, uint8_t* buf, uint32_t count, uint32_t n) {
+    static blk_request_t reqs[64];
+    memset(reqs, 0, sizeof(reqs));
+    for (uint32_t i = 0; i < n; i++) {
+        reqs[i] = (blk_request_t){ op, lba + (uint64_t)i * count, count, buf + (uint64_t)i * count * 512, 0 };
+        while (!dev->submit(dev, &reqs[i])) dev->tick(dev);
+    }
+    uint8_t ok = 1;
+    for (uint32_t i = 0; i < n; i++) {
+        while (reqs[i].status == BLK_REQ_PENDING) {
+            blk_device_idle(dev);
+            dev->tick(dev);
+        }
+        ok &= reqs[i].status == BLK_REQ_DONE;
+    }
+    return ok;
+}
+
+// kmain's md0: each member behind a request queue. requests in flight at once,
+// each starting and ending mid-chunk, land where the layout says
+static void test_raid0_stripes(void) {
+    blk_device_t* drives[2];
+    test_two_drives(drives);
+    static blkq_queue_t queues[2];
+    blk_device_t* members[2];
+    for (int i = 0; i < 2; i++) {
+        blkq_init(&queues[i], drives[i]);
+        members[i] = blkq_device_get(&queues[i]);
+    }
+    static raid0_t r;
+    CHECK(raid0_init(&r, members, 2, TEST_CHUNK));
+    blk_device_t* md = raid0_device_get(&r);
+    CHECK(md->sectors == 2 * TEST_SECTORS);
+
+    enum { REQS = 8, COUNT = 100 };
+    uint64_t bytes = (uint64_t)REQS * COUNT * 512;
+    uint8_t* out = sim_phys_alloc(bytes);
+    uint8_t* in = sim_phys_alloc(bytes);
+    test_fill(out, bytes, 3);
+    CHECK(test_batch(md, BLK_OP_WRITE, 7, out, COUNT, REQS));
+    CHECK(test_batch(md, BLK_OP_READ, 7, in, COUNT, REQS));
+    CHECK(memcmp(in, out, bytes) == 0);
+
+    // volume chunk c is member c % 2's chunk c / 2
+    for (uint64_t s = 7; s < 7 + REQS * COUNT; s++) {
+        uint64_t c = s / TEST_CHUNK;
+        uint64_t at = (c / 2) * TEST_CHUNK + s % TEST_CHUNK;
+        CHECK(memcmp(sim_disk(c % 2 ? 2 : 0) + at * 512, out + (s - 7) * 512, 512) == 0);
+    }
+    CHECK(sim_stats(0)->commands > REQS && sim_stats(2)->commands > REQS);
+    CHECK(sim_stats(0)->violations == 0 && sim_stats(2)->violations == 0);
+}
+
+// a memory disk that holds up to TEST_LIFO_DEPTH requests and carries them out
+// newest first, the way a drive with a command queue may
+#define TEST_LIFO_DEPTH 4
+
+#define TEST_LIFO_LOG   32
+
+typedef struct test_lifo_t {
+    blk_device_t blk;
+    uint8_t* mem;
+    blk_request_t* held[TEST_LIFO_DEPTH];
+    uint32_t count;
+    blk_request_t log[TEST_LIFO_LOG];   // what was accepted, in order
+    uint32_t logged;
+} test_lifo_t;
+
+static uint8_t test_lifo_submit(blk_device_t* dev, blk_request_t* req) {
+    test_lifo_t* d = (test_lifo_t*)dev->ctx;
+    if (d->count == TEST_LIFO_DEPTH) return 0;
+    d->held[d->count++] = req;
+    if (d->logged < TEST_LIFO_LOG) d->log[d->logged++] = *req;
+    return 1;
+}
+
+static void test_lifo_tick(blk_device_t* dev) {
+    test_lifo_t* d = (test_lifo_t*)dev->ctx;
+    if (d->count == 0) return;
+    blk_request_t* req = d->held[--d->count];
+    uint8_t* at = d->mem + req->lba * 512;
+    if (req->op == BLK_OP_WRITE) memcpy(at, req->addr, (uint64_t)req->count * 512);
+    if (req->op == BLK_OP_READ) memcpy(req->addr, at, (uint64_t)req->count * 512);
+    blk_request_complete(req, 1);
+}
+
+static void test_lifo_init(test_lifo_t* d) {
+    memset(d, 0, sizeof(*d));
+    d->mem = sim_phys_alloc((uint64_t)TEST_SECTORS * 512);
+    d->blk = (blk_device_t){ .name = "lifo", .sectors = TEST_SECTORS, .max_sectors = 256,
+                             .queue_depth = TEST_LIFO_DEPTH, .submit = test_lifo_submit,
+                             .tick = test_lifo_tick, .ctx = d };
+}
+
+// a read after an overlapping write sees the write, and of two overlapping
+// writes the later one wins, although the device serves the newest request first.
+// reads of the same sectors still go out together
+static void test_blkq_hazards(void) {
+    static test_lifo_t lifo;
+    test_lifo_init(&lifo);
+    static blkq_queue_t q;
+    blkq_init(&q, &lifo.blk);
+    blk_device_t* dev = blkq_device_get(&q);
+
+    uint8_t* a = sim_phys_alloc(8 * 512);
+    uint8_t* b = sim_phys_alloc(8 * 512);
+    uint8_t* in = sim_phys_alloc(8 * 512);
+    test_fill(a, 8 * 512, 1);
+    test_fill(b, 8 * 512, 2);
+
+    blk_request_t w1 = { BLK_OP_WRITE, 100, 8, a, 0 };
+    blk_request_t r1 = { BLK_OP_READ, 104, 4, in, 0 };
+    blk_request_t w2 = { BLK_OP_WRITE, 96, 8, b, 0 };
+    CHECK(dev->submit(dev, &w1) && dev->submit(dev, &r1) && dev->submit(dev, &w2));
+    CHECK(q.hazards == 2);
+    while (w1.status == BLK_REQ_PENDING || r1.status == BLK_REQ_PENDING || w2.status == BLK_REQ_PENDING) dev->tick(dev);
+    CHECK(w1.status == BLK_REQ_DONE && r1.status == BLK_REQ_DONE && w2.status == BLK_REQ_DONE);
+    CHECK(memcmp(in, a + 4 * 512, 4 * 512) == 0);
+    CHECK(memcmp(lifo.mem + 96 * 512, b, 8 * 512) == 0);
+    CHECK(memcmp(lifo.mem + 104 * 512, a + 4 * 512, 4 * 512) == 0);
+
+    blk_request_t r2 = { BLK_OP_READ, 96, 8, in, 0 };
+    blk_request_t r3 = { BLK_OP_READ, 100, 8, in, 0 };
+    CHECK(dev->submit(dev, &r2) && dev->submit(dev, &r3));
+    CHECK(q.hazards == 2 && lifo.count == 2);
+    while (r2.status == BLK_REQ_PENDING || r3.status == BLK_REQ_PENDING) dev->tick(dev);
+}
+
+// fills the lifo with one-sector reads from lba on, so what is submitted next stays queued
+static void test_lifo_block(blk_device_t* dev, blk_request_t* reqs, uint64_t lba, uint8_t* buf) {
+    for (uint32_t i = 0; i < TEST_LIFO_DEPTH; i++) {
+        reqs[i] = (blk_request_t){ BLK_OP_READ, lba + i * 2, 1, buf + i * 2 * 512, 0 };
+        CHECK(dev->submit(dev, &reqs[i]));
+    }
+}
+
+static void test_lifo_drain(blk_device_t* dev, blkq_queue_t* q, test_lifo_t* lifo) {
+    while (lifo->count || blkq_pending_count(q)) dev->tick(dev);
+}
+
+// adjacent requests merge into one command, a request filling the gap between
+// two joins them, the pending commands go out in C-LOOK order from the head,
+// and an expired read goes ahead of that order
+static void test_blkq_merge_order(void) {
+    static test_lifo_t lifo;
+    test_lifo_init(&lifo);
+    static blkq_queue_t q;
+    blkq_init(&q, &lifo.blk);
+    blk_device_t* dev = blkq_device_get(&q);
+
+    uint8_t* buf = sim_phys_alloc(64 * 512);
+    uint8_t* scratch = sim_phys_alloc(64 * 512);
+    blk_request_t block[TEST_LIFO_DEPTH];
+    test_lifo_block(dev, block, 5000, scratch);
+    CHECK(q.head_pos == 5007 && lifo.logged == TEST_LIFO_DEPTH);
+
+    blk_request_t a = { BLK_OP_WRITE, 100, 8, buf, 0 };
+    blk_request_t c = { BLK_OP_WRITE, 116, 8, buf + 16 * 512, 0 };
+    blk_request_t b = { BLK_OP_WRITE, 108, 8, buf + 8 * 512, 0 };
+    blk_request_t low = { BLK_OP_READ, 50, 4, scratch + 8 * 512, 0 };
+    blk_request_t mid = { BLK_OP_READ, 300, 4, scratch + 16 * 512, 0 };
+    blk_request_t high = { BLK_OP_READ, 6000, 4, scratch + 24 * 512, 0 };
+    CHECK(dev->submit(dev, &a) && dev->submit(dev, &c));
+    CHECK(q.merged == 0 && blkq_pending_count(&q) == 2);
+    CHECK(dev->submit(dev, &b));
+    CHECK(q.merged == 2 && blkq_pending_count(&q) == 1);
+    CHECK(dev->submit(dev, &mid) && dev->submit(dev, &low) && dev->submit(dev, &high));
+    test_lifo_drain(dev, &q, &lifo);
+    CHECK(a.status == BLK_REQ_DONE && b.status == BLK_REQ_DONE && c.status == BLK_REQ_DONE);
+
+    // up from the head, then wrapped to the lowest LBA: 6000, 50, 100 (all three), 300
+    const blk_request_t* log = &lifo.log[TEST_LIFO_DEPTH];
+    CHECK(lifo.logged == TEST_LIFO_DEPTH + 4);
+    CHECK(log[0].lba == 6000 && log[1].lba == 50 && log[3].lba == 300);
+    CHECK(log[2].op == BLK_OP_WRITE && log[2].lba == 100 && log[2].count == 24);
+    CHECK(q.expired == 0);
+
+    // a read submitted already late: it goes before the write ahead of the head
+    test_lifo_block(dev, block, 1000, scratch);
+    blk_request_t ahead = { BLK_OP_WRITE, 2000, 4, buf, 0 };
+    blk_request_t late = { BLK_OP_READ, 500, 4, scratch + 8 * 512, 0 };
+    CHECK(dev->submit(dev, &ahead));
+    q.read_expire = 0;
+    CHECK(dev->submit(dev, &late));
+    uint32_t first = lifo.logged;
+    test_lifo_drain(dev, &q, &lifo);
+    CHECK(lifo.log[first].lba == 500 && lifo.log[first + 1].lba == 2000);
+    CHECK(q.expired == 1);
+}
+
+// every volume gets its own name, so both can be registered
+static void test_raid0_names(void) {
+    blk_device_t* drives[2];
+    test_two_drives(drives);
+    static raid0_t a, b;
+    CHECK(raid0_init(&a, drives, 2, TEST_CHUNK));
+    CHECK(raid0_init(&b, drives, 2, TEST_CHUNK));
+    CHECK(!strcmp(raid0_device_get(&a)->name, "md0"));
+    CHECK(!strcmp(raid0_device_get(&b)->name, "md1"));
+    CHECK(blk_device_register(raid0_device_get(&a)));
+    CHECK(blk_device_register(raid0_device_get(&b)));
+    CHECK(!blk_device_register(raid0_device_get(&a)));
+}
+
+// ata0 with drive 0 as configured, behind a cache of nbufs buffers
+static blk_device_t* test_cache(bcache_t* c, const sim_cfg_t* cfg, uint32_t nbufs) {
+    sim_init(cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+    CHECK(bcache_init(c, test_blk(0, ATA_WAIT_IRQ), nbufs));
+    return bcache_device_get(c);
+}
+
+// a write over a cached block and one whose fill fails: it fails as a whole,
+// the cached block keeps its old data and nothing of it reaches the disk
+static void test_bcache_partial_write(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].err_lba = 16;
+    cfg.drive[0].err_count = 1;
+    static bcache_t c;
+    blk_device_t* dev = test_cache(&c, &cfg, 16);
+    test_fill(sim_disk(0), (uint64_t)TEST_SECTORS * 512, 9);
+
+    uint8_t* old = sim_phys_alloc(8 * 512);
+    uint8_t* in = sim_phys_alloc(8 * 512);
+    uint8_t* out = sim_phys_alloc(12 * 512);
+    memcpy(old, sim_disk(0) + 8 * 512, 8 * 512);
+    CHECK(test_io(dev, BLK_OP_READ, 8, in, 8, 0));
+    test_fill(out, 12 * 512, 4);
+    CHECK(!test_io(dev, BLK_OP_WRITE, 10, out, 12, 0));
+
+    CHECK(c.dirty == 0);
+    CHECK(test_io(dev, BLK_OP_READ, 8, in, 8, 0));
+    CHECK(memcmp(in, old, 8 * 512) == 0);
+    CHECK(bcache_sync(&c) == 0);
+    CHECK(memcmp(sim_disk(0) + 8 * 512, old, 8 * 512) == 0);
+}
+
+// a block the disk refuses to take: after BCACHE_WB_ATTEMPTS it is dropped,
+// the FLUSH waiting on it fails instead of retrying forever, the next one works
+static void test_bcache_writeback_gives_up(void) {
+    sim_cfg_t cfg = test_cfg();
+    cfg.drive[0].err_lba = 40;
+    cfg.drive[0].err_count = 8;
+    static bcache_t c;
+    blk_device_t* dev = test_cache(&c, &cfg, 16);
+
+    uint8_t* out = sim_phys_alloc(16 * 512);
+    test_fill(out, 16 * 512, 5);
+    CHECK(test_io(dev, BLK_OP_WRITE, 32, out, 16, 0));
+    CHECK(c.dirty == 2);
+
+    // each failed attempt fails the FLUSH waiting on it
+    for (int i = 0; i < BCACHE_WB_ATTEMPTS; i++) CHECK(!test_io(dev, BLK_OP_FLUSH, 0, NULL, 0, 0));
+    CHECK(c.writeback_dropped == 1 && c.writeback_errors == BCACHE_WB_ATTEMPTS && c.dirty == 0);
+    CHECK(memcmp(sim_disk(0) + 32 * 512, out, 8 * 512) == 0);
+    CHECK(test_io(dev, BLK_OP_FLUSH, 0, NULL, 0, 0));
+
+    // dropped with no barrier waiting: the next one reports it, once
+    CHECK(test_io(dev, BLK_OP_WRITE, 40, out, 8, 0));
+    while (bcache_sync(&c)) dev->tick(dev);
+    CHECK(c.writeback_dropped == 2);
+    CHECK(!test_io(dev, BLK_OP_FLUSH, 0, NULL, 0, 0));
+    CHECK(test_io(dev, BLK_OP_FLUSH, 0, NULL, 0, 0));
+}
+
+// more unaligned reads in flight than a small cache has buffers for: each
+// pins its two blocks, waits its turn when none are left, and gets its data
+static void test_bcache_pinned_reads(void) {
+    sim_cfg_t cfg = test_cfg();
+    static bcache_t c;
+    blk_device_t* dev = test_cache(&c, &cfg, 8);
+    CHECK(dev->max_sectors == 8);
+    test_fill(sim_disk(0), (uint64_t)TEST_SECTORS * 512, 6);
+
+    enum { REQS = 16 };
+    static blk_request_t reqs[REQS];
+    uint8_t* in = sim_phys_alloc((uint64_t)REQS * 8 * 512);
+    for (int i = 0; i < REQS; i++) {
+        reqs[i] = (blk_request_t){ BLK_OP_READ, 4 + (uint64_t)i * 64, 8, in + (uint64_t)i * 8 * 512, 0 };
+        while (!dev->submit(dev, &reqs[i])) dev->tick(dev);
+    }
+    for (int i = 0; i < REQS; i++) {
+        while (reqs[i].status == BLK_REQ_PENDING) {
+            blk_device_idle(dev);
+            dev->tick(dev);
+        }
+        CHECK(reqs[i].status == BLK_REQ_DONE);
+        CHECK(memcmp(in + (uint64_t)i * 8 * 512, sim_disk(0) + reqs[i].lba * 512, 8 * 512) == 0);
+    }
+    for (uint32_t i = 0; i < c.nbufs; i++) CHECK(c.bufs[i].pins == 0);
+}
+
+// kmain's scratch trim on ata2: freed ranges, two of them touching, go out
+// coalesced as one DISCARD on flush and come back as zeroes
+static void test_discard_scratch(void) {
+    blk_device_t* drives[2];
+    test_two_drives(drives);
+    test_fill(sim_disk(2), (uint64_t)TEST_SECTORS * 512, 3);
+    static discard_queue_t dq;
+    discard_init(&dq, drives[1]);
+    CHECK(!strcmp(discard_device_get(&dq)->name, "data2"));
+
+    discard_queue_add(&dq, 0, 256);
+    discard_queue_add(&dq, 256, 256);
+    discard_queue_add(&dq, 1024, 64);
+    CHECK(dq.issued == 0 && dq.pending_count == 2);
+    blk_device_t* dev = discard_device_get(&dq);
+    while (discard_flush(&dq)) {
+        blk_device_idle(dev);
+        dev->tick(dev);
+    }
+    CHECK(dq.issued == 1 && dq.issued_sectors == 576 && dq.errors == 0);
+    CHECK(sim_stats(2)->trimmed == 576);
+
+    static const uint8_t zero[512];
+    for (uint64_t lba = 0; lba < 512; lba++) CHECK(memcmp(sim_disk(2) + lba * 512, zero, 512) == 0);
+    CHECK(memcmp(sim_disk(2) + 512 * 512, zero, 512) != 0);
+}
+
+// bulk writers throttled to a request a second pile up what the pool lets
+// them hold: each its own share, all of them less than the pool. an RT read
+// still gets an entry and goes straight past them
+static void test_qos_rt_reserve(void) {
+    sim_cfg_t cfg = test_cfg();
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+    static blk_qos_t q;
+    blk_qos_init(&q, test_blk(0, ATA_WAIT_IRQ));
+
+    enum { BULK = 4, MAX = BLK_QOS_POOL_SIZE };
+    static blk_qos_client_t bulk[BULK], rt;
+    static blk_request_t reqs[BULK][MAX];
+    uint8_t* buf = sim_phys_alloc(8 * 512);
+    uint32_t held = 0;
+    for (int i = 0; i < BULK; i++) {
+        CHECK(blk_qos_client_add(&q, &bulk[i], BLK_QOS_BE));
+        blk_qos_client_limit_set(&bulk[i], 1, 0);
+        blk_device_t* dev = blk_qos_client_device_get(&bulk[i]);
+        for (int j = 0; j < MAX; j++) {
+            reqs[i][j] = (blk_request_t){ BLK_OP_WRITE, (uint64_t)j * 8, 8, buf, 0 };
+            if (!dev->submit(dev, &reqs[i][j])) break;
+            held++;
+        }
+        CHECK(bulk[i].held <= BLK_QOS_CLIENT_HELD);
+    }
+    CHECK(held == BLK_QOS_POOL_SIZE - BLK_QOS_RT_RESERVE);
+    CHECK(!strcmp(bulk[1].name, "pata0.1"));
+
+    CHECK(blk_qos_client_add(&q, &rt, BLK_QOS_RT));
+    CHECK(test_io(blk_qos_client_device_get(&rt), BLK_OP_READ, 0, buf, 8, 0));
+
+    // unthrottled, the backlog drains
+    for (int i = 0; i < BULK; i++) blk_qos_client_limit_set(&bulk[i], 0, 0);
+    blk_device_t* dev = blk_qos_client_device_get(&bulk[0]);
+    while (q.held_shared) {
+        blk_device_idle(dev);
+        dev->tick(dev);
+    }
+    CHECK(q.stats[BLK_QOS_BE].completed == held && q.stats[BLK_QOS_BE].failed == 0);
+}
+
+// ring entries name a registered buffer and an offset: reads land there, an
+// entry past the buffer's end or naming a free index never reaches the disk
+static void test_ring_buffers(void) {
+    sim_cfg_t cfg = test_cfg();
+    sim_init(&cfg);
+    test_irq_setup();
+    CHECK(ata_dma_init());
+    test_fill(sim_disk(0), (uint64_t)TEST_SECTORS * 512, 7);
+    static blk_ring_t ring;
+    CHECK(blk_ring_init(&ring, test_blk(0, ATA_WAIT_IRQ)));
+
+    uint8_t* buf = sim_phys_alloc(4 * 4096);
+    uint16_t idx = blk_ring_buffer_register(&ring, (phys_addr_t)(uintptr_t)buf, 4 * 4096);
+    CHECK(idx == 0);
+
+    enum { N = 6 };
+    static const blk_ring_sqe_t sqes[N] = {
+        { .op = BLK_OP_READ, .buf = 0, .buf_offset = 0,     .lba = 64, .count = 8, .user_data = 0 },
+        { .op = BLK_OP_READ, .buf = 0, .buf_offset = 4096,  .lba = 8,  .count = 8, .user_data = 1 },
+        { .op = BLK_OP_READ, .buf = 0, .buf_offset = 12288, .lba = 16, .count = 8, .user_data = 2 },
+        { .op = BLK_OP_READ, .buf = 0, .buf_offset = 12800, .lba = 16, .count = 8, .user_data = 3 },
+        { .op = BLK_OP_READ, .buf = 1, .buf_offset = 0,     .lba = 16, .count = 8, .user_data = 4 },
+        { .op = BLK_OP_DISCARD,                             .lba = 32, .count = 8, .user_data = 5 },
+    };
+    for (int i = 0; i < N; i++) *blk_ring_sqe_at(ring.shared, (uint32_t)i) = sqes[i];
+    blk_ring_sq_publish(ring.shared, N);
+    CHECK(blk_ring_enter(&ring, N) == N);
+
+    blk_ring_cqe_t cqes[N];
+    CHECK(blk_ring_reap(ring.shared, cqes, N) == N);
+    int32_t res[N];
+    for (int i = 0; i < N; i++) res[cqes[i].user_data] = cqes[i].res;
+    CHECK(res[0] == BLK_RING_RES_OK && res[1] == BLK_RING_RES_OK && res[2] == BLK_RING_RES_OK);
+    CHECK(res[3] == BLK_RING_RES_EINVAL && res[4] == BLK_RING_RES_EINVAL);
+    CHECK(res[5] == BLK_RING_RES_OK && sim_stats(0)->trimmed == 8);
+    CHECK(memcmp(buf, sim_disk(0) + 64 * 512, 4096) == 0);
+    CHECK(memcmp(buf + 4096, sim_disk(0) + 8 * 512, 4096) == 0);
+    CHECK(memcmp(buf + 12288, sim_disk(0) + 16 * 512, 4096) == 0);
+}
+
+// a sequential scan through the cache: every prefetch window after the first is
+// twice the one before, up to max_window; a read back inside the window halves
+// it. near the end of the disk the prefetch stops at the last sector
+static void test_readahead_window(void) {
+    sim_cfg_t cfg = test_cfg();
+    static bcache_t c;
+    blk_device_t* cdev = test_cache(&c, &cfg, BCACHE_MAX_BUFS);
+    test_fill(sim_disk(0), (uint64_t)TEST_SECTORS * 512, 6);
+    static readahead_t ra;
+    readahead_init(&ra, &c);
+    blk_device_t* dev = readahead_device_get(&ra);
+    CHECK(ra.max_window == cdev->max_sectors && ra.max_window < READAHEAD_MAX_WINDOW);
+
+    uint8_t* buf = sim_phys_alloc(8 * 512);
+    const readahead_stream_t* s = &ra.streams[0];
+    uint64_t lba = 0;
+    uint64_t windows = 0;
+    uint32_t last = 0;
+    while (s->window < ra.max_window || windows == 0) {
+        CHECK(lba + 8 <= TEST_SECTORS / 2);
+        CHECK(test_io(dev, BLK_OP_READ, lba, buf, 8, 0));
+        CHECK(memcmp(buf, sim_disk(0) + lba * 512, 8 * 512) == 0);
+        lba += 8;
+        if (ra.windows == windows) continue;
+
+        uint32_t expect = last ? last * 2 : READAHEAD_MIN_WINDOW;
+        if (expect > ra.max_window) expect = ra.max_window;
+        CHECK(ra.windows == windows + 1 && s->window == expect);
+        windows = ra.windows;
+        last = s->window;
+    }
+    CHECK(windows >= 7 && ra.seq_misses == 1);
+
+    CHECK(test_io(dev, BLK_OP_READ, lba - 16, buf, 8, 0));
+    CHECK(s->window == ra.max_window / 2 && ra.seq_misses == 2);
+
+    // a second stream 40 sectors before the end: its one window is cut to the 24 left
+    uint64_t prefetched = c.prefetched;
+    for (lba = TEST_SECTORS - 40; lba < TEST_SECTORS; lba += 8) {
+        CHECK(test_io(dev, BLK_OP_READ, lba, buf, 8, 0));
+        CHECK(memcmp(buf, sim_disk(0) + lba * 512, 8 * 512) == 0);
+    }
+    CHECK(ra.windows == windows + 1);
+    CHECK(c.prefetched - prefetched == 24 / BCACHE_BLOCK_SECTORS);
+    CHECK(sim_stats(0)->errors == 0 && sim_stats(0)->violations == 0);
+}
+
+const host_test_t g_blk_tests[] = {
+    { "raid0 over queues, both channels", test_raid0_stripes },
+    { "raid0 volumes named apart",        test_raid0_names },
+    { "queue holds back overlapping i/o", test_blkq_hazards },
+    { "queue merges, C-LOOK, deadlines",  test_blkq_merge_order },
+    { "cache: failed write leaves no trace", test_bcache_partial_write },
+    { "cache: write-back gives up",       test_bcache_writeback_gives_up },
+    { "cache: reads pin their blocks",    test_bcache_pinned_reads },
+    { "discard: scratch range trimmed",   test_discard_scratch },
+    { "qos: bulk writers leave RT entries", test_qos_rt_reserve },
+    { "ring: entries name registered buffers", test_ring_buffers },
+    { "readahead: window doubles, halves, clamps", test_readahead_window },
+};
+
+const uint32_t g_blk_test_count = sizeof(g_blk_tests) / sizeof(g_blk_tests[0]);
@@ -0,0 +1,40 @@
+#include "common.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "sim.h"
+
+// the physical memory manager and HHDM for host builds: frames come from the
+// model's RAM (below 4 GiB, so DMA reaches them) and virtual == physical
+
+#define HOST_FREE_MAX 1024
+
+static phys_addr_t g_free[HOST_FREE_MAX];
+static uint32_t g_free_count;
+
+phys_addr_t pmm_frame_alloc(void) {
+    if (g_free_count) {
+        phys_addr_t p = g_free[--g_free_count];
+        uint8_t* b = (uint8_t*)(uintptr_t)p;
+        for (uint64_t i = 0; i < PAGE_SIZE; i++) b[i] = 0;
+        return p;
+    }
+    return (phys_addr_t)(uintptr_t)sim_phys_alloc(PAGE_SIZE);
+}
+
+void pmm_frame_free(uint64_t frame_idx) {
+    if (g_free_count < HOST_FREE_MAX) g_free[g_free_count++] = frame_idx << PAGE_SHIFT;
+}
+
+phys_addr_t pmm_range_alloc(uint64_t frames) {
+    return (phys_addr_t)(uintptr_t)sim_phys_alloc(frames << PAGE_SHIFT);
+}
+
+// the bump allocator never takes a range back
+void pmm_range_free(phys_addr_t base, uint64_t frames) {
+    (void)base;
+    (void)frames;
+}
+
+phys_addr_t vmm_virt_to_phys(virt_addr_t vaddr) {
+    return (phys_addr_t)vaddr;
+}
@@ -0,0 +1,68 @@
+#include "test.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// a test that hangs (a wait nothing ends) is killed after this many seconds
+#define HOST_TEST_TIMEOUT 30
+
+static uint8_t host_test_run(const host_test_t* t) {
+    printf("  %-40s ", t->name);
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        alarm(HOST_TEST_TIMEOUT);
+        t->run();
+        fflush(stdout);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        printf("  ok\n");
+        return 1;
+    }
+    if (WIFSIGNALED(status)) printf("    FAIL: signal %d%s\n", WTERMSIG(status), WTERMSIG(status) == SIGALRM ? " (hung)" : "");
+    return 0;
+}
+
+typedef struct host_table_t {
+    const char* name;
+    const host_test_t* tests;
+    const uint32_t* count;
+    void (*bench)(void);
+} host_table_t;
+
+static const host_table_t g_tables[] = {
+    { "ata", g_ata_tests, &g_ata_test_count, ata_bench_run },
+    { "blk", g_blk_tests, &g_blk_test_count, blk_bench_run },
+};
+
+#define HOST_TABLES (sizeof(g_tables) / sizeof(g_tables[0]))
+
+int main(int argc, char** argv) {
+    const char* only = argc > 1 ? argv[1] : NULL;
+    uint8_t bench_only = only && !strcmp(only, "bench");
+    uint32_t run = 0, failed = 0;
+
+    for (uint32_t t = 0; t < HOST_TABLES && !bench_only; t++) {
+        printf("%s tests:\n", g_tables[t].name);
+        for (uint32_t i = 0; i < *g_tables[t].count; i++) {
+            if (only && !strstr(g_tables[t].tests[i].name, only)) continue;
+            run++;
+            if (!host_test_run(&g_tables[t].tests[i])) failed++;
+        }
+    }
+    printf("%u of %u passed\n", run - failed, run);
+    if (failed) return 1;
+
+    for (uint32_t t = 0; t < HOST_TABLES && (!only || bench_only); t++) {
+        printf("\n%s bench:\n", g_tables[t].name);
+        fflush(stdout);
+        g_tables[t].bench();
+    }
+    return 0;
+}
@@ -0,0 +1,1044 @@
+#include "sim.h"
+#include "ata_driver_irq.h"
+#include "pit.h"
+#include "pci.h"
+#include "serial.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define SIM_ARENA_BYTES   (512ULL << 20)
+#define SIM_HLT_LIMIT_US  1000000       // a hlt nothing ends within a second never ends
+#define SIM_BLOCK_MAX     256           // sectors per DRQ block the model buffers
+
+#define SIM_ERR_ABRT      0x04
+#define SIM_ERR_IDNF      0x10
+#define SIM_ERR_UNC       0x40
+
+typedef enum sim_event_t {
+    SIM_EV_NONE = 0,
+    SIM_EV_DRQ,                 // read: the next block is in the buffer
+    SIM_EV_BLOCK,               // write: the block written through DATA is on the media
+    SIM_EV_DONE,                // non-data command finished
+    SIM_EV_DMA                  // the whole DMA command transferred
+} sim_event_t;
+
+typedef struct sim_drive_t {
+    sim_drive_cfg_t cfg;
+    uint8_t* image;
+    uint16_t identify[256];
+    uint8_t multiple;
+    uint8_t wcache_on;
+    uint8_t dirty;              // written since the last flush
+    sim_stats_t stats;
+} sim_drive_t;
+
+typedef struct sim_channel_t {
+    uint8_t irq;
+    uint16_t io;
+    uint16_t ctrl_port;
+    sim_drive_t* drives[2];
+
+    // task file: [0] last written, [1] the one before (48-bit "previous")
+    uint8_t feature[2];
+    uint8_t count[2];
+    uint8_t lba_low[2];
+    uint8_t lba_mid[2];
+    uint8_t lba_high[2];
+    uint8_t dev;
+    uint8_t ctrl;
+    uint8_t status;
+    uint8_t error;
+    uint8_t intrq;              // asserted until STATUS is read
+    uint8_t line;               // what the PIC sees: intrq with nIEN clear
+
+    // command in progress
+    sim_drive_t* drv;
+    uint8_t cmd;
+    uint8_t write;
+    uint8_t identify;
+    uint8_t fail;               // SIM_EV_DONE: end with ERR
+    uint64_t lba;
+    uint32_t left;              // sectors not transferred yet
+    uint32_t block;             // sectors in the current DRQ block
+    uint32_t pos;               // bytes of the block moved through DATA
+    uint8_t buf[SIM_BLOCK_MAX * 512];
+    sim_event_t ev;
+    uint64_t ev_at;
+
+    // bus master
+    uint8_t bm_cmd;
+    uint8_t bm_status;
+    uint32_t bm_prdt;
+    uint8_t dma_wait;           // DMA command issued, START not set yet
+} sim_channel_t;
+
+typedef struct sim_pic_t {
+    uint8_t imr;
+    uint8_t irr;
+    uint8_t isr;
+    uint8_t offset;
+    uint8_t icw;                // next ICW expected on the data port, 0 = none
+    uint8_t icw4;
+} sim_pic_t;
+
+typedef struct sim_pit_t {
+    uint8_t ch0_byte;
+    uint16_t ch0_count;
+    uint8_t ch0_armed;
+    uint64_t ch0_at;
+    uint8_t ch2_byte;
+    uint16_t ch2_count;
+    uint8_t gate;               // port 0x61 as written
+    uint64_t ch2_start;
+    uint8_t ch2_running;
+} sim_pit_t;
+
+typedef struct sim_t {
+    sim_cfg_t cfg;
+    sim_drive_t drives[SIM_DRIVES];
+    sim_channel_t chan[2];
+    sim_pic_t pic[2];
+    sim_pit_t pit;
+    uint64_t irq_at[16];        // when each requested line went up
+    uint64_t irq_count[16];
+    uint64_t wakeups;
+    void (*vectors[SIM_VECTORS])(interrupt_frame_t* f);
+    uint8_t intr;               // RFLAGS.IF
+    uint32_t pci_addr;
+    uint16_t pci_command;
+    uint8_t com1_lcr;
+} sim_t;
+
+static sim_t g_sim;
+static uint64_t g_tsc_hz;
+static uint8_t* g_arena;
+static uint64_t g_arena_used;
+
+static uint64_t sim_update(void);
+static void sim_irq_poll(void);
+
+// ---- time ----
+
+static uint64_t sim_ns_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sim_tsc_measure(void) {
+    uint64_t ns0 = sim_ns_now();
+    uint64_t t0 = rdtsc();
+    while (sim_ns_now() - ns0 < 20000000ULL) {}
+    uint64_t ns1 = sim_ns_now();
+    uint64_t t1 = rdtsc();
+    g_tsc_hz = (t1 - t0) * 1000000000ULL / (ns1 - ns0);
+}
+
+uint64_t sim_tsc_hz(void) { return g_tsc_hz; }
+
+uint64_t sim_us_to_tsc(uint64_t us) { return us * g_tsc_hz / 1000000ULL; }
+
+uint64_t sim_tsc_to_ns(uint64_t tsc) { return tsc * 1000ULL / (g_tsc_hz / 1000000ULL); }
+
+static uint64_t sim_ns_to_tsc(uint64_t ns) { return ns * (g_tsc_hz / 1000000ULL) / 1000ULL; }
+
+// ---- misc ----
+
+void sim_fail(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    printf("\n    FAIL: ");
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+    fflush(stdout);
+    exit(1);
+}
+
+void* sim_phys_alloc(uint64_t bytes) {
+    if (!g_arena) {
+        g_arena = mmap(NULL, SIM_ARENA_BYTES, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | MAP_NORESERVE, -1, 0);
+        if (g_arena == MAP_FAILED) sim_fail("no memory below 4 GiB for the model's RAM");
+    }
+    bytes = (bytes + PAGE_MASK) & ~PAGE_MASK;
+    if (g_arena_used + bytes > SIM_ARENA_BYTES) sim_fail("model RAM exhausted");
+    void* p = g_arena + g_arena_used;
+    g_arena_used += bytes;
+    return p;
+}
+
+sim_drive_cfg_t sim_drive_default(uint64_t sectors) {
+    sim_drive_cfg_t d;
+    memset(&d, 0, sizeof(d));
+    d.sectors = sectors;
+    d.lba48 = 1;
+    d.max_multiple = 16;
+    d.dma = 1;
+    d.write_cache = 1;
+    d.fua = 1;
+    d.trim = 1;
+    return d;
+}
+
+uint8_t* sim_disk(uint8_t drive) { return g_sim.drives[drive].image; }
+
+sim_stats_t* sim_stats(uint8_t drive) { return &g_sim.drives[drive].stats; }
+
+uint64_t sim_irq_count(uint8_t irq) { return g_sim.irq_count[irq & 15]; }
+
+uint64_t sim_wakeups(void) { return g_sim.wakeups; }
+
+void sim_vector_set(uint8_t vector, void (*handler)(interrupt_frame_t* f)) {
+    g_sim.vectors[vector] = handler;
+}
+
+// ---- PIC ----
+
+static void sim_pic_raise(uint8_t irq, uint64_t at) {
+    sim_pic_t* pic = &g_sim.pic[irq >> 3];
+    uint8_t bit = (uint8_t)(1u << (irq & 7));
+    if (pic->irr & bit) return;
+    pic->irr |= bit;
+    g_sim.irq_at[irq] = at;
+}
+
+static uint8_t sim_pic_blocked(uint8_t irq) {
+    // fully nested: anything in service at the same or a higher priority holds it back
+    uint8_t m = irq < 8 ? irq : PIC_IRQ_CASCADE;
+    if (g_sim.pic[0].isr & (uint8_t)((2u << m) - 1)) return 1;
+    if (irq >= 8 && (g_sim.pic[1].isr & (uint8_t)((2u << (irq - 8)) - 1))) return 1;
+    return 0;
+}
+
+static uint8_t sim_pic_masked(uint8_t irq) {
+    if (irq < 8) return (g_sim.pic[0].imr >> irq) & 1;
+    return ((g_sim.pic[1].imr >> (irq - 8)) & 1) || ((g_sim.pic[0].imr >> PIC_IRQ_CASCADE) & 1);
+}
+
+// the highest priority request that may interrupt now, -1 if none
+static int sim_pic_pending(uint64_t now) {
+    static const uint8_t order[15] = { 0, 1, 8, 9, 10, 11, 12, 13, 14, 15, 3, 4, 5, 6, 7 };
+    uint64_t latency = sim_us_to_tsc(g_sim.cfg.irq_latency_us);
+    for (int i = 0; i < 15; i++) {
+        uint8_t irq = order[i];
+        if (!((g_sim.pic[irq >> 3].irr >> (irq & 7)) & 1)) continue;
+        if (sim_pic_masked(irq) || sim_pic_blocked(irq)) continue;
+        if (now < g_sim.irq_at[irq] + latency) continue;
+        return irq;
+    }
+    return -1;
+}
+
+static void sim_pic_command(uint8_t which, uint8_t v) {
+    sim_pic_t* pic = &g_sim.pic[which];
+    if (v & PIC_ICW1_INIT) {
+        pic->icw = 2;
+        pic->icw4 = v & PIC_ICW1_ICW4;
+        pic->imr = 0;
+        pic->isr = 0;
+        return;
+    }
+    if (v == PIC_CMD_EOI) {
+        // non-specific: the highest priority in service
+        for (int i = 0; i < 8; i++) {
+            if (pic->isr & (1u << i)) {
+                pic->isr &= (uint8_t)~(1u << i);
+                return;
+            }
+        }
+    }
+}
+
+static void sim_pic_data(uint8_t which, uint8_t v) {
+    sim_pic_t* pic = &g_sim.pic[which];
+    switch (pic->icw) {
+        case 2: pic->offset = (uint8_t)(v & 0xF8); pic->icw = 3; return;
+        case 3: pic->icw = pic->icw4 ? 4 : 0; return;
+        case 4: pic->icw = 0; return;
+        default: pic->imr = v; return;
+    }
+}
+
+// ---- ATA ----
+
+static sim_drive_t* sim_selected(sim_channel_t* c) {
+    return c->drives[(c->dev >> 4) & 1];
+}
+
+static void sim_line_update(sim_channel_t* c, uint64_t at) {
+    uint8_t line = c->intrq && !(c->ctrl & ATA_CTRL_nIEN);
+    if (line && !c->line) sim_pic_raise(c->irq, at);
+    c->line = line;
+}
+
+static void sim_intrq(sim_channel_t* c, uint64_t at) {
+    c->intrq = 1;
+    sim_line_update(c, at);
+}
+
+static void sim_event(sim_channel_t* c, sim_event_t ev, uint64_t at) {
+    c->ev = ev;
+    c->ev_at = at;
+}
+
+static uint64_t sim_media_tsc(const sim_drive_t* d, uint32_t sectors) {
+    return sim_ns_to_tsc((uint64_t)d->cfg.sector_ns * sectors);
+}
+
+static uint8_t sim_range_fails(const sim_drive_t* d, uint64_t lba, uint32_t n) {
+    return d->cfg.err_count && lba < d->cfg.err_lba + d->cfg.err_count && lba + n > d->cfg.err_lba;
+}
+
+static void sim_command_end(sim_channel_t* c, uint8_t err, uint64_t at) {
+    c->status = ATA_SR_DRDY | (err ? ATA_SR_ERR : 0);
+    c->error = err;
+    if (err) c->drv->stats.errors++;
+    c->ev = SIM_EV_NONE;
+    c->dma_wait = 0;
+    sim_intrq(c, at);
+}
+
+static void sim_identify_build(sim_drive_t* d) {
+    uint16_t* id = d->identify;
+    memset(id, 0, sizeof(d->identify));
+    uint64_t s28 = d->cfg.sectors < ATA_LBA28_LIMIT ? d->cfg.sectors : ATA_LBA28_LIMIT - 1;
+    id[0] = 0x0040;
+    id[ATA_ID_MAX_MULTIPLE] = (uint16_t)(0x8000 | d->cfg.max_multiple);
+    id[ATA_ID_CAPABILITIES] = (uint16_t)((1u << 9) | (d->cfg.dma ? ATA_ID_CAP_DMA : 0));
+    id[ATA_ID_FIELD_VALID] = ATA_ID_VALID_64_70 | ATA_ID_VALID_88;
+    id[ATA_ID_LBA28_SECTORS] = (uint16_t)s28;
+    id[ATA_ID_LBA28_SECTORS + 1] = (uint16_t)(s28 >> 16);
+    id[ATA_ID_MWDMA_MODES] = 0x07;
+    id[ATA_ID_PIO_MODES] = 0x03;
+    id[ATA_ID_CMDSET_1] = (uint16_t)((d->cfg.write_cache ? ATA_ID_CMDSET_WCACHE : 0) | ATA_ID_CMDSET_FLUSH);
+    id[ATA_ID_CMDSET_2] = (uint16_t)((d->cfg.lba48 ? ATA_ID_CMDSET_LBA48 | ATA_ID_CMDSET_FLUSH_EXT : 0));
+    id[ATA_ID_CMDSET_EXT] = (uint16_t)(d->cfg.fua ? ATA_ID_CMDSET_FUA : 0);
+    id[ATA_ID_CMDSET_1_EN] = (uint16_t)(d->wcache_on ? ATA_ID_CMDSET_WCACHE : 0);
+    id[ATA_ID_UDMA_MODES] = d->cfg.dma ? 0x3F : 0;
+    if (d->cfg.lba48) {
+        for (int i = 0; i < 4; i++) id[ATA_ID_LBA48_SECTORS + i] = (uint16_t)(d->cfg.sectors >> (16 * i));
+    }
+    id[ATA_ID_DSM_MAX_BLOCKS] = d->cfg.trim ? 8 : 0;
+    id[ATA_ID_DSM] = d->cfg.trim ? ATA_ID_DSM_TRIM : 0;
+}
+
+static uint64_t sim_lba_get(const sim_channel_t* c, uint8_t ext) {
+    if (!ext) {
+        return (uint64_t)c->lba_low[0] | ((uint64_t)c->lba_mid[0] << 8) |
+               ((uint64_t)c->lba_high[0] << 16) | ((uint64_t)(c->dev & 0x0F) << 24);
+    }
+    return (uint64_t)c->lba_low[0] | ((uint64_t)c->lba_mid[0] << 8) | ((uint64_t)c->lba_high[0] << 16) |
+           ((uint64_t)c->lba_low[1] << 24) | ((uint64_t)c->lba_mid[1] << 32) | ((uint64_t)c->lba_high[1] << 40);
+}
+
+static uint32_t sim_count_get(const sim_channel_t* c, uint8_t ext) {
+    uint32_t n = ext ? ((uint32_t)c->count[1] << 8 | c->count[0]) : c->count[0];
+    if (n == 0) n = ext ? 65536 : 256;
+    return n;
+}
+
+static void sim_block_next(sim_channel_t* c) {
+    uint32_t n = c->identify ? 1 : (c->cmd == ATA_CMD_READ_MULTIPLE || c->cmd == ATA_CMD_WRITE_MULTIPLE ||
+                                    c->cmd == ATA_CMD_READ_MULTIPLE_EXT || c->cmd == ATA_CMD_WRITE_MULTIPLE_EXT ||
+                                    c->cmd == ATA_CMD_WRITE_MULTIPLE_FUA_EXT) ? c->drv->multiple : 1;
+    c->block = c->left < n ? c->left : n;
+    c->pos = 0;
+}
+
+static void sim_dma_start(sim_channel_t* c, uint64_t now) {
+    sim_drive_t* d = c->drv;
+    uint64_t t = sim_us_to_tsc(d->cfg.cmd_us);
+    if (c->cmd != ATA_CMD_DSM) t += sim_media_tsc(d, c->left);
+    c->dma_wait = 0;
+    c->bm_status |= ATA_BM_SR_ACTIVE;
+    sim_event(c, SIM_EV_DMA, now + t);
+}
+
+static void sim_ata_command(sim_channel_t* c, uint8_t cmd, uint64_t now) {
+    sim_drive_t* d = sim_selected(c);
+    if (!d) return;
+    if (c->status & (ATA_SR_BSY | ATA_SR_DRQ)) {
+        d->stats.violations++;
+        return;
+    }
+
+    c->drv = d;
+    c->cmd = cmd;
+    c->error = 0;
+    c->identify = 0;
+    c->fail = 0;
+    d->stats.commands++;
+    uint64_t cmd_tsc = sim_us_to_tsc(d->cfg.cmd_us);
+
+    uint8_t ext = 0, multiple = 0, write = 0, dma = 0;
+    switch (cmd) {
+        case ATA_CMD_IDENTIFY:
+            sim_identify_build(d);
+            c->identify = 1;
+            c->write = 0;
+            c->left = 1;
+            sim_block_next(c);
+            c->status = ATA_SR_BSY;
+            sim_event(c, SIM_EV_DRQ, now + cmd_tsc);
+            return;
+
+        case ATA_CMD_SET_MULTIPLE: {
+            uint8_t n = c->count[0];
+            uint8_t ok = n && n <= d->cfg.max_multiple && (n & (n - 1)) == 0;
+            if (ok) d->multiple = n;
+            c->fail = !ok;
+            c->status = ATA_SR_BSY;
+            sim_event(c, SIM_EV_DONE, now + cmd_tsc);
+            return;
+        }
+
+        case ATA_CMD_SET_FEATURES:
+            c->fail = !(c->feature[0] == ATA_FEATURE_WCACHE_ON && d->cfg.write_cache);
+            if (!c->fail) d->wcache_on = 1;
+            c->status = ATA_SR_BSY;
+            sim_event(c, SIM_EV_DONE, now + cmd_tsc);
+            return;
+
+        case ATA_CMD_FLUSH_CACHE:
+        case ATA_CMD_FLUSH_CACHE_EXT:
+            if (cmd == ATA_CMD_FLUSH_CACHE_EXT && !d->cfg.lba48) break;
+            d->stats.flushes++;
+            c->status = ATA_SR_BSY;
+            sim_event(c, SIM_EV_DONE, now + (d->dirty ? sim_us_to_tsc(d->cfg.flush_us) : cmd_tsc));
+            d->dirty = 0;
+            return;
+
+        case ATA_CMD_READ_SECTORS:          break;
+        case ATA_CMD_READ_SECTORS_EXT:      ext = 1; break;
+        case ATA_CMD_READ_MULTIPLE:         multiple = 1; break;
+        case ATA_CMD_READ_MULTIPLE_EXT:     ext = 1; multiple = 1; break;
+        case ATA_CMD_WRITE_SECTORS:         write = 1; break;
+        case ATA_CMD_WRITE_SECTORS_EXT:     write = 1; ext = 1; break;
+        case ATA_CMD_WRITE_MULTIPLE:        write = 1; multiple = 1; break;
+        case ATA_CMD_WRITE_MULTIPLE_EXT:    write = 1; ext = 1; multiple = 1; break;
+        case ATA_CMD_WRITE_MULTIPLE_FUA_EXT:write = 1; ext = 1; multiple = 1; break;
+        case ATA_CMD_READ_DMA_EXT:          ext = 1; dma = 1; break;
+        case ATA_CMD_WRITE_DMA_EXT:         write = 1; ext = 1; dma = 1; break;
+        case ATA_CMD_WRITE_DMA_FUA_EXT:     write = 1; ext = 1; dma = 1; break;
+        case ATA_CMD_DSM:                   write = 1; ext = 1; dma = 1; break;
+        default:
+            c->status = ATA_SR_BSY;
+            c->fail = 1;
+            sim_event(c, SIM_EV_DONE, now + cmd_tsc);
+            return;
+    }
+
+    uint8_t fua = (cmd == ATA_CMD_WRITE_MULTIPLE_FUA_EXT || cmd == ATA_CMD_WRITE_DMA_FUA_EXT);
+    uint8_t refused = (ext && !d->cfg.lba48) || (multiple && !d->multiple) || (dma && !d->cfg.dma) ||
+                      (fua && !d->cfg.fua) ||
+                      (cmd == ATA_CMD_DSM && (!d->cfg.trim || c->feature[0] != ATA_DSM_FEATURE_TRIM));
+    if (refused) {
+        c->status = ATA_SR_DRDY | ATA_SR_ERR;
+        c->error = SIM_ERR_ABRT;
+        d->stats.errors++;
+        sim_intrq(c, now);
+        return;
+    }
+
+    c->write = write;
+    c->lba = cmd == ATA_CMD_DSM ? 0 : sim_lba_get(c, ext);
+    c->left = sim_count_get(c, ext);
+    if (cmd != ATA_CMD_DSM && c->lba + c->left > d->cfg.sectors) {
+        c->status = ATA_SR_DRDY | ATA_SR_ERR;
+        c->error = SIM_ERR_IDNF;
+        d->stats.errors++;
+        sim_intrq(c, now);
+        return;
+    }
+    if (fua) d->stats.fua_writes++;
+
+    if (dma) {
+        c->status = ATA_SR_BSY | ATA_SR_DRDY;
+        c->dma_wait = 1;
+        if (c->bm_cmd & ATA_BM_CMD_START) sim_dma_start(c, now);
+        return;
+    }
+
+    sim_block_next(c);
+    if (write) {
+        // the first block is asked for without an IRQ
+        c->status = ATA_SR_DRDY | ATA_SR_DRQ;
+        return;
+    }
+    c->status = ATA_SR_BSY;
+    sim_event(c, SIM_EV_DRQ, now + cmd_tsc + sim_media_tsc(d, c->block));
+}
+
+// PRD walk for the DMA command that just finished; returns 0 on a bad table
+static uint8_t sim_dma_move(sim_channel_t* c) {
+    sim_drive_t* d = c->drv;
+    uint64_t bytes = (uint64_t)c->left * 512;
+    uint64_t off = 0;
+    const ata_prd_t* prd = (const ata_prd_t*)(uintptr_t)c->bm_prdt;
+    uint8_t* payload = c->cmd == ATA_CMD_DSM ? c->buf : NULL;
+
+    for (uint32_t i = 0; off < bytes; i++) {
+        if (i == ATA_PRD_MAX) return 0;
+        const ata_prd_t* e = &prd[i];
+        uint32_t len = e->byte_count ? e->byte_count : 0x10000u;
+        if ((e->phys & 1) || (e->phys & 0xFFFF) + len > 0x10000u) d->stats.violations++;
+        if (len > bytes - off) len = (uint32_t)(bytes - off);
+
+        uint8_t* mem = (uint8_t*)(uintptr_t)e->phys;
+        if (payload) {
+            if (off + len <= sizeof(c->buf)) memcpy(payload + off, mem, len);
+        } else if (c->write) {
+            memcpy(d->image + c->lba * 512 + off, mem, len);
+        } else {
+            memcpy(mem, d->image + c->lba * 512 + off, len);
+        }
+        off += len;
+        if ((e->flags & ATA_PRD_EOT) && off < bytes) return 0;
+    }
+
+    if (payload) {
+        const uint64_t* ent = (const uint64_t*)payload;
+        for (uint64_t i = 0; i < bytes / 8 && i * 8 < sizeof(c->buf); i++) {
+            uint64_t lba = ent[i] & 0xFFFFFFFFFFFFULL;
+            uint64_t n = ent[i] >> 48;
+            if (n == 0) continue;
+            if (lba + n > d->cfg.sectors) return 0;
+            memset(d->image + lba * 512, 0, n * 512);
+            d->stats.trimmed += n;
+        }
+    } else if (c->write) {
+        d->stats.sectors_written += c->left;
+        d->dirty = d->wcache_on && c->cmd != ATA_CMD_WRITE_DMA_FUA_EXT;
+    } else {
+        d->stats.sectors_read += c->left;
+    }
+    return 1;
+}
+
+static void sim_ata_event(sim_channel_t* c) {
+    sim_drive_t* d = c->drv;
+    uint64_t at = c->ev_at;
+    switch (c->ev) {
+        case SIM_EV_DRQ:
+            if (!c->identify && sim_range_fails(d, c->lba, c->block)) {
+                sim_command_end(c, SIM_ERR_UNC, at);
+                return;
+            }
+            if (c->identify) memcpy(c->buf, d->identify, 512);
+            else memcpy(c->buf, d->image + c->lba * 512, (uint64_t)c->block * 512);
+            c->status = ATA_SR_DRDY | ATA_SR_DRQ;
+            c->ev = SIM_EV_NONE;
+            sim_intrq(c, at);
+            return;
+
+        case SIM_EV_BLOCK:
+            if (sim_range_fails(d, c->lba, c->block)) {
+                sim_command_end(c, SIM_ERR_UNC, at);
+                return;
+            }
+            memcpy(d->image + c->lba * 512, c->buf, (uint64_t)c->block * 512);
+            d->stats.sectors_written += c->block;
+            d->dirty = d->wcache_on && c->cmd != ATA_CMD_WRITE_MULTIPLE_FUA_EXT;
+            c->lba += c->block;
+            c->left -= c->block;
+            c->ev = SIM_EV_NONE;
+            if (c->left == 0) {
+                sim_command_end(c, 0, at);
+                return;
+            }
+            sim_block_next(c);
+            c->status = ATA_SR_DRDY | ATA_SR_DRQ;
+            sim_intrq(c, at);
+            return;
+
+        case SIM_EV_DONE:
+            sim_command_end(c, c->fail ? SIM_ERR_ABRT : 0, at);
+            return;
+
+        case SIM_EV_DMA: {
+            uint8_t bad = c->cmd != ATA_CMD_DSM && sim_range_fails(d, c->lba, c->left);
+            uint8_t ok = bad || sim_dma_move(c);
+            c->bm_status = (uint8_t)((c->bm_status & ~ATA_BM_SR_ACTIVE) | ATA_BM_SR_IRQ | (ok ? 0 : ATA_BM_SR_ERR));
+            sim_command_end(c, bad ? SIM_ERR_UNC : 0, at);
+            return;
+        }
+
+        default:
+            return;
+    }
+}
+
+// a DRQ block moved through DATA completely
+static void sim_block_moved(sim_channel_t* c, uint64_t now) {
+    sim_drive_t* d = c->drv;
+    if (c->write) {
+        c->status = ATA_SR_BSY;
+        sim_event(c, SIM_EV_BLOCK, now + sim_media_tsc(d, c->block));
+        return;
+    }
+    if (!c->identify) d->stats.sectors_read += c->block;
+    c->lba += c->block;
+    c->left -= c->block;
+    if (c->left == 0) {
+        // no IRQ after the last block of a read
+        c->status = ATA_SR_DRDY;
+        return;
+    }
+    sim_block_next(c);
+    c->status = ATA_SR_BSY;
+    sim_event(c, SIM_EV_DRQ, now + sim_media_tsc(d, c->block));
+}
+
+static uint16_t sim_data_in(sim_channel_t* c, uint64_t now) {
+    if (!(c->status & ATA_SR_DRQ) || c->write) {
+        if (c->drv) c->drv->stats.violations++;
+        return 0xFFFF;
+    }
+    uint16_t w = (uint16_t)(c->buf[c->pos] | (c->buf[c->pos + 1] << 8));
+    c->pos += 2;
+    if (c->pos == c->block * 512) sim_block_moved(c, now);
+    return w;
+}
+
+static void sim_data_out(sim_channel_t* c, uint16_t w, uint64_t now) {
+    if (!(c->status & ATA_SR_DRQ) || !c->write) {
+        if (c->drv) c->drv->stats.violations++;
+        return;
+    }
+    c->buf[c->pos] = (uint8_t)w;
+    c->buf[c->pos + 1] = (uint8_t)(w >> 8);
+    c->pos += 2;
+    if (c->pos == c->block * 512) sim_block_moved(c, now);
+}
+
+static void sim_ata_reset(sim_channel_t* c) {
+    c->status = ATA_SR_DRDY;
+    c->error = 1;
+    c->ev = SIM_EV_NONE;
+    c->dma_wait = 0;
+    c->dev = ATA_DH_BASE;
+    c->intrq = 0;
+    c->line = 0;
+}
+
+static uint8_t sim_ata_read(sim_channel_t* c, uint8_t reg, uint64_t now) {
+    if (!c->drives[0] && !c->drives[1]) return 0xFF;
+    if (reg == ATA_REG_DRIVE_SEL) return c->dev;
+    if (!sim_selected(c)) return 0;
+
+    switch (reg) {
+        case ATA_REG_DATA:      return (uint8_t)sim_data_in(c, now);
+        case ATA_REG_FEATURES:  return c->error;
+        case ATA_REG_SECCOUNT:  return c->count[0];
+        case ATA_REG_LBA_LOW:   return c->lba_low[0];
+        case ATA_REG_LBA_MID:   return c->lba_mid[0];
+        case ATA_REG_LBA_HIGH:  return c->lba_high[0];
+        case ATA_REG_STATUS:
+            c->intrq = 0;
+            sim_line_update(c, now);
+            return c->status;
+        default:                return 0xFF;
+    }
+}
+
+static void sim_tf_write(uint8_t* r, uint8_t v) {
+    r[1] = r[0];
+    r[0] = v;
+}
+
+static void sim_ata_write(sim_channel_t* c, uint8_t reg, uint8_t v, uint64_t now) {
+    sim_drive_t* d = sim_selected(c);
+    if (reg != ATA_REG_DATA && reg != ATA_REG_COMMAND && (c->status & (ATA_SR_BSY | ATA_SR_DRQ))) {
+        if (d) d->stats.violations++;
+        return;
+    }
+    switch (reg) {
+        case ATA_REG_DATA:      sim_data_out(c, v, now); return;
+        case ATA_REG_FEATURES:  sim_tf_write(c->feature, v); return;
+        case ATA_REG_SECCOUNT:  sim_tf_write(c->count, v); return;
+        case ATA_REG_LBA_LOW:   sim_tf_write(c->lba_low, v); return;
+        case ATA_REG_LBA_MID:   sim_tf_write(c->lba_mid, v); return;
+        case ATA_REG_LBA_HIGH:  sim_tf_write(c->lba_high, v); return;
+        case ATA_REG_DRIVE_SEL: c->dev = v; return;
+        case ATA_REG_COMMAND:   sim_ata_command(c, v, now); return;
+        default: return;
+    }
+}
+
+static void sim_ctrl_write(sim_channel_t* c, uint8_t v, uint64_t now) {
+    if ((v & ATA_CTRL_SRST) && !(c->ctrl & ATA_CTRL_SRST)) sim_ata_reset(c);
+    c->ctrl = v;
+    sim_line_update(c, now);
+}
+
+static uint8_t sim_alt_status(sim_channel_t* c) {
+    if (!c->drives[0] && !c->drives[1]) return 0xFF;
+    if (!sim_selected(c)) return 0;
+    return c->status;
+}
+
+static void sim_bm_write(sim_channel_t* c, uint8_t reg, uint8_t v, uint64_t now) {
+    if (reg == ATA_BM_REG_COMMAND) {
+        uint8_t start = (v & ATA_BM_CMD_START) && !(c->bm_cmd & ATA_BM_CMD_START);
+        c->bm_cmd = v;
+        if (!(v & ATA_BM_CMD_START)) c->bm_status &= (uint8_t)~ATA_BM_SR_ACTIVE;
+        if (start && c->dma_wait) sim_dma_start(c, now);
+        return;
+    }
+    if (reg == ATA_BM_REG_STATUS) {
+        uint8_t clear = v & (ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+        c->bm_status = (uint8_t)((c->bm_status & ~clear & ~0x60) | (v & 0x60));
+    }
+}
+
+// ---- PIT ----
+
+static uint64_t sim_pit_tsc(uint16_t count) {
+    return (uint64_t)(count ? count : 0x10000) * g_tsc_hz / PIT_HZ;
+}
+
+static void sim_pit_write(uint16_t port, uint8_t v, uint64_t now) {
+    sim_pit_t* pit = &g_sim.pit;
+    if (port == PIT_CMD) {
+        uint8_t ch = v >> 6;
+        if (ch == 0) {
+            pit->ch0_byte = 0;
+            pit->ch0_armed = 0;
+        } else if (ch == 2) {
+            pit->ch2_byte = 0;
+            pit->ch2_running = 0;
+        }
+        return;
+    }
+    if (port == PIT_CH0_DATA) {
+        if (pit->ch0_byte++ == 0) {
+            pit->ch0_count = v;
+            return;
+        }
+        pit->ch0_count = (uint16_t)(pit->ch0_count | (v << 8));
+        pit->ch0_armed = 1;
+        pit->ch0_at = now + sim_pit_tsc(pit->ch0_count);
+        return;
+    }
+    if (port == PIT_CH2_DATA) {
+        if (pit->ch2_byte++ == 0) pit->ch2_count = v;
+        else pit->ch2_count = (uint16_t)(pit->ch2_count | (v << 8));
+        return;
+    }
+    if (port == PIT_GATE_PORT) {
+        if ((v & PIT_GATE_CH2) && !(pit->gate & PIT_GATE_CH2)) {
+            pit->ch2_start = now;
+            pit->ch2_running = 1;
+        }
+        pit->gate = v;
+    }
+}
+
+static uint8_t sim_pit_gate_read(uint64_t now) {
+    sim_pit_t* pit = &g_sim.pit;
+    uint8_t out = pit->ch2_running && !g_sim.cfg.pit_stuck && now >= pit->ch2_start + sim_pit_tsc(pit->ch2_count);
+    return (uint8_t)((pit->gate & 0x0F) | (out ? PIT_OUT_CH2 : 0));
+}
+
+// ---- PCI: host bridge at 00:00.0, PIIX3 ISA 00:01.0, its IDE function 00:01.1 ----
+
+static uint32_t sim_pci_read(uint32_t addr) {
+    uint8_t bus = (uint8_t)(addr >> 16);
+    uint8_t slot = (uint8_t)((addr >> 11) & 0x1F);
+    uint8_t func = (uint8_t)((addr >> 8) & 7);
+    uint8_t off = (uint8_t)(addr & 0xFC);
+    if (bus != 0) return 0xFFFFFFFFu;
+
+    if (slot == 0 && func == 0) {
+        if (off == PCI_REG_VENDOR_ID) return 0x12378086u;
+        if (off == 0x08) return 0x06000000u;
+        return 0;
+    }
+    if (slot != 1) return 0xFFFFFFFFu;
+    if (func == 0) {
+        if (off == PCI_REG_VENDOR_ID) return 0x70008086u;
+        if (off == 0x08) return 0x06010000u;
+        if (off == 0x0C) return (uint32_t)PCI_HEADER_MULTIFN << 16;
+        return 0;
+    }
+    if (func != 1 || g_sim.cfg.no_bus_master) return 0xFFFFFFFFu;
+    switch (off) {
+        case PCI_REG_VENDOR_ID: return 0x70108086u;
+        case PCI_REG_COMMAND:   return g_sim.pci_command;
+        case 0x08:              return ((uint32_t)PCI_CLASS_STORAGE << 24) | ((uint32_t)PCI_SUBCLASS_IDE << 16) | (0x80u << 8);
+        case PCI_REG_BAR0 + 16: return SIM_BM_BASE | PCI_BAR_IO;
+        default:                return 0;
+    }
+}
+
+static void sim_pci_write(uint32_t addr, uint32_t v) {
+    if (((addr >> 8) & 0xFFFF) == ((1u << 3) | 1) && (addr & 0xFC) == PCI_REG_COMMAND) g_sim.pci_command = (uint16_t)v;
+}
+
+// ---- port dispatch ----
+
+static sim_channel_t* sim_channel_io(uint16_t port, uint8_t* reg) {
+    for (int i = 0; i < 2; i++) {
+        sim_channel_t* c = &g_sim.chan[i];
+        if (port >= c->io && port < c->io + 8) {
+            *reg = (uint8_t)(port - c->io);
+            return c;
+        }
+    }
+    return NULL;
+}
+
+static uint8_t sim_inb(uint16_t port) {
+    uint64_t now = sim_update();
+    uint8_t reg;
+    sim_channel_t* c = sim_channel_io(port, &reg);
+    if (c) return sim_ata_read(c, reg, now);
+    for (int i = 0; i < 2; i++) {
+        if (port == g_sim.chan[i].ctrl_port) return sim_alt_status(&g_sim.chan[i]);
+        uint16_t bm = (uint16_t)(SIM_BM_BASE + i * ATA_BM_CHANNEL_STRIDE);
+        if (port == bm + ATA_BM_REG_COMMAND) return g_sim.chan[i].bm_cmd;
+        if (port == bm + ATA_BM_REG_STATUS) return (uint8_t)(g_sim.chan[i].bm_status | (g_sim.cfg.simplex ? ATA_BM_SR_SIMPLEX : 0));
+    }
+    switch (port) {
+        case PIC1_DATA: return g_sim.pic[0].imr;
+        case PIC2_DATA: return g_sim.pic[1].imr;
+        case PIT_GATE_PORT: return sim_pit_gate_read(now);
+        case SERIAL_COM1 + SERIAL_REG_LSR: return SERIAL_LSR_THRE | 0x40;
+        default: return 0xFF;
+    }
+}
+
+static void sim_outb(uint16_t port, uint8_t v) {
+    uint64_t now = sim_update();
+    uint8_t reg;
+    sim_channel_t* c = sim_channel_io(port, &reg);
+    if (c) {
+        sim_ata_write(c, reg, v, now);
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (port == g_sim.chan[i].ctrl_port) {
+            sim_ctrl_write(&g_sim.chan[i], v, now);
+            return;
+        }
+        uint16_t bm = (uint16_t)(SIM_BM_BASE + i * ATA_BM_CHANNEL_STRIDE);
+        if (port >= bm && port < bm + ATA_BM_CHANNEL_STRIDE) {
+            sim_bm_write(&g_sim.chan[i], (uint8_t)(port - bm), v, now);
+            return;
+        }
+    }
+    switch (port) {
+        case PIC1_CMD:  sim_pic_command(0, v); return;
+        case PIC2_CMD:  sim_pic_command(1, v); return;
+        case PIC1_DATA: sim_pic_data(0, v); return;
+        case PIC2_DATA: sim_pic_data(1, v); return;
+        case PIT_CMD:
+        case PIT_CH0_DATA:
+        case PIT_CH2_DATA:
+        case PIT_GATE_PORT: sim_pit_write(port, v, now); return;
+        case SERIAL_COM1 + SERIAL_REG_LCR: g_sim.com1_lcr = v; return;
+        case SERIAL_COM1 + SERIAL_REG_DATA:
+            if (!(g_sim.com1_lcr & SERIAL_LCR_DLAB) && v != '\r') putchar(v);
+            return;
+        default: return;
+    }
+}
+
+static void sim_io_done(void) {
+    if (g_sim.intr) sim_irq_poll();
+}
+
+void outb(uint16_t port, uint8_t value) { sim_outb(port, value); sim_io_done(); }
+uint8_t inb(uint16_t port) { uint8_t v = sim_inb(port); sim_io_done(); return v; }
+
+void outw(uint16_t port, uint16_t value) {
+    uint8_t reg;
+    sim_channel_t* c = sim_channel_io(port, &reg);
+    sim_update();
+    if (c && reg == ATA_REG_DATA) sim_data_out(c, value, rdtsc());
+    sim_io_done();
+}
+
+uint16_t inw(uint16_t port) {
+    uint8_t reg;
+    sim_channel_t* c = sim_channel_io(port, &reg);
+    sim_update();
+    uint16_t v = (c && reg == ATA_REG_DATA) ? sim_data_in(c, rdtsc()) : 0xFFFF;
+    sim_io_done();
+    return v;
+}
+
+void outl(uint16_t port, uint32_t value) {
+    sim_update();
+    if (port == PCI_CONFIG_ADDRESS) g_sim.pci_addr = value;
+    else if (port == PCI_CONFIG_DATA) sim_pci_write(g_sim.pci_addr, value);
+    for (int i = 0; i < 2; i++) {
+        if (port == SIM_BM_BASE + i * ATA_BM_CHANNEL_STRIDE + ATA_BM_REG_PRDT) g_sim.chan[i].bm_prdt = value;
+    }
+    sim_io_done();
+}
+
+uint32_t inl(uint16_t port) {
+    sim_update();
+    uint32_t v = 0xFFFFFFFFu;
+    if (port == PCI_CONFIG_DATA) v = sim_pci_read(g_sim.pci_addr);
+    for (int i = 0; i < 2; i++) {
+        if (port == SIM_BM_BASE + i * ATA_BM_CHANNEL_STRIDE + ATA_BM_REG_PRDT) v = g_sim.chan[i].bm_prdt;
+    }
+    sim_io_done();
+    return v;
+}
+
+void outsw(uint16_t port, const void* addr, uint32_t count) {
+    uint8_t reg;
+    sim_channel_t* c = sim_channel_io(port, &reg);
+    const uint16_t* w = (const uint16_t*)addr;
+    uint64_t now = sim_update();
+    for (uint32_t i = 0; c && i < count; i++) sim_data_out(c, w[i], now);
+    sim_io_done();
+}
+
+void insw(uint16_t port, void* addr, uint32_t count) {
+    uint8_t reg;
+    sim_channel_t* c = sim_channel_io(port, &reg);
+    uint16_t* w = (uint16_t*)addr;
+    uint64_t now = sim_update();
+    for (uint32_t i = 0; i < count; i++) w[i] = c ? sim_data_in(c, now) : 0xFFFF;
+    sim_io_done();
+}
+
+// the handlers run with interrupts off, nothing is delivered from inside them
+__attribute__((no_caller_saved_registers)) uint8_t inb_irq(uint16_t port) { return sim_inb(port); }
+__attribute__((no_caller_saved_registers)) void outb_irq(uint16_t port, uint8_t value) { sim_outb(port, value); }
+
+__attribute__((no_caller_saved_registers)) void insw_irq(uint16_t port, void* addr, uint32_t count) {
+    uint8_t reg;
+    sim_channel_t* c = sim_channel_io(port, &reg);
+    uint16_t* w = (uint16_t*)addr;
+    uint64_t now = sim_update();
+    for (uint32_t i = 0; i < count; i++) w[i] = c ? sim_data_in(c, now) : 0xFFFF;
+}
+
+__attribute__((no_caller_saved_registers)) void outsw_irq(uint16_t port, const void* addr, uint32_t count) {
+    uint8_t reg;
+    sim_channel_t* c = sim_channel_io(port, &reg);
+    const uint16_t* w = (const uint16_t*)addr;
+    uint64_t now = sim_update();
+    for (uint32_t i = 0; c && i < count; i++) sim_data_out(c, w[i], now);
+}
+
+// ---- interrupts ----
+
+// device events and timers that are due, in the order they happened. returns
+// the time it looked at
+static uint64_t sim_update(void) {
+    uint64_t now = rdtsc();
+    for (;;) {
+        sim_channel_t* next = NULL;
+        for (int i = 0; i < 2; i++) {
+            sim_channel_t* c = &g_sim.chan[i];
+            if (c->ev != SIM_EV_NONE && c->ev_at <= now && (!next || c->ev_at < next->ev_at)) next = c;
+        }
+        if (!next) break;
+        sim_ata_event(next);
+    }
+    if (g_sim.pit.ch0_armed && g_sim.pit.ch0_at <= now) {
+        g_sim.pit.ch0_armed = 0;
+        sim_pic_raise(PIC_IRQ_PIT, g_sim.pit.ch0_at);
+    }
+    return now;
+}
+
+// takes one IRQ if interrupts are on and one is due; returns 1 if it did
+static uint8_t sim_irq_take(void) {
+    if (!g_sim.intr) return 0;
+    int irq = sim_pic_pending(rdtsc());
+    if (irq < 0) return 0;
+
+    sim_pic_t* pic = &g_sim.pic[irq >> 3];
+    uint8_t bit = (uint8_t)(1u << (irq & 7));
+    pic->irr &= (uint8_t)~bit;
+    pic->isr |= bit;
+    if (irq >= 8) g_sim.pic[0].isr |= (uint8_t)(1u << PIC_IRQ_CASCADE);
+
+    uint8_t vector = (uint8_t)(pic->offset + (irq & 7));
+    if (!g_sim.vectors[vector]) sim_fail("IRQ%d arrived on vector %u, which has no IDT entry", irq, vector);
+
+    interrupt_frame_t frame = { 0, KERNEL_CS, RFLAGS_IF, 0, 0 };
+    g_sim.irq_count[irq]++;
+    g_sim.intr = 0;
+    g_sim.vectors[vector](&frame);
+    g_sim.intr = 1;
+    return 1;
+}
+
+static void sim_irq_poll(void) {
+    sim_update();
+    while (sim_irq_take()) sim_update();
+}
+
+uint64_t host_irq_save(void) {
+    uint64_t flags = g_sim.intr ? RFLAGS_IF : 0;
+    g_sim.intr = 0;
+    return flags;
+}
+
+void host_irq_restore(uint64_t flags) {
+    if (!(flags & RFLAGS_IF)) return;
+    g_sim.intr = 1;
+    sim_irq_poll();
+}
+
+// sti; hlt
+void host_wait_for_irq(void) {
+    g_sim.intr = 1;
+    uint64_t limit = rdtsc() + sim_us_to_tsc(SIM_HLT_LIMIT_US);
+    for (;;) {
+        sim_update();
+        if (sim_irq_take()) {
+            g_sim.wakeups++;
+            return;
+        }
+        if (rdtsc() > limit) sim_fail("hlt: no interrupt came within %d ms", SIM_HLT_LIMIT_US / 1000);
+    }
+}
+
+// ---- setup ----
+
+void sim_init(const sim_cfg_t* cfg) {
+    if (!g_tsc_hz) sim_tsc_measure();
+    memset(&g_sim, 0, sizeof(g_sim));
+    g_sim.cfg = *cfg;
+
+    for (int i = 0; i < SIM_DRIVES; i++) {
+        sim_drive_t* d = &g_sim.drives[i];
+        d->cfg = cfg->drive[i];
+        if (d->cfg.sectors == 0) continue;
+        d->image = calloc(d->cfg.sectors, 512);
+        if (!d->image) sim_fail("no memory for a %lu sector image", d->cfg.sectors);
+        g_sim.chan[i / 2].drives[i % 2] = d;
+    }
+
+    static const uint16_t io[2] = { ATA_PRIMARY_IO, ATA_SECONDARY_IO };
+    static const uint16_t ctrl[2] = { ATA_PRIMARY_CTRL, ATA_SECONDARY_CTRL };
+    for (int i = 0; i < 2; i++) {
+        sim_channel_t* c = &g_sim.chan[i];
+        c->irq = (uint8_t)(PIC_IRQ_ATA_PRIMARY + i);
+        c->io = io[i];
+        c->ctrl_port = ctrl[i];
+        sim_ata_reset(c);
+    }
+
+    // what SeaBIOS leaves: timer, keyboard, cascade and the IDE channels unmasked
+    g_sim.pic[0].offset = 0x08;
+    g_sim.pic[0].imr = 0xB8;
+    g_sim.pic[1].offset = 0x70;
+    g_sim.pic[1].imr = 0x3F;
+    g_sim.intr = 0;
+}
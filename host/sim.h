@@ -0,0 +1,79 @@
+#pragma once
+#include "common.h"
+#include "idt.h"
+
+// a simulated PC for host builds of the kernel drivers (./build.sh host): a PIIX
+// IDE controller (two channels, bus master DMA), the 8259 PICs, the 8254 PIT and
+// COM1, reached through the kernel's port I/O and host_irq_* hooks. time is the
+// real TSC: a drive's latency passes as wall time, so ticks, polls and halts cost
+// what they cost. RAM for DMA comes from sim_phys_alloc, mapped 1:1 below 4 GiB
+// (HHDM_OFFSET is 0 in host builds)
+
+#define SIM_DRIVES      4               // channel * 2 + drive, like ata_context_get
+#define SIM_BM_BASE     0xC000          // bus master BAR4
+#define SIM_VECTORS     256
+
+typedef struct sim_drive_cfg_t {
+    uint64_t sectors;           // 0: no drive
+    uint8_t lba48;
+    uint8_t max_multiple;       // IDENTIFY word 47, 0: no READ/WRITE MULTIPLE
+    uint8_t dma;
+    uint8_t write_cache;
+    uint8_t fua;
+    uint8_t trim;
+    uint32_t cmd_us;            // command overhead, before the first block / completion
+    uint32_t sector_ns;         // media time per sector
+    uint32_t flush_us;          // FLUSH CACHE with dirty data in the cache
+    // a data command reaching [err_lba, err_lba + err_count) stops there with
+    // ERR / UNC. err_count 0: none
+    uint64_t err_lba;
+    uint32_t err_count;
+} sim_drive_cfg_t;
+
+typedef struct sim_cfg_t {
+    sim_drive_cfg_t drive[SIM_DRIVES];
+    uint32_t irq_latency_us;    // INTRQ / PIT OUT edge to handler entry
+    uint8_t no_bus_master;      // no PCI IDE function
+    uint8_t simplex;            // bus master status bit 7
+    uint8_t pit_stuck;          // channel 2 OUT never rises
+} sim_cfg_t;
+
+typedef struct sim_stats_t {
+    uint64_t commands;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t flushes;
+    uint64_t fua_writes;
+    uint64_t trimmed;           // sectors
+    uint64_t errors;            // commands ended with ERR
+    uint64_t violations;        // register accesses the protocol does not allow
+} sim_stats_t;
+
+// a drive with what QEMU's ide-hd reports, fast enough for tests
+sim_drive_cfg_t sim_drive_default(uint64_t sectors);
+
+// powers the machine up: drives blank, PICs as the BIOS left them (vectors 8 / 0x70),
+// interrupts disabled, no IDT vectors
+void sim_init(const sim_cfg_t* cfg);
+
+// the IDT: handler for vector, NULL to remove. an IRQ reaching a vector
+// without one fails the run, the way a triple fault would
+void sim_vector_set(uint8_t vector, void (*handler)(interrupt_frame_t* f));
+
+// the drive's image (sectors * 512 bytes) and counters
+uint8_t* sim_disk(uint8_t drive);
+sim_stats_t* sim_stats(uint8_t drive);
+
+// handler entries per IRQ line, and IRQs taken out of a hlt
+uint64_t sim_irq_count(uint8_t irq);
+uint64_t sim_wakeups(void);
+
+// 4 KiB aligned, zeroed, below 4 GiB; "physical" address == pointer
+void* sim_phys_alloc(uint64_t bytes);
+
+uint64_t sim_tsc_hz(void);
+uint64_t sim_us_to_tsc(uint64_t us);
+uint64_t sim_tsc_to_ns(uint64_t tsc);
+
+// prints why and ends the test (the process) as failed
+__attribute__((noreturn, format(printf, 1, 2))) void sim_fail(const char* fmt, ...);
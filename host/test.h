@@ -0,0 +1,44 @@
+#pragma once
+#include "common.h"
+#include "sim.h"
+#include "blk.h"
+#include "ata_driver_irq.h"
+
+// host test usage:
+// 1) a test is a function that sets up the model (sim_init), drives the kernel
+//    code against it and CHECKs what it sees. a failed CHECK ends the test
+// 2) list it in its file's table; main.c runs every table, each test in its own
+//    process (kernel globals can't be reset) with a watchdog for hangs
+
+#define CHECK(cond) \
+    do { if (!(cond)) sim_fail("%s:%d: %s", __FILE__, __LINE__, #cond); } while (0)
+
+typedef struct host_test_t {
+    const char* name;
+    void (*run)(void);
+} host_test_t;
+
+extern const host_test_t g_ata_tests[];
+extern const uint32_t g_ata_test_count;
+extern const host_test_t g_blk_tests[];
+extern const uint32_t g_blk_test_count;
+
+// measurements printed after the tests, not pass/fail
+void ata_bench_run(void);
+void blk_bench_run(void);
+
+// shared by the tables (ata_test.c)
+#define TEST_SECTORS 8192
+
+// drive 0 only, sim_drive_default(TEST_SECTORS)
+sim_cfg_t test_cfg(void);
+// what kmain does before any drive runs on its IRQ: IDT vectors, PIC, sti,
+// and the block layer's clock
+void test_irq_setup(void);
+// IDENTIFY etc. in the given mode, 1 if the drive came up
+uint8_t test_drive_init(ata_context_t* ata, ata_wait_mode_t mode);
+// the channel's master, initialized, as a blk device
+blk_device_t* test_blk(uint8_t channel, ata_wait_mode_t mode);
+// one synchronous request, 1 on success
+uint8_t test_io(blk_device_t* dev, blk_op_t op, uint64_t lba, void* buf, uint32_t count, uint32_t flags);
+void test_fill(uint8_t* buf, uint64_t bytes, uint32_t seed);
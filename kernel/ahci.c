@@ -0,0 +1,431 @@
+#include "ahci.h"
+#include "ata_driver_irq.h"
+#include "common.h"
+#include "mem.h"
+#include "pci.h"
+#include "pmm.h"
+#include "vmm.h"
+
+static ahci_context_t g_ahci_ctx = {
+    .hba = NULL,
+    .port = NULL,
+    .ncq = 0,
+    .slots = 0,
+    .issued = 0,
+    .preflush = 0,
+    .postflush = 0,
+    .irq_status = 0
+};
+
+static inline void* ahci_phys_to_virt(phys_addr_t phys) {
+    return (void*)(phys + HHDM_OFFSET);
+}
+
+static inline uint32_t ahci_slot_mask(void) {
+    return (g_ahci_ctx.slots >= 32) ? 0xFFFFFFFFu : ((1u << g_ahci_ctx.slots) - 1);
+}
+
+static uint8_t ahci_port_stop(volatile ahci_port_regs_t* port) {
+    port->cmd &= ~AHCI_PxCMD_ST;
+    uint32_t timeout = AHCI_POLL_TIMEOUT;
+    while ((port->cmd & AHCI_PxCMD_CR) && --timeout) continue;
+
+    port->cmd &= ~AHCI_PxCMD_FRE;
+    timeout = AHCI_POLL_TIMEOUT;
+    while ((port->cmd & AHCI_PxCMD_FR) && --timeout) continue;
+
+    return !(port->cmd & (AHCI_PxCMD_CR | AHCI_PxCMD_FR));
+}
+
+static uint8_t ahci_port_start(volatile ahci_port_regs_t* port) {
+    uint32_t timeout = AHCI_POLL_TIMEOUT;
+    while ((port->tfd & (AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ)) && --timeout) continue;
+    if (!timeout) return 0;
+
+    port->cmd |= AHCI_PxCMD_FRE;
+    port->cmd |= AHCI_PxCMD_ST;
+    return 1;
+}
+
+static inline uint32_t ahci_prdt_len(const ahci_prdt_entry_t* e) {
+    return (e->dbc & 0x3FFFFF) + 1;
+}
+
+// one entry per physically contiguous run of the buffer (flat or segment list);
+// returns entry count, 0 = not DMA-able
+static uint16_t ahci_prdt_build(ahci_cmd_table_t* table, const blk_request_t* req) {
+    uint32_t bytes = req->count * BLK_SECTOR_SIZE;
+    blk_buf_cursor_t cur = { 0, 0, 0 };
+    uint16_t n = 0;
+
+    while (bytes != 0) {
+        phys_addr_t p;
+        uint32_t chunk = blk_buf_next(req, &cur, bytes, &p);
+        if (chunk == 0) return 0;
+
+        ahci_prdt_entry_t* last = n ? &table->prdt[n - 1] : NULL;
+        uint64_t last_end = last ? (((uint64_t)last->dbau << 32) | last->dba) + ahci_prdt_len(last) : 0;
+        if (last && last_end == p && ahci_prdt_len(last) + chunk <= AHCI_PRDT_MAX_BYTES) {
+            last->dbc = ahci_prdt_len(last) + chunk - 1;
+        } else {
+            if (n == AHCI_PRDT_MAX) return 0;
+            table->prdt[n].dba = (uint32_t)p;
+            table->prdt[n].dbau = (uint32_t)(p >> 32);
+            table->prdt[n].rsv = 0;
+            table->prdt[n].dbc = chunk - 1;
+            n++;
+        }
+
+        bytes -= chunk;
+    }
+    return n;
+}
+
+static void ahci_fis_build(ahci_cmd_table_t* table, uint8_t command, uint64_t lba, uint32_t count, uint8_t slot) {
+    ahci_fis_h2d_t* fis = (ahci_fis_h2d_t*)table->cfis;
+    mem_zero(table->cfis, sizeof(table->cfis));
+
+    fis->fis_type = AHCI_FIS_TYPE_REG_H2D;
+    fis->pm_c = AHCI_FIS_H2D_CMD;
+    fis->command = command;
+
+    fis->lba0 = (uint8_t)lba;
+    fis->lba1 = (uint8_t)(lba >> 8);
+    fis->lba2 = (uint8_t)(lba >> 16);
+    fis->lba3 = (uint8_t)(lba >> 24);
+    fis->lba4 = (uint8_t)(lba >> 32);
+    fis->lba5 = (uint8_t)(lba >> 40);
+
+    if (command == AHCI_ATA_CMD_IDENTIFY) return;
+    fis->device = AHCI_DEV_LBA;
+
+    if (command == AHCI_ATA_CMD_READ_FPDMA_QUEUED || command == AHCI_ATA_CMD_WRITE_FPDMA_QUEUED) {
+        // FPDMA: sector count moves to the feature register, the tag goes in count bits 7:3
+        fis->feature_low = (uint8_t)count;
+        fis->feature_high = (uint8_t)(count >> 8);
+        fis->count_low = (uint8_t)(slot << 3);
+    } else {
+        fis->count_low = (uint8_t)count;
+        fis->count_high = (uint8_t)(count >> 8);
+    }
+}
+
+static inline void ahci_header_prepare(uint8_t slot, uint8_t write, uint16_t prdtl) {
+    ahci_cmd_header_t* h = &g_ahci_ctx.cmd_list[slot];
+    h->flags = (uint16_t)((sizeof(ahci_fis_h2d_t) / 4) | (write ? AHCI_CMD_HDR_WRITE : 0));
+    h->prdtl = prdtl;
+    h->prdbc = 0;
+}
+
+static uint8_t ahci_identify(void) {
+    volatile ahci_port_regs_t* port = g_ahci_ctx.port;
+    phys_addr_t buf = pmm_frame_alloc();
+    if (buf == PMM_INVALID_FRAME) return 0;
+
+    ahci_cmd_table_t* table = g_ahci_ctx.cmd_tables[0];
+    table->prdt[0].dba = (uint32_t)buf;
+    table->prdt[0].dbau = (uint32_t)(buf >> 32);
+    table->prdt[0].rsv = 0;
+    table->prdt[0].dbc = 512 - 1;
+    ahci_fis_build(table, AHCI_ATA_CMD_IDENTIFY, 0, 0, 0);
+    ahci_header_prepare(0, 0, 1);
+
+    port->is = 0xFFFFFFFFu;
+    compiler_barrier();
+    port->ci = 1;
+
+    uint8_t ok = 0;
+    uint32_t timeout = AHCI_POLL_TIMEOUT;
+    while (--timeout) {
+        if (port->is & AHCI_PxIS_TFES) break;
+        if (!(port->ci & 1)) { ok = !(port->tfd & AHCI_PxTFD_ERR); break; }
+    }
+    port->is = 0xFFFFFFFFu;
+
+    if (ok) {
+        const uint16_t* id = (const uint16_t*)ahci_phys_to_virt(buf);
+        mem_copy(g_ahci_ctx.identify, id, sizeof(g_ahci_ctx.identify));
+    }
+    pmm_frame_free(buf >> PAGE_SHIFT);
+    return ok;
+}
+
+static uint8_t ahci_port_find(void) {
+    uint32_t pi = g_ahci_ctx.hba->pi;
+    for (uint8_t p = 0; p < AHCI_MAX_PORTS; p++) {
+        if (!(pi & (1u << p))) continue;
+        volatile ahci_port_regs_t* port = &g_ahci_ctx.hba->ports[p];
+        if ((port->ssts & AHCI_SSTS_DET_MASK) != AHCI_SSTS_DET_PRESENT) continue;
+        if (port->sig != AHCI_SIG_ATA) continue;
+
+        g_ahci_ctx.port_no = p;
+        g_ahci_ctx.port = port;
+        return 1;
+    }
+    return 0;
+}
+
+static uint8_t ahci_port_memory_setup(void) {
+    volatile ahci_port_regs_t* port = g_ahci_ctx.port;
+
+    // command list (1 KiB) and received FIS area (256 B) share one frame
+    phys_addr_t frame = pmm_frame_alloc();
+    if (frame == PMM_INVALID_FRAME) return 0;
+    mem_zero(ahci_phys_to_virt(frame), PAGE_SIZE);
+
+    g_ahci_ctx.cmd_list = (ahci_cmd_header_t*)ahci_phys_to_virt(frame);
+    port->clb = (uint32_t)frame;
+    port->clbu = (uint32_t)(frame >> 32);
+    port->fb = (uint32_t)(frame + 1024);
+    port->fbu = (uint32_t)((frame + 1024) >> 32);
+
+    for (uint8_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if ((slot % AHCI_TABLES_PER_FRAME) == 0) {
+            frame = pmm_frame_alloc();
+            if (frame == PMM_INVALID_FRAME) return 0;
+            mem_zero(ahci_phys_to_virt(frame), PAGE_SIZE);
+        }
+        phys_addr_t table = frame + (slot % AHCI_TABLES_PER_FRAME) * AHCI_CMD_TABLE_SIZE;
+        g_ahci_ctx.cmd_tables_phys[slot] = table;
+        g_ahci_ctx.cmd_tables[slot] = (ahci_cmd_table_t*)ahci_phys_to_virt(table);
+        g_ahci_ctx.cmd_list[slot].ctba = (uint32_t)table;
+        g_ahci_ctx.cmd_list[slot].ctbau = (uint32_t)(table >> 32);
+    }
+    return 1;
+}
+
+static void ahci_identify_parse(void) {
+    const uint16_t* id = g_ahci_ctx.identify;
+
+    if (id[AHCI_ID_CMDSET_2] & (1u << 10)) {
+        g_ahci_ctx.sectors = 0;
+        for (int i = 3; i >= 0; i--) {
+            g_ahci_ctx.sectors = (g_ahci_ctx.sectors << 16) | id[AHCI_ID_LBA48_SECTORS + i];
+        }
+    } else {
+        g_ahci_ctx.sectors = (uint64_t)id[AHCI_ID_LBA28_SECTORS] | ((uint64_t)id[AHCI_ID_LBA28_SECTORS + 1] << 16);
+    }
+
+    uint8_t hba_slots = (uint8_t)(((g_ahci_ctx.hba->cap >> AHCI_CAP_NCS_SHIFT) & AHCI_CAP_NCS_MASK) + 1);
+    uint8_t drive_depth = (uint8_t)((id[AHCI_ID_QUEUE_DEPTH] & 0x1F) + 1);
+
+    g_ahci_ctx.ncq = (g_ahci_ctx.hba->cap & AHCI_CAP_SNCQ) && (id[AHCI_ID_SATA_CAP] & AHCI_ID_SATA_CAP_NCQ);
+    g_ahci_ctx.write_cache = (id[AHCI_ID_CMDSET_1_EN] & (1u << 5)) ? 1 : 0;
+    g_ahci_ctx.fua = (id[AHCI_ID_CMDSET_EXT] & (1u << 6)) ? 1 : 0;
+    g_ahci_ctx.slots = hba_slots;
+    if (g_ahci_ctx.ncq && drive_depth < hba_slots) g_ahci_ctx.slots = drive_depth;
+}
+
+uint8_t ahci_init(void) {
+    pci_device_t dev;
+    uint8_t found = 0;
+    for (uint8_t i = 0; pci_device_find_by_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, i, &dev); i++) {
+        if (dev.prog_if == PCI_PROG_IF_AHCI) { found = 1; break; }
+    }
+    if (!found) return 0;
+
+    uint32_t abar = pci_bar_get(&dev, 5) & PCI_BAR_MEM_MASK;
+    if (abar == 0) return 0;
+    pci_bus_master_enable(&dev);
+
+    g_ahci_ctx.hba = (volatile ahci_hba_regs_t*)vmm_mmio_map(abar, sizeof(ahci_hba_regs_t));
+    if (!g_ahci_ctx.hba) return 0;
+    g_ahci_ctx.hba->ghc |= AHCI_GHC_AE;
+    g_ahci_ctx.irq = dev.irq_line;
+
+    if (!ahci_port_find()) return 0;
+    volatile ahci_port_regs_t* port = g_ahci_ctx.port;
+
+    if (!ahci_port_stop(port)) return 0;
+    if (!ahci_port_memory_setup()) return 0;
+    port->serr = 0xFFFFFFFFu;
+    port->is = 0xFFFFFFFFu;
+    port->cmd |= AHCI_PxCMD_SUD | AHCI_PxCMD_POD;
+    if (!ahci_port_start(port)) return 0;
+
+    if (!ahci_identify()) return 0;
+    ahci_identify_parse();
+
+    port->ie = AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_SDBS | AHCI_PxIS_DPS | AHCI_PxIS_ERRORS;
+    g_ahci_ctx.hba->is = 0xFFFFFFFFu;
+    g_ahci_ctx.hba->ghc |= AHCI_GHC_IE;
+    return 1;
+}
+
+uint8_t ahci_irq_line_get(void) { return g_ahci_ctx.irq; }
+
+void setup_ahci_irq(void) {
+    unmask_irq(g_ahci_ctx.irq);
+}
+
+__attribute__((interrupt, no_caller_saved_registers))
+void irq_ahci(interrupt_frame_t* f) {
+    (void)f;
+    uint32_t is = g_ahci_ctx.port->is;
+    g_ahci_ctx.port->is = is;
+    g_ahci_ctx.hba->is = 1u << g_ahci_ctx.port_no;
+    g_ahci_ctx.irq_status |= is;
+    send_eoi(g_ahci_ctx.irq);
+}
+
+static void ahci_fail_all(void) {
+    uint32_t issued = g_ahci_ctx.issued;
+    g_ahci_ctx.issued = 0;
+    g_ahci_ctx.preflush = 0;
+    g_ahci_ctx.postflush = 0;
+    while (issued) {
+        uint8_t slot = (uint8_t)__builtin_ctz(issued);
+        issued &= issued - 1;
+        blk_request_t* req = g_ahci_ctx.reqs[slot];
+        g_ahci_ctx.reqs[slot] = NULL;
+        if (req) blk_request_complete(req, 0);
+    }
+}
+
+// task file error: the HBA stops the port; restart it and fail whatever was queued
+static void ahci_port_recover(void) {
+    volatile ahci_port_regs_t* port = g_ahci_ctx.port;
+    ahci_port_stop(port);
+    port->serr = 0xFFFFFFFFu;
+    port->is = 0xFFFFFFFFu;
+    g_ahci_ctx.irq_status = 0;
+    ahci_port_start(port);
+    ahci_fail_all();
+}
+
+static void ahci_flush_issue(uint8_t slot, blk_request_t* req) {
+    ahci_fis_build(g_ahci_ctx.cmd_tables[slot], AHCI_ATA_CMD_FLUSH_CACHE_EXT, 0, 0, slot);
+    ahci_header_prepare(slot, 0, 0);
+
+    g_ahci_ctx.reqs[slot] = req;
+    g_ahci_ctx.issued |= 1u << slot;
+
+    compiler_barrier();
+    g_ahci_ctx.port->ci = 1u << slot;
+}
+
+// returns 0 if the buffer can't be described by the slot's PRDT
+static uint8_t ahci_data_issue(uint8_t slot, blk_request_t* req) {
+    ahci_cmd_table_t* table = g_ahci_ctx.cmd_tables[slot];
+    uint16_t prdtl = ahci_prdt_build(table, req);
+    if (prdtl == 0) return 0;
+
+    uint8_t write = (req->op == BLK_OP_WRITE);
+    uint8_t fua = write && (req->flags & BLK_REQ_F_FUA) && g_ahci_ctx.write_cache;
+    uint8_t command;
+    if (g_ahci_ctx.ncq) command = write ? AHCI_ATA_CMD_WRITE_FPDMA_QUEUED : AHCI_ATA_CMD_READ_FPDMA_QUEUED;
+    else if (fua && g_ahci_ctx.fua) command = AHCI_ATA_CMD_WRITE_DMA_FUA_EXT;
+    else command = write ? AHCI_ATA_CMD_WRITE_DMA_EXT : AHCI_ATA_CMD_READ_DMA_EXT;
+
+    ahci_fis_build(table, command, req->lba, req->count, slot);
+    if (fua && g_ahci_ctx.ncq) ((ahci_fis_h2d_t*)table->cfis)->device |= AHCI_DEV_FUA;
+    else if (fua && !g_ahci_ctx.fua) g_ahci_ctx.postflush |= 1u << slot;
+    ahci_header_prepare(slot, write, prdtl);
+
+    g_ahci_ctx.reqs[slot] = req;
+    g_ahci_ctx.issued |= 1u << slot;
+
+    compiler_barrier();
+    if (g_ahci_ctx.ncq) g_ahci_ctx.port->sact = 1u << slot;
+    g_ahci_ctx.port->ci = 1u << slot;
+    return 1;
+}
+
+static uint8_t ahci_blk_submit(blk_device_t* dev, blk_request_t* req) {
+    (void)dev;
+    req->status = BLK_REQ_PENDING;
+
+    uint8_t bad = (req->op == BLK_OP_FLUSH) ? req->count != 0
+                : (req->op == BLK_OP_DISCARD) ? req->lba + req->count > g_ahci_ctx.sectors
+                : req->count == 0 || req->count > AHCI_MAX_SECTORS ||
+                  req->lba + req->count > g_ahci_ctx.sectors || ((uintptr_t)req->addr & 1) ||
+                  !blk_request_sg_is_valid(req);
+    if (bad) {
+        blk_request_complete(req, 0);
+        return 1;
+    }
+
+    // DSM TRIM is not wired up here; a discard is only a hint
+    if (req->op == BLK_OP_DISCARD) {
+        blk_request_complete(req, 1);
+        return 1;
+    }
+
+    // no volatile cache: a flush has nothing to do
+    uint8_t flush = g_ahci_ctx.write_cache && blk_request_is_barrier(req);
+    if (req->op == BLK_OP_FLUSH && !flush) {
+        blk_request_complete(req, 1);
+        return 1;
+    }
+
+    // FLUSH CACHE EXT is not queued: it can't share the port with NCQ commands
+    if (flush && g_ahci_ctx.issued) return 0;
+
+    uint32_t free = ~g_ahci_ctx.issued & ahci_slot_mask();
+    if (!free) return 0;
+    uint8_t slot = (uint8_t)__builtin_ctz(free);
+
+    if (flush) {
+        // PREFLUSH: the data goes out from tick once the flush completed
+        if (req->op != BLK_OP_FLUSH) g_ahci_ctx.preflush |= 1u << slot;
+        ahci_flush_issue(slot, req);
+        return 1;
+    }
+
+    if (!ahci_data_issue(slot, req)) blk_request_complete(req, 0);
+    return 1;
+}
+
+static void ahci_blk_tick(blk_device_t* dev) {
+    (void)dev;
+    if (!g_ahci_ctx.issued) return;
+
+    uint32_t is = __atomic_exchange_n(&g_ahci_ctx.irq_status, 0, __ATOMIC_ACQ_REL);
+    is |= g_ahci_ctx.port->is & AHCI_PxIS_ERRORS;
+    if (is & AHCI_PxIS_ERRORS) { ahci_port_recover(); return; }
+
+    // queued commands finish when their SACT bit drops, plain ones when CI drops
+    uint32_t busy = g_ahci_ctx.port->ci;
+    if (g_ahci_ctx.ncq) busy |= g_ahci_ctx.port->sact;
+
+    uint32_t done = g_ahci_ctx.issued & ~busy;
+    while (done) {
+        uint8_t slot = (uint8_t)__builtin_ctz(done);
+        done &= done - 1;
+
+        blk_request_t* req = g_ahci_ctx.reqs[slot];
+        g_ahci_ctx.reqs[slot] = NULL;
+        g_ahci_ctx.issued &= ~(1u << slot);
+
+        // multi-command requests continue in the same slot
+        if (g_ahci_ctx.preflush & (1u << slot)) {
+            g_ahci_ctx.preflush &= ~(1u << slot);
+            if (!ahci_data_issue(slot, req)) blk_request_complete(req, 0);
+            continue;
+        }
+        if (g_ahci_ctx.postflush & (1u << slot)) {
+            g_ahci_ctx.postflush &= ~(1u << slot);
+            ahci_flush_issue(slot, req);
+            continue;
+        }
+        blk_request_complete(req, 1);
+    }
+}
+
+static blk_device_t g_ahci_blk = {
+    .name = "ahci0",
+    .sectors = 0,
+    .max_sectors = AHCI_MAX_SECTORS,
+    .queue_depth = 0,
+    .submit = ahci_blk_submit,
+    .tick = ahci_blk_tick,
+    .idle = NULL,
+    .map = NULL,
+    .ctx = &g_ahci_ctx
+};
+
+blk_device_t* ahci_blk_device_get(void) {
+    g_ahci_blk.sectors = g_ahci_ctx.sectors;
+    g_ahci_blk.queue_depth = g_ahci_ctx.slots;
+    return &g_ahci_blk;
+}
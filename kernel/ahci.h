@@ -0,0 +1,215 @@
+#pragma once
+#include "common.h"
+#include "idt.h"
+#include "blk.h"
+
+#define AHCI_MAX_PORTS        32
+#define AHCI_MAX_SLOTS        32
+
+// 1 KiB command tables: 128 bytes of FIS area + 56 PRDT entries
+#define AHCI_CMD_TABLE_SIZE   1024
+#define AHCI_PRDT_MAX         56
+#define AHCI_TABLES_PER_FRAME (PAGE_SIZE / AHCI_CMD_TABLE_SIZE)
+
+// worst case every page of the buffer needs its own PRDT entry, plus one for misalignment
+#define AHCI_MAX_SECTORS      (((AHCI_PRDT_MAX - 1) * PAGE_SIZE) / BLK_SECTOR_SIZE)
+#define AHCI_PRDT_MAX_BYTES   (4u * 1024 * 1024)
+
+// generic host control
+#define AHCI_CAP_NCS_SHIFT    8       // bits 8-12: command slots - 1
+#define AHCI_CAP_NCS_MASK     0x1F
+#define AHCI_CAP_SNCQ         (1u << 30)
+
+#define AHCI_GHC_HR           (1u << 0)
+#define AHCI_GHC_IE           (1u << 1)
+#define AHCI_GHC_AE           (1u << 31)
+
+// port command and status
+#define AHCI_PxCMD_ST         (1u << 0)
+#define AHCI_PxCMD_SUD        (1u << 1)
+#define AHCI_PxCMD_POD        (1u << 2)
+#define AHCI_PxCMD_FRE        (1u << 4)
+#define AHCI_PxCMD_FR         (1u << 14)
+#define AHCI_PxCMD_CR         (1u << 15)
+
+// port interrupt status / enable
+#define AHCI_PxIS_DHRS        (1u << 0)   // D2H register FIS
+#define AHCI_PxIS_PSS         (1u << 1)   // PIO setup FIS
+#define AHCI_PxIS_DSS         (1u << 2)   // DMA setup FIS
+#define AHCI_PxIS_SDBS        (1u << 3)   // set device bits FIS (NCQ completion)
+#define AHCI_PxIS_DPS         (1u << 5)   // descriptor processed
+#define AHCI_PxIS_IFS         (1u << 27)
+#define AHCI_PxIS_HBDS        (1u << 28)
+#define AHCI_PxIS_HBFS        (1u << 29)
+#define AHCI_PxIS_TFES        (1u << 30)
+#define AHCI_PxIS_ERRORS      (AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+
+#define AHCI_PxTFD_BSY        0x80
+#define AHCI_PxTFD_DRQ        0x08
+#define AHCI_PxTFD_ERR        0x01
+
+#define AHCI_SSTS_DET_MASK    0x0F
+#define AHCI_SSTS_DET_PRESENT 0x03
+
+#define AHCI_SIG_ATA          0x00000101
+
+#define AHCI_FIS_TYPE_REG_H2D 0x27
+#define AHCI_FIS_H2D_CMD      0x80        // C bit: this FIS carries a command
+
+#define AHCI_DEV_LBA          0x40
+#define AHCI_DEV_FUA          0x80        // FPDMA writes: forced unit access
+
+// ATA commands used over AHCI
+#define AHCI_ATA_CMD_IDENTIFY           0xEC
+#define AHCI_ATA_CMD_READ_DMA_EXT       0x25
+#define AHCI_ATA_CMD_WRITE_DMA_EXT      0x35
+#define AHCI_ATA_CMD_READ_FPDMA_QUEUED  0x60
+#define AHCI_ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define AHCI_ATA_CMD_WRITE_DMA_FUA_EXT  0x3D
+#define AHCI_ATA_CMD_FLUSH_CACHE_EXT    0xEA
+
+// IDENTIFY words
+#define AHCI_ID_QUEUE_DEPTH   75          // bits 0-4: depth - 1
+#define AHCI_ID_SATA_CAP      76          // bit 8: NCQ
+#define AHCI_ID_SATA_CAP_NCQ  (1u << 8)
+#define AHCI_ID_CMDSET_2      83          // bit 10: LBA48
+#define AHCI_ID_CMDSET_EXT    84          // bit 6: WRITE DMA FUA EXT
+#define AHCI_ID_CMDSET_1_EN   85          // bit 5: write cache enabled
+#define AHCI_ID_LBA28_SECTORS 60
+#define AHCI_ID_LBA48_SECTORS 100
+
+#define AHCI_POLL_TIMEOUT     10000000
+
+typedef struct ahci_port_regs_t {
+  uint32_t clb;
+  uint32_t clbu;
+  uint32_t fb;
+  uint32_t fbu;
+  uint32_t is;
+  uint32_t ie;
+  uint32_t cmd;
+  uint32_t rsv0;
+  uint32_t tfd;
+  uint32_t sig;
+  uint32_t ssts;
+  uint32_t sctl;
+  uint32_t serr;
+  uint32_t sact;
+  uint32_t ci;
+  uint32_t sntf;
+  uint32_t fbs;
+  uint32_t rsv1[11];
+  uint32_t vendor[4];
+} __attribute__((packed)) ahci_port_regs_t;
+
+typedef struct ahci_hba_regs_t {
+  uint32_t cap;
+  uint32_t ghc;
+  uint32_t is;
+  uint32_t pi;
+  uint32_t vs;
+  uint32_t ccc_ctl;
+  uint32_t ccc_ports;
+  uint32_t em_loc;
+  uint32_t em_ctl;
+  uint32_t cap2;
+  uint32_t bohc;
+  uint8_t  rsv[0xA0 - 0x2C];
+  uint8_t  vendor[0x100 - 0xA0];
+  ahci_port_regs_t ports[AHCI_MAX_PORTS];
+} __attribute__((packed)) ahci_hba_regs_t;
+
+typedef struct ahci_cmd_header_t {
+  uint16_t flags;             // bits 0-4: CFL (dwords), bit 6: write, bit 10: clear busy on R_OK
+  uint16_t prdtl;             // PRDT entries
+  volatile uint32_t prdbc;    // bytes transferred (HBA writes)
+  uint32_t ctba;
+  uint32_t ctbau;
+  uint32_t rsv[4];
+} __attribute__((packed)) ahci_cmd_header_t;
+
+#define AHCI_CMD_HDR_WRITE    (1u << 6)
+
+typedef struct ahci_prdt_entry_t {
+  uint32_t dba;
+  uint32_t dbau;
+  uint32_t rsv;
+  uint32_t dbc;               // bits 0-21: byte count - 1, bit 31: interrupt on completion
+} __attribute__((packed)) ahci_prdt_entry_t;
+
+typedef struct ahci_fis_h2d_t {
+  uint8_t fis_type;
+  uint8_t pm_c;               // bit 7: command
+  uint8_t command;
+  uint8_t feature_low;
+  uint8_t lba0;
+  uint8_t lba1;
+  uint8_t lba2;
+  uint8_t device;
+  uint8_t lba3;
+  uint8_t lba4;
+  uint8_t lba5;
+  uint8_t feature_high;
+  uint8_t count_low;
+  uint8_t count_high;
+  uint8_t icc;
+  uint8_t control;
+  uint8_t rsv[4];
+} __attribute__((packed)) ahci_fis_h2d_t;
+
+typedef struct ahci_cmd_table_t {
+  uint8_t cfis[64];
+  uint8_t acmd[16];
+  uint8_t rsv[48];
+  ahci_prdt_entry_t prdt[AHCI_PRDT_MAX];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+typedef struct ahci_context_t {
+  volatile ahci_hba_regs_t* hba;
+  volatile ahci_port_regs_t* port;
+  uint8_t port_no;
+  uint8_t irq;
+
+  uint8_t ncq;                // HBA and drive both do NCQ
+  uint8_t slots;              // usable command slots
+  uint64_t sectors;
+  uint8_t write_cache;        // drive's volatile write cache is on
+  uint8_t fua;                // WRITE DMA FUA EXT supported
+
+  ahci_cmd_header_t* cmd_list;               // HHDM view of the 1 KiB command list
+  ahci_cmd_table_t* cmd_tables[AHCI_MAX_SLOTS];
+  phys_addr_t cmd_tables_phys[AHCI_MAX_SLOTS];
+
+  // slot ownership; only touched outside IRQ context
+  uint32_t issued;
+  blk_request_t* reqs[AHCI_MAX_SLOTS];
+  uint32_t preflush;          // slots running FLUSH CACHE before their request's data
+  uint32_t postflush;         // slots that still owe a FLUSH CACHE after their data (FUA emulation)
+
+  // IRQ communication
+  volatile uint32_t irq_status;   // PxIS bits accumulated by the handler
+
+  uint16_t identify[256];
+} ahci_context_t;
+
+// AHCI usage:
+// 1) ahci_init() (after pmm/vmm and remap_pic)
+// 2) setup_ahci_irq(), IDT vector PIC_REMAP_MASTER + ahci_irq_line_get() -> irq_ahci
+// 3) blk_device_register(ahci_blk_device_get())
+// 4) sti, then submit blk_request_t's and tick the device (or blk_tick_all());
+//    with NCQ up to 32 tagged requests are in flight at once
+// FLUSH and PREFLUSH requests wait for the port to go idle (FLUSH CACHE EXT is
+// not queued); FUA writes use the FPDMA FUA bit, WRITE DMA FUA EXT, or a flush
+// after the data when the drive has neither
+
+// finds the first AHCI controller and SATA disk, starts the port, IDENTIFYs it (polled)
+uint8_t ahci_init(void);
+
+uint8_t ahci_irq_line_get(void);
+
+// unmasks the controller's legacy INTx line
+void setup_ahci_irq(void);
+
+__attribute__((interrupt, no_caller_saved_registers)) void irq_ahci(interrupt_frame_t* f);
+
+blk_device_t* ahci_blk_device_get(void);
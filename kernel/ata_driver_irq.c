@@ -1,23 +1,39 @@
 #include "ata_driver_irq.h"
 #include "common.h"
+#include "blk.h"
+#include "pci.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "pit.h"
 
-static ata_context_t g_ata_ctx = {
-    .irq = PIC_IRQ_ATA_PRIMARY,    // IRQ14
-    .multiple = 1,                 // 16 sectors per DRQ block
-    .irq_fired = 0,
-    .last_status = 0,
-    .op = ATA_OP_NONE,
-    .step = ATA_STEP_IDLE,
-    .delay_400 = 0,
-    .lba = 0,
-    .sectors_left = 0,
-    .batch_left = 0,
-    .ptr = 0
+static ata_channel_t g_ata_channels[ATA_CHANNELS] = {
+    { .io = ATA_PRIMARY_IO,   .ctrl = ATA_PRIMARY_CTRL,   .irq = PIC_IRQ_ATA_PRIMARY,   .active = NULL, .dma_ready = 0 },
+    { .io = ATA_SECONDARY_IO, .ctrl = ATA_SECONDARY_CTRL, .irq = PIC_IRQ_ATA_SECONDARY, .active = NULL, .dma_ready = 0 }
 };
 
-static inline uint8_t ata_status_read_once(void) {
-    // STATUS (0x1F7): reading clears the device INTRQ condition
-    return inb(ATA_REG_STATUS);
+#define ATA_CONTEXT_INIT(channel, drive) {      \
+    .chan = &g_ata_channels[channel],           \
+    .slave = drive,                             \
+    .multiple = 1,  /* raised by SET MULTIPLE during init */ \
+    .irq_xfer = 1,                              \
+    .wcache_enable = 1,                         \
+    .wait_mode = ATA_WAIT_POLL, /* until ata_irq_routed_set */ \
+    .irq_fired = 0,                             \
+    .last_status = 0,                           \
+    .op = ATA_OP_NONE,                          \
+    .step = ATA_STEP_IDLE,                      \
+    .blk_req = NULL                             \
+}
+
+// index = channel * 2 + drive
+static ata_context_t g_ata_ctx[ATA_DRIVES] = {
+    ATA_CONTEXT_INIT(0, 0), ATA_CONTEXT_INIT(0, 1),
+    ATA_CONTEXT_INIT(1, 0), ATA_CONTEXT_INIT(1, 1)
+};
+
+static inline uint8_t ata_status_read_once(ata_context_t* ctx) {
+    // STATUS (io + 7): reading clears the device INTRQ condition
+    return inb(ctx->chan->io + ATA_REG_STATUS);
 }
 
 static inline void pic_io_wait(void) {
@@ -25,9 +41,9 @@ static inline void pic_io_wait(void) {
     outb(0x80, 0);
 }
 
-static inline uint8_t ata_alt_status_read_once(void) {
-    // CONTROL (0x3F6): returns alternate status and does not clear INTRQ
-    return inb(ATA_REG_CONTROL);
+static inline uint8_t ata_alt_status_read_once(ata_context_t* ctx) {
+    // CONTROL (ctrl port): returns alternate status and does not clear INTRQ
+    return inb(ctx->chan->ctrl);
 }
 
 static inline uint8_t ata_status_is_bad(uint8_t st) {
@@ -97,268 +113,1078 @@ void send_eoi(uint8_t irq) {
 void setup_ata_irq(void) {
     remap_pic(PIC_REMAP_MASTER, PIC_REMAP_SLAVE);
     unmask_irq(PIC_IRQ_ATA_PRIMARY);
+    unmask_irq(PIC_IRQ_ATA_SECONDARY);
 }
 
-static inline void ata_delay_400ns_start(void) {
-    g_ata_ctx.delay_400 = 4;
+ata_context_t* ata_context_get(uint8_t channel, uint8_t drive) {
+    if (channel >= ATA_CHANNELS || drive > 1) return NULL;
+    return &g_ata_ctx[channel * 2 + drive];
 }
 
-static inline uint8_t ata_delay_400ns_tick(void) {
-    if (g_ata_ctx.delay_400 == 0) return 1;
-    (void)inb(ATA_REG_CONTROL);
-    g_ata_ctx.delay_400--;
-    return (g_ata_ctx.delay_400 == 0);
+static inline uint8_t ata_drive_select_bits(const ata_context_t* ctx) {
+    return (uint8_t)(ATA_DH_LBA_MASTER | (ctx->slave ? ATA_DH_SLAVE : 0));
 }
 
-__attribute__((interrupt, no_caller_saved_registers))
-void irq14_ata(interrupt_frame_t* f) {
-    (void)f;
-    g_ata_ctx.last_status = inb_irq(ATA_REG_STATUS);
-    g_ata_ctx.irq_fired = 1;
-    send_eoi(PIC_IRQ_ATA_PRIMARY);
+static inline void ata_delay_400ns_start(ata_context_t* ctx) {
+    ctx->delay_400 = 4;
+}
+
+static inline uint8_t ata_delay_400ns_tick(ata_context_t* ctx) {
+    if (ctx->delay_400 == 0) return 1;
+    (void)inb(ctx->chan->ctrl);
+    ctx->delay_400--;
+    return (ctx->delay_400 == 0);
 }
 
-uint8_t is_ata_irq_busy(void) {
-    if (g_ata_ctx.step == ATA_STEP_IDLE || 
-        g_ata_ctx.step == ATA_STEP_INIT_DONE || g_ata_ctx.step == ATA_STEP_INIT_FAIL ||
-        g_ata_ctx.step == ATA_STEP_IO_DONE || g_ata_ctx.step == ATA_STEP_IO_FAIL) return 0;
+uint8_t is_ata_irq_busy(ata_context_t* ctx) {
+    if (ctx->step == ATA_STEP_IDLE || 
+        ctx->step == ATA_STEP_INIT_DONE || ctx->step == ATA_STEP_INIT_FAIL ||
+        ctx->step == ATA_STEP_IO_DONE || ctx->step == ATA_STEP_IO_FAIL) return 0;
     return 1;
 }
 
-uint8_t is_ata_irq_done(void) { return (g_ata_ctx.step == ATA_STEP_IO_DONE); }
-uint8_t is_ata_irq_failed(void) { return (g_ata_ctx.step == ATA_STEP_IO_FAIL); }
-uint8_t is_ata_init_done(void) { return (g_ata_ctx.step == ATA_STEP_INIT_DONE); }
-uint8_t is_ata_init_failed(void) { return (g_ata_ctx.step == ATA_STEP_INIT_FAIL); }
+uint8_t is_ata_irq_done(ata_context_t* ctx) { return (ctx->step == ATA_STEP_IO_DONE); }
+uint8_t is_ata_irq_failed(ata_context_t* ctx) { return (ctx->step == ATA_STEP_IO_FAIL); }
+uint8_t is_ata_init_done(ata_context_t* ctx) { return (ctx->step == ATA_STEP_INIT_DONE); }
+uint8_t is_ata_init_failed(ata_context_t* ctx) { return (ctx->step == ATA_STEP_INIT_FAIL); }
+
+const ata_device_info_t* ata_device_info_get(ata_context_t* ctx) { return &ctx->info; }
 
-static inline void ata_irq_flags_reset(void) {
-    g_ata_ctx.irq_fired = 0;
-    g_ata_ctx.last_status = 0;
+// set once vectors 46/47 are in the IDT and interrupts are on
+static uint8_t g_ata_irq_routed = 0;
+
+void ata_irq_routed_set(uint8_t routed) { g_ata_irq_routed = routed; }
+
+// an IRQ nothing delivers would leave IRQ and hybrid waits hanging: poll instead
+void ata_wait_mode_set(ata_context_t* ctx, ata_wait_mode_t mode) {
+    ctx->wait_mode = g_ata_irq_routed ? mode : ATA_WAIT_POLL;
 }
 
-static inline void ata_request_state_reset(void) {
-    g_ata_ctx.delay_400 = 0;
-    ata_irq_flags_reset();
+// steps that only move on once the drive reports something (IRQ or status poll)
+static inline uint8_t ata_step_is_waiting(const ata_context_t* ctx) {
+    switch (ctx->step) {
+        case ATA_STEP_INIT_IDENTIFY_WAIT:
+        case ATA_STEP_INIT_SETMULT_WAIT:
+        case ATA_STEP_INIT_SETFEAT_WAIT:
+        case ATA_STEP_IO_WAIT_IRQ:
+        case ATA_STEP_IO_WAIT_DONE:
+        case ATA_STEP_IO_DMA_WAIT:
+            return 1;
+        default:
+            return 0;
+    }
 }
 
-uint8_t begin_init_ata_28_irq(void) {
-    if (g_ata_ctx.step != ATA_STEP_IDLE) return 0;
-    g_ata_ctx.op = ATA_OP_INIT_28;
-    g_ata_ctx.step = ATA_STEP_INIT_SELECT;
-    ata_request_state_reset();
-    return 1;
+uint8_t is_ata_irq_waiting(ata_context_t* ctx) {
+    return ata_step_is_waiting(ctx) && ctx->delay_400 == 0;
 }
 
-uint8_t begin_init_ata_48_irq(void) {
-    if (g_ata_ctx.step != ATA_STEP_IDLE) return 0;
-    g_ata_ctx.op = ATA_OP_INIT_48;
-    g_ata_ctx.step = ATA_STEP_INIT_SELECT;
-    ata_request_state_reset();
-    return 1;
+static inline void ata_irq_flags_reset(ata_context_t* ctx) {
+    ctx->irq_fired = 0;
+    ctx->last_status = 0;
+}
+
+static inline void ata_request_state_reset(ata_context_t* ctx) {
+    ctx->delay_400 = 0;
+    ata_irq_flags_reset(ctx);
 }
 
-uint8_t begin_read_from_disk_ata_28_irq(uint32_t lba, void* addr, uint32_t sector_count) {
-    if (g_ata_ctx.step != ATA_STEP_IDLE || sector_count == 0) return 0;
-    g_ata_ctx.op = ATA_OP_READ_28;
-    g_ata_ctx.step = ATA_STEP_IO_ISSUE_SELECT;
-    g_ata_ctx.lba = (uint64_t)lba;
-    g_ata_ctx.sectors_left = sector_count;
-    g_ata_ctx.batch_left = 0;
-    g_ata_ctx.ptr = (uint16_t*)addr;
-    ata_request_state_reset();
+static inline uint8_t ata_op_is_read(ata_op_t op) {
+    return (op == ATA_OP_READ_28 || op == ATA_OP_READ_48 || op == ATA_OP_READ_DMA_48);
+}
+
+static inline uint8_t ata_op_is_48(ata_op_t op) {
+    return (op != ATA_OP_READ_28 && op != ATA_OP_WRITE_28);
+}
+
+static inline uint8_t ata_op_is_dma(ata_op_t op) {
+    return (op == ATA_OP_READ_DMA_48 || op == ATA_OP_WRITE_DMA_48 || op == ATA_OP_WRITE_DMA_FUA_48 ||
+            op == ATA_OP_DSM_TRIM);
+}
+
+// a drive may start a command once neither it nor the other drive on its channel is
+// busy. a blk request holds the channel between its commands (PREFLUSH, data, flush)
+static uint8_t ata_channel_is_free(ata_context_t* ctx) {
+    ata_context_t* owner = ctx->chan->active;
+    if (is_ata_irq_busy(ctx)) return 0;
+    return !(owner && owner != ctx && (is_ata_irq_busy(owner) || owner->blk_req));
+}
+
+static uint8_t ata_init_begin(ata_context_t* ctx, ata_op_t op) {
+    if (!ata_channel_is_free(ctx)) return 0;
+    ctx->chan->active = ctx;
+    ctx->op = op;
+    ctx->step = ATA_STEP_INIT_SELECT;
+    ata_request_state_reset(ctx);
     return 1;
 }
 
-uint8_t begin_write_to_disk_ata_28_irq(uint32_t lba, void* addr, uint32_t sector_count) {
-    if (g_ata_ctx.step != ATA_STEP_IDLE || sector_count == 0) return 0;
-    g_ata_ctx.op = ATA_OP_WRITE_28;
-    g_ata_ctx.step = ATA_STEP_IO_ISSUE_SELECT;
-    g_ata_ctx.lba = (uint64_t)lba;
-    g_ata_ctx.sectors_left = sector_count;
-    g_ata_ctx.batch_left = 0;
-    g_ata_ctx.ptr = (uint16_t*)addr;
-    ata_request_state_reset();
+// EXT commands on a drive without LBA48 are aborted by the drive; FLUSH picks
+// its command from the drive's info and runs on any drive
+static inline uint8_t ata_op_is_usable(const ata_context_t* ctx, ata_op_t op) {
+    return ctx->info.lba48 || !ata_op_is_48(op) || op == ATA_OP_FLUSH;
+}
+
+static uint8_t ata_io_begin(ata_context_t* ctx, ata_op_t op, uint64_t lba, void* addr, uint32_t sector_count) {
+    if ((sector_count == 0 && op != ATA_OP_FLUSH) || !ata_op_is_usable(ctx, op) || !ata_channel_is_free(ctx)) return 0;
+    ctx->chan->active = ctx;
+    ctx->op = op;
+    ctx->step = ATA_STEP_IO_ISSUE_SELECT;
+    ctx->lba = lba;
+    ctx->sectors_left = sector_count;
+    ctx->batch_left = 0;
+    ctx->dma_batch = 0;
+    ctx->ptr = (uint16_t*)addr;
+    ctx->sg = NULL;
+    ata_request_state_reset(ctx);
     return 1;
 }
 
-uint8_t begin_read_from_disk_ata_48_irq(uint64_t lba, void* addr, uint32_t sector_count) {
-    if (g_ata_ctx.step != ATA_STEP_IDLE || sector_count == 0) return 0;
-    g_ata_ctx.op = ATA_OP_READ_48;
-    g_ata_ctx.step = ATA_STEP_IO_ISSUE_SELECT;
-    g_ata_ctx.lba = lba;
-    g_ata_ctx.sectors_left = sector_count;
-    g_ata_ctx.batch_left = 0;
-    g_ata_ctx.ptr = (uint16_t*)addr;
-    ata_request_state_reset();
+// the command only starts from tick_ata, setting the list up after ata_io_begin is safe
+static uint8_t ata_sg_begin(ata_context_t* ctx, ata_op_t op, uint64_t lba, const blk_sg_list_t* sg, uint32_t sector_count) {
+    if (!ata_io_begin(ctx, op, lba, NULL, sector_count)) return 0;
+    ctx->sg = sg;
+    ctx->sg_cur.pos = 0;
+    ctx->sg_cur.seg = 0;
+    ctx->sg_cur.seg_off = 0;
     return 1;
 }
 
-uint8_t begin_write_to_disk_ata_48_irq(uint64_t lba, void* addr, uint32_t sector_count) {
-    if (g_ata_ctx.step != ATA_STEP_IDLE || sector_count == 0) return 0;
-    g_ata_ctx.op = ATA_OP_WRITE_48;
-    g_ata_ctx.step = ATA_STEP_IO_ISSUE_SELECT;
-    g_ata_ctx.lba = lba;
-    g_ata_ctx.sectors_left = sector_count;
-    g_ata_ctx.batch_left = 0;
-    g_ata_ctx.ptr = (uint16_t*)addr;
-    ata_request_state_reset();
+uint8_t begin_init_ata_28_irq(ata_context_t* ctx) {
+    return ata_init_begin(ctx, ATA_OP_INIT_28);
+}
+
+uint8_t begin_init_ata_48_irq(ata_context_t* ctx) {
+    return ata_init_begin(ctx, ATA_OP_INIT_48);
+}
+
+uint8_t begin_read_from_disk_ata_28_irq(ata_context_t* ctx, uint32_t lba, void* addr, uint32_t sector_count) {
+    return ata_io_begin(ctx, ATA_OP_READ_28, lba, addr, sector_count);
+}
+
+uint8_t begin_write_to_disk_ata_28_irq(ata_context_t* ctx, uint32_t lba, void* addr, uint32_t sector_count) {
+    return ata_io_begin(ctx, ATA_OP_WRITE_28, lba, addr, sector_count);
+}
+
+uint8_t begin_read_from_disk_ata_48_irq(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count) {
+    return ata_io_begin(ctx, ATA_OP_READ_48, lba, addr, sector_count);
+}
+
+uint8_t begin_write_to_disk_ata_48_irq(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count) {
+    return ata_io_begin(ctx, ATA_OP_WRITE_48, lba, addr, sector_count);
+}
+
+uint8_t begin_write_to_disk_ata_48_fua_irq(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count) {
+    // there is no single-sector FUA write
+    if (!ctx->info.fua || ctx->multiple < 2) return 0;
+    return ata_io_begin(ctx, ATA_OP_WRITE_FUA_48, lba, addr, sector_count);
+}
+
+uint8_t begin_read_from_disk_ata_48_sg(ata_context_t* ctx, uint64_t lba, const blk_sg_list_t* sg, uint32_t sector_count) {
+    return ata_sg_begin(ctx, ATA_OP_READ_48, lba, sg, sector_count);
+}
+
+uint8_t begin_write_to_disk_ata_48_sg(ata_context_t* ctx, uint64_t lba, const blk_sg_list_t* sg, uint32_t sector_count) {
+    return ata_sg_begin(ctx, ATA_OP_WRITE_48, lba, sg, sector_count);
+}
+
+uint8_t begin_flush_ata_irq(ata_context_t* ctx) {
+    return ata_io_begin(ctx, ATA_OP_FLUSH, 0, NULL, 0);
+}
+
+uint8_t initialize_ata_28_irq(ata_context_t* ctx) { return begin_init_ata_28_irq(ctx); }
+
+static inline void ata_finish_io(ata_context_t* ctx, uint8_t success) {
+    ctx->step = success ? ATA_STEP_IO_DONE : ATA_STEP_IO_FAIL;
+    ctx->op = ATA_OP_NONE;
+}
+
+static inline void ata_finish_init(ata_context_t* ctx, uint8_t success) {
+    ctx->step = success ? ATA_STEP_INIT_DONE : ATA_STEP_INIT_FAIL;
+    ctx->op = ATA_OP_NONE;
+}
+
+static inline void ata_init_select_handle(ata_context_t* ctx) {
+    outb(ctx->chan->ctrl, ctx->wait_mode == ATA_WAIT_POLL ? ATA_CTRL_IRQ_DISABLE : ATA_CTRL_IRQ_ENABLE);
+    outb(ctx->chan->io + ATA_REG_DRIVE_SEL, ata_drive_select_bits(ctx));
+    ata_delay_400ns_start(ctx);
+    ctx->step = ATA_STEP_INIT_IDENTIFY_CMD;
+}
+
+static inline void ata_init_identify_cmd_handle(ata_context_t* ctx) {
+    outb(ctx->chan->io + ATA_REG_SECCOUNT, 0);
+    outb(ctx->chan->io + ATA_REG_LBA_LOW,  0);
+    outb(ctx->chan->io + ATA_REG_LBA_MID,  0);
+    outb(ctx->chan->io + ATA_REG_LBA_HIGH, 0);
+    outb(ctx->chan->io + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    ata_irq_flags_reset(ctx);
+    ctx->step = ATA_STEP_INIT_IDENTIFY_WAIT;
+
+    // no drive behind this select bit (0) or no channel at all (floating): no IRQ will come
+    uint8_t st = ata_alt_status_read_once(ctx);
+    if (st == 0 || ATA_STATUS_IS_FLOATING(st)) ata_finish_init(ctx, 0);
+}
+
+// init commands report on their IRQ, or in poll mode once the drive drops BSY
+static inline uint8_t ata_init_event_get(ata_context_t* ctx, uint8_t* st) {
+    if (ctx->irq_fired) {
+        ctx->irq_fired = 0;
+        *st = ctx->last_status;
+        return 1;
+    }
+    if (ctx->wait_mode != ATA_WAIT_POLL) return 0;
+    if (ATA_STATUS_IS_BUSY(ata_alt_status_read_once(ctx))) return 0;
+    *st = ata_status_read_once(ctx);
     return 1;
 }
 
-uint8_t initialize_ata_28_irq(void) { return begin_init_ata_28_irq(); }
+static inline void ata_init_identify_wait_handle(ata_context_t* ctx) {
+    uint8_t st;
+    if (!ata_init_event_get(ctx, &st)) return;
+
+    if (ata_status_is_bad(st)) { ata_finish_init(ctx, 0); return; }
 
-static inline void ata_finish_io(uint8_t success) {
-    g_ata_ctx.step = success ? ATA_STEP_IO_DONE : ATA_STEP_IO_FAIL;
-    g_ata_ctx.op = ATA_OP_NONE;
+    if (st & ATA_SR_DRQ) { ctx->step = ATA_STEP_INIT_IDENTIFY_XFER; return; }
+
+    st = ata_alt_status_read_once(ctx);
+    if (ata_status_is_bad(st)) { ata_finish_init(ctx, 0); return; }
+    if (st & ATA_SR_DRQ) ctx->step = ATA_STEP_INIT_IDENTIFY_XFER;
 }
 
-static inline void ata_finish_init(uint8_t success) {
-    g_ata_ctx.step = success ? ATA_STEP_INIT_DONE : ATA_STEP_INIT_FAIL;
-    g_ata_ctx.op = ATA_OP_NONE;
+static inline void ata_identify_parse(ata_context_t* ctx) {
+    const uint16_t* id = ctx->identify;
+    ata_device_info_t* info = &ctx->info;
+
+    info->sectors_28 = (uint64_t)id[ATA_ID_LBA28_SECTORS] |
+                       ((uint64_t)id[ATA_ID_LBA28_SECTORS + 1] << 16);
+    info->lba48 = (id[ATA_ID_CMDSET_2] & ATA_ID_CMDSET_LBA48) ? 1 : 0;
+    info->sectors_48 = 0;
+    if (info->lba48) {
+        for (int i = 3; i >= 0; i--) {
+            info->sectors_48 = (info->sectors_48 << 16) | id[ATA_ID_LBA48_SECTORS + i];
+        }
+    }
+
+    info->max_multiple = (uint8_t)(id[ATA_ID_MAX_MULTIPLE] & 0xFF);
+    info->dma = (id[ATA_ID_CAPABILITIES] & ATA_ID_CAP_DMA) ? 1 : 0;
+    info->mwdma_modes = (uint8_t)(id[ATA_ID_MWDMA_MODES] & 0x07);
+    info->pio_modes = (id[ATA_ID_FIELD_VALID] & ATA_ID_VALID_64_70) ? (uint8_t)(id[ATA_ID_PIO_MODES] & 0x03) : 0;
+    info->udma_modes = (id[ATA_ID_FIELD_VALID] & ATA_ID_VALID_88) ? (uint8_t)(id[ATA_ID_UDMA_MODES] & 0x7F) : 0;
+    info->write_cache = (id[ATA_ID_CMDSET_1] & ATA_ID_CMDSET_WCACHE) ? 1 : 0;
+    info->write_cache_on = (id[ATA_ID_CMDSET_1_EN] & ATA_ID_CMDSET_WCACHE) ? 1 : 0;
+    info->flush = (id[ATA_ID_CMDSET_1] & ATA_ID_CMDSET_FLUSH) ? 1 : 0;
+    info->flush_ext = (id[ATA_ID_CMDSET_2] & ATA_ID_CMDSET_FLUSH_EXT) ? 1 : 0;
+    info->fua = (id[ATA_ID_CMDSET_EXT] & ATA_ID_CMDSET_FUA) ? 1 : 0;
+    info->trim = (info->lba48 && (id[ATA_ID_DSM] & ATA_ID_DSM_TRIM)) ? 1 : 0;
+    // 0 means the drive doesn't say: one block is always allowed
+    uint16_t blocks = id[ATA_ID_DSM_MAX_BLOCKS];
+    if (blocks == 0) blocks = 1;
+    info->dsm_max_blocks = (uint8_t)(blocks > ATA_DSM_MAX_BLOCKS ? ATA_DSM_MAX_BLOCKS : blocks);
 }
 
-static inline void ata_init_select_handle(void) {
-    outb(ATA_REG_CONTROL, ATA_CTRL_IRQ_ENABLE);
-    outb(ATA_REG_DRIVE_SEL, ATA_DH_LBA_MASTER);
-    ata_delay_400ns_start();
-    g_ata_ctx.step = ATA_STEP_INIT_IDENTIFY_CMD;
+// last init step: a write cache that is off gets turned on (flushes keep writes safe)
+static inline void ata_init_features_next(ata_context_t* ctx) {
+    if (ctx->wcache_enable && ctx->info.write_cache && !ctx->info.write_cache_on) {
+        ctx->step = ATA_STEP_INIT_SETFEAT_CMD;
+        return;
+    }
+    ata_finish_init(ctx, 1);
 }
 
-static inline void ata_init_identify_cmd_handle(void) {
-    outb(ATA_REG_SECCOUNT, 0);
-    outb(ATA_REG_LBA_LOW,  0);
-    outb(ATA_REG_LBA_MID,  0);
-    outb(ATA_REG_LBA_HIGH, 0);
-    outb(ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
-    ata_irq_flags_reset();
-    g_ata_ctx.step = ATA_STEP_INIT_IDENTIFY_WAIT;
+static inline void ata_init_identify_xfer_handle(ata_context_t* ctx) {
+    insw(ctx->chan->io + ATA_REG_DATA, ctx->identify, 256);
+    ata_identify_parse(ctx);
+
+    // only worth a SET MULTIPLE round trip if the drive can do more than 1 sector per block
+    if (ctx->info.max_multiple > 1) {
+        ctx->step = ATA_STEP_INIT_SETMULT_CMD;
+        return;
+    }
+    ctx->multiple = 1;
+    ata_init_features_next(ctx);
 }
 
-static inline void ata_init_identify_wait_handle(void) {
-    if (!g_ata_ctx.irq_fired) return;
-    g_ata_ctx.irq_fired = 0;
+static inline void ata_init_setmult_cmd_handle(ata_context_t* ctx) {
+    outb(ctx->chan->io + ATA_REG_SECCOUNT, ctx->info.max_multiple);
+    outb(ctx->chan->io + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+    ata_irq_flags_reset(ctx);
+    ctx->step = ATA_STEP_INIT_SETMULT_WAIT;
+    // polled: BSY may not be up yet right after the command
+    if (ctx->wait_mode == ATA_WAIT_POLL) ata_delay_400ns_start(ctx);
+}
 
-    uint8_t st = g_ata_ctx.last_status;
-    if (ata_status_is_bad(st)) { ata_finish_init(0); return; }
+static inline void ata_init_setmult_wait_handle(ata_context_t* ctx) {
+    uint8_t st;
+    if (!ata_init_event_get(ctx, &st)) return;
+    if (ATA_STATUS_IS_FLOATING(st)) { ata_finish_init(ctx, 0); return; }
 
-    if (st & ATA_SR_DRQ) { g_ata_ctx.step = ATA_STEP_INIT_IDENTIFY_XFER; return; }
+    // drive refused the block size: stay on single-sector commands, still usable
+    ctx->multiple = ATA_STATUS_HAS_ERROR(st) ? 1 : ctx->info.max_multiple;
+    ata_init_features_next(ctx);
+}
 
-    st = ata_alt_status_read_once();
-    if (ata_status_is_bad(st)) { ata_finish_init(0); return; }
-    if (st & ATA_SR_DRQ) g_ata_ctx.step = ATA_STEP_INIT_IDENTIFY_XFER;
+static inline void ata_init_setfeat_cmd_handle(ata_context_t* ctx) {
+    outb(ctx->chan->io + ATA_REG_FEATURES, ATA_FEATURE_WCACHE_ON);
+    outb(ctx->chan->io + ATA_REG_COMMAND, ATA_CMD_SET_FEATURES);
+    ata_irq_flags_reset(ctx);
+    ctx->step = ATA_STEP_INIT_SETFEAT_WAIT;
+    if (ctx->wait_mode == ATA_WAIT_POLL) ata_delay_400ns_start(ctx);
 }
 
-static inline void ata_init_identify_xfer_handle(void) {
-    insw(ATA_REG_DATA, g_ata_ctx.identify, 256);
-    ata_finish_init(1);
+static inline void ata_init_setfeat_wait_handle(ata_context_t* ctx) {
+    uint8_t st;
+    if (!ata_init_event_get(ctx, &st)) return;
+    if (ATA_STATUS_IS_FLOATING(st)) { ata_finish_init(ctx, 0); return; }
+
+    // refused: the drive stays write-through, still usable
+    ctx->info.write_cache_on = !ATA_STATUS_HAS_ERROR(st);
+    ata_finish_init(ctx, 1);
 }
 
-static inline void ata_init_tick(void) {
-    switch (g_ata_ctx.step) {
-        case ATA_STEP_INIT_SELECT:        ata_init_select_handle();        return;
-        case ATA_STEP_INIT_IDENTIFY_CMD:  ata_init_identify_cmd_handle();  return;
-        case ATA_STEP_INIT_IDENTIFY_WAIT: ata_init_identify_wait_handle(); return;
-        case ATA_STEP_INIT_IDENTIFY_XFER: ata_init_identify_xfer_handle(); return;
+static inline void ata_init_tick(ata_context_t* ctx) {
+    switch (ctx->step) {
+        case ATA_STEP_INIT_SELECT:        ata_init_select_handle(ctx);        return;
+        case ATA_STEP_INIT_IDENTIFY_CMD:  ata_init_identify_cmd_handle(ctx);  return;
+        case ATA_STEP_INIT_IDENTIFY_WAIT: ata_init_identify_wait_handle(ctx); return;
+        case ATA_STEP_INIT_IDENTIFY_XFER: ata_init_identify_xfer_handle(ctx); return;
+        case ATA_STEP_INIT_SETMULT_CMD:   ata_init_setmult_cmd_handle(ctx);   return;
+        case ATA_STEP_INIT_SETMULT_WAIT:  ata_init_setmult_wait_handle(ctx);  return;
+        case ATA_STEP_INIT_SETFEAT_CMD:   ata_init_setfeat_cmd_handle(ctx);   return;
+        case ATA_STEP_INIT_SETFEAT_WAIT:  ata_init_setfeat_wait_handle(ctx);  return;
         default: return;
     }
 }
 
-static inline void ata_io_issue_select_handle(void) {
-    if (g_ata_ctx.op == ATA_OP_READ_28 || g_ata_ctx.op == ATA_OP_WRITE_28) {
-        uint32_t lba28 = (uint32_t)g_ata_ctx.lba;
-        uint8_t top4 = (uint8_t)((lba28 >> 24) & 0x0F);
-        outb(ATA_REG_DRIVE_SEL, (uint8_t)(ATA_DH_LBA_MASTER | top4));
-    } else {
-        outb(ATA_REG_DRIVE_SEL, ATA_DH_LBA_MASTER);
+// svc_tsc slot: flushes (and TRIMs) take far longer than a data block, keep them apart
+static inline uint8_t ata_svc_slot(ata_op_t op) {
+    if (op == ATA_OP_FLUSH || op == ATA_OP_DSM_TRIM) return 2;
+    return ata_op_is_read(op) ? 0 : 1;
+}
+
+static inline uint8_t ata_io_command_get(ata_context_t* ctx) {
+    uint8_t rd = ata_op_is_read(ctx->op);
+    if (ctx->op == ATA_OP_WRITE_FUA_48) return ATA_CMD_WRITE_MULTIPLE_FUA_EXT;
+    if (ata_op_is_48(ctx->op)) {
+        if (ctx->multiple > 1) return rd ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE_EXT;
+        return rd ? ATA_CMD_READ_SECTORS_EXT : ATA_CMD_WRITE_SECTORS_EXT;
+    }
+    if (ctx->multiple > 1) return rd ? ATA_CMD_READ_MULTIPLE : ATA_CMD_WRITE_MULTIPLE;
+    return rd ? ATA_CMD_READ_SECTORS : ATA_CMD_WRITE_SECTORS;
+}
+
+// the helpers below are shared with irq14_ata, hence the _irq port wrappers
+__attribute__((no_caller_saved_registers))
+static void ata_drive_select_write(ata_context_t* ctx) {
+    outb_irq(ctx->chan->ctrl, ctx->wait_mode == ATA_WAIT_POLL ? ATA_CTRL_IRQ_DISABLE : ATA_CTRL_IRQ_ENABLE);
+
+    uint8_t sel = ata_drive_select_bits(ctx);
+    if (!ata_op_is_48(ctx->op)) sel |= (uint8_t)((ctx->lba >> 24) & 0x0F);
+    outb_irq(ctx->chan->io + ATA_REG_DRIVE_SEL, sel);
+}
+
+static inline void ata_io_issue_select_handle(ata_context_t* ctx) {
+    ata_drive_select_write(ctx);
+    ata_delay_400ns_start(ctx);
+    ctx->step = ATA_STEP_IO_ISSUE_TASKFILE;
+}
+
+__attribute__((no_caller_saved_registers))
+static void ata_taskfile_program(ata_context_t* ctx, uint32_t batch) {
+    if (!ata_op_is_48(ctx->op)) {
+        uint32_t lba28 = (uint32_t)ctx->lba;
+        outb_irq(ctx->chan->io + ATA_REG_SECCOUNT, (uint8_t)batch);
+        outb_irq(ctx->chan->io + ATA_REG_LBA_LOW,  (uint8_t)lba28);
+        outb_irq(ctx->chan->io + ATA_REG_LBA_MID,  (uint8_t)(lba28 >> 8));
+        outb_irq(ctx->chan->io + ATA_REG_LBA_HIGH, (uint8_t)(lba28 >> 16));
+        return;
     }
-    ata_delay_400ns_start();
-    g_ata_ctx.step = ATA_STEP_IO_ISSUE_TASKFILE;
+    outb_irq(ctx->chan->io + ATA_REG_SECCOUNT, (uint8_t)(batch >> 8)); // High byte
+    outb_irq(ctx->chan->io + ATA_REG_LBA_LOW,  (uint8_t)(ctx->lba >> 24));
+    outb_irq(ctx->chan->io + ATA_REG_LBA_MID,  (uint8_t)(ctx->lba >> 32));
+    outb_irq(ctx->chan->io + ATA_REG_LBA_HIGH, (uint8_t)(ctx->lba >> 40));
+    outb_irq(ctx->chan->io + ATA_REG_SECCOUNT, (uint8_t)batch); // Low byte
+    outb_irq(ctx->chan->io + ATA_REG_LBA_LOW,  (uint8_t)ctx->lba);
+    outb_irq(ctx->chan->io + ATA_REG_LBA_MID,  (uint8_t)(ctx->lba >> 8));
+    outb_irq(ctx->chan->io + ATA_REG_LBA_HIGH, (uint8_t)(ctx->lba >> 16));
+}
+
+// the drive starts working on a command or the next DRQ block now
+__attribute__((no_caller_saved_registers))
+static void ata_wait_arm(ata_context_t* ctx) {
+    ctx->wait_start = rdtsc();
+    ctx->poll_at = ctx->wait_start + (ctx->svc_tsc[ata_svc_slot(ctx->op)] >> ATA_HYBRID_SLEEP_SHIFT);
+}
+
+// the drive reported back: fold the time since ata_wait_arm into the average
+__attribute__((no_caller_saved_registers))
+static void ata_svc_sample(ata_context_t* ctx) {
+    uint64_t* avg = &ctx->svc_tsc[ata_svc_slot(ctx->op)];
+    uint64_t t = rdtsc() - ctx->wait_start;
+    if (*avg == 0) { *avg = t; return; }
+    *avg = (uint64_t)((int64_t)*avg + (((int64_t)t - (int64_t)*avg) >> ATA_SVC_EWMA_SHIFT));
+}
+
+// one command covers as much as the sector count register allows;
+// the count wraps to 0 for the maximum (256 / 65536), which is what the drive expects
+__attribute__((no_caller_saved_registers))
+static void ata_pio_command_issue(ata_context_t* ctx) {
+    uint32_t batch = ata_op_is_48(ctx->op) ? ATA_MAX_SECTORS_48 : ATA_MAX_SECTORS_28;
+    if (ctx->sectors_left < batch) batch = ctx->sectors_left;
+    ctx->batch_left = batch;
+
+    ata_taskfile_program(ctx, batch);
+    ata_irq_flags_reset(ctx);
+    ctx->poll_drq = !ata_op_is_read(ctx->op);
+    // step first: the first IRQ may arrive right after the command byte
+    ctx->step = ATA_STEP_IO_WAIT_IRQ;
+    ata_wait_arm(ctx);
+    outb_irq(ctx->chan->io + ATA_REG_COMMAND, ata_io_command_get(ctx));
 }
 
-static inline void ata_io_issue_taskfile_handle(void) {
-    if (g_ata_ctx.sectors_left == 0) { ata_finish_io(1); return; }
-    g_ata_ctx.batch_left = 1;
+// the next run of at most words words of the buffer, through the HHDM for a
+// segment list (one segment at a time); moves past it
+__attribute__((no_caller_saved_registers))
+static uint16_t* ata_pio_buf_take(ata_context_t* ctx, uint32_t words, uint32_t* got) {
+    uint16_t* p = ctx->ptr;
+    if (ctx->sg) {
+        const blk_segment_t* s = &ctx->sg->segs[ctx->sg_cur.seg];
+        uint32_t left = (s->len - ctx->sg_cur.seg_off) / 2;
+        if (words > left) words = left;
+        p = (uint16_t*)(s->frame + s->offset + ctx->sg_cur.seg_off + HHDM_OFFSET);
 
-    if (g_ata_ctx.op == ATA_OP_READ_28 || g_ata_ctx.op == ATA_OP_WRITE_28) {
-        uint32_t lba28 = (uint32_t)g_ata_ctx.lba;
-        outb(ATA_REG_SECCOUNT, 1);
-        outb(ATA_REG_LBA_LOW,  (uint8_t)lba28);
-        outb(ATA_REG_LBA_MID,  (uint8_t)(lba28 >> 8));
-        outb(ATA_REG_LBA_HIGH, (uint8_t)(lba28 >> 16));
-        outb(ATA_REG_COMMAND, (g_ata_ctx.op == ATA_OP_READ_28) ? ATA_CMD_READ_SECTORS : ATA_CMD_WRITE_SECTORS);
+        ctx->sg_cur.pos += words * 2;
+        ctx->sg_cur.seg_off += words * 2;
+        if (ctx->sg_cur.seg_off == s->len) {
+            ctx->sg_cur.seg++;
+            ctx->sg_cur.seg_off = 0;
+        }
     } else {
-        outb(ATA_REG_SECCOUNT, 0); // High byte
-        outb(ATA_REG_LBA_LOW,  (uint8_t)(g_ata_ctx.lba >> 24));
-        outb(ATA_REG_LBA_MID,  (uint8_t)(g_ata_ctx.lba >> 32));
-        outb(ATA_REG_LBA_HIGH, (uint8_t)(g_ata_ctx.lba >> 40));
-        outb(ATA_REG_SECCOUNT, 1); // Low byte
-        outb(ATA_REG_LBA_LOW,  (uint8_t)g_ata_ctx.lba);
-        outb(ATA_REG_LBA_MID,  (uint8_t)(g_ata_ctx.lba >> 8));
-        outb(ATA_REG_LBA_HIGH, (uint8_t)(g_ata_ctx.lba >> 16));
-        outb(ATA_REG_COMMAND, (g_ata_ctx.op == ATA_OP_READ_48) ? ATA_CMD_READ_SECTORS_EXT : ATA_CMD_WRITE_SECTORS_EXT);
+        ctx->ptr += words;
+    }
+    *got = words;
+    return p;
+}
+
+// moves one DRQ block (<= multiple sectors), returns the sectors moved
+__attribute__((no_caller_saved_registers))
+static uint32_t ata_pio_block_move(ata_context_t* ctx) {
+    uint32_t n = ctx->multiple;
+    if (ctx->batch_left < n) n = ctx->batch_left;
+    if (n == 0) return 0;
+
+    uint32_t word_count = n * 256;
+    uint8_t rd = ata_op_is_read(ctx->op);
+    while (word_count != 0) {
+        uint32_t words;
+        uint16_t* p = ata_pio_buf_take(ctx, word_count, &words);
+        if (rd) {
+            insw_irq(ctx->chan->io + ATA_REG_DATA, p, words);
+        } else {
+            outsw_irq(ctx->chan->io + ATA_REG_DATA, p, words);
+        }
+        word_count -= words;
+    }
+
+    ctx->lba += n;
+    ctx->batch_left -= n;
+    ctx->sectors_left -= n;
+    ctx->poll_drq = 0;
+    ata_wait_arm(ctx);
+    return n;
+}
+
+static inline void ata_dma_issue_handle(ata_context_t* ctx);
+
+// non-data command: one IRQ when the cache is on the media
+static inline void ata_flush_issue_handle(ata_context_t* ctx) {
+    ata_irq_flags_reset(ctx);
+    ctx->poll_drq = 0;
+    ctx->step = ATA_STEP_IO_WAIT_DONE;
+    ata_wait_arm(ctx);
+    outb(ctx->chan->io + ATA_REG_COMMAND, ctx->info.lba48 && ctx->info.flush_ext ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+}
+
+static inline void ata_io_issue_taskfile_handle(ata_context_t* ctx) {
+    if (ctx->op == ATA_OP_FLUSH) { ata_flush_issue_handle(ctx); return; }
+    if (ctx->sectors_left == 0) { ata_finish_io(ctx, 1); return; }
+    if (ata_op_is_dma(ctx->op)) { ata_dma_issue_handle(ctx); return; }
+    ata_pio_command_issue(ctx);
+}
+
+static inline uint8_t ata_poll_is_due(ata_context_t* ctx) {
+    if (ctx->poll_drq || ctx->wait_mode == ATA_WAIT_POLL) return 1;
+    if (ctx->wait_mode == ATA_WAIT_HYBRID) return (int64_t)(rdtsc() - ctx->poll_at) >= 0;
+    return 0;
+}
+
+// the drive's next event, from the IRQ handler or from polling alternate status
+// (write DRQ, poll and hybrid modes). returns 0 if there is none yet
+static uint8_t ata_event_get(ata_context_t* ctx, uint8_t* st) {
+    if (ctx->irq_fired) {
+        ctx->irq_fired = 0;
+        *st = ctx->last_status;
+        return 1;
     }
-    ata_irq_flags_reset();
-    g_ata_ctx.step = ATA_STEP_IO_WAIT_IRQ;
+    if (!ata_poll_is_due(ctx)) return 0;
+    if (ATA_STATUS_IS_BUSY(ata_alt_status_read_once(ctx))) return 0;
+
+    // STATUS rather than alternate status: acks INTRQ the way the IRQ handler would
+    if (!ctx->poll_drq) ata_svc_sample(ctx);
+    *st = ata_status_read_once(ctx);
+    return 1;
 }
 
-static inline void ata_io_wait_irq_handle(void) {
+// one IRQ per DRQ block: reads get it before each block, writes after each block
+static inline void ata_io_wait_irq_handle(ata_context_t* ctx) {
     uint8_t st;
-    if (g_ata_ctx.irq_fired) {
-        g_ata_ctx.irq_fired = 0;
-        st = g_ata_ctx.last_status;
-    } else {
-        if (g_ata_ctx.batch_left != 0) return;
-        st = ata_alt_status_read_once();
+    if (!ata_event_get(ctx, &st)) return;
+
+    if (ata_status_is_bad(st)) { ata_finish_io(ctx, 0); return; }
+    if (st & ATA_SR_DRQ) { ctx->step = ATA_STEP_IO_XFER_BLOCK; return; }
+
+    st = ata_alt_status_read_once(ctx);
+    if (ata_status_is_bad(st)) { ata_finish_io(ctx, 0); return; }
+    if (st & ATA_SR_DRQ) ctx->step = ATA_STEP_IO_XFER_BLOCK;
+}
+
+static inline void ata_io_next_or_finish(ata_context_t* ctx) {
+    if (ctx->sectors_left == 0) { ata_finish_io(ctx, 1); return; }
+    ctx->step = ATA_STEP_IO_ISSUE_SELECT;
+}
+
+static inline void ata_io_xfer_block_handle(ata_context_t* ctx) {
+    if (ata_pio_block_move(ctx) == 0) { ctx->step = ATA_STEP_IO_WAIT_IRQ; return; }
+
+    if (ctx->batch_left != 0) { ctx->step = ATA_STEP_IO_WAIT_IRQ; return; }
+
+    // writes: the drive raises a final IRQ once the last block is committed
+    if (!ata_op_is_read(ctx->op)) { ctx->step = ATA_STEP_IO_WAIT_DONE; return; }
+
+    // reads: no IRQ after the last block, just check nothing went wrong
+    uint8_t st = ata_alt_status_read_once(ctx);
+    if (ata_status_is_bad(st)) { ata_finish_io(ctx, 0); return; }
+    ata_io_next_or_finish(ctx);
+}
+
+static inline void ata_io_wait_done_handle(ata_context_t* ctx) {
+    uint8_t st;
+    if (!ata_event_get(ctx, &st)) return;
+
+    if (ata_status_is_bad(st)) { ata_finish_io(ctx, 0); return; }
+    ata_io_next_or_finish(ctx);
+}
+
+__attribute__((no_caller_saved_registers))
+static void ata_irq_command_next(ata_context_t* ctx);
+
+// interrupt context version of ata_io_xfer_block_handle
+__attribute__((no_caller_saved_registers))
+static void ata_irq_block_xfer(ata_context_t* ctx) {
+    if (ata_pio_block_move(ctx) == 0) return;
+
+    if (ctx->batch_left != 0) { ctx->step = ATA_STEP_IO_WAIT_IRQ; return; }
+    if (!ata_op_is_read(ctx->op)) { ctx->step = ATA_STEP_IO_WAIT_DONE; return; }
+
+    if (ata_status_is_bad(inb_irq(ctx->chan->ctrl))) { ata_finish_io(ctx, 0); return; }
+    ata_irq_command_next(ctx);
+}
+
+// interrupt context: issue the request's next command right away, or mark it
+// finished and leave the completion notification to the blk adapter's tick
+__attribute__((no_caller_saved_registers))
+static void ata_irq_command_next(ata_context_t* ctx) {
+    if (ctx->sectors_left == 0) { ata_finish_io(ctx, 1); return; }
+
+    ata_drive_select_write(ctx);
+    for (int i = 0; i < 4; i++) (void)inb_irq(ctx->chan->ctrl);  // 400ns
+    ata_pio_command_issue(ctx);
+    if (ata_op_is_read(ctx->op)) return;
+
+    // writes: the first block raises no IRQ. DRQ normally shows up within a few
+    // microseconds; if not, tick_ata polls for it as usual
+    for (int i = 0; i < ATA_IRQ_DRQ_SPIN; i++) {
+        uint8_t st = inb_irq(ctx->chan->ctrl);
+        if (ATA_STATUS_IS_BUSY(st)) continue;
+        if (ata_status_is_bad(st)) { ata_finish_io(ctx, 0); return; }
+        if (st & ATA_SR_DRQ) { ata_irq_block_xfer(ctx); return; }
+    }
+}
+
+// returns 0 when the IRQ is left to tick_ata (init, DMA, or a step it doesn't own)
+__attribute__((no_caller_saved_registers))
+static uint8_t ata_irq_pio_handle(ata_context_t* ctx, uint8_t st) {
+    if (!ctx->irq_xfer || ata_op_is_dma(ctx->op)) return 0;
+
+    if (ctx->step == ATA_STEP_IO_WAIT_DONE) {
+        if (ata_status_is_bad(st)) { ata_finish_io(ctx, 0); return 1; }
+        ata_irq_command_next(ctx);
+        return 1;
     }
+    if (ctx->step != ATA_STEP_IO_WAIT_IRQ) return 0;
 
-    if (ata_status_is_bad(st)) { ata_finish_io(0); return; }
-    if (st & ATA_SR_DRQ) { g_ata_ctx.step = ATA_STEP_IO_XFER_BLOCK; return; }
-    if (g_ata_ctx.batch_left == 0) {
-        if (g_ata_ctx.sectors_left == 0) { ata_finish_io(1); return; }
-        g_ata_ctx.step = ATA_STEP_IO_ISSUE_SELECT;
-        return;
+    if (ata_status_is_bad(st)) { ata_finish_io(ctx, 0); return 1; }
+    if (!(st & ATA_SR_DRQ)) {
+        st = inb_irq(ctx->chan->ctrl);
+        if (ata_status_is_bad(st)) { ata_finish_io(ctx, 0); return 1; }
+        if (!(st & ATA_SR_DRQ)) return 0;
     }
-    st = ata_alt_status_read_once();
-    if (ata_status_is_bad(st)) { ata_finish_io(0); return; }
-    if (st & ATA_SR_DRQ) g_ata_ctx.step = ATA_STEP_IO_XFER_BLOCK;
+    ata_irq_block_xfer(ctx);
+    return 1;
 }
 
-static inline void ata_io_xfer_block_handle(void) {
-    uint32_t n = 1;
-    if (g_ata_ctx.batch_left < n) n = g_ata_ctx.batch_left;
-    if (n == 0) { g_ata_ctx.step = ATA_STEP_IO_WAIT_IRQ; return; }
+// the IRQ belongs to whichever drive last started a command on the channel.
+// a hybrid poll may have taken the event already: then the drive is busy with
+// the next block, or the state machine is not waiting, and the IRQ is dropped
+__attribute__((no_caller_saved_registers))
+static void ata_irq_channel_handle(ata_channel_t* chan) {
+    uint8_t st = inb_irq(chan->io + ATA_REG_STATUS);
+    ata_context_t* ctx = chan->active;
+    if (!ctx || !ata_step_is_waiting(ctx) || ATA_STATUS_IS_BUSY(st)) { send_eoi(chan->irq); return; }
 
-    uint32_t word_count = n * 256;
-    if (g_ata_ctx.op == ATA_OP_READ_28 || g_ata_ctx.op == ATA_OP_READ_48) {
-        insw(ATA_REG_DATA, g_ata_ctx.ptr, word_count);
-    } else {
-        outsw(ATA_REG_DATA, g_ata_ctx.ptr, word_count);
+    if (ctx->op != ATA_OP_INIT_28 && ctx->op != ATA_OP_INIT_48) ata_svc_sample(ctx);
+    if (!ata_irq_pio_handle(ctx, st)) {
+        ctx->last_status = st;
+        ctx->irq_fired = 1;
+    }
+    send_eoi(chan->irq);
+}
+
+IRQ_HANDLER
+void irq14_ata(interrupt_frame_t* f) {
+    (void)f;
+    ata_irq_channel_handle(&g_ata_channels[0]);
+}
+
+IRQ_HANDLER
+void irq15_ata(interrupt_frame_t* f) {
+    (void)f;
+    ata_irq_channel_handle(&g_ata_channels[1]);
+}
+
+uint8_t ata_dma_init(void) {
+    pci_device_t ide;
+    if (!pci_device_find_by_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, 0, &ide)) return 0;
+
+    uint32_t bar4 = pci_bar_get(&ide, 4);
+    if (!(bar4 & PCI_BAR_IO)) return 0;
+    uint16_t bm_base = (uint16_t)(bar4 & PCI_BAR_IO_MASK);
+    if (bm_base == 0) return 0;
+
+    // simplex controllers can only run DMA on one channel at a time: keep it on the primary
+    uint8_t channels = (inb(bm_base + ATA_BM_REG_STATUS) & ATA_BM_SR_SIMPLEX) ? 1 : ATA_CHANNELS;
+
+    uint8_t ready = 0;
+    for (uint8_t i = 0; i < channels; i++) {
+        ata_channel_t* chan = &g_ata_channels[i];
+        phys_addr_t frame = pmm_frame_alloc();
+        if (frame == PMM_INVALID_FRAME || frame >= ATA_DMA_PHYS_LIMIT) break;
+
+        chan->bm_base = (uint16_t)(bm_base + i * ATA_BM_CHANNEL_STRIDE);
+        chan->prd_phys = frame;
+        chan->prd = (ata_prd_t*)(frame + HHDM_OFFSET);
+        chan->dma_ready = 1;
+
+        // TRIM just stays unavailable without it
+        phys_addr_t dsm = pmm_frame_alloc();
+        if (dsm != PMM_INVALID_FRAME && dsm < ATA_DMA_PHYS_LIMIT) {
+            chan->dsm_phys = dsm;
+            chan->dsm = (uint64_t*)(dsm + HHDM_OFFSET);
+        }
+        ready++;
+    }
+    if (ready == 0) return 0;
+
+    pci_bus_master_enable(&ide);
+    return 1;
+}
+
+// the channel's bus master and the drive's DMA support, both
+static uint8_t ata_dma_begin(ata_context_t* ctx, ata_op_t op, uint64_t lba, void* addr, uint32_t sector_count) {
+    if (!ctx->chan->dma_ready || !ctx->info.dma || ((uintptr_t)addr & 1)) return 0;
+    return ata_io_begin(ctx, op, lba, addr, sector_count);
+}
+
+uint8_t begin_read_from_disk_ata_48_dma(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count) {
+    return ata_dma_begin(ctx, ATA_OP_READ_DMA_48, lba, addr, sector_count);
+}
+
+uint8_t begin_write_to_disk_ata_48_dma(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count) {
+    return ata_dma_begin(ctx, ATA_OP_WRITE_DMA_48, lba, addr, sector_count);
+}
+
+uint8_t begin_write_to_disk_ata_48_dma_fua(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count) {
+    if (!ctx->info.fua) return 0;
+    return ata_dma_begin(ctx, ATA_OP_WRITE_DMA_FUA_48, lba, addr, sector_count);
+}
+
+uint8_t begin_read_from_disk_ata_48_dma_sg(ata_context_t* ctx, uint64_t lba, const blk_sg_list_t* sg, uint32_t sector_count) {
+    if (!ctx->chan->dma_ready || !ctx->info.dma) return 0;
+    return ata_sg_begin(ctx, ATA_OP_READ_DMA_48, lba, sg, sector_count);
+}
+
+uint8_t begin_write_to_disk_ata_48_dma_sg(ata_context_t* ctx, uint64_t lba, const blk_sg_list_t* sg, uint32_t sector_count) {
+    if (!ctx->chan->dma_ready || !ctx->info.dma) return 0;
+    return ata_sg_begin(ctx, ATA_OP_WRITE_DMA_48, lba, sg, sector_count);
+}
+
+// DSM only runs over DMA, out of the channel's payload frame
+static inline uint8_t ata_trim_is_usable(const ata_context_t* ctx) {
+    return ctx->info.trim && ctx->info.dma && ctx->chan->dsm != NULL;
+}
+
+// fills the channel's payload with entries from the cursor on, up to what one
+// command may carry. returns the 512-byte blocks used, the tail is zeroed
+static uint32_t ata_dsm_pack(ata_context_t* ctx, const blk_discard_list_t* list, uint32_t* range, uint32_t* done) {
+    uint64_t* e = ctx->chan->dsm;
+    uint32_t max = (uint32_t)ctx->info.dsm_max_blocks * ATA_DSM_ENTRIES_PER_BLOCK;
+    uint32_t n = 0;
+
+    while (n < max && *range < list->count) {
+        const blk_discard_range_t* r = &list->ranges[*range];
+        uint32_t len = r->count - *done;
+        if (len > ATA_DSM_RANGE_MAX) len = ATA_DSM_RANGE_MAX;
+        if (len) e[n++] = (r->lba + *done) | ((uint64_t)len << 48);
+
+        *done += len;
+        if (*done >= r->count) {
+            (*range)++;
+            *done = 0;
+        }
+    }
+
+    uint32_t blocks = (n + ATA_DSM_ENTRIES_PER_BLOCK - 1) / ATA_DSM_ENTRIES_PER_BLOCK;
+    for (uint32_t i = n; i < blocks * ATA_DSM_ENTRIES_PER_BLOCK; i++) e[i] = 0;
+    return blocks;
+}
+
+uint8_t begin_trim_ata_dma(ata_context_t* ctx, const blk_discard_list_t* list, uint32_t* range, uint32_t* done) {
+    if (!ata_trim_is_usable(ctx) || !ata_channel_is_free(ctx)) return 0;
+
+    // the cursor only moves once the command is sure to start
+    uint32_t r = *range;
+    uint32_t d = *done;
+    uint32_t blocks = ata_dsm_pack(ctx, list, &r, &d);
+    if (blocks == 0 || !ata_dma_begin(ctx, ATA_OP_DSM_TRIM, 0, ctx->chan->dsm, blocks)) return 0;
+    *range = r;
+    *done = d;
+    return 1;
+}
+
+static inline uint32_t ata_prd_len(const ata_prd_t* e) {
+    return e->byte_count ? e->byte_count : (uint32_t)ATA_PRD_BOUNDARY;
+}
+
+// fills the PRD table for the buffer at ptr (or the segment list from its cursor
+// on), page by page, merging physically contiguous runs. returns how many whole
+// sectors it covers (0 = not DMA-able)
+static uint32_t ata_dma_prd_build(ata_context_t* ctx, uint32_t sectors) {
+    uint64_t bytes_left = (uint64_t)sectors * 512;
+    virt_addr_t v = (virt_addr_t)ctx->ptr;
+    blk_buf_cursor_t cur = ctx->sg_cur;
+    uint64_t covered = 0;
+    uint32_t n = 0;
+
+    while (bytes_left != 0) {
+        phys_addr_t p;
+        uint64_t chunk;
+        if (ctx->sg) {
+            chunk = blk_sg_next(ctx->sg, &cur, bytes_left > PAGE_SIZE ? (uint32_t)PAGE_SIZE : (uint32_t)bytes_left, &p);
+            if (chunk == 0) break;
+        } else {
+            p = vmm_virt_to_phys(v);
+            if (p == VMM_INVALID) break;
+            chunk = PAGE_SIZE - (v & PAGE_MASK);
+            if (chunk > bytes_left) chunk = bytes_left;
+        }
+        if (p + chunk > ATA_DMA_PHYS_LIMIT) break;
+
+        ata_prd_t* last = n ? &ctx->chan->prd[n - 1] : NULL;
+        if (last && last->phys + ata_prd_len(last) == p &&
+            (last->phys & ~(ATA_PRD_BOUNDARY - 1)) == ((p + chunk - 1) & ~(ATA_PRD_BOUNDARY - 1))) {
+            last->byte_count = (uint16_t)(ata_prd_len(last) + chunk);
+        } else {
+            if (n == ATA_PRD_MAX) break;
+            ctx->chan->prd[n].phys = (uint32_t)p;
+            ctx->chan->prd[n].byte_count = (uint16_t)chunk;
+            ctx->chan->prd[n].flags = 0;
+            n++;
+        }
+
+        v += chunk;
+        covered += chunk;
+        bytes_left -= chunk;
+    }
+
+    // table filled up (or hit an unmapped page) mid-sector: trim back to a sector boundary
+    uint64_t excess = covered & 511;
+    while (excess != 0 && n != 0) {
+        ata_prd_t* last = &ctx->chan->prd[n - 1];
+        uint32_t len = ata_prd_len(last);
+        if (len > excess) {
+            last->byte_count = (uint16_t)(len - excess);
+            covered -= excess;
+            excess = 0;
+        } else {
+            covered -= len;
+            excess -= len;
+            n--;
+        }
+    }
+
+    if (n == 0) return 0;
+    ctx->chan->prd[n - 1].flags = ATA_PRD_EOT;
+    return (uint32_t)(covered / 512);
+}
+
+static inline void ata_dma_issue_handle(ata_context_t* ctx) {
+    uint32_t batch = ATA_MAX_SECTORS_48;
+    if (ctx->sectors_left < batch) batch = ctx->sectors_left;
+    batch = ata_dma_prd_build(ctx, batch);
+    if (batch == 0) { ata_finish_io(ctx, 0); return; }
+    ctx->dma_batch = batch;
+
+    uint16_t bm = ctx->chan->bm_base;
+    uint8_t dir = ata_op_is_read(ctx->op) ? ATA_BM_CMD_READ : 0;
+    outb(bm + ATA_BM_REG_COMMAND, dir);
+    outl(bm + ATA_BM_REG_PRDT, (uint32_t)ctx->chan->prd_phys);
+    outb(bm + ATA_BM_REG_STATUS, (uint8_t)(inb(bm + ATA_BM_REG_STATUS) | ATA_BM_SR_ERR | ATA_BM_SR_IRQ));
+
+    // DSM: features is a 16-bit register too, high byte first; LBA stays 0
+    if (ctx->op == ATA_OP_DSM_TRIM) {
+        outb(ctx->chan->io + ATA_REG_FEATURES, 0);
+        outb(ctx->chan->io + ATA_REG_FEATURES, ATA_DSM_FEATURE_TRIM);
     }
+    ata_taskfile_program(ctx, batch);
+    ata_irq_flags_reset(ctx);
+    ata_wait_arm(ctx);
+    uint8_t command = ATA_CMD_READ_DMA_EXT;
+    if (ctx->op == ATA_OP_WRITE_DMA_48) command = ATA_CMD_WRITE_DMA_EXT;
+    else if (ctx->op == ATA_OP_WRITE_DMA_FUA_48) command = ATA_CMD_WRITE_DMA_FUA_EXT;
+    else if (ctx->op == ATA_OP_DSM_TRIM) command = ATA_CMD_DSM;
+    outb(ctx->chan->io + ATA_REG_COMMAND, command);
+    outb(bm + ATA_BM_REG_COMMAND, (uint8_t)(dir | ATA_BM_CMD_START));
+    ctx->step = ATA_STEP_IO_DMA_WAIT;
+}
+
+static inline void ata_dma_wait_handle(ata_context_t* ctx) {
+    uint8_t st;
+    if (!ata_event_get(ctx, &st)) return;
+
+    uint16_t bm = ctx->chan->bm_base;
+    uint8_t bm_st = inb(bm + ATA_BM_REG_STATUS);
+    outb(bm + ATA_BM_REG_COMMAND, 0);
+    outb(bm + ATA_BM_REG_STATUS, (uint8_t)(bm_st | ATA_BM_SR_ERR | ATA_BM_SR_IRQ));
 
-    g_ata_ctx.ptr += word_count;
-    g_ata_ctx.lba += n;
-    g_ata_ctx.batch_left -= n;
-    g_ata_ctx.sectors_left -= n;
-    g_ata_ctx.step = ATA_STEP_IO_WAIT_IRQ;
+    if ((bm_st & ATA_BM_SR_ERR) || ata_status_is_bad(st)) { ata_finish_io(ctx, 0); return; }
+
+    uint32_t n = ctx->dma_batch;
+    if (ctx->sg) blk_sg_skip(ctx->sg, &ctx->sg_cur, (uint64_t)n * 512);
+    else ctx->ptr += n * 256;
+    ctx->lba += n;
+    ctx->sectors_left -= n;
+    ata_io_next_or_finish(ctx);
 }
 
-static inline void ata_io_tick(void) {
-    switch (g_ata_ctx.step) {
-        case ATA_STEP_IO_ISSUE_SELECT:   ata_io_issue_select_handle();   return;
-        case ATA_STEP_IO_ISSUE_TASKFILE: ata_io_issue_taskfile_handle(); return;
-        case ATA_STEP_IO_WAIT_IRQ:       ata_io_wait_irq_handle();       return;
-        case ATA_STEP_IO_XFER_BLOCK:     ata_io_xfer_block_handle();     return;
+static inline void ata_io_tick(ata_context_t* ctx) {
+    switch (ctx->step) {
+        case ATA_STEP_IO_ISSUE_SELECT:   ata_io_issue_select_handle(ctx);   return;
+        case ATA_STEP_IO_ISSUE_TASKFILE: ata_io_issue_taskfile_handle(ctx); return;
+        case ATA_STEP_IO_WAIT_IRQ:       ata_io_wait_irq_handle(ctx);       return;
+        case ATA_STEP_IO_XFER_BLOCK:     ata_io_xfer_block_handle(ctx);     return;
+        case ATA_STEP_IO_WAIT_DONE:      ata_io_wait_done_handle(ctx);      return;
+        case ATA_STEP_IO_DMA_WAIT:       ata_dma_wait_handle(ctx);          return;
         default: return;
     }
 }
 
-void tick_ata(void) {
-    if (g_ata_ctx.delay_400 != 0) {
-        (void)ata_delay_400ns_tick();
-        if (g_ata_ctx.delay_400 != 0) return;
+static inline void ata_tick_step(ata_context_t* ctx) {
+    if (ctx->delay_400 != 0) {
+        (void)ata_delay_400ns_tick(ctx);
+        if (ctx->delay_400 != 0) return;
     }
-    if (g_ata_ctx.op == ATA_OP_INIT_28 || g_ata_ctx.op == ATA_OP_INIT_48) {
-        ata_init_tick();
+    if (ctx->op == ATA_OP_INIT_28 || ctx->op == ATA_OP_INIT_48) {
+        ata_init_tick(ctx);
     } else {
-        ata_io_tick();
+        ata_io_tick(ctx);
+    }
+}
+
+void tick_ata(ata_context_t* ctx) {
+    // irq14_ata advances the same state machine
+    uint64_t flags = irq_save();
+    ata_tick_step(ctx);
+    irq_restore(flags);
+}
+
+// segment lists: the same choice as below, through the vectored begins
+static uint8_t ata_blk_begin_sg(ata_context_t* ctx, blk_request_t* req, uint8_t rd, uint8_t fua) {
+    const blk_sg_list_t* sg = (const blk_sg_list_t*)req->addr;
+    if (!ctx->info.lba48) return ata_sg_begin(ctx, rd ? ATA_OP_READ_28 : ATA_OP_WRITE_28, req->lba, sg, req->count);
+
+    if (ctx->chan->dma_ready && ctx->info.dma) {
+        if (fua && ctx->info.fua && ata_sg_begin(ctx, ATA_OP_WRITE_DMA_FUA_48, req->lba, sg, req->count)) {
+            ctx->blk_postflush = 0;
+            return 1;
+        }
+        uint8_t ok = rd ? begin_read_from_disk_ata_48_dma_sg(ctx, req->lba, sg, req->count)
+                        : begin_write_to_disk_ata_48_dma_sg(ctx, req->lba, sg, req->count);
+        if (ok) return 1;
+    }
+    if (fua && ctx->info.fua && ctx->multiple >= 2 && ata_sg_begin(ctx, ATA_OP_WRITE_FUA_48, req->lba, sg, req->count)) {
+        ctx->blk_postflush = 0;
+        return 1;
+    }
+    return rd ? begin_read_from_disk_ata_48_sg(ctx, req->lba, sg, req->count)
+              : begin_write_to_disk_ata_48_sg(ctx, req->lba, sg, req->count);
+}
+
+// blk_device_t adapter: one request in flight per drive, DMA when the controller and drive allow it
+static uint8_t ata_blk_begin(ata_context_t* ctx, blk_request_t* req) {
+    if (req->op == BLK_OP_DISCARD) {
+        ctx->blk_postflush = 0;
+        ctx->dsm_range = 0;
+        ctx->dsm_done = 0;
+        return begin_trim_ata_dma(ctx, (const blk_discard_list_t*)req->addr, &ctx->dsm_range, &ctx->dsm_done);
+    }
+
+    uint8_t rd = (req->op == BLK_OP_READ);
+    uint8_t fua = !rd && (req->flags & BLK_REQ_F_FUA) && ctx->info.write_cache_on;
+
+    // cleared below when a FUA command carries the write
+    ctx->blk_postflush = fua;
+    if (req->flags & BLK_REQ_F_SG) return ata_blk_begin_sg(ctx, req, rd, fua);
+
+    if (!ctx->info.lba48) {
+        return rd ? begin_read_from_disk_ata_28_irq(ctx, (uint32_t)req->lba, req->addr, req->count)
+                  : begin_write_to_disk_ata_28_irq(ctx, (uint32_t)req->lba, req->addr, req->count);
+    }
+
+    if (ctx->chan->dma_ready && ctx->info.dma) {
+        if (fua && begin_write_to_disk_ata_48_dma_fua(ctx, req->lba, req->addr, req->count)) {
+            ctx->blk_postflush = 0;
+            return 1;
+        }
+        uint8_t ok = rd ? begin_read_from_disk_ata_48_dma(ctx, req->lba, req->addr, req->count)
+                        : begin_write_to_disk_ata_48_dma(ctx, req->lba, req->addr, req->count);
+        if (ok) return 1;
+        // odd-aligned buffer: fall through to PIO
+    }
+    if (fua && begin_write_to_disk_ata_48_fua_irq(ctx, req->lba, req->addr, req->count)) {
+        ctx->blk_postflush = 0;
+        return 1;
+    }
+    return rd ? begin_read_from_disk_ata_48_irq(ctx, req->lba, req->addr, req->count)
+              : begin_write_to_disk_ata_48_irq(ctx, req->lba, req->addr, req->count);
+}
+
+static uint8_t ata_blk_submit(blk_device_t* dev, blk_request_t* req) {
+    ata_context_t* ctx = (ata_context_t*)dev->ctx;
+    // the other drive on the channel may hold it: retry later
+    if (ctx->blk_req || !ata_channel_is_free(ctx)) return 0;
+
+    if (req->flags & BLK_REQ_F_POLL) ata_wait_mode_set(ctx, ATA_WAIT_POLL);
+    else if (req->flags & BLK_REQ_F_HYBRID) ata_wait_mode_set(ctx, ATA_WAIT_HYBRID);
+    else ata_wait_mode_set(ctx, ATA_WAIT_IRQ);
+
+    uint8_t bad = (req->op == BLK_OP_FLUSH) ? req->count != 0
+                : (req->op == BLK_OP_DISCARD) ? req->addr == NULL
+                : req->count == 0 || (!ctx->info.lba48 && req->lba + req->count > ATA_LBA28_LIMIT) ||
+                  !blk_request_sg_is_valid(req);
+    // write-through drive: flushes have nothing to do. discards are only a hint:
+    // nothing to do without TRIM (or with nothing in the list)
+    uint8_t flush = ctx->info.write_cache_on && blk_request_is_barrier(req);
+    uint8_t noop = (req->op == BLK_OP_FLUSH && !flush) ||
+                   (req->op == BLK_OP_DISCARD && !bad &&
+                    (!ata_trim_is_usable(ctx) || ((const blk_discard_list_t*)req->addr)->count == 0));
+    if (!bad && noop) {
+        blk_request_complete(req, 1);
+        return 1;
+    }
+
+    uint8_t ok = 0;
+    if (!bad && flush) {
+        ctx->blk_phase = (req->op == BLK_OP_FLUSH) ? ATA_BLK_PHASE_FLUSH : ATA_BLK_PHASE_PREFLUSH;
+        ok = begin_flush_ata_irq(ctx);
+    } else if (!bad) {
+        ctx->blk_phase = ATA_BLK_PHASE_DATA;
+        ok = ata_blk_begin(ctx, req);
+    }
+    if (!ok) {
+        blk_request_complete(req, 0);
+        return 1;
     }
+    req->status = BLK_REQ_PENDING;
+    ctx->blk_req = req;
+    return 1;
+}
+
+static void ata_blk_tick(blk_device_t* dev) {
+    ata_context_t* ctx = (ata_context_t*)dev->ctx;
+    tick_ata(ctx);
+
+    blk_request_t* req = ctx->blk_req;
+    if (!req) return;
+    if (!is_ata_irq_done(ctx) && !is_ata_irq_failed(ctx)) return;
+
+    // the request's next command starts right away, its channel is still held
+    uint8_t ok = is_ata_irq_done(ctx);
+    if (ok && ctx->blk_phase == ATA_BLK_PHASE_DATA && req->op == BLK_OP_DISCARD &&
+        ctx->dsm_range < ((const blk_discard_list_t*)req->addr)->count) {
+        // more ranges than one DSM command carries
+        if (begin_trim_ata_dma(ctx, (const blk_discard_list_t*)req->addr, &ctx->dsm_range, &ctx->dsm_done)) return;
+        ok = 0;
+    } else if (ok && ctx->blk_phase == ATA_BLK_PHASE_PREFLUSH) {
+        ctx->blk_phase = ATA_BLK_PHASE_DATA;
+        if (ata_blk_begin(ctx, req)) return;
+        ok = 0;
+    } else if (ok && ctx->blk_phase == ATA_BLK_PHASE_DATA && ctx->blk_postflush) {
+        ctx->blk_phase = ATA_BLK_PHASE_FLUSH;
+        if (begin_flush_ata_irq(ctx)) return;
+        ok = 0;
+    }
+
+    ctx->blk_req = NULL;
+    blk_request_complete(req, ok);
+}
+
+// halts until the drive's IRQ (or the hybrid poll point) when the request in
+// flight is waiting on the device; otherwise there is work for tick, just pause
+static void ata_blk_idle(blk_device_t* dev) {
+    ata_context_t* ctx = (ata_context_t*)dev->ctx;
+
+    // checked with interrupts masked: an IRQ arriving after the check still ends the hlt
+    uint64_t flags = irq_save();
+    uint8_t can_halt = (flags & RFLAGS_IF) && ctx->wait_mode != ATA_WAIT_POLL &&
+                       ata_step_is_waiting(ctx) && !ctx->irq_fired && !ctx->poll_drq && ctx->delay_400 == 0;
+    if (can_halt && ctx->wait_mode == ATA_WAIT_HYBRID) {
+        int64_t left = (int64_t)(ctx->poll_at - rdtsc());
+        if (left <= 0) can_halt = 0;                       // polling is due
+        else if (pit_is_ready()) pit_oneshot_arm((uint64_t)left);
+        // no PIT: the drive's IRQ ends the sleep instead
+    }
+    if (!can_halt) {
+        irq_restore(flags);
+        cpu_relax();
+        return;
+    }
+    cpu_wait_for_irq();
+}
+
+blk_device_t* ata_blk_device_get(ata_context_t* ctx) {
+    ctx->name[0] = 'a';
+    ctx->name[1] = 't';
+    ctx->name[2] = 'a';
+    ctx->name[3] = (char)('0' + (ctx - g_ata_ctx));
+    ctx->name[4] = 0;
+
+    ctx->blk.name = ctx->name;
+    ctx->blk.sectors = ctx->info.lba48 ? ctx->info.sectors_48 : ctx->info.sectors_28;
+    ctx->blk.max_sectors = ctx->info.lba48 ? ATA_MAX_SECTORS_48 : ATA_MAX_SECTORS_28;
+    ctx->blk.queue_depth = 1;
+    ctx->blk.submit = ata_blk_submit;
+    ctx->blk.tick = ata_blk_tick;
+    ctx->blk.idle = ata_blk_idle;
+    ctx->blk.map = NULL;
+    ctx->blk.ctx = ctx;
+    return &ctx->blk;
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include "common.h"
 #include "idt.h"
+#include "blk.h"
 
 typedef enum ata_op_t {
   ATA_OP_NONE = 0,
@@ -12,7 +13,19 @@ typedef enum ata_op_t {
   ATA_OP_WRITE_28,
 
   ATA_OP_READ_48,
-  ATA_OP_WRITE_48
+  ATA_OP_WRITE_48,
+
+  ATA_OP_READ_DMA_48,
+  ATA_OP_WRITE_DMA_48,
+
+  // forced unit access: complete once the data is on the media
+  ATA_OP_WRITE_FUA_48,
+  ATA_OP_WRITE_DMA_FUA_48,
+
+  ATA_OP_FLUSH,
+
+  // DATA SET MANAGEMENT / TRIM: DMA out of the channel's range payload
+  ATA_OP_DSM_TRIM
 } ata_op_t;
 
 typedef enum ata_step_t {
@@ -25,6 +38,8 @@ typedef enum ata_step_t {
   ATA_STEP_INIT_IDENTIFY_XFER, // if DRQ, read 256 words from DATA
   ATA_STEP_INIT_SETMULT_CMD,   // write SECCOUNT=multi, issue SET_MULTIPLE
   ATA_STEP_INIT_SETMULT_WAIT,  // wait for IRQ completion
+  ATA_STEP_INIT_SETFEAT_CMD,   // SET FEATURES: enable the write cache
+  ATA_STEP_INIT_SETFEAT_WAIT,
   ATA_STEP_INIT_DONE,
   ATA_STEP_INIT_FAIL,
 
@@ -35,22 +50,89 @@ typedef enum ata_step_t {
   ATA_STEP_IO_WAIT_IRQ,        // wait IRQ and check status
   ATA_STEP_IO_XFER_BLOCK,      // if DRQ, transfer one block (<=multi sectors)
   ATA_STEP_IO_WAIT_DONE,       // optional final completion IRQ
+  ATA_STEP_IO_DMA_WAIT,        // bus master running, one IRQ ends the whole PRD table
   ATA_STEP_IO_DONE,
   ATA_STEP_IO_FAIL
 } ata_step_t;
 
+// how a drive waits for its device events (DRQ blocks, command completion)
+typedef enum ata_wait_mode_t {
+  ATA_WAIT_IRQ = 0,   // IRQ14/15 only
+  ATA_WAIT_POLL,      // device IRQ off (nIEN), tick_ata spins on alternate status
+  ATA_WAIT_HYBRID     // IRQ on; sleep part of the learned service time, then poll
+} ata_wait_mode_t;
+
+// capabilities parsed from the IDENTIFY block during init
+typedef struct ata_device_info_t {
+  uint64_t sectors_28;        // words 60-61: addressable sectors in LBA28
+  uint64_t sectors_48;        // words 100-103: addressable sectors in LBA48
+  uint8_t  lba48;             // word 83 bit 10
+  uint8_t  max_multiple;      // word 47 bits 0-7: max sectors per DRQ block
+  uint8_t  pio_modes;         // word 64 bits 0-1: PIO 3/4 supported
+  uint8_t  mwdma_modes;       // word 63 bits 0-2: multiword DMA 0-2 supported
+  uint8_t  udma_modes;        // word 88 bits 0-6: UDMA 0-6 supported
+  uint8_t  dma;               // word 49 bit 8
+  uint8_t  write_cache;       // word 82 bit 5: write cache supported
+  uint8_t  write_cache_on;    // word 85 bit 5: write cache enabled (updated by init's SET FEATURES)
+  uint8_t  flush;             // word 82 bit 12: FLUSH CACHE
+  uint8_t  flush_ext;         // word 83 bit 13: FLUSH CACHE EXT
+  uint8_t  fua;               // word 84 bit 6: WRITE DMA / MULTIPLE FUA EXT
+  uint8_t  trim;              // word 169 bit 0: DATA SET MANAGEMENT TRIM
+  uint8_t  dsm_max_blocks;    // word 105: payload blocks per DSM command (0 read as 1, capped)
+} ata_device_info_t;
+
+// blk adapter: a request may take several commands
+typedef enum ata_blk_phase_t {
+  ATA_BLK_PHASE_PREFLUSH = 0,  // flush, then the data
+  ATA_BLK_PHASE_DATA,          // data, then a flush if FUA had to be emulated
+  ATA_BLK_PHASE_FLUSH          // last command
+} ata_blk_phase_t;
+
+// physical region descriptor: one contiguous chunk, must not cross a 64 KiB boundary
+typedef struct ata_prd_t {
+  uint32_t phys;
+  uint16_t byte_count;        // 0 means 64 KiB
+  uint16_t flags;             // bit 15: end of table
+} __attribute__((packed)) ata_prd_t;
+
+struct ata_context_t;
+
+// one IDE channel: its ports, IRQ line and bus master registers. a channel runs
+// one command at a time; primary and secondary run independently.
+typedef struct ata_channel_t {
+  uint16_t io;              // task file base (0x1F0 / 0x170)
+  uint16_t ctrl;            // device control / alternate status (0x3F6 / 0x376)
+  uint8_t irq;              // 14 / 15
+
+  // drive whose request currently owns the channel, IRQs are routed to it
+  struct ata_context_t* volatile active;
+
+  // bus-master DMA (set up by ata_dma_init)
+  uint8_t dma_ready;
+  uint16_t bm_base;         // BAR4 + 8 * channel
+  ata_prd_t* prd;           // PRD table, one frame, accessed through HHDM
+  phys_addr_t prd_phys;
+  uint64_t* dsm;            // TRIM range payload, one frame, NULL if it couldn't be allocated
+  phys_addr_t dsm_phys;
+} ata_channel_t;
+
+// one drive (master or slave) on a channel
 typedef struct ata_context_t {
-  // config (single drive now, still helps later)
-  uint8_t irq;          // 14
-  uint8_t multiple;     // 16 sectors per DRQ block
+  // config
+  ata_channel_t* chan;
+  uint8_t slave;        // drive select bit
+  uint8_t multiple;     // sectors per DRQ block, negotiated via SET MULTIPLE
+  uint8_t irq_xfer;     // PIO data phase runs in irq14_ata instead of waiting for tick_ata
+  uint8_t wcache_enable;  // init turns the drive's write cache on if it has one
+  ata_wait_mode_t wait_mode;
 
   // IRQ communication (must be volatile because IRQ handler writes it)
   volatile uint8_t irq_fired;
   volatile uint8_t last_status;
 
-  // state machine
+  // state machine. irq14_ata moves step on while tick_ata / idle look at it
   ata_op_t op;
-  ata_step_t step;
+  volatile ata_step_t step;
 
   // non-blocking 400ns delay handling:
   // instead of "for (i=0;i<4;i++) inb(CTRL)" in one shot,
@@ -61,10 +143,31 @@ typedef struct ata_context_t {
   uint64_t lba;
   uint32_t sectors_left;    // remaining sectors overall
   uint32_t batch_left;      // remaining sectors in current command batch
+  uint8_t poll_drq;         // writes: first DRQ block raises no IRQ, poll alt status
   uint16_t* ptr;            // current RAM pointer (word pointer)
+  const blk_sg_list_t* sg;  // vectored buffer instead of ptr, NULL if none
+  blk_buf_cursor_t sg_cur;  // position in sg
+
+  uint32_t dma_batch;       // sectors covered by the PRD table in flight
+
+  // completion timing: the drive started working on the current block / command at
+  // wait_start; hybrid waits poll from poll_at on
+  uint64_t wait_start;
+  uint64_t poll_at;
+  uint64_t svc_tsc[3];      // learned service time per event in TSC cycles: read, write, flush
 
-  // optional: identify buffer for init
+  // identify buffer for init, and what we parsed out of it
   uint16_t identify[256];
+  ata_device_info_t info;
+
+  // blk_device_t adapter, one request in flight
+  blk_request_t* blk_req;
+  ata_blk_phase_t blk_phase;
+  uint8_t blk_postflush;    // FUA write without a FUA command: flush after the data
+  uint32_t dsm_range;       // discard: next range of the list to pack
+  uint32_t dsm_done;        // sectors of that range already sent
+  blk_device_t blk;
+  char name[8];
 } ata_context_t;
 
 #define ATA_STATUS_IS_FLOATING(st) ((st) == 0xFF)
@@ -88,17 +191,26 @@ typedef struct ata_context_t {
 #define ATA_CMD_READ_MULTIPLE_EXT 0x29
 #define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
 
-// primary bus ports
-#define ATA_REG_DATA       0x1F0
-#define ATA_REG_FEATURES   0x1F1
-#define ATA_REG_SECCOUNT   0x1F2
-#define ATA_REG_LBA_LOW    0x1F3
-#define ATA_REG_LBA_MID    0x1F4
-#define ATA_REG_LBA_HIGH   0x1F5
-#define ATA_REG_DRIVE_SEL  0x1F6 // bits 0-3: lba bits 24-27; bit 4: drive; bit 6: lba mode
-#define ATA_REG_COMMAND    0x1F7
-#define ATA_REG_STATUS     0x1F7
-#define ATA_REG_CONTROL    0x3F6
+// channel ports
+#define ATA_CHANNELS        2
+#define ATA_DRIVES          (ATA_CHANNELS * 2)
+#define ATA_PRIMARY_IO      0x1F0
+#define ATA_PRIMARY_CTRL    0x3F6
+#define ATA_SECONDARY_IO    0x170
+#define ATA_SECONDARY_CTRL  0x376
+#define ATA_BM_CHANNEL_STRIDE 8
+
+// task file registers, offsets from the channel's io base
+// (device control / alternate status is the channel's ctrl port)
+#define ATA_REG_DATA       0
+#define ATA_REG_FEATURES   1
+#define ATA_REG_SECCOUNT   2
+#define ATA_REG_LBA_LOW    3
+#define ATA_REG_LBA_MID    4
+#define ATA_REG_LBA_HIGH   5
+#define ATA_REG_DRIVE_SEL  6 // bits 0-3: lba bits 24-27; bit 4: drive; bit 6: lba mode
+#define ATA_REG_COMMAND    7
+#define ATA_REG_STATUS     7
 
 // ATA control (Device Control / Alternate Status port base, primary=0x3F6)
 #define ATA_CTRL_SRST 0x04  // Software reset
@@ -110,7 +222,7 @@ typedef struct ata_context_t {
 #define ATA_DH_BASE    0xA0 // 1010 0000: mandatory pattern bits (CHS default)
 #define ATA_DH_LBA     0x40 // LBA mode bit
 #define ATA_DH_MASTER  0x00 // bit4=0
-#define ATA_DH_SLAVE   0x10 // bit4=1 (not used by you)
+#define ATA_DH_SLAVE   0x10 // bit4=1
                             //
 #define ATA_DH_LBA_MASTER  (ATA_DH_BASE | ATA_DH_LBA | ATA_DH_MASTER) // usually 0xE0
 
@@ -119,19 +231,92 @@ typedef struct ata_context_t {
 
 #define ATA_CMD_SET_MULTIPLE        0xC6
 
+#define ATA_CMD_SET_FEATURES        0xEF
+#define ATA_FEATURE_WCACHE_ON       0x02
+
+#define ATA_CMD_FLUSH_CACHE         0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT     0xEA
+
 #define ATA_CMD_READ_MULTIPLE       0xC4
 #define ATA_CMD_WRITE_MULTIPLE      0xC5
 
 #define ATA_CMD_READ_MULTIPLE_EXT   0x29
 #define ATA_CMD_WRITE_MULTIPLE_EXT  0x39
 
+#define ATA_CMD_READ_DMA_EXT        0x25
+#define ATA_CMD_WRITE_DMA_EXT       0x35
+#define ATA_CMD_WRITE_DMA_FUA_EXT   0x3D
+#define ATA_CMD_WRITE_MULTIPLE_FUA_EXT 0xCE
+
+#define ATA_CMD_DSM                 0x06
+#define ATA_DSM_FEATURE_TRIM        0x01
+
 #define ATA_CMD_READ_SECTORS        0x20
 #define ATA_CMD_WRITE_SECTORS       0x30
 #define ATA_CMD_READ_SECTORS_EXT    0x24
 #define ATA_CMD_WRITE_SECTORS_EXT   0x34
 
+// PIIX bus master IDE registers (offsets from BAR4, +8 for the secondary channel)
+#define ATA_BM_REG_COMMAND  0x00
+#define ATA_BM_REG_STATUS   0x02
+#define ATA_BM_REG_PRDT     0x04
+
+#define ATA_BM_CMD_START    0x01
+#define ATA_BM_CMD_READ     0x08  // bus master writes to memory (device -> RAM)
+
+#define ATA_BM_SR_ACTIVE    0x01
+#define ATA_BM_SR_ERR       0x02  // write 1 to clear
+#define ATA_BM_SR_IRQ       0x04  // write 1 to clear
+#define ATA_BM_SR_SIMPLEX   0x80  // channels can't do DMA at the same time
+
+#define ATA_PRD_EOT         0x8000
+#define ATA_PRD_MAX         (PAGE_SIZE / sizeof(ata_prd_t))
+#define ATA_PRD_BOUNDARY    0x10000ULL
+#define ATA_DMA_PHYS_LIMIT  0x100000000ULL
+
+// how long the IRQ path waits for a new write command's first DRQ before leaving it to tick_ata
+#define ATA_IRQ_DRQ_SPIN    64
+
+// service time average: each sample moves it by 1/8 of the difference
+#define ATA_SVC_EWMA_SHIFT  3
+// hybrid waits sleep for this fraction (as a shift) of the learned service time
+#define ATA_HYBRID_SLEEP_SHIFT 1
+
+// TRIM payload: 8-byte entries, LBA in bits 0-47 and a sector count in bits 48-63
+// (0 = unused entry), 64 to a 512-byte block. one frame holds 8 blocks
+#define ATA_DSM_ENTRIES_PER_BLOCK 64
+#define ATA_DSM_RANGE_MAX   0xFFFFu
+#define ATA_DSM_MAX_BLOCKS  (PAGE_SIZE / 512)
+
 #define ATA_MAX_SECTORS_28  256
 #define ATA_MAX_SECTORS_48  65536
+#define ATA_LBA28_LIMIT     (1ULL << 28)
+
+// IDENTIFY DEVICE word offsets
+#define ATA_ID_MAX_MULTIPLE   47  // bits 0-7: max sectors per DRQ block
+#define ATA_ID_CAPABILITIES   49  // bit 8: DMA supported
+#define ATA_ID_FIELD_VALID    53  // bit 1: words 64-70 valid; bit 2: word 88 valid
+#define ATA_ID_LBA28_SECTORS  60  // words 60-61
+#define ATA_ID_MWDMA_MODES    63
+#define ATA_ID_PIO_MODES      64
+#define ATA_ID_CMDSET_1       82  // bit 5: write cache
+#define ATA_ID_CMDSET_2       83  // bit 10: LBA48, bit 13: FLUSH CACHE EXT
+#define ATA_ID_CMDSET_EXT     84  // bit 6: FUA writes
+#define ATA_ID_CMDSET_1_EN    85  // bit 5: write cache enabled
+#define ATA_ID_UDMA_MODES     88
+#define ATA_ID_LBA48_SECTORS  100 // words 100-103
+#define ATA_ID_DSM_MAX_BLOCKS 105
+#define ATA_ID_DSM            169 // bit 0: TRIM
+
+#define ATA_ID_CAP_DMA        (1u << 8)
+#define ATA_ID_VALID_64_70    (1u << 1)
+#define ATA_ID_VALID_88       (1u << 2)
+#define ATA_ID_CMDSET_WCACHE  (1u << 5)   // word 82 / 85
+#define ATA_ID_CMDSET_FLUSH   (1u << 12)  // word 82
+#define ATA_ID_CMDSET_LBA48   (1u << 10)  // word 83
+#define ATA_ID_CMDSET_FLUSH_EXT (1u << 13) // word 83
+#define ATA_ID_CMDSET_FUA     (1u << 6)   // word 84
+#define ATA_ID_DSM_TRIM       (1u << 0)   // word 169
 
 // 8259 PIC I/O ports                                     
 #define PIC1_CMD     0x20   // Master PIC command port
@@ -156,44 +341,116 @@ typedef struct ata_context_t {
 // IRQ numbers you care about
 #define PIC_IRQ_CASCADE 2    // Master IRQ2 is where the slave is connected
 #define PIC_IRQ_ATA_PRIMARY 14
+#define PIC_IRQ_ATA_SECONDARY 15
+
+// drive contexts: channel 0/1 = primary/secondary, drive 0/1 = master/slave
+ata_context_t* ata_context_get(uint8_t channel, uint8_t drive);
 
 // initializes ata controller and sets multiple mode
-uint8_t initialize_ata_28_irq(void);
+uint8_t initialize_ata_28_irq(ata_context_t* ctx);
 
 // IRQ ATA usage:
-// 1) remap PIC + unmask IRQ14: setup_ata_irq()
-// 2) IDT vector 46 -> irq14_ata
-// 3) sti
-// 4) begin_init_ata_28_irq()  (or 48)
-// 5) call tick_ata() every kernel loop
-// 6) begin_read/write...irq(), keep ticking until done/failed
-
-// PIC setup for IRQ14 -> vector 46, unmask IRQ14
+// 1) remap PIC + unmask IRQ14 and IRQ15: setup_ata_irq()
+// 2) IDT vector 46 -> irq14_ata, vector 47 -> irq15_ata
+// 3) sti, then ata_irq_routed_set(1). until then every drive runs polled,
+//    whatever mode is asked for, so drives work before the IDT exists
+// 4) begin_init_ata_28_irq(ctx)  (or 48) for each drive of interest
+// 5) call tick_ata(ctx) every kernel loop
+// 6) begin_read/write...irq(ctx, ...), keep ticking until done/failed
+// drives on different channels run commands at the same time; the two drives
+// of one channel take turns (begin_* returns 0 while the other one is busy).
+// once a PIO command is running, the channel's IRQ handler moves each DRQ block
+// and issues the next command itself; tick_ata only starts requests and reports
+// them finished. tick_ata masks interrupts while it runs so the two never step
+// on each other.
+
+// PIC setup for IRQ14 -> vector 46 and IRQ15 -> vector 47
 void setup_ata_irq(void);
 
-// IRQ handler (installed in IDT vector 46)
-__attribute__((interrupt, no_caller_saved_registers)) void irq14_ata(interrupt_frame_t* f);
+// IRQ handlers (installed in IDT vectors 46 and 47)
+IRQ_HANDLER void irq14_ata(interrupt_frame_t* f);
+IRQ_HANDLER void irq15_ata(interrupt_frame_t* f);
 
 // state machine tick (call every kernel loop)
-void tick_ata(void);
-
-// init begin (non-blocking)
-uint8_t begin_init_ata_28_irq(void);
-uint8_t begin_init_ata_48_irq(void);
+void tick_ata(ata_context_t* ctx);
+
+// 1 once IRQ14/15 reach irq14_ata / irq15_ata (IDT gates, PIC unmasked, sti)
+void ata_irq_routed_set(uint8_t routed);
+
+// completion mode for the next commands of this drive (ATA_WAIT_POLL while no
+// IRQ is routed). the blk adapter sets it
+// per request from BLK_REQ_F_POLL / BLK_REQ_F_HYBRID (IRQ otherwise).
+// hybrid learns how long the drive takes per DRQ block / DMA table, sleeps the
+// first half of that (hlt, woken by a PIT one-shot if pit_init succeeded)
+// and polls alternate status from there; the IRQ stays armed as a fallback.
+void ata_wait_mode_set(ata_context_t* ctx, ata_wait_mode_t mode);
+
+// init begin (non-blocking). in ATA_WAIT_POLL mode init runs with the device IRQ
+// off and tick_ata polls status, so it needs no IDT vector
+uint8_t begin_init_ata_28_irq(ata_context_t* ctx);
+uint8_t begin_init_ata_48_irq(ata_context_t* ctx);
+
+// I/O begin (non-blocking). the _48 variants return 0 on a drive without LBA48
+uint8_t begin_read_from_disk_ata_28_irq(ata_context_t* ctx, uint32_t lba, void* addr, uint32_t sector_count);
+uint8_t begin_write_to_disk_ata_28_irq(ata_context_t* ctx, uint32_t lba, void* addr, uint32_t sector_count);
+
+uint8_t begin_read_from_disk_ata_48_irq(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count);
+uint8_t begin_write_to_disk_ata_48_irq(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count);
+
+// writes that complete only once on the media (drive must report FUA support;
+// the PIO one also needs multiple mode). return 0 if the drive can't
+uint8_t begin_write_to_disk_ata_48_fua_irq(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count);
+uint8_t begin_write_to_disk_ata_48_dma_fua(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count);
+
+// FLUSH CACHE (EXT): everything the drive acknowledged so far reaches the media
+uint8_t begin_flush_ata_irq(ata_context_t* ctx);
+
+// bus-master DMA: locate the IDE controller on PCI and allocate a PRD table (and a
+// TRIM payload frame) per channel.
+// needs pmm/vmm up. returns 0 if there is no usable controller (PIO still works)
+uint8_t ata_dma_init(void);
+
+// DMA I/O begin (non-blocking). buffer must be 2-byte aligned and below 4 GiB physical;
+// one IRQ completes each PRD table (up to 65536 sectors)
+uint8_t begin_read_from_disk_ata_48_dma(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count);
+uint8_t begin_write_to_disk_ata_48_dma(ata_context_t* ctx, uint64_t lba, void* addr, uint32_t sector_count);
+
+// vectored variants: the buffer is a segment list (see blk_sg_list_t) instead of one
+// virtually contiguous range. PIO reaches the segments through the HHDM, DMA puts
+// them straight into the PRD table. the list must stay untouched until the end
+uint8_t begin_read_from_disk_ata_48_sg(ata_context_t* ctx, uint64_t lba, const blk_sg_list_t* sg, uint32_t sector_count);
+uint8_t begin_write_to_disk_ata_48_sg(ata_context_t* ctx, uint64_t lba, const blk_sg_list_t* sg, uint32_t sector_count);
+uint8_t begin_read_from_disk_ata_48_dma_sg(ata_context_t* ctx, uint64_t lba, const blk_sg_list_t* sg, uint32_t sector_count);
+uint8_t begin_write_to_disk_ata_48_dma_sg(ata_context_t* ctx, uint64_t lba, const blk_sg_list_t* sg, uint32_t sector_count);
+
+// DATA SET MANAGEMENT TRIM (drive must report TRIM, channel needs DMA). packs as many
+// ranges as one command takes into the channel's payload, starting *range ranges and
+// *done sectors into the list, and moves that cursor past them; call again until
+// *range reaches list->count. returns 0 if no command was started
+uint8_t begin_trim_ata_dma(ata_context_t* ctx, const blk_discard_list_t* list, uint32_t* range, uint32_t* done);
+
+// block device view of a drive, "ata0".."ata3" (call after is_ata_init_done() so
+// capacity is known). its tick() also drives tick_ata(); its idle() halts the
+// CPU while the drive works on an IRQ or hybrid request.
+// with the write cache on, FLUSH requests become FLUSH CACHE, PREFLUSH runs one
+// before the data, and FUA writes use the FUA commands (or a flush afterwards).
+// DISCARD requests become one or more DSM TRIM commands; drives without TRIM
+// (or without DMA) complete them right away. segment-list requests (BLK_REQ_F_SG) use the vectored
+// begins
+blk_device_t* ata_blk_device_get(ata_context_t* ctx);
 
-// I/O begin (non-blocking)
-uint8_t begin_read_from_disk_ata_28_irq(uint32_t lba, void* addr, uint32_t sector_count);
-uint8_t begin_write_to_disk_ata_28_irq(uint32_t lba, void* addr, uint32_t sector_count);
+// query state (so kernel can know when finished)
+uint8_t is_ata_irq_busy(ata_context_t* ctx);
+uint8_t is_ata_irq_done(ata_context_t* ctx);
+uint8_t is_ata_irq_failed(ata_context_t* ctx);
+uint8_t is_ata_init_done(ata_context_t* ctx);
+uint8_t is_ata_init_failed(ata_context_t* ctx);
 
-uint8_t begin_read_from_disk_ata_48_irq(uint64_t lba, void* addr, uint32_t sector_count);
-uint8_t begin_write_to_disk_ata_48_irq(uint64_t lba, void* addr, uint32_t sector_count);
+// busy, but only waiting for the drive (a command is out): ticking now does no work
+uint8_t is_ata_irq_waiting(ata_context_t* ctx);
 
-// query state (so kernel can know when finished)
-uint8_t is_ata_irq_busy(void);
-uint8_t is_ata_irq_done(void);
-uint8_t is_ata_irq_failed(void);
-uint8_t is_ata_init_done(void);
-uint8_t is_ata_init_failed(void);
+// device capabilities (valid once is_ata_init_done())
+const ata_device_info_t* ata_device_info_get(ata_context_t* ctx);
 
 void remap_pic(uint8_t master_offset, uint8_t slave_offset);
 void unmask_irq(uint8_t irq);
@@ -0,0 +1,599 @@
+#include "bcache.h"
+#include "common.h"
+#include "pmm.h"
+
+static inline uint32_t bcache_hash(uint64_t block) {
+  return (uint32_t)((block * 0x9E3779B97F4A7C15ULL) >> 56) & (BCACHE_HASH_SIZE - 1);
+}
+
+// the last block of a disk can be short
+static inline uint32_t bcache_block_sectors(const bcache_t* c, uint64_t block) {
+  uint64_t left = c->dev->sectors - block * BCACHE_BLOCK_SECTORS;
+  return left < BCACHE_BLOCK_SECTORS ? (uint32_t)left : BCACHE_BLOCK_SECTORS;
+}
+
+static bcache_buf_t* bcache_lookup(bcache_t* c, uint64_t block) {
+  for (bcache_buf_t* buf = c->hash[bcache_hash(block)]; buf; buf = buf->hash_next) {
+    if (buf->block == block) return buf;
+  }
+  return NULL;
+}
+
+static void bcache_hash_insert(bcache_t* c, bcache_buf_t* buf, uint64_t block) {
+  uint32_t h = bcache_hash(block);
+  buf->block = block;
+  buf->hash_next = c->hash[h];
+  c->hash[h] = buf;
+}
+
+static void bcache_hash_remove(bcache_t* c, bcache_buf_t* buf) {
+  if (buf->block == BCACHE_NO_BLOCK) return;
+
+  bcache_buf_t** pp = &c->hash[bcache_hash(buf->block)];
+  while (*pp && *pp != buf) pp = &(*pp)->hash_next;
+  if (*pp) *pp = buf->hash_next;
+
+  buf->hash_next = NULL;
+  buf->block = BCACHE_NO_BLOCK;
+}
+
+static void bcache_mark_dirty(bcache_t* c, bcache_buf_t* buf) {
+  if (buf->flags & BCACHE_WRITING) buf->redirtied = 1;
+  if (buf->flags & BCACHE_DIRTY) return;
+
+  buf->flags |= BCACHE_DIRTY;
+  if (c->dirty++ == 0) c->dirty_since = rdtsc();
+}
+
+static void bcache_buf_done(blk_request_t* req);
+static void bcache_flush_done(blk_request_t* req);
+
+// sends one device flush for everything in flush_wait once no dirty data is left
+static void bcache_flush_kick(bcache_t* c) {
+  if (c->flush_busy || !c->flush_wait) return;
+
+  // the flush must cover what those requests left in the cache
+  if (c->dirty != 0) {
+    c->syncing = 1;
+    return;
+  }
+
+  c->flush_batch = c->flush_wait;
+  c->flush_wait = NULL;
+  c->flush_busy = 1;
+  c->flush_lost = c->wb_lost;
+  c->wb_lost = 0;
+
+  blk_request_t* fr = &c->flush_req;
+  fr->op = BLK_OP_FLUSH;
+  fr->lba = 0;
+  fr->count = 0;
+  fr->addr = NULL;
+  fr->flags = 0;
+  fr->status = BLK_REQ_PENDING;
+  fr->done = bcache_flush_done;
+  fr->priv = c;
+  if (!c->dev->submit(c->dev, fr)) {
+    c->flush_wait = c->flush_batch;
+    c->flush_batch = NULL;
+    c->flush_busy = 0;
+    c->wb_lost |= c->flush_lost;
+  }
+}
+
+static void bcache_flush_done(blk_request_t* req) {
+  bcache_t* c = (bcache_t*)req->priv;
+  uint8_t success = req->status == BLK_REQ_DONE && !c->flush_lost;
+  blk_request_t* r = c->flush_batch;
+
+  c->flush_batch = NULL;
+  c->flush_busy = 0;
+  c->flushes++;
+  while (r) {
+    blk_request_t* next = r->next;   // the callback may reuse r
+    blk_request_complete(r, success);
+    r = next;
+  }
+  bcache_flush_kick(c);
+}
+
+// a write-back failed: the data the waiting flushes should cover may never get out
+static void bcache_flush_fail(bcache_t* c) {
+  blk_request_t* r = c->flush_wait;
+  if (r) c->wb_lost = 0;
+  c->flush_wait = NULL;
+  while (r) {
+    blk_request_t* next = r->next;
+    blk_request_complete(r, 0);
+    r = next;
+  }
+}
+
+// req was served from the cache: done, unless it asked for stable media
+static void bcache_request_finish(bcache_t* c, blk_request_t* req) {
+  if (!blk_request_is_barrier(req) && !(req->flags & BLK_REQ_F_FUA)) {
+    blk_request_complete(req, 1);
+    return;
+  }
+
+  blk_request_t** pp = &c->flush_wait;
+  while (*pp) pp = &(*pp)->next;
+  req->next = NULL;
+  *pp = req;
+  bcache_flush_kick(c);
+}
+
+// hands every prepared fill / write-back to the lower device until it refuses one
+static void bcache_io_kick(bcache_t* c) {
+  if (c->kicking || c->unsubmitted == 0) return;
+  c->kicking = 1;
+
+  for (uint32_t i = 0; i < c->nbufs && c->unsubmitted; i++) {
+    bcache_buf_t* buf = &c->bufs[i];
+    if (!(buf->flags & BCACHE_UNSUBMITTED)) continue;
+
+    // cleared first, the lower device may complete it before submit returns
+    buf->flags &= ~BCACHE_UNSUBMITTED;
+    c->unsubmitted--;
+    if (!c->dev->submit(c->dev, &buf->req)) {
+      buf->flags |= BCACHE_UNSUBMITTED;
+      c->unsubmitted++;
+      break;
+    }
+  }
+
+  c->kicking = 0;
+}
+
+static void bcache_buf_io_start(bcache_t* c, bcache_buf_t* buf, blk_op_t op) {
+  buf->flags |= (op == BLK_OP_READ ? BCACHE_READING : BCACHE_WRITING) | BCACHE_UNSUBMITTED;
+  buf->req.op = op;
+  buf->req.lba = buf->block * BCACHE_BLOCK_SECTORS;
+  buf->req.count = bcache_block_sectors(c, buf->block);
+  buf->req.addr = buf->data;
+  buf->req.flags = 0;
+  buf->req.status = BLK_REQ_PENDING;
+  buf->req.done = bcache_buf_done;
+  buf->req.priv = buf;
+  c->unsubmitted++;
+}
+
+static void bcache_writeback_start(bcache_t* c) {
+  for (uint32_t i = 0; i < c->nbufs; i++) {
+    bcache_buf_t* buf = &c->bufs[i];
+    if ((buf->flags & BCACHE_DIRTY) && !(buf->flags & (BCACHE_READING | BCACHE_WRITING))) {
+      bcache_buf_io_start(c, buf, BLK_OP_WRITE);
+    }
+  }
+  bcache_io_kick(c);
+}
+
+static void bcache_writeback_maybe(bcache_t* c) {
+  if (c->dirty == 0) return;
+
+  uint32_t batch = c->nbufs / BCACHE_WB_BATCH_DIV;
+  if (c->syncing || c->dirty >= batch || rdtsc() - c->dirty_since >= c->wb_delay) {
+    bcache_writeback_start(c);
+  }
+}
+
+// clock: first buffer that is clean, idle, unpinned and not recently used; clears
+// REF bits on the way
+static bcache_buf_t* bcache_evict(bcache_t* c) {
+  for (uint32_t n = 0; n < c->nbufs * 2; n++) {
+    bcache_buf_t* buf = &c->bufs[c->hand];
+    c->hand = (c->hand + 1) % c->nbufs;
+
+    if (buf->pins || (buf->flags & (BCACHE_DIRTY | BCACHE_READING | BCACHE_WRITING))) continue;
+    if (buf->flags & BCACHE_REF) {
+      buf->flags &= ~BCACHE_REF;
+      continue;
+    }
+
+    bcache_hash_remove(c, buf);
+    buf->flags = 0;
+    buf->redirtied = 0;
+    buf->wb_failures = 0;
+    return buf;
+  }
+
+  // everything is dirty or busy: push dirty buffers out so the next attempt succeeds
+  bcache_writeback_start(c);
+  return NULL;
+}
+
+static void bcache_unpin(bcache_t* c, uint64_t first, uint64_t end) {
+  for (uint64_t block = first; block < end; block++) bcache_lookup(c, block)->pins--;
+}
+
+// pins a buffer for every block of req, taking buffers for the uncached ones.
+// all or nothing: 0, with nothing pinned, when a buffer can't be had yet
+static uint8_t bcache_pin(bcache_t* c, const blk_request_t* req) {
+  if (req->count == 0) return 1;   // FLUSH
+  uint64_t first = req->lba / BCACHE_BLOCK_SECTORS;
+  uint64_t last = (req->lba + req->count - 1) / BCACHE_BLOCK_SECTORS;
+  for (uint64_t block = first; block <= last; block++) {
+    bcache_buf_t* buf = bcache_lookup(c, block);
+    if (!buf) {
+      buf = bcache_evict(c);
+      if (!buf) {
+        bcache_unpin(c, first, block);
+        return 0;
+      }
+      bcache_hash_insert(c, buf, block);
+    }
+    buf->pins++;
+  }
+
+  for (uint64_t block = first; block <= last; block++) {
+    if (bcache_lookup(c, block)->flags & BCACHE_VALID) c->hits++;
+    else c->misses++;
+  }
+  return 1;
+}
+
+static void bcache_unpin_request(bcache_t* c, const blk_request_t* req) {
+  if (req->count == 0) return;
+  bcache_unpin(c, req->lba / BCACHE_BLOCK_SECTORS, (req->lba + req->count - 1) / BCACHE_BLOCK_SECTORS + 1);
+}
+
+// with every block of req pinned: 1 once all of them are usable and req's data
+// was copied. otherwise starts the missing fills and copies nothing, so a write
+// never lands half in the cache
+static uint8_t bcache_try_serve(bcache_t* c, blk_request_t* req) {
+  uint8_t ready = 1;
+  uint64_t lba = req->lba;
+  uint32_t left = req->count;
+  while (left) {
+    uint64_t block = lba / BCACHE_BLOCK_SECTORS;
+    uint32_t off = (uint32_t)(lba % BCACHE_BLOCK_SECTORS);
+    uint32_t n = BCACHE_BLOCK_SECTORS - off;
+    if (n > left) n = left;
+
+    bcache_buf_t* buf = bcache_lookup(c, block);
+    // a write covering the whole block needs no fill
+    uint8_t whole = req->op == BLK_OP_WRITE && off == 0 && n == bcache_block_sectors(c, block);
+    if (!(buf->flags & BCACHE_VALID) && (!whole || (buf->flags & BCACHE_READING))) {
+      ready = 0;
+      if (!(buf->flags & BCACHE_READING)) bcache_buf_io_start(c, buf, BLK_OP_READ);
+    }
+
+    lba += n;
+    left -= n;
+  }
+  if (!ready) {
+    bcache_io_kick(c);
+    return 0;
+  }
+
+  lba = req->lba;
+  left = req->count;
+  uint64_t pos = 0;
+  while (left) {
+    uint64_t block = lba / BCACHE_BLOCK_SECTORS;
+    uint32_t off = (uint32_t)(lba % BCACHE_BLOCK_SECTORS);
+    uint32_t n = BCACHE_BLOCK_SECTORS - off;
+    if (n > left) n = left;
+
+    bcache_buf_t* buf = bcache_lookup(c, block);
+    uint8_t* data = buf->data + (uint64_t)off * BLK_SECTOR_SIZE;
+    if (req->op == BLK_OP_READ) {
+      blk_buf_copy(req, pos, data, (uint64_t)n * BLK_SECTOR_SIZE, 1);
+    } else {
+      blk_buf_copy(req, pos, data, (uint64_t)n * BLK_SECTOR_SIZE, 0);
+      buf->flags |= BCACHE_VALID;
+      bcache_mark_dirty(c, buf);
+    }
+    buf->flags |= BCACHE_REF;
+
+    lba += n;
+    left -= n;
+    pos += (uint64_t)n * BLK_SECTOR_SIZE;
+  }
+  return 1;
+}
+
+static inline uint8_t bcache_overlaps(const blk_request_t* a, const blk_request_t* b) {
+  return a->lba < b->lba + b->count && b->lba < a->lba + a->count;
+}
+
+// an earlier waiting request touches the same sectors and one of the two writes:
+// req must not overtake it. a barrier waits for every earlier write
+static uint8_t bcache_is_blocked(const bcache_t* c, const blk_request_t* req) {
+  for (const bcache_wait_t* w = c->waiting; w && w->req != req; w = w->next) {
+    if (w->req->op == BLK_OP_WRITE && blk_request_is_barrier(req)) return 1;
+    if ((w->req->op == BLK_OP_WRITE || req->op == BLK_OP_WRITE) && bcache_overlaps(w->req, req)) return 1;
+  }
+  return 0;
+}
+
+static void bcache_waiting_append(bcache_t* c, blk_request_t* req, uint8_t pinned) {
+  bcache_wait_t* w = c->free_waits;
+  c->free_waits = w->next;
+  w->req = req;
+  w->pinned = pinned;
+  w->next = NULL;
+
+  bcache_wait_t** pp = &c->waiting;
+  while (*pp) pp = &(*pp)->next;
+  *pp = w;
+}
+
+// unlinks *pp from the waiting list, unpins and frees it. returns its request
+static blk_request_t* bcache_waiting_remove(bcache_t* c, bcache_wait_t** pp) {
+  bcache_wait_t* w = *pp;
+  blk_request_t* req = w->req;
+  *pp = w->next;
+  if (w->pinned) bcache_unpin_request(c, req);
+  w->next = c->free_waits;
+  c->free_waits = w;
+  return req;
+}
+
+static void bcache_waiting_retry(bcache_t* c) {
+  if (c->retrying) return;
+  c->retrying = 1;
+
+  bcache_wait_t** pp = &c->waiting;
+  while (*pp) {
+    bcache_wait_t* w = *pp;
+    if (!bcache_is_blocked(c, w->req)) {
+      if (!w->pinned) w->pinned = bcache_pin(c, w->req);
+      if (w->pinned && bcache_try_serve(c, w->req)) {
+        bcache_request_finish(c, bcache_waiting_remove(c, pp));
+        continue;
+      }
+    }
+    pp = &w->next;
+  }
+
+  c->retrying = 0;
+}
+
+// a fill failed: everyone waiting on that block fails with it
+static void bcache_waiting_fail_block(bcache_t* c, uint64_t block) {
+  blk_request_t span = { .lba = block * BCACHE_BLOCK_SECTORS, .count = BCACHE_BLOCK_SECTORS };
+
+  bcache_wait_t** pp = &c->waiting;
+  while (*pp) {
+    if (bcache_overlaps((*pp)->req, &span)) {
+      blk_request_complete(bcache_waiting_remove(c, pp), 0);
+      continue;
+    }
+    pp = &(*pp)->next;
+  }
+}
+
+static void bcache_buf_done(blk_request_t* req) {
+  bcache_buf_t* buf = (bcache_buf_t*)req->priv;
+  bcache_t* c = buf->cache;
+  uint8_t success = req->status == BLK_REQ_DONE;
+
+  if (buf->flags & BCACHE_READING) {
+    buf->flags &= ~BCACHE_READING;
+    if (success) {
+      buf->flags |= BCACHE_VALID | BCACHE_REF;
+    } else {
+      // its waiters unpin it as they fail, then it can go
+      bcache_waiting_fail_block(c, buf->block);
+      bcache_hash_remove(c, buf);
+      buf->flags = 0;
+    }
+  } else {
+    buf->flags &= ~BCACHE_WRITING;
+    if (success) {
+      c->writebacks++;
+      buf->wb_failures = 0;
+      if (!buf->redirtied) {
+        buf->flags &= ~BCACHE_DIRTY;
+        if (--c->dirty == 0) c->syncing = 0;
+      }
+    } else if (++buf->wb_failures < BCACHE_WB_ATTEMPTS) {
+      c->writeback_errors++;   // stays dirty, retried with the next batch
+      bcache_flush_fail(c);
+    } else {
+      // given up: the data is lost, a later read gets what the disk has. a
+      // barrier waiting now fails, or else the next one
+      c->writeback_errors++;
+      c->writeback_dropped++;
+      buf->flags &= ~(BCACHE_DIRTY | BCACHE_VALID);
+      buf->wb_failures = 0;
+      if (--c->dirty == 0) c->syncing = 0;
+      c->wb_lost = 1;
+      bcache_flush_fail(c);
+    }
+    buf->redirtied = 0;
+  }
+
+  bcache_io_kick(c);
+  bcache_waiting_retry(c);
+  bcache_flush_kick(c);
+}
+
+// an idle cached copy of a block the discard covers completely is dropped; if it
+// was dirty it no longer needs writing back
+static void bcache_discard_block(bcache_t* c, bcache_buf_t* buf) {
+  if (buf->pins || (buf->flags & (BCACHE_READING | BCACHE_WRITING | BCACHE_UNSUBMITTED))) return;
+
+  if ((buf->flags & BCACHE_DIRTY) && --c->dirty == 0) c->syncing = 0;
+  bcache_hash_remove(c, buf);
+  buf->flags = 0;
+  c->discarded++;
+}
+
+static void bcache_discard_range(bcache_t* c, const blk_discard_range_t* r) {
+  // whole blocks only; the disk's short last block counts as whole
+  uint64_t end = r->lba + r->count;
+  uint64_t first = (r->lba + BCACHE_BLOCK_SECTORS - 1) / BCACHE_BLOCK_SECTORS;
+  uint64_t last = end >= c->dev->sectors ? (end + BCACHE_BLOCK_SECTORS - 1) / BCACHE_BLOCK_SECTORS
+                                         : end / BCACHE_BLOCK_SECTORS;
+  if (first >= last) return;
+
+  // big ranges: cheaper to walk the buffers than every block of the range
+  if (last - first > c->nbufs) {
+    for (uint32_t i = 0; i < c->nbufs; i++) {
+      bcache_buf_t* buf = &c->bufs[i];
+      if (buf->block != BCACHE_NO_BLOCK && buf->block >= first && buf->block < last) bcache_discard_block(c, buf);
+    }
+    return;
+  }
+  for (uint64_t block = first; block < last; block++) {
+    bcache_buf_t* buf = bcache_lookup(c, block);
+    if (buf) bcache_discard_block(c, buf);
+  }
+}
+
+// not cached: dropping the covered blocks, then passed on. it must not overtake an
+// earlier waiting write to the same sectors, busy until that one is served
+static uint8_t bcache_discard(bcache_t* c, blk_request_t* req) {
+  if (bcache_is_blocked(c, req)) return 0;
+
+  const blk_discard_list_t* list = (const blk_discard_list_t*)req->addr;
+  for (uint32_t i = 0; i < list->count; i++) bcache_discard_range(c, &list->ranges[i]);
+  bcache_flush_kick(c);
+  return c->dev->submit(c->dev, req);
+}
+
+static uint8_t bcache_submit(blk_device_t* dev, blk_request_t* req) {
+  bcache_t* c = (bcache_t*)dev->ctx;
+
+  uint8_t bad = req->op == BLK_OP_FLUSH ? req->count != 0
+                                        : req->count == 0 || req->lba + req->count > c->dev->sectors ||
+                                          (req->op == BLK_OP_DISCARD ? req->addr == NULL : req->count > dev->max_sectors) ||
+                                          !blk_request_sg_is_valid(req);
+  if (bad) {
+    blk_request_complete(req, 0);
+    return 1;
+  }
+
+  if (req->op == BLK_OP_DISCARD) return bcache_discard(c, req);
+
+  if (!c->free_waits) return 0;
+  req->status = BLK_REQ_PENDING;
+  req->next = NULL;
+
+  uint8_t pinned = !bcache_is_blocked(c, req) && bcache_pin(c, req);
+  if (pinned && bcache_try_serve(c, req)) {
+    bcache_unpin_request(c, req);
+    bcache_writeback_maybe(c);
+    bcache_request_finish(c, req);
+    return 1;
+  }
+
+  bcache_waiting_append(c, req, pinned);
+  bcache_writeback_maybe(c);
+  return 1;
+}
+
+static void bcache_tick(blk_device_t* dev) {
+  bcache_t* c = (bcache_t*)dev->ctx;
+  c->dev->tick(c->dev);
+
+  bcache_io_kick(c);
+  bcache_writeback_maybe(c);
+  bcache_waiting_retry(c);
+  bcache_flush_kick(c);
+}
+
+static void bcache_idle(blk_device_t* dev) {
+  bcache_t* c = (bcache_t*)dev->ctx;
+  blk_device_idle(c->dev);
+}
+
+uint8_t bcache_init(bcache_t* c, blk_device_t* lower, uint32_t nbufs) {
+  if (nbufs > BCACHE_MAX_BUFS) nbufs = BCACHE_MAX_BUFS;
+
+  c->dev = lower;
+  c->nbufs = 0;
+  c->hand = 0;
+  c->waiting = NULL;
+  c->free_waits = NULL;
+  for (uint32_t i = 0; i < BCACHE_WAIT_MAX; i++) {
+    c->waits[i].next = c->free_waits;
+    c->free_waits = &c->waits[i];
+  }
+  c->unsubmitted = 0;
+  c->dirty = 0;
+  c->dirty_since = 0;
+  c->wb_delay = blk_us_to_tsc(BCACHE_WB_DELAY_US);
+  c->syncing = 0;
+  c->flush_wait = NULL;
+  c->flush_batch = NULL;
+  c->flush_busy = 0;
+  c->wb_lost = 0;
+  c->flush_lost = 0;
+  c->kicking = 0;
+  c->retrying = 0;
+  c->hits = 0;
+  c->misses = 0;
+  c->writebacks = 0;
+  c->writeback_errors = 0;
+  c->writeback_dropped = 0;
+  c->prefetched = 0;
+  c->flushes = 0;
+  c->discarded = 0;
+  for (uint32_t i = 0; i < BCACHE_HASH_SIZE; i++) c->hash[i] = NULL;
+
+  for (uint32_t i = 0; i < nbufs; i++) {
+    phys_addr_t frame = pmm_frame_alloc();
+    if (frame == PMM_INVALID_FRAME) break;
+
+    bcache_buf_t* buf = &c->bufs[i];
+    buf->block = BCACHE_NO_BLOCK;
+    buf->data = (uint8_t*)(frame + HHDM_OFFSET);
+    buf->flags = 0;
+    buf->redirtied = 0;
+    buf->wb_failures = 0;
+    buf->pins = 0;
+    buf->hash_next = NULL;
+    buf->cache = c;
+    c->nbufs++;
+  }
+  if (c->nbufs < 8) return 0;
+
+  blk_name_derive(c->name, sizeof(c->name), "c", lower);
+  c->blk.name = c->name;
+  c->blk.sectors = lower->sectors;
+  // a request pins all its blocks at once: at most a quarter of the cache, so
+  // once the pinned requests are served it can always get its buffers (an
+  // unaligned request spans one block more)
+  c->blk.max_sectors = (c->nbufs / 4 - 1) * BCACHE_BLOCK_SECTORS;
+  c->blk.queue_depth = BCACHE_WAIT_MAX;
+  c->blk.submit = bcache_submit;
+  c->blk.tick = bcache_tick;
+  c->blk.idle = bcache_idle;
+  c->blk.map = NULL;
+  c->blk.ctx = c;
+  return 1;
+}
+
+blk_device_t* bcache_device_get(bcache_t* c) {
+  return &c->blk;
+}
+
+uint32_t bcache_prefetch(bcache_t* c, uint64_t lba, uint32_t count) {
+  if (count == 0 || lba >= c->dev->sectors) return 0;
+  if (count > c->dev->sectors - lba) count = (uint32_t)(c->dev->sectors - lba);
+
+  uint32_t started = 0;
+  uint64_t last = (lba + count - 1) / BCACHE_BLOCK_SECTORS;
+  for (uint64_t block = lba / BCACHE_BLOCK_SECTORS; block <= last; block++) {
+    if (bcache_lookup(c, block)) continue;
+
+    bcache_buf_t* buf = bcache_evict(c);
+    if (!buf) break;
+    bcache_hash_insert(c, buf, block);
+    bcache_buf_io_start(c, buf, BLK_OP_READ);
+    started++;
+  }
+
+  c->prefetched += started;
+  bcache_io_kick(c);
+  return started;
+}
+
+uint32_t bcache_sync(bcache_t* c) {
+  c->syncing = c->dirty != 0;
+  if (c->syncing) bcache_writeback_start(c);
+  return c->dirty;
+}
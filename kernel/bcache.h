@@ -0,0 +1,116 @@
+#pragma once
+#include "common.h"
+#include "blk.h"
+
+#define BCACHE_BLOCK_SECTORS  (PAGE_SIZE / BLK_SECTOR_SIZE)   // one frame per buffer
+#define BCACHE_MAX_BUFS       1024
+#define BCACHE_HASH_SIZE      256                            // buckets, power of two
+#define BCACHE_NO_BLOCK       UINT64_MAX
+
+#define BCACHE_WAIT_MAX       64                             // caller requests waiting on fills
+
+// dirty buffers are written back once this many are dirty, or the oldest is this old
+#define BCACHE_WB_BATCH_DIV   8                              // nbufs / 8
+#define BCACHE_WB_DELAY_US    1000000
+// a buffer whose write-back failed this many times in a row is dropped
+#define BCACHE_WB_ATTEMPTS    3
+
+// buffer flags
+#define BCACHE_VALID          0x01    // data matches (or is newer than) the disk
+#define BCACHE_DIRTY          0x02
+#define BCACHE_READING        0x04
+#define BCACHE_WRITING        0x08
+#define BCACHE_REF            0x10    // clock reference bit
+#define BCACHE_UNSUBMITTED    0x20    // I/O set up, lower device has not taken it yet
+
+struct bcache_t;
+
+// a caller request that could not be served at once
+typedef struct bcache_wait_t {
+  blk_request_t* req;
+  uint8_t pinned;                     // holds a pin on every block of req
+  struct bcache_wait_t* next;         // waiting FIFO, or the free list
+} bcache_wait_t;
+
+typedef struct bcache_buf_t {
+  uint64_t block;                     // lba / BCACHE_BLOCK_SECTORS, BCACHE_NO_BLOCK if unused
+  uint8_t* data;                      // HHDM view of the frame
+  uint8_t flags;
+  uint8_t redirtied;                  // written to while a write-back was in flight
+  uint8_t wb_failures;                // failed write-backs in a row
+  uint16_t pins;                      // waiting requests holding it, never evicted meanwhile
+
+  struct bcache_buf_t* hash_next;
+  blk_request_t req;                  // fill / write-back request
+  struct bcache_t* cache;
+} bcache_buf_t;
+
+typedef struct bcache_t {
+  blk_device_t* dev;                  // lower device
+  blk_device_t blk;                   // the cache itself
+  char name[12];
+
+  bcache_buf_t bufs[BCACHE_MAX_BUFS];
+  uint32_t nbufs;
+  uint32_t hand;                      // clock hand
+  bcache_buf_t* hash[BCACHE_HASH_SIZE];
+
+  bcache_wait_t waits[BCACHE_WAIT_MAX];
+  bcache_wait_t* waiting;             // requests waiting on fills or on other requests, FIFO
+  bcache_wait_t* free_waits;
+  uint32_t unsubmitted;
+  uint32_t dirty;
+  uint64_t dirty_since;               // rdtsc() when the first of the current dirty set appeared
+  uint64_t wb_delay;                  // BCACHE_WB_DELAY_US in TSC cycles
+  uint8_t syncing;                    // write back everything regardless of the batch size
+
+  blk_request_t* flush_wait;          // served barrier / FUA requests waiting for a device flush, FIFO
+  blk_request_t* flush_batch;         // the ones the flush in flight covers
+  blk_request_t flush_req;
+  uint8_t flush_busy;
+  uint8_t wb_lost;                    // a dropped buffer no failed barrier reported yet
+  uint8_t flush_lost;                 // the flush in flight has to report one
+  uint8_t kicking;
+  uint8_t retrying;
+
+  // stats, per block
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t writebacks;
+  uint64_t writeback_errors;
+  uint64_t writeback_dropped;         // buffers given up after BCACHE_WB_ATTEMPTS
+  uint64_t prefetched;
+  uint64_t flushes;                   // device flushes issued
+  uint64_t discarded;                 // buffers dropped because a discard covered them
+} bcache_t;
+
+// buffer cache usage:
+// 1) bcache_init(&c, lower, nbufs) after pmm/vmm, lower is usually a blk_queue over
+//    the disk so fills and write-backs get sorted and merged
+// 2) blk_device_register(bcache_device_get(&c)), submit requests to it
+// 3) reads of cached blocks complete inside submit; misses fill whole blocks
+//    and complete from the lower device's completion. writes land in the cache
+//    (partial blocks are filled first) and are written back in batches.
+//    a request takes a buffer for each of its blocks at once (or none, and
+//    waits) and pins them until it is served, so its blocks can't be evicted
+//    while the missing ones are read; its data is copied only once every
+//    block is there. a write-back that keeps failing (BCACHE_WB_ATTEMPTS) drops
+//    the buffer: its data is lost, and the next barrier waiting fails
+// 4) bcache_sync(&c) before power off / reload, tick until it returns 0
+// 5) FLUSH requests, and requests flagged PREFLUSH or FUA, are served like any
+//    other, then wait until every dirty buffer is written back and one device
+//    flush went through; all requests waiting at that point share that flush
+// 6) DISCARD requests drop the idle buffers they cover whole (dirty ones are not
+//    written back any more) and go on to the lower device uncached
+// 7) segment-list (BLK_REQ_F_SG) requests are copied through the HHDM
+// returns 0 if fewer than 8 buffer frames could be allocated
+uint8_t bcache_init(bcache_t* c, blk_device_t* lower, uint32_t nbufs);
+
+blk_device_t* bcache_device_get(bcache_t* c);
+
+// starts fills for the uncached blocks of a range without a caller waiting on them
+// (readahead); stops early when nothing can be evicted. returns blocks started
+uint32_t bcache_prefetch(bcache_t* c, uint64_t lba, uint32_t count);
+
+// starts writing back every dirty buffer, returns how many are still dirty
+uint32_t bcache_sync(bcache_t* c);
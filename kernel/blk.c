@@ -0,0 +1,176 @@
+#include "blk.h"
+#include "common.h"
+#include "mem.h"
+#include "vmm.h"
+
+static blk_device_t* g_blk_devices[BLK_DEVICE_MAX];
+static uint8_t g_blk_device_count = 0;
+static uint64_t g_blk_tsc_hz = 0;
+
+void blk_clock_init(uint64_t tsc_hz) {
+  g_blk_tsc_hz = tsc_hz;
+}
+
+uint64_t blk_clock_hz(void) {
+  return g_blk_tsc_hz ? g_blk_tsc_hz : BLK_TSC_HZ_UNKNOWN;
+}
+
+uint64_t blk_us_to_tsc(uint64_t us) {
+  uint64_t hz = blk_clock_hz();
+  // split so us * hz can't overflow
+  return us / 1000000 * hz + us % 1000000 * hz / 1000000;
+}
+
+uint32_t blk_name_derive(char* dst, uint32_t size, const char* prefix, const blk_device_t* lower) {
+  uint32_t n = 0;
+  for (const char* s = prefix; *s && n < size - 1; s++) dst[n++] = *s;
+  for (const char* s = lower->name; *s && n < size - 1; s++) dst[n++] = *s;
+  dst[n] = 0;
+  return n;
+}
+
+void blk_request_complete(blk_request_t* req, uint8_t success) {
+  req->status = success ? BLK_REQ_DONE : BLK_REQ_FAILED;
+  if (req->done) req->done(req);
+}
+
+uint8_t blk_request_sg_is_valid(const blk_request_t* req) {
+  if (!(req->flags & BLK_REQ_F_SG) || (req->op != BLK_OP_READ && req->op != BLK_OP_WRITE)) return 1;
+
+  const blk_sg_list_t* sg = (const blk_sg_list_t*)req->addr;
+  if (!sg) return 0;
+  uint64_t bytes = 0;
+  for (uint32_t i = 0; i < sg->count; i++) {
+    const blk_segment_t* s = &sg->segs[i];
+    if (s->len == 0 || ((s->offset | s->len) & 1)) return 0;
+    bytes += s->len;
+  }
+  return bytes == (uint64_t)req->count * BLK_SECTOR_SIZE;
+}
+
+uint32_t blk_sg_next(const blk_sg_list_t* sg, blk_buf_cursor_t* cur, uint32_t max, phys_addr_t* phys) {
+  if (cur->seg >= sg->count || max == 0) return 0;
+
+  const blk_segment_t* s = &sg->segs[cur->seg];
+  phys_addr_t p = s->frame + s->offset + cur->seg_off;
+  uint32_t chunk = (uint32_t)(PAGE_SIZE - (p & PAGE_MASK));
+  if (chunk > s->len - cur->seg_off) chunk = s->len - cur->seg_off;
+  if (chunk > max) chunk = max;
+
+  *phys = p;
+  blk_sg_skip(sg, cur, chunk);
+  return chunk;
+}
+
+void blk_sg_skip(const blk_sg_list_t* sg, blk_buf_cursor_t* cur, uint64_t bytes) {
+  cur->pos += bytes;
+  while (bytes && cur->seg < sg->count) {
+    uint32_t left = sg->segs[cur->seg].len - cur->seg_off;
+    if (bytes < left) {
+      cur->seg_off += (uint32_t)bytes;
+      return;
+    }
+    bytes -= left;
+    cur->seg++;
+    cur->seg_off = 0;
+  }
+}
+
+uint32_t blk_buf_next(const blk_request_t* req, blk_buf_cursor_t* cur, uint32_t max, phys_addr_t* phys) {
+  if (req->flags & BLK_REQ_F_SG) return blk_sg_next((const blk_sg_list_t*)req->addr, cur, max, phys);
+  if (max == 0) return 0;
+
+  virt_addr_t v = (virt_addr_t)req->addr + cur->pos;
+  phys_addr_t p = vmm_virt_to_phys(v);
+  if (p == VMM_INVALID) return 0;
+
+  uint32_t chunk = (uint32_t)(PAGE_SIZE - (v & PAGE_MASK));
+  if (chunk > max) chunk = max;
+  *phys = p;
+  cur->pos += chunk;
+  return chunk;
+}
+
+void blk_buf_copy(const blk_request_t* req, uint64_t off, void* mem, uint64_t bytes, uint8_t to_req) {
+  uint8_t* m = (uint8_t*)mem;
+
+  if (!(req->flags & BLK_REQ_F_SG)) {
+    uint8_t* b = (uint8_t*)req->addr + off;
+    if (to_req) mem_copy(b, m, bytes);
+    else mem_copy(m, b, bytes);
+    return;
+  }
+
+  // segments through the HHDM
+  const blk_sg_list_t* sg = (const blk_sg_list_t*)req->addr;
+  blk_buf_cursor_t cur = { 0, 0, 0 };
+  blk_sg_skip(sg, &cur, off);
+  while (bytes && cur.seg < sg->count) {
+    const blk_segment_t* s = &sg->segs[cur.seg];
+    uint8_t* b = (uint8_t*)(s->frame + s->offset + cur.seg_off + HHDM_OFFSET);
+    uint64_t n = s->len - cur.seg_off;
+    if (n > bytes) n = bytes;
+    if (to_req) mem_copy(b, m, n);
+    else mem_copy(m, b, n);
+    blk_sg_skip(sg, &cur, n);
+    m += n;
+    bytes -= n;
+  }
+}
+
+static uint8_t blk_name_equal(const char* a, const char* b) {
+  while (*a && *a == *b) {
+    a++;
+    b++;
+  }
+  return *a == *b;
+}
+
+uint8_t blk_device_register(blk_device_t* dev) {
+  if (g_blk_device_count >= BLK_DEVICE_MAX) return 0;
+  for (uint8_t i = 0; i < g_blk_device_count; i++) {
+    if (blk_name_equal(g_blk_devices[i]->name, dev->name)) return 0;
+  }
+  g_blk_devices[g_blk_device_count++] = dev;
+  return 1;
+}
+
+blk_device_t* blk_device_get(uint8_t index) {
+  if (index >= g_blk_device_count) return NULL;
+  return g_blk_devices[index];
+}
+
+uint8_t blk_device_count(void) {
+  return g_blk_device_count;
+}
+
+void blk_tick_all(void) {
+  for (uint8_t i = 0; i < g_blk_device_count; i++) {
+    g_blk_devices[i]->tick(g_blk_devices[i]);
+  }
+}
+
+void blk_device_idle(blk_device_t* dev) {
+  if (dev->idle) dev->idle(dev);
+  else cpu_relax();
+}
+
+const void* blk_device_map(blk_device_t* dev, uint64_t lba, uint32_t count) {
+  if (!dev->map || count == 0 || lba + count > dev->sectors) return NULL;
+  return dev->map(dev, lba, count);
+}
+
+uint8_t blk_request_wait(blk_device_t* dev, blk_request_t* req) {
+  req->status = BLK_REQ_PENDING;
+  while (!dev->submit(dev, req)) {
+    dev->tick(dev);
+    blk_device_idle(dev);
+  }
+
+  while (req->status == BLK_REQ_PENDING) {
+    dev->tick(dev);
+    if (req->status != BLK_REQ_PENDING) break;
+    blk_device_idle(dev);
+  }
+  return req->status == BLK_REQ_DONE;
+}
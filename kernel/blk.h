@@ -0,0 +1,154 @@
+#pragma once
+#include "common.h"
+
+#define BLK_SECTOR_SIZE  512
+#define BLK_DEVICE_MAX   8
+#define BLK_TSC_HZ_UNKNOWN 1000000000ULL   // assumed until blk_clock_init gets a calibrated rate
+
+typedef enum blk_op_t {
+  BLK_OP_READ = 0,
+  BLK_OP_WRITE,
+  BLK_OP_FLUSH,            // count 0: everything written before it reaches stable media
+  BLK_OP_DISCARD           // addr -> blk_discard_list_t; lba / count span all its ranges
+} blk_op_t;
+
+// sectors the owner no longer needs (TRIM). only a hint: devices that can't
+// discard complete it successfully, and discarded sectors read back undefined
+typedef struct blk_discard_range_t {
+  uint64_t lba;
+  uint32_t count;
+} blk_discard_range_t;
+
+typedef struct blk_discard_list_t {
+  blk_discard_range_t* ranges;   // ascending, not overlapping
+  uint32_t count;
+} blk_discard_list_t;
+
+// vectored buffer: len bytes from offset on in a physical frame (a segment may run
+// on into the frames after it if they are physically contiguous). offsets and
+// lengths are even and non-zero, and the segments add up to the request's sectors
+typedef struct blk_segment_t {
+  phys_addr_t frame;
+  uint32_t offset;
+  uint32_t len;
+} blk_segment_t;
+
+typedef struct blk_sg_list_t {
+  blk_segment_t* segs;
+  uint32_t count;
+} blk_sg_list_t;
+
+// position in a request's buffer
+typedef struct blk_buf_cursor_t {
+  uint64_t pos;              // bytes walked
+  uint32_t seg;              // segment lists: current segment, and bytes into it
+  uint32_t seg_off;
+} blk_buf_cursor_t;
+
+// per-request flags
+#define BLK_REQ_F_POLL     0x01   // busy-poll for completion, device IRQ off
+#define BLK_REQ_F_HYBRID   0x02   // sleep most of the expected service time, then poll (IRQ as fallback)
+#define BLK_REQ_F_PREFLUSH 0x04   // flush the device cache before this request
+#define BLK_REQ_F_FUA      0x08   // write: completes only once the data is on stable media
+#define BLK_REQ_F_SG       0x10   // addr -> blk_sg_list_t instead of a virtually contiguous buffer
+
+// write cache semantics: plain writes may complete while still in a volatile cache.
+// a FLUSH request (or PREFLUSH flag) covers every write submitted before it; layers
+// that reorder (blk_queue) never move requests across it. devices without a
+// volatile cache complete FLUSH at once and ignore PREFLUSH / FUA.
+
+typedef enum blk_status_t {
+  BLK_REQ_PENDING = 0,   // handed to a device, not finished yet
+  BLK_REQ_DONE,
+  BLK_REQ_FAILED
+} blk_status_t;
+
+struct blk_device_t;
+
+typedef struct blk_request_t {
+  blk_op_t op;
+  uint64_t lba;
+  uint32_t count;          // sectors
+  void* addr;
+  uint32_t flags;          // BLK_REQ_F_*
+
+  volatile blk_status_t status;
+
+  // optional completion callback, runs from the owning device's tick
+  void (*done)(struct blk_request_t* req);
+  void* priv;              // owner's cookie, untouched by devices
+
+  struct blk_request_t* next;  // free for whoever currently owns the request
+} blk_request_t;
+
+// a backend. submit never blocks: it returns 0 when the device has no free
+// slot (caller retries after a tick), 1 once the request is owned by the device.
+// requests the device can never serve are accepted and completed as failed.
+typedef struct blk_device_t {
+  const char* name;
+  uint64_t sectors;          // capacity
+  uint32_t max_sectors;      // largest single request submit() accepts
+  uint8_t queue_depth;       // requests it can hold in flight
+
+  uint8_t (*submit)(struct blk_device_t* dev, blk_request_t* req);
+  void (*tick)(struct blk_device_t* dev);
+  // optional: wait cheaply for the device's next event (hlt, timed sleep or pause)
+  void (*idle)(struct blk_device_t* dev);
+  // optional: the device's own memory holding lba..lba+count (memory-backed devices),
+  // or NULL. lets a reader use the data in place instead of copying it out
+  const void* (*map)(struct blk_device_t* dev, uint64_t lba, uint32_t count);
+
+  void* ctx;                 // backend private
+} blk_device_t;
+
+static inline uint8_t blk_request_is_barrier(const blk_request_t* req) {
+  return req->op == BLK_OP_FLUSH || (req->flags & BLK_REQ_F_PREFLUSH);
+}
+
+// READ / WRITE buffer checks for a segment list (anything goes for a flat buffer)
+uint8_t blk_request_sg_is_valid(const blk_request_t* req);
+
+// next physically contiguous piece of a segment list at the cursor: at most max
+// bytes and not crossing a page. moves the cursor, returns the length (0 at the end)
+uint32_t blk_sg_next(const blk_sg_list_t* sg, blk_buf_cursor_t* cur, uint32_t max, phys_addr_t* phys);
+
+// moves the cursor bytes further into the segment list
+void blk_sg_skip(const blk_sg_list_t* sg, blk_buf_cursor_t* cur, uint64_t bytes);
+
+// blk_sg_next for any request buffer; flat buffers are translated page by page,
+// returns 0 at an unmapped page too. DMA backends build their tables with it
+uint32_t blk_buf_next(const blk_request_t* req, blk_buf_cursor_t* cur, uint32_t max, phys_addr_t* phys);
+
+// copies bytes between req's buffer (from byte off on) and mem; to_req picks the direction
+void blk_buf_copy(const blk_request_t* req, uint64_t off, void* mem, uint64_t bytes, uint8_t to_req);
+
+// sets the final status and runs the callback
+void blk_request_complete(blk_request_t* req, uint8_t success);
+
+// the TSC rate behind the layers' timers (boot_info_t.tsc_hz, or the kernel's own
+// calibration). call before setting up any layer: each converts its microsecond
+// settings to TSC cycles once, in its init
+void blk_clock_init(uint64_t tsc_hz);
+uint64_t blk_clock_hz(void);
+uint64_t blk_us_to_tsc(uint64_t us);
+
+// a stacked layer's name: prefix + the lower device's name, e.g. "q" + "ata0".
+// cut to fit size bytes with the terminator, returns the length
+uint32_t blk_name_derive(char* dst, uint32_t size, const char* prefix, const blk_device_t* lower);
+
+// 0 when the table is full or a registered device has the same name
+uint8_t blk_device_register(blk_device_t* dev);
+blk_device_t* blk_device_get(uint8_t index);
+uint8_t blk_device_count(void);
+
+// ticks every registered device (call every kernel loop)
+void blk_tick_all(void);
+
+// lets the device pick how to wait for its next event; pause if it has no preference
+void blk_device_idle(blk_device_t* dev);
+
+// zero-copy read: the device's pointer to the sectors, NULL if it has none (submit a READ then)
+const void* blk_device_map(blk_device_t* dev, uint64_t lba, uint32_t count);
+
+// synchronous helper: submits req and ticks / idles until it finished. returns 1 on success
+uint8_t blk_request_wait(blk_device_t* dev, blk_request_t* req);
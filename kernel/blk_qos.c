@@ -0,0 +1,286 @@
+#include "blk_qos.h"
+#include "common.h"
+
+static void blk_qos_bucket_init(blk_qos_bucket_t* b, uint64_t rate, uint64_t burst_min) {
+  b->rate = rate;
+  b->burst = rate / 10;
+  if (b->burst < burst_min) b->burst = burst_min;
+  b->tokens = (int64_t)b->burst;
+  b->last = rdtsc();
+}
+
+// adds the tokens earned since last. last only moves by the time those whole
+// tokens took, so frequent calls don't round the rate away
+static void blk_qos_bucket_refill(blk_qos_bucket_t* b, uint64_t now, uint64_t hz) {
+  if (b->rate == 0) return;
+
+  uint64_t elapsed = now - b->last;
+  if (elapsed > hz) elapsed = hz;          // a full second refills any burst
+  uint64_t add = elapsed * b->rate / hz;
+  if (add == 0) return;
+
+  if (b->tokens + (int64_t)add >= (int64_t)b->burst) {
+    b->tokens = (int64_t)b->burst;
+    b->last = now;
+    return;
+  }
+  b->tokens += (int64_t)add;
+  b->last += add * hz / b->rate;
+}
+
+static inline uint8_t blk_qos_bucket_ok(const blk_qos_bucket_t* b) {
+  return b->rate == 0 || b->tokens > 0;
+}
+
+static inline void blk_qos_bucket_charge(blk_qos_bucket_t* b, int64_t cost) {
+  if (b->rate) b->tokens -= cost;
+}
+
+static inline uint64_t blk_qos_cmd_bytes(const blk_qos_cmd_t* cmd) {
+  return cmd->req.op == BLK_OP_FLUSH || cmd->req.op == BLK_OP_DISCARD ? 0 : (uint64_t)cmd->req.count * BLK_SECTOR_SIZE;
+}
+
+// the client's next request may go now (buckets refilled first)
+static uint8_t blk_qos_client_ready(blk_qos_t* q, blk_qos_client_t* c, uint64_t now) {
+  if (!c->head) return 0;
+  blk_qos_bucket_refill(&c->iops, now, q->tsc_hz);
+  blk_qos_bucket_refill(&c->bw, now, q->tsc_hz);
+  if (blk_qos_bucket_ok(&c->iops) && blk_qos_bucket_ok(&c->bw)) return 1;
+  c->throttled++;
+  return 0;
+}
+
+static uint8_t blk_qos_class_may_go(const blk_qos_t* q, blk_qos_class_t cls, uint64_t now) {
+  if (cls == BLK_QOS_RT) return 1;
+  if (q->in_flight[BLK_QOS_BE] + q->in_flight[BLK_QOS_IDLE] >= q->shared_limit) return 0;
+  if (cls == BLK_QOS_BE) return 1;
+  return q->in_flight[BLK_QOS_RT] + q->in_flight[BLK_QOS_BE] == 0 &&
+         now - q->last_busy >= q->idle_grace;
+}
+
+// highest class first, round robin among that class's ready clients
+static blk_qos_client_t* blk_qos_pick(blk_qos_t* q, uint64_t now) {
+  for (uint32_t cls = 0; cls < BLK_QOS_CLASSES; cls++) {
+    if (!blk_qos_class_may_go(q, (blk_qos_class_t)cls, now)) continue;
+
+    for (uint8_t i = 0; i < q->client_count; i++) {
+      uint8_t idx = (uint8_t)((q->rr[cls] + i) % q->client_count);
+      blk_qos_client_t* c = q->clients[idx];
+      if (c->cls != cls || !blk_qos_client_ready(q, c, now)) continue;
+      q->rr[cls] = (uint8_t)((idx + 1) % q->client_count);
+      return c;
+    }
+  }
+  return NULL;
+}
+
+static void blk_qos_cmd_done(blk_request_t* req);
+
+static void blk_qos_dispatch(blk_qos_t* q) {
+  if (q->dispatching) return;
+  q->dispatching = 1;
+
+  uint64_t now = rdtsc();
+  for (;;) {
+    blk_qos_client_t* c = blk_qos_pick(q, now);
+    if (!c) break;
+
+    // unlink first, the lower device may complete (and free) it before submit returns
+    blk_qos_cmd_t* cmd = c->head;
+    c->head = cmd->next;
+    if (!c->head) c->tail = NULL;
+
+    int64_t bytes = (int64_t)blk_qos_cmd_bytes(cmd);
+    blk_qos_bucket_charge(&c->iops, 1);
+    blk_qos_bucket_charge(&c->bw, bytes);
+    q->in_flight[c->cls]++;
+
+    if (!q->dev->submit(q->dev, &cmd->req)) {
+      q->in_flight[c->cls]--;
+      blk_qos_bucket_charge(&c->iops, -1);
+      blk_qos_bucket_charge(&c->bw, -bytes);
+      cmd->next = c->head;
+      c->head = cmd;
+      if (!c->tail) c->tail = cmd;
+      break;
+    }
+  }
+
+  q->dispatching = 0;
+}
+
+static void blk_qos_latency_record(blk_qos_stats_t* s, uint64_t lat, uint64_t hz, uint8_t success) {
+  if (success) s->completed++;
+  else s->failed++;
+  s->lat_sum += lat;
+  if (lat > s->lat_max) s->lat_max = lat;
+
+  uint64_t us = lat / (hz / 1000000 ? hz / 1000000 : 1);
+  uint32_t bucket = 0;
+  while (bucket < BLK_QOS_HIST_BUCKETS - 1 && (1ULL << bucket) <= us) bucket++;
+  s->hist[bucket]++;
+}
+
+static void blk_qos_cmd_done(blk_request_t* req) {
+  blk_qos_cmd_t* cmd = (blk_qos_cmd_t*)req->priv;
+  blk_qos_client_t* c = cmd->client;
+  blk_qos_t* q = c->qos;
+  blk_request_t* orig = cmd->orig;
+  uint8_t success = req->status == BLK_REQ_DONE;
+  uint64_t now = rdtsc();
+
+  blk_qos_latency_record(&q->stats[c->cls], now - cmd->start, q->tsc_hz, success);
+  q->in_flight[c->cls]--;
+  if (c->cls != BLK_QOS_IDLE) q->last_busy = now;
+
+  cmd->next = q->free;
+  q->free = cmd;
+  c->held--;
+  if (c->cls != BLK_QOS_RT) q->held_shared--;
+
+  // next request goes out before the callback runs
+  blk_qos_dispatch(q);
+  blk_request_complete(orig, success);
+}
+
+static uint8_t blk_qos_client_submit(blk_device_t* dev, blk_request_t* req) {
+  blk_qos_client_t* c = (blk_qos_client_t*)dev->ctx;
+  blk_qos_t* q = c->qos;
+
+  // the last entries of the pool are RT's
+  uint8_t shared = c->cls != BLK_QOS_RT;
+  blk_qos_cmd_t* cmd = q->free;
+  if (!cmd || c->held >= BLK_QOS_CLIENT_HELD ||
+      (shared && q->held_shared >= BLK_QOS_POOL_SIZE - BLK_QOS_RT_RESERVE)) {
+    c->refused++;
+    return 0;
+  }
+  q->free = cmd->next;
+  c->held++;
+  if (shared) q->held_shared++;
+
+  cmd->req.op = req->op;
+  cmd->req.lba = req->lba;
+  cmd->req.count = req->count;
+  cmd->req.addr = req->addr;
+  cmd->req.flags = req->flags;
+  cmd->req.status = BLK_REQ_PENDING;
+  cmd->req.done = blk_qos_cmd_done;
+  cmd->req.priv = cmd;
+  cmd->orig = req;
+  cmd->client = c;
+  cmd->start = rdtsc();
+  cmd->next = NULL;
+
+  if (c->tail) c->tail->next = cmd;
+  else c->head = cmd;
+  c->tail = cmd;
+
+  req->status = BLK_REQ_PENDING;
+  c->submitted++;
+  if (c->cls != BLK_QOS_IDLE) q->last_busy = cmd->start;
+
+  blk_qos_dispatch(q);
+  return 1;
+}
+
+// also where throttled and idle-class requests get their next chance
+static void blk_qos_client_tick(blk_device_t* dev) {
+  blk_qos_client_t* c = (blk_qos_client_t*)dev->ctx;
+  c->qos->dev->tick(c->qos->dev);
+  blk_qos_dispatch(c->qos);
+}
+
+static void blk_qos_client_idle(blk_device_t* dev) {
+  blk_qos_client_t* c = (blk_qos_client_t*)dev->ctx;
+  blk_device_idle(c->qos->dev);
+}
+
+void blk_qos_init(blk_qos_t* q, blk_device_t* lower) {
+  q->dev = lower;
+  q->tsc_hz = blk_clock_hz();
+  q->idle_grace = blk_us_to_tsc(BLK_QOS_IDLE_GRACE_US);
+  q->client_count = 0;
+  q->free = NULL;
+  q->held_shared = 0;
+  q->last_busy = 0;
+  q->dispatching = 0;
+
+  // half the lower device's slots for BE / idle, at least one
+  q->shared_limit = lower->queue_depth / 2;
+  if (q->shared_limit == 0) q->shared_limit = 1;
+
+  for (uint32_t cls = 0; cls < BLK_QOS_CLASSES; cls++) {
+    q->rr[cls] = 0;
+    q->in_flight[cls] = 0;
+    blk_qos_stats_t* s = &q->stats[cls];
+    s->completed = 0;
+    s->failed = 0;
+    s->lat_sum = 0;
+    s->lat_max = 0;
+    for (uint32_t i = 0; i < BLK_QOS_HIST_BUCKETS; i++) s->hist[i] = 0;
+  }
+
+  for (int i = BLK_QOS_POOL_SIZE - 1; i >= 0; i--) {
+    q->pool[i].next = q->free;
+    q->free = &q->pool[i];
+  }
+}
+
+uint8_t blk_qos_client_add(blk_qos_t* q, blk_qos_client_t* client, blk_qos_class_t cls) {
+  if (q->client_count >= BLK_QOS_MAX_CLIENTS || cls >= BLK_QOS_CLASSES) return 0;
+
+  client->qos = q;
+  client->cls = cls;
+  client->head = NULL;
+  client->tail = NULL;
+  client->held = 0;
+  client->submitted = 0;
+  client->refused = 0;
+  client->throttled = 0;
+  blk_qos_bucket_init(&client->iops, 0, 1);
+  blk_qos_bucket_init(&client->bw, 0, 65536);
+
+  // "p" + lower name + "." + client number, e.g. "pcqata0.1"
+  uint32_t n = blk_name_derive(client->name, sizeof(client->name) - 2, "p", q->dev);
+  client->name[n++] = '.';
+  client->name[n++] = (char)('0' + q->client_count);
+  client->name[n] = 0;
+
+  client->blk.name = client->name;
+  client->blk.sectors = q->dev->sectors;
+  client->blk.max_sectors = q->dev->max_sectors;
+  client->blk.queue_depth = BLK_QOS_CLIENT_HELD;
+  client->blk.submit = blk_qos_client_submit;
+  client->blk.tick = blk_qos_client_tick;
+  client->blk.idle = blk_qos_client_idle;
+  client->blk.map = NULL;
+  client->blk.ctx = client;
+
+  q->clients[q->client_count++] = client;
+  return 1;
+}
+
+void blk_qos_client_limit_set(blk_qos_client_t* client, uint64_t iops, uint64_t bytes_per_sec) {
+  blk_qos_bucket_init(&client->iops, iops, 1);
+  blk_qos_bucket_init(&client->bw, bytes_per_sec, 65536);
+}
+
+blk_device_t* blk_qos_client_device_get(blk_qos_client_t* client) {
+  return &client->blk;
+}
+
+uint64_t blk_qos_latency_percentile(const blk_qos_t* q, blk_qos_class_t cls, uint32_t pct) {
+  const blk_qos_stats_t* s = &q->stats[cls];
+  uint64_t total = s->completed + s->failed;
+  if (total == 0) return 0;
+  if (pct > 100) pct = 100;
+
+  uint64_t want = (total * pct + 99) / 100;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < BLK_QOS_HIST_BUCKETS; i++) {
+    seen += s->hist[i];
+    if (seen >= want) return 1ULL << i;
+  }
+  return 1ULL << (BLK_QOS_HIST_BUCKETS - 1);
+}
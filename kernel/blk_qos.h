@@ -0,0 +1,114 @@
+#pragma once
+#include "common.h"
+#include "blk.h"
+
+#define BLK_QOS_MAX_CLIENTS   8
+#define BLK_QOS_POOL_SIZE     64        // requests held (pending or in flight), all clients
+#define BLK_QOS_RT_RESERVE    16        // of those, only RT clients may take the last ones
+#define BLK_QOS_CLIENT_HELD   16        // requests one client may hold
+#define BLK_QOS_HIST_BUCKETS  24        // latency histogram, bucket i: below 2^i us
+#define BLK_QOS_IDLE_GRACE_US 10000     // idle class waits this long after other I/O
+
+typedef enum blk_qos_class_t {
+  BLK_QOS_RT = 0,     // always first, may use every slot of the lower device
+  BLK_QOS_BE,         // best effort
+  BLK_QOS_IDLE,       // only once nothing else used the disk for BLK_QOS_IDLE_GRACE_US
+  BLK_QOS_CLASSES
+} blk_qos_class_t;
+
+// rate per second, 0 = unlimited. tokens may go negative: a request is let through
+// whenever the bucket is positive, so one bigger than the burst still passes
+typedef struct blk_qos_bucket_t {
+  uint64_t rate;
+  uint64_t burst;
+  int64_t tokens;
+  uint64_t last;              // rdtsc() the tokens were last brought up to
+} blk_qos_bucket_t;
+
+struct blk_qos_t;
+struct blk_qos_client_t;
+
+typedef struct blk_qos_cmd_t {
+  blk_request_t req;          // what the lower device sees
+  blk_request_t* orig;        // the client's request
+  struct blk_qos_client_t* client;
+  uint64_t start;             // rdtsc() at submit
+  struct blk_qos_cmd_t* next; // free list / client FIFO
+} blk_qos_cmd_t;
+
+typedef struct blk_qos_client_t {
+  struct blk_qos_t* qos;
+  blk_qos_class_t cls;
+  blk_qos_bucket_t iops;
+  blk_qos_bucket_t bw;        // bytes
+
+  blk_qos_cmd_t* head;        // pending, FIFO
+  blk_qos_cmd_t* tail;
+  uint32_t held;              // pending + in flight, at most BLK_QOS_CLIENT_HELD
+
+  blk_device_t blk;           // the client's view of the disk
+  char name[16];
+
+  // stats
+  uint64_t submitted;
+  uint64_t refused;           // submits turned away, client or pool full
+  uint64_t throttled;         // dispatch passes where a bucket held its next request back
+} blk_qos_client_t;
+
+typedef struct blk_qos_stats_t {
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t lat_sum;           // TSC, submit to completion (time spent queued here included)
+  uint64_t lat_max;
+  uint32_t hist[BLK_QOS_HIST_BUCKETS];
+} blk_qos_stats_t;
+
+typedef struct blk_qos_t {
+  blk_device_t* dev;          // lower device
+  uint64_t tsc_hz;
+  uint64_t idle_grace;        // BLK_QOS_IDLE_GRACE_US in TSC cycles
+
+  blk_qos_client_t* clients[BLK_QOS_MAX_CLIENTS];
+  uint8_t client_count;
+  uint8_t rr[BLK_QOS_CLASSES];        // round robin position per class
+
+  blk_qos_cmd_t pool[BLK_QOS_POOL_SIZE];
+  blk_qos_cmd_t* free;
+  uint32_t held_shared;       // pool entries held by BE and idle clients
+
+  uint32_t in_flight[BLK_QOS_CLASSES];
+  uint32_t shared_limit;      // BE + idle requests at the lower device, the rest is kept for RT
+  uint64_t last_busy;         // rdtsc() of the last RT / BE submit or completion
+  uint8_t dispatching;
+
+  blk_qos_stats_t stats[BLK_QOS_CLASSES];
+} blk_qos_t;
+
+// QoS usage:
+// 1) blk_qos_init(&q, lower) over the shared stack (cache, queue or disk)
+// 2) per subsystem: blk_qos_client_add(&q, &client, BLK_QOS_BE), optionally
+//    blk_qos_client_limit_set(&client, iops, bytes_per_sec), then submit to
+//    blk_qos_client_device_get(&client) (register it to have it ticked)
+// 3) requests wait per client in FIFO order. at dispatch the highest class with a
+//    client whose buckets are positive goes first, round robin inside a class;
+//    throttled clients don't hold back lower classes. BE and idle together keep
+//    at most shared_limit requests at the lower device, so an RT request never
+//    waits behind a full queue of bulk writes. the pool is shared the same way:
+//    a client holds at most BLK_QOS_CLIENT_HELD requests and BE + idle leave
+//    BLK_QOS_RT_RESERVE entries to RT, so throttled bulk writers piling up
+//    requests can't starve RT of entries either (submit returns 0, retry)
+// 4) latency per class: stats[cls], blk_qos_latency_percentile()
+// ordering (FLUSH / PREFLUSH) holds within a client, not between clients
+void blk_qos_init(blk_qos_t* q, blk_device_t* lower);
+
+// returns 0 if all client slots are taken
+uint8_t blk_qos_client_add(blk_qos_t* q, blk_qos_client_t* client, blk_qos_class_t cls);
+
+// 0 = unlimited; the burst is a tenth of a second at the given rate (at least one request / 64 KiB)
+void blk_qos_client_limit_set(blk_qos_client_t* client, uint64_t iops, uint64_t bytes_per_sec);
+
+blk_device_t* blk_qos_client_device_get(blk_qos_client_t* client);
+
+// upper bound in microseconds under which pct percent of the class's requests
+// completed (histogram resolution: powers of two), 0 if none completed
+uint64_t blk_qos_latency_percentile(const blk_qos_t* q, blk_qos_class_t cls, uint32_t pct);
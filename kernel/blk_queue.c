@@ -0,0 +1,322 @@
+#include "blk_queue.h"
+#include "common.h"
+
+static blkq_cmd_t* blkq_cmd_alloc(blkq_queue_t* q) {
+  blkq_cmd_t* cmd = q->free;
+  if (!cmd) return NULL;
+
+  q->free = cmd->sort_next;
+  cmd->sort_next = NULL;
+  cmd->members = NULL;
+  cmd->members_tail = NULL;
+  return cmd;
+}
+
+static void blkq_cmd_free(blkq_queue_t* q, blkq_cmd_t* cmd) {
+  cmd->sort_next = q->free;
+  q->free = cmd;
+}
+
+static void blkq_sorted_insert(blkq_queue_t* q, blkq_cmd_t* cmd) {
+  blkq_cmd_t** pp = &q->sorted;
+  while (*pp && (*pp)->dev_req.lba <= cmd->dev_req.lba) pp = &(*pp)->sort_next;
+  cmd->sort_next = *pp;
+  *pp = cmd;
+}
+
+static void blkq_sorted_remove(blkq_queue_t* q, blkq_cmd_t* cmd) {
+  blkq_cmd_t** pp = &q->sorted;
+  while (*pp && *pp != cmd) pp = &(*pp)->sort_next;
+  if (*pp) *pp = cmd->sort_next;
+  cmd->sort_next = NULL;
+}
+
+static void blkq_flight_remove(blkq_queue_t* q, blkq_cmd_t* cmd) {
+  blkq_cmd_t** pp = &q->flight;
+  while (*pp && *pp != cmd) pp = &(*pp)->sort_next;
+  if (*pp) *pp = cmd->sort_next;
+  cmd->sort_next = NULL;
+}
+
+// barriers, and discards (a write must neither overtake a discard of the same
+// sectors nor be overtaken by it), keep their place against everything around them
+static inline uint8_t blkq_is_ordered(const blk_request_t* req) {
+  return blk_request_is_barrier(req) || req->op == BLK_OP_DISCARD;
+}
+
+// b starts exactly where a ends, both on disk and in memory (segment lists don't merge)
+static uint8_t blkq_is_contiguous(const blk_request_t* a, const blk_request_t* b) {
+  return a->op == b->op && a->flags == b->flags && !(a->flags & BLK_REQ_F_SG) &&
+         !blkq_is_ordered(a) && !blkq_is_ordered(b) &&
+         a->lba + a->count == b->lba &&
+         (uint8_t*)a->addr + (uint64_t)a->count * BLK_SECTOR_SIZE == (uint8_t*)b->addr;
+}
+
+// a data command the lower device may not reorder against req: the ranges
+// overlap and at least one of them writes
+static uint8_t blkq_is_hazard(const blk_request_t* a, const blk_request_t* req) {
+  uint8_t a_data = a->op == BLK_OP_READ || a->op == BLK_OP_WRITE;
+  uint8_t req_data = req->op == BLK_OP_READ || req->op == BLK_OP_WRITE;
+  if (!a_data || !req_data || (a->op == BLK_OP_READ && req->op == BLK_OP_READ)) return 0;
+  return a->lba < req->lba + req->count && req->lba < a->lba + a->count;
+}
+
+static uint8_t blkq_has_hazard(const blkq_queue_t* q, const blk_request_t* req) {
+  for (const blkq_cmd_t* cmd = q->sorted; cmd; cmd = cmd->sort_next) {
+    if (blkq_is_hazard(&cmd->dev_req, req)) return 1;
+  }
+  for (const blkq_cmd_t* cmd = q->flight; cmd; cmd = cmd->sort_next) {
+    if (blkq_is_hazard(&cmd->dev_req, req)) return 1;
+  }
+  return 0;
+}
+
+// joins pending neighbours that became contiguous (a request filled the gap between them)
+static void blkq_coalesce(blkq_queue_t* q) {
+  blkq_cmd_t* cmd = q->sorted;
+  while (cmd && cmd->sort_next) {
+    blkq_cmd_t* next = cmd->sort_next;
+    if (cmd->epoch == next->epoch &&
+        cmd->dev_req.count + next->dev_req.count <= q->dev->max_sectors &&
+        blkq_is_contiguous(&cmd->dev_req, &next->dev_req)) {
+      cmd->dev_req.count += next->dev_req.count;
+      cmd->members_tail->next = next->members;
+      cmd->members_tail = next->members_tail;
+      if (next->deadline < cmd->deadline) cmd->deadline = next->deadline;
+      cmd->drain |= next->drain;
+
+      cmd->sort_next = next->sort_next;
+      blkq_cmd_free(q, next);
+      q->merged++;
+      continue;
+    }
+    cmd = next;
+  }
+}
+
+// folds req into a pending command it extends at either end
+static uint8_t blkq_merge(blkq_queue_t* q, blk_request_t* req) {
+  for (blkq_cmd_t* cmd = q->sorted; cmd; cmd = cmd->sort_next) {
+    blk_request_t* r = &cmd->dev_req;
+    // only the newest epoch: anything older sits before a barrier req came after
+    if (cmd->epoch != q->epoch || r->count + req->count > q->dev->max_sectors) continue;
+
+    if (blkq_is_contiguous(r, req)) {
+      r->count += req->count;
+      cmd->members_tail->next = req;
+      cmd->members_tail = req;
+    } else if (blkq_is_contiguous(req, r)) {
+      r->lba = req->lba;
+      r->addr = req->addr;
+      r->count += req->count;
+      req->next = cmd->members;
+      cmd->members = req;
+
+      // start moved down, keep the list sorted
+      blkq_sorted_remove(q, cmd);
+      blkq_sorted_insert(q, cmd);
+    } else {
+      continue;
+    }
+
+    q->merged++;
+    blkq_coalesce(q);
+    return 1;
+  }
+  return 0;
+}
+
+// only the oldest epoch is eligible. its barrier (if it has one) goes first and
+// alone, once the lower device drained; so does the command that opened it
+// for a hazard, without holding back what comes after it. then: oldest command if its deadline
+// passed, otherwise C-LOOK: the next command at or above the head position,
+// wrapping to the lowest LBA
+static blkq_cmd_t* blkq_next_pick(blkq_queue_t* q, uint64_t now) {
+  if (q->barrier_busy || !q->sorted) return NULL;
+
+  uint64_t epoch = q->sorted->epoch;
+  for (blkq_cmd_t* cmd = q->sorted; cmd; cmd = cmd->sort_next) {
+    if (cmd->epoch < epoch) epoch = cmd->epoch;
+  }
+
+  blkq_cmd_t* oldest = NULL;
+  blkq_cmd_t* ahead = NULL;
+  blkq_cmd_t* lowest = NULL;
+  for (blkq_cmd_t* cmd = q->sorted; cmd; cmd = cmd->sort_next) {
+    if (cmd->epoch != epoch) continue;
+    if (blkq_is_ordered(&cmd->dev_req) || cmd->drain) return q->in_flight == 0 ? cmd : NULL;
+
+    if (!lowest) lowest = cmd;
+    if (!oldest || cmd->deadline < oldest->deadline) oldest = cmd;
+    if (!ahead && cmd->dev_req.lba >= q->head_pos) ahead = cmd;
+  }
+
+  if ((int64_t)(now - oldest->deadline) >= 0) return oldest;
+  return ahead ? ahead : lowest;
+}
+
+static void blkq_cmd_done(blk_request_t* dev_req);
+
+// feeds the lower device until it refuses or nothing is pending
+static void blkq_dispatch(blkq_queue_t* q) {
+  if (q->dispatching) return;
+  q->dispatching = 1;
+
+  uint64_t now = rdtsc();
+  for (;;) {
+    blkq_cmd_t* cmd = blkq_next_pick(q, now);
+    if (!cmd) break;
+
+    uint64_t end = cmd->dev_req.lba + cmd->dev_req.count;
+    uint8_t late = (int64_t)(now - cmd->deadline) >= 0;
+    uint8_t barrier = blkq_is_ordered(&cmd->dev_req);
+    uint8_t moves_head = cmd->dev_req.op != BLK_OP_FLUSH && cmd->dev_req.op != BLK_OP_DISCARD;
+
+    // unlink first, the lower device may complete (and free) it before submit returns
+    blkq_sorted_remove(q, cmd);
+    uint8_t drain = cmd->drain;
+    cmd->drain = 0;
+    cmd->sort_next = q->flight;
+    q->flight = cmd;
+    cmd->dev_req.status = BLK_REQ_PENDING;
+    cmd->dev_req.done = blkq_cmd_done;
+    cmd->dev_req.priv = cmd;
+    q->in_flight++;
+    q->barrier_busy = barrier;
+
+    if (!q->dev->submit(q->dev, &cmd->dev_req)) {
+      q->in_flight--;
+      q->barrier_busy = 0;
+      blkq_flight_remove(q, cmd);
+      cmd->drain = drain;
+      blkq_sorted_insert(q, cmd);
+      break;
+    }
+
+    if (moves_head) q->head_pos = end;
+    q->dispatched++;
+    if (late) q->expired++;
+  }
+
+  q->dispatching = 0;
+}
+
+// lower device finished a command: refill it, then fan the result out to the members
+static void blkq_cmd_done(blk_request_t* dev_req) {
+  blkq_cmd_t* cmd = (blkq_cmd_t*)dev_req->priv;
+  blkq_queue_t* q = cmd->queue;
+  uint8_t success = dev_req->status == BLK_REQ_DONE;
+  blk_request_t* req = cmd->members;
+
+  q->in_flight--;
+  if (blkq_is_ordered(dev_req)) q->barrier_busy = 0;
+  blkq_flight_remove(q, cmd);
+  blkq_cmd_free(q, cmd);
+
+  // next command goes out before the callbacks run, the disk stays busy meanwhile
+  blkq_dispatch(q);
+
+  while (req) {
+    blk_request_t* next = req->next;   // the callback may reuse req
+    blk_request_complete(req, success);
+    req = next;
+  }
+}
+
+static uint8_t blkq_submit(blk_device_t* dev, blk_request_t* req) {
+  blkq_queue_t* q = (blkq_queue_t*)dev->ctx;
+
+  // checked here, one bad request must not fail the ones merged with it
+  uint8_t bad = req->op == BLK_OP_FLUSH ? req->count != 0
+                                        : req->count == 0 || req->lba + req->count > q->dev->sectors ||
+                                          (req->op != BLK_OP_DISCARD && req->count > q->dev->max_sectors);
+  if (bad) {
+    blk_request_complete(req, 0);
+    return 1;
+  }
+
+  req->next = NULL;
+  uint8_t hazard = blkq_has_hazard(q, req);
+  if (hazard || !blkq_merge(q, req)) {
+    blkq_cmd_t* cmd = blkq_cmd_alloc(q);
+    if (!cmd) return 0;
+
+    if (blkq_is_ordered(req) || hazard) q->epoch++;
+    cmd->epoch = q->epoch;
+    cmd->drain = hazard;
+    if (hazard) q->hazards++;
+
+    cmd->dev_req.op = req->op;
+    cmd->dev_req.lba = req->lba;
+    cmd->dev_req.count = req->count;
+    cmd->dev_req.addr = req->addr;
+    cmd->dev_req.flags = req->flags;
+    cmd->deadline = rdtsc() + (req->op == BLK_OP_READ ? q->read_expire : q->write_expire);
+    cmd->members = req;
+    cmd->members_tail = req;
+    blkq_sorted_insert(q, cmd);
+  }
+
+  req->status = BLK_REQ_PENDING;
+  q->submitted++;
+  blkq_dispatch(q);
+  return 1;
+}
+
+static void blkq_tick(blk_device_t* dev) {
+  blkq_queue_t* q = (blkq_queue_t*)dev->ctx;
+  q->dev->tick(q->dev);
+
+  // the lower device may have been busy (or still initialising) at the last dispatch
+  blkq_dispatch(q);
+}
+
+static void blkq_idle(blk_device_t* dev) {
+  blkq_queue_t* q = (blkq_queue_t*)dev->ctx;
+  blk_device_idle(q->dev);
+}
+
+void blkq_init(blkq_queue_t* q, blk_device_t* lower) {
+  q->dev = lower;
+  q->free = NULL;
+  q->sorted = NULL;
+  q->flight = NULL;
+  q->read_expire = blk_us_to_tsc(BLKQ_READ_EXPIRE_US);
+  q->write_expire = blk_us_to_tsc(BLKQ_WRITE_EXPIRE_US);
+  q->head_pos = 0;
+  q->in_flight = 0;
+  q->epoch = 0;
+  q->barrier_busy = 0;
+  q->dispatching = 0;
+  q->submitted = 0;
+  q->merged = 0;
+  q->dispatched = 0;
+  q->expired = 0;
+  q->hazards = 0;
+
+  for (int i = BLKQ_POOL_SIZE - 1; i >= 0; i--) {
+    q->pool[i].queue = q;
+    blkq_cmd_free(q, &q->pool[i]);
+  }
+
+  blk_name_derive(q->name, sizeof(q->name), "q", lower);
+  q->blk.name = q->name;
+  q->blk.sectors = lower->sectors;
+  q->blk.max_sectors = lower->max_sectors;
+  q->blk.queue_depth = BLKQ_POOL_SIZE;
+  q->blk.submit = blkq_submit;
+  q->blk.tick = blkq_tick;
+  q->blk.idle = blkq_idle;
+  q->blk.map = NULL;
+  q->blk.ctx = q;
+}
+
+blk_device_t* blkq_device_get(blkq_queue_t* q) {
+  return &q->blk;
+}
+
+uint32_t blkq_pending_count(const blkq_queue_t* q) {
+  uint32_t n = 0;
+  for (const blkq_cmd_t* cmd = q->sorted; cmd; cmd = cmd->sort_next) n++;
+  return n;
+}
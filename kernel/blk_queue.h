@@ -0,0 +1,74 @@
+#pragma once
+#include "common.h"
+#include "blk.h"
+
+#define BLKQ_POOL_SIZE       64     // queued commands per queue (merged requests share one)
+
+// deadlines; expired commands jump the elevator
+#define BLKQ_READ_EXPIRE_US  50000
+#define BLKQ_WRITE_EXPIRE_US 500000
+
+struct blkq_queue_t;
+
+// one command for the lower device, covering one or more merged caller requests
+typedef struct blkq_cmd_t {
+  blk_request_t dev_req;             // what the lower device sees
+  blk_request_t* members;            // caller requests in LBA order, linked through ->next
+  blk_request_t* members_tail;
+  uint64_t deadline;                 // rdtsc() value after which it is dispatched first
+  uint64_t epoch;                    // barriers submitted before it (a barrier opens its own epoch)
+  uint8_t drain;                     // overlaps an earlier command, see usage 5)
+  struct blkq_cmd_t* sort_next;      // pending list, ascending LBA (also the pool and in-flight lists)
+  struct blkq_queue_t* queue;
+} blkq_cmd_t;
+
+typedef struct blkq_queue_t {
+  blk_device_t* dev;                 // lower device
+  blk_device_t blk;                  // the queue itself
+  char name[12];
+
+  blkq_cmd_t pool[BLKQ_POOL_SIZE];
+  blkq_cmd_t* free;
+
+  blkq_cmd_t* sorted;                // pending, ascending LBA
+  blkq_cmd_t* flight;                // at the lower device, linked through sort_next
+  uint64_t read_expire;              // BLKQ_*_EXPIRE_US in TSC cycles
+  uint64_t write_expire;
+
+  uint64_t head_pos;                 // LBA just past the last dispatched command (C-LOOK sweep)
+  uint32_t in_flight;
+  uint64_t epoch;                    // newest epoch, bumped by every barrier and hazard
+  uint8_t barrier_busy;              // a barrier (or discard) is at the lower device, nothing else may go
+  uint8_t dispatching;               // lower submit can complete synchronously, don't recurse
+
+  // stats
+  uint64_t submitted;
+  uint64_t merged;
+  uint64_t dispatched;
+  uint64_t expired;
+  uint64_t hazards;                  // requests held back behind an overlapping one
+} blkq_queue_t;
+
+// request queue usage:
+// 1) blkq_init(&q, lower) wraps a backend (ata0, ahci0, vblkq0, ...) once its init finished
+// 2) blk_device_register(blkq_device_get(&q)) instead of the lower device;
+//    the queue's tick also ticks the lower device
+// 3) submit blk_request_t's to the queue; it sorts them with a C-LOOK elevator,
+//    lets requests older than their deadline go first, and merges requests
+//    that are adjacent on disk and in memory into one command.
+//    when the lower device completes a command the next one is dispatched
+//    straight from that completion.
+// 4) barriers (FLUSH, PREFLUSH) split the stream into epochs: nothing merges or
+//    is reordered across one, a barrier goes out alone once everything before
+//    it completed, and what follows waits for it. FUA writes need no ordering.
+//    DISCARDs are ordered the same way (without flushing anything) and never merge.
+// 5) a request overlapping a pending or in-flight one where either is a write
+//    (read after write, write after read or write) opens a new epoch and goes
+//    out once everything before it completed, so the lower device can't
+//    reorder the two. overlapping reads are not held back
+void blkq_init(blkq_queue_t* q, blk_device_t* lower);
+
+blk_device_t* blkq_device_get(blkq_queue_t* q);
+
+// pending (not yet dispatched) commands
+uint32_t blkq_pending_count(const blkq_queue_t* q);
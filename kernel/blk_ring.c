@@ -0,0 +1,235 @@
+#include "blk_ring.h"
+#include "common.h"
+#include "mem.h"
+#include "pmm.h"
+
+static void blk_ring_cqe_post(blk_ring_t* ring, uint64_t user_data, int32_t res) {
+  blk_ring_shared_t* sh = ring->shared;
+  blk_ring_cqe_t* cqe = &sh->cqes[sh->cq_tail & (BLK_RING_CQ_ENTRIES - 1)];
+  cqe->user_data = user_data;
+  cqe->res = res;
+  cqe->rsvd = 0;
+
+  // entry before index: a reader that sees the new tail sees the entry
+  compiler_barrier();
+  sh->cq_tail = sh->cq_tail + 1;
+  ring->completed++;
+}
+
+static void blk_ring_slot_free(blk_ring_t* ring, blk_ring_slot_t* slot) {
+  slot->next = ring->free;
+  ring->free = slot;
+  ring->in_flight--;
+}
+
+static void blk_ring_kick(blk_ring_t* ring);
+
+static void blk_ring_slot_done(blk_request_t* req) {
+  blk_ring_slot_t* slot = (blk_ring_slot_t*)req->priv;
+  blk_ring_t* ring = slot->ring;
+
+  blk_ring_cqe_post(ring, slot->user_data, req->status == BLK_REQ_DONE ? BLK_RING_RES_OK : BLK_RING_RES_EIO);
+  blk_ring_slot_free(ring, slot);
+
+  // the slot is free again: keep the device busy
+  blk_ring_kick(ring);
+}
+
+// fills slot->req from sqe, the kernel's copy of the entry (the client may rewrite
+// the shared one meanwhile). 0 if it is malformed or its buffer range is not all
+// inside a registered buffer
+static uint8_t blk_ring_slot_fill(blk_ring_t* ring, blk_ring_slot_t* slot, const blk_ring_sqe_t* sqe) {
+  slot->req.op = (blk_op_t)sqe->op;
+  slot->req.lba = sqe->lba;
+  slot->req.count = sqe->count;
+  slot->req.addr = NULL;
+  slot->req.flags = sqe->flags;
+
+  if (sqe->op > BLK_OP_DISCARD || (sqe->flags & BLK_REQ_F_SG)) return 0;
+  if (sqe->op == BLK_OP_FLUSH) return sqe->count == 0;
+  if (sqe->count == 0) return 0;
+
+  if (sqe->op == BLK_OP_DISCARD) {
+    slot->range.lba = sqe->lba;
+    slot->range.count = sqe->count;
+    slot->list.ranges = &slot->range;
+    slot->list.count = 1;
+    slot->req.addr = &slot->list;
+    return 1;
+  }
+
+  if (sqe->buf >= BLK_RING_BUFS) return 0;
+  uint64_t size = ring->buf_bytes[sqe->buf];
+  uint64_t bytes = (uint64_t)sqe->count * BLK_SECTOR_SIZE;
+  if (sqe->buf_offset > size || bytes > size - sqe->buf_offset) return 0;
+  slot->req.addr = (void*)(uintptr_t)(ring->buf_phys[sqe->buf] + HHDM_OFFSET + sqe->buf_offset);
+  return 1;
+}
+
+// free slots that are sure to find room in the CQ when they complete
+static uint8_t blk_ring_can_take(const blk_ring_t* ring) {
+  const blk_ring_shared_t* sh = ring->shared;
+  uint32_t cq_used = sh->cq_tail - sh->cq_head;
+  return ring->free && cq_used + ring->in_flight < BLK_RING_CQ_ENTRIES;
+}
+
+// refused slots first (in order), then whatever was published since
+static void blk_ring_kick(blk_ring_t* ring) {
+  if (ring->kicking) return;
+  ring->kicking = 1;
+
+  while (ring->backlog) {
+    blk_ring_slot_t* slot = ring->backlog;
+
+    // unlinked first, the device may complete (and free) it before submit returns
+    ring->backlog = slot->next;
+    if (!ring->backlog) ring->backlog_tail = NULL;
+
+    if (!ring->dev->submit(ring->dev, &slot->req)) {
+      slot->next = ring->backlog;
+      ring->backlog = slot;
+      if (!ring->backlog_tail) ring->backlog_tail = slot;
+      ring->kicking = 0;
+      return;
+    }
+  }
+
+  blk_ring_shared_t* sh = ring->shared;
+  while (sh->sq_head != sh->sq_tail && blk_ring_can_take(ring)) {
+    // index before entry. the entry is read once, into sqe: checks and the request
+    // only use that copy, so the client can't change it between the two
+    compiler_barrier();
+    blk_ring_sqe_t sqe = sh->sqes[sh->sq_head & (BLK_RING_SQ_ENTRIES - 1)];
+
+    // the entry was copied, the client may reuse it
+    compiler_barrier();
+    sh->sq_head = sh->sq_head + 1;
+    ring->submitted++;
+
+    blk_ring_slot_t* slot = ring->free;
+    ring->free = slot->next;
+    ring->in_flight++;
+
+    slot->user_data = sqe.user_data;
+    uint8_t valid = blk_ring_slot_fill(ring, slot, &sqe);
+    slot->req.status = BLK_REQ_PENDING;
+    slot->req.done = blk_ring_slot_done;
+    slot->req.priv = slot;
+    slot->next = NULL;
+
+    if (!valid) {
+      blk_ring_cqe_post(ring, slot->user_data, BLK_RING_RES_EINVAL);
+      blk_ring_slot_free(ring, slot);
+      continue;
+    }
+    if (!ring->dev->submit(ring->dev, &slot->req)) {
+      ring->backlog = slot;
+      ring->backlog_tail = slot;
+      break;
+    }
+  }
+
+  ring->kicking = 0;
+}
+
+uint8_t blk_ring_init(blk_ring_t* ring, blk_device_t* dev) {
+  phys_addr_t frame = pmm_frame_alloc();
+  if (frame == PMM_INVALID_FRAME) return 0;
+
+  ring->dev = dev;
+  ring->shared_phys = frame;
+  ring->shared = (blk_ring_shared_t*)(frame + HHDM_OFFSET);
+  ring->free = NULL;
+  ring->backlog = NULL;
+  ring->backlog_tail = NULL;
+  ring->in_flight = BLK_RING_SQ_ENTRIES;    // counted back down by blk_ring_slot_free
+  ring->kicking = 0;
+  ring->submitted = 0;
+  ring->completed = 0;
+  ring->doorbells = 0;
+  for (uint32_t i = 0; i < BLK_RING_BUFS; i++) {
+    ring->buf_phys[i] = 0;
+    ring->buf_bytes[i] = 0;
+  }
+
+  for (uint32_t i = 0; i < BLK_RING_SQ_ENTRIES; i++) {
+    ring->slots[i].ring = ring;
+    blk_ring_slot_free(ring, &ring->slots[i]);
+  }
+
+  mem_zero(ring->shared, sizeof(blk_ring_shared_t));
+  ring->shared->sq_entries = BLK_RING_SQ_ENTRIES;
+  ring->shared->cq_entries = BLK_RING_CQ_ENTRIES;
+  return 1;
+}
+
+uint16_t blk_ring_buffer_register(blk_ring_t* ring, phys_addr_t phys, uint64_t bytes) {
+  if (bytes == 0) return BLK_RING_BUF_INVALID;
+  for (uint16_t i = 0; i < BLK_RING_BUFS; i++) {
+    if (ring->buf_bytes[i]) continue;
+    ring->buf_phys[i] = phys;
+    ring->buf_bytes[i] = bytes;
+    return i;
+  }
+  return BLK_RING_BUF_INVALID;
+}
+
+// entries already taken off the SQ keep their address: unregister once they completed
+void blk_ring_buffer_unregister(blk_ring_t* ring, uint16_t index) {
+  if (index < BLK_RING_BUFS) ring->buf_bytes[index] = 0;
+}
+
+blk_ring_sqe_t* blk_ring_sqe_at(blk_ring_shared_t* sh, uint32_t index) {
+  uint32_t tail = sh->sq_tail + index;
+  if (tail - sh->sq_head >= sh->sq_entries) return NULL;
+  return &sh->sqes[tail & (sh->sq_entries - 1)];
+}
+
+void blk_ring_sq_publish(blk_ring_shared_t* sh, uint32_t n) {
+  // entries before index
+  compiler_barrier();
+  sh->sq_tail = sh->sq_tail + n;
+}
+
+uint32_t blk_ring_reap(blk_ring_shared_t* sh, blk_ring_cqe_t* out, uint32_t max) {
+  uint32_t n = 0;
+  uint32_t head = sh->cq_head;
+  uint32_t tail = sh->cq_tail;
+
+  // index before entries
+  compiler_barrier();
+  while (n < max && head != tail) {
+    out[n++] = sh->cqes[head & (sh->cq_entries - 1)];
+    head++;
+  }
+
+  // entries copied before the kernel may reuse them
+  compiler_barrier();
+  sh->cq_head = head;
+  return n;
+}
+
+uint32_t blk_ring_enter(blk_ring_t* ring, uint32_t min_complete) {
+  blk_ring_shared_t* sh = ring->shared;
+  uint64_t before = ring->submitted;
+
+  if (sh->sq_head != sh->sq_tail || ring->backlog) ring->doorbells++;
+  blk_ring_kick(ring);
+
+  // more than the CQ can hold would never arrive
+  if (min_complete > BLK_RING_CQ_ENTRIES) min_complete = BLK_RING_CQ_ENTRIES;
+  while (sh->cq_tail - sh->cq_head < min_complete) {
+    // nothing in flight and nothing left to take: no completion will come
+    if (ring->in_flight == 0 && (sh->sq_head == sh->sq_tail || !blk_ring_can_take(ring))) break;
+
+    ring->dev->tick(ring->dev);
+    blk_ring_kick(ring);
+    if (sh->cq_tail - sh->cq_head >= min_complete) break;
+    blk_device_idle(ring->dev);
+  }
+  return (uint32_t)(ring->submitted - before);
+}
+
+void blk_ring_tick(blk_ring_t* ring) {
+  blk_ring_kick(ring);
+}
@@ -0,0 +1,123 @@
+#pragma once
+#include "common.h"
+#include "blk.h"
+
+// both rings and their indices share one frame (see blk_ring_shared_t)
+#define BLK_RING_SQ_ENTRIES   32        // power of two
+#define BLK_RING_CQ_ENTRIES   64        // power of two, >= SQ entries
+#define BLK_RING_BUFS         16        // registered buffers per ring
+#define BLK_RING_BUF_INVALID  0xFFFF
+
+// completion results
+#define BLK_RING_RES_OK       0
+#define BLK_RING_RES_EIO      (-1)      // the device failed the request
+#define BLK_RING_RES_EINVAL   (-2)      // malformed entry, never reached the device
+
+// submission entry, written by the client. fixed-size fields only, so the layout is
+// the same for anyone mapping the frame. no addresses: data lands in a buffer the
+// kernel registered for the ring, checked against its bounds on every entry
+typedef struct blk_ring_sqe_t {
+  uint8_t op;                           // blk_op_t
+  uint8_t rsvd;
+  uint16_t buf;                         // registered buffer index (READ / WRITE)
+  uint32_t count;                       // sectors; a DISCARD frees [lba, lba + count)
+  uint64_t lba;
+  uint32_t buf_offset;                  // bytes into the buffer
+  uint32_t flags;                       // BLK_REQ_F_*, not SG
+  uint64_t user_data;                   // handed back untouched in the completion
+} blk_ring_sqe_t;
+
+// completion entry, written by the kernel
+typedef struct blk_ring_cqe_t {
+  uint64_t user_data;
+  int32_t res;                          // BLK_RING_RES_*
+  uint32_t rsvd;
+} blk_ring_cqe_t;
+
+// the shared frame. each index has a single writer: the client moves sq_tail and
+// cq_head, the kernel sq_head and cq_tail. indices run freely and are masked on use
+typedef struct blk_ring_shared_t {
+  volatile uint32_t sq_head;
+  volatile uint32_t sq_tail;
+  volatile uint32_t cq_head;
+  volatile uint32_t cq_tail;
+  uint32_t sq_entries;
+  uint32_t cq_entries;
+  uint32_t rsvd[2];
+
+  blk_ring_sqe_t sqes[BLK_RING_SQ_ENTRIES];
+  blk_ring_cqe_t cqes[BLK_RING_CQ_ENTRIES];
+} blk_ring_shared_t;
+
+struct blk_ring_t;
+
+// one submission the device holds (or refused for now)
+typedef struct blk_ring_slot_t {
+  blk_request_t req;
+  blk_discard_range_t range;            // a DISCARD's one range
+  blk_discard_list_t list;
+  uint64_t user_data;
+  struct blk_ring_t* ring;
+  struct blk_ring_slot_t* next;         // free list / backlog
+} blk_ring_slot_t;
+
+typedef struct blk_ring_t {
+  blk_device_t* dev;
+  blk_ring_shared_t* shared;            // HHDM view of the frame
+  phys_addr_t shared_phys;              // for mapping it somewhere else later
+
+  // physically contiguous, phys + HHDM_OFFSET is what the device gets
+  phys_addr_t buf_phys[BLK_RING_BUFS];
+  uint64_t buf_bytes[BLK_RING_BUFS];    // 0 = free index
+
+  blk_ring_slot_t slots[BLK_RING_SQ_ENTRIES];
+  blk_ring_slot_t* free;
+  blk_ring_slot_t* backlog;             // taken off the SQ, device refused: retried first, FIFO
+  blk_ring_slot_t* backlog_tail;
+  uint32_t in_flight;                   // slots not completed yet (backlog included)
+  uint8_t kicking;
+
+  // stats
+  uint64_t submitted;                   // entries taken off the SQ
+  uint64_t completed;                   // entries posted to the CQ
+  uint64_t doorbells;                   // blk_ring_enter calls that found work
+} blk_ring_t;
+
+// ring usage:
+// 1) blk_ring_init(&ring, dev) after pmm, dev is any block device (usually the top
+//    of a stack: readahead / cache / queue)
+// 2) blk_ring_buffer_register(&ring, phys, bytes) for each buffer the client does
+//    I/O through; entries name it by the index it returns
+// 3) producers fill entries: sqe = blk_ring_sqe_at(ring.shared, i) for i = 0..n-1,
+//    then blk_ring_sq_publish(ring.shared, n) makes the batch visible
+// 4) blk_ring_enter(&ring, 0) is the doorbell: every published entry goes to the
+//    device at once. with min_complete > 0 it also ticks / idles the device until
+//    that many completions are waiting
+// 5) blk_ring_reap(ring.shared, cqes, max) takes completions in batches; each one
+//    carries its entry's user_data. completions are in finishing order
+// entries are only taken off the SQ while their completion is sure to fit the CQ,
+// so the CQ never overflows: reap to keep the SQ moving. single CPU, producers
+// must not interleave steps 3 (no locking on the client side). an entry naming
+// an unregistered buffer, or reaching past its end, completes with EINVAL
+// returns 0 if the ring frame could not be allocated
+uint8_t blk_ring_init(blk_ring_t* ring, blk_device_t* dev);
+
+// bytes of physically contiguous RAM at phys, returns its index or
+// BLK_RING_BUF_INVALID if all are taken
+uint16_t blk_ring_buffer_register(blk_ring_t* ring, phys_addr_t phys, uint64_t bytes);
+void blk_ring_buffer_unregister(blk_ring_t* ring, uint16_t index);
+
+// client side, touching only the shared frame
+// index-th entry past the published tail, NULL if the SQ has no room for it
+blk_ring_sqe_t* blk_ring_sqe_at(blk_ring_shared_t* sh, uint32_t index);
+void blk_ring_sq_publish(blk_ring_shared_t* sh, uint32_t n);
+// copies up to max completions to out and hands their CQ entries back, returns how many
+uint32_t blk_ring_reap(blk_ring_shared_t* sh, blk_ring_cqe_t* out, uint32_t max);
+
+// kernel side: submits everything published, then waits for min_complete
+// completions to be reapable. returns entries taken off the SQ
+uint32_t blk_ring_enter(blk_ring_t* ring, uint32_t min_complete);
+
+// retries refused entries and picks up newly published ones without a doorbell
+// (call every kernel loop, like blk_tick_all)
+void blk_ring_tick(blk_ring_t* ring);
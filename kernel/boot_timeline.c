@@ -0,0 +1,60 @@
+#include "boot_timeline.h"
+#include "common.h"
+#include "serial.h"
+
+static const char* const g_boot_stamp_names[BOOT_STAMP_COUNT] = {
+    [BOOT_STAMP_BOOT1]       = "boot1",
+    [BOOT_STAMP_BOOT2]       = "boot2",
+    [BOOT_STAMP_LOADER_READ] = "boot2: kernelLoader read",
+    [BOOT_STAMP_E820]        = "boot2: e820",
+    [BOOT_STAMP_VBE]         = "boot2: vbe",
+    [BOOT_STAMP_LONG_MODE]   = "boot2: long mode",
+    [BOOT_STAMP_KEXEC]       = "kexec: previous kernel",
+    [BOOT_STAMP_LOADER]      = "kernelLoader",
+    [BOOT_STAMP_KERNEL_READ] = "kernelLoader: kernel loaded",
+    [BOOT_STAMP_INITRD_READ] = "kernelLoader: initrd loaded",
+    [BOOT_STAMP_RESUME]      = "kernelLoader: hibernation image restored",
+    [BOOT_STAMP_KERNEL]      = "kmain",
+    [BOOT_STAMP_BSS]         = "kmain: bss cleared",
+    [BOOT_STAMP_PMM]         = "kmain: pmm_init",
+    [BOOT_STAMP_VMM]         = "kmain: vmm_init",
+    [BOOT_STAMP_READY]       = "kmain: init done",
+};
+
+static uint64_t boot_timeline_us(uint64_t cycles, uint64_t tsc_hz) {
+    // split so cycles * 1000000 can't overflow
+    return cycles / tsc_hz * 1000000 + cycles % tsc_hz * 1000000 / tsc_hz;
+}
+
+void boot_timeline_print(const boot_info_t* bi, uint64_t tsc_hz) {
+    if (tsc_hz == 0) {
+        serial_write("boot timeline: TSC not calibrated\n");
+        return;
+    }
+
+    // steps run in id order; a missing one (older stage) is skipped
+    uint64_t first = 0;
+    uint64_t prev = 0;
+    serial_write("boot timeline (us since the first step, +us since previous step):\n");
+    for (uint32_t i = 0; i < BOOT_STAMP_COUNT; i++) {
+        uint64_t t = bi->stamps[i];
+        if (t == 0) continue;
+        if (first == 0) first = prev = t;
+
+        serial_write("  ");
+        serial_write_dec(boot_timeline_us(t - first, tsc_hz));
+        serial_write(" +");
+        serial_write_dec(boot_timeline_us(t - prev, tsc_hz));
+        serial_write("  ");
+        serial_write(g_boot_stamp_names[i]);
+        serial_write("\n");
+        prev = t;
+    }
+
+    // a warm restart's timeline starts in the previous kernel, at kexec_load
+    if (bi->stamps[BOOT_STAMP_KEXEC] && bi->stamps[BOOT_STAMP_READY]) {
+        serial_write("kexec restart: ");
+        serial_write_dec(boot_timeline_us(bi->stamps[BOOT_STAMP_READY] - bi->stamps[BOOT_STAMP_KEXEC], tsc_hz));
+        serial_write(" us from kexec_load to init done\n");
+    }
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "common.h"
+
+// boot timeline usage:
+// stages stamp bootinfo->stamps[] with boot_stamp() as they pass each step
+// (boot1 / boot2 in assembly, the loader and kmain in C). once the serial port
+// is up, boot_timeline_print(bootinfo, tsc_hz) writes one line per step reached:
+// time since boot1 and since the previous step, in microseconds
+void boot_timeline_print(const boot_info_t* bi, uint64_t tsc_hz);
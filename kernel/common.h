@@ -13,6 +13,8 @@ typedef unsigned short uint16_t;
 typedef unsigned int   uint32_t;
 typedef unsigned long  uint64_t;
 typedef unsigned char  uint8_t;
+typedef long           int64_t;
+typedef int            int32_t;
 typedef uint64_t uintptr_t;
 typedef uintptr_t virt_addr_t;
 typedef uint64_t phys_addr_t;
@@ -26,6 +28,31 @@ typedef struct e820_entry_t {
 
 #define E820_MAX 64
 
+// boot timeline: rdtsc() at each step, indexed by id, 0 = never reached.
+// boot2.asm has the same ids (BOOT_STAMP_*)
+typedef enum boot_stamp_t {
+    BOOT_STAMP_BOOT1 = 0,       // boot1 entry (parked at BOOT1_STAMP_ADDR for boot2)
+    BOOT_STAMP_BOOT2,           // boot2 entry
+    BOOT_STAMP_LOADER_READ,     // kernelLoader read from disk
+    BOOT_STAMP_E820,
+    BOOT_STAMP_VBE,
+    BOOT_STAMP_LONG_MODE,       // boot2 in long mode, jumping to the loader
+    BOOT_STAMP_KEXEC,           // warm reload: the previous kernel started loading this one
+    BOOT_STAMP_LOADER,          // kernelLoader kmain
+    BOOT_STAMP_KERNEL_READ,     // kernel image loaded
+    BOOT_STAMP_INITRD_READ,     // initrd loaded (if the manifest has one)
+    BOOT_STAMP_RESUME,          // hibernation image restored, jumping back into the kernel
+    BOOT_STAMP_KERNEL,          // kernel kmain
+    BOOT_STAMP_BSS,
+    BOOT_STAMP_PMM,
+    BOOT_STAMP_VMM,
+    BOOT_STAMP_READY,           // every kmain init step settled
+    BOOT_STAMP_COUNT
+} boot_stamp_t;
+
+#define BOOT_STAMP_MAX   16
+#define BOOT1_STAMP_ADDR 0x500
+
 typedef struct boot_info_t {
     uint16_t   e820_count;
     e820_entry_t e820_map[E820_MAX];
@@ -37,13 +64,23 @@ typedef struct boot_info_t {
     uint8_t  vbe_bpp;
     uint8_t  _pad;        // implicit alignment fix (matches ASM align 4)
     uint32_t vbe_fb;
+
+    uint64_t tsc_hz;      // kernelLoader's TSC calibration, 0 if it had none
+    uint64_t stamps[BOOT_STAMP_MAX];  // boot timeline, see boot_stamp_t
+
+    uint64_t initrd_phys; // set by the kernelLoader, 0 = no initrd
+    uint64_t initrd_size; // bytes
 }__attribute__((packed)) boot_info_t;
 
+// port I/O, from io_wrapper.asm. a host build (-DKERNEL_HOST, see below) keeps these
+// declarations and links its own definitions instead, e.g. a simulated ATA device
 // arg 1 goes to rdi, arg 2 to rsi, arg 3 to rdx
 extern void outb(uint16_t port, uint8_t value);
 extern uint8_t inb(uint16_t port);
 extern void outw(uint16_t port, uint16_t value);
 extern uint16_t inw(uint16_t port);
+extern void outl(uint16_t port, uint32_t value);
+extern uint32_t inl(uint16_t port);
 extern void outsw(uint16_t port, const void* addr, uint32_t count);
 extern void insw(uint16_t port, void* addr, uint32_t count);
 
@@ -58,9 +95,69 @@ __attribute__((no_caller_saved_registers)) void outsw_irq(uint16_t port, const v
 #define PAGE_MASK  (PAGE_SIZE - 1)
 #define VGA_ADDR 0xB8000ULL; 
 #define UINT64_MAX ((uint64_t)0xFFFFFFFFFFFFFFFFULL)
+#define UINT32_MAX ((uint32_t)0xFFFFFFFFu)
 
+#ifdef KERNEL_HOST
+#define HHDM_OFFSET 0ULL                  // host build: the model's "RAM" is plain memory
+#else
 #define HHDM_OFFSET 0xFFFF800000000000ULL
+#endif
 #define GIB_SIZE    (1ULL << 30)
 #define PS_BIT      (1ULL << 7) // Page Size bit
 
 #define NULL ((void*)0)
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#define RFLAGS_IF (1ULL << 9)
+
+#ifdef KERNEL_HOST
+// host build: drivers compiled as a user-space program against a device model.
+// cli / sti / hlt would fault there, the model provides these instead (it decides
+// when its "IRQ handlers" run, and what waiting for one means)
+uint64_t host_irq_save(void);
+void host_irq_restore(uint64_t flags);
+void host_wait_for_irq(void);
+
+static inline uint64_t irq_save(void) { return host_irq_save(); }
+static inline void irq_restore(uint64_t flags) { host_irq_restore(flags); }
+static inline void cpu_wait_for_irq(void) { host_wait_for_irq(); }
+static inline void irq_enable(void) { host_irq_restore(RFLAGS_IF); }
+#else
+// masks interrupts, returns the previous RFLAGS for irq_restore
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ __volatile__("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & RFLAGS_IF) __asm__ __volatile__("sti" ::: "memory");
+}
+
+// sti, once every vector the PIC may deliver to has its IDT gate
+static inline void irq_enable(void) {
+    __asm__ __volatile__("sti" ::: "memory");
+}
+
+// sleeps until the next interrupt. call with interrupts masked after checking
+// there is nothing to do: sti only takes effect after hlt, so no IRQ slips in between
+static inline void cpu_wait_for_irq(void) {
+    __asm__ __volatile__("sti; hlt" ::: "memory");
+}
+#endif
+
+static inline void cpu_relax(void) {
+    __asm__ __volatile__("pause" ::: "memory");
+}
+
+static inline void boot_stamp(boot_info_t* bi, boot_stamp_t id) {
+    bi->stamps[id] = rdtsc();
+}
+
+// keeps the compiler from moving memory accesses across a device doorbell write
+#define compiler_barrier() __asm__ __volatile__("" ::: "memory")
@@ -0,0 +1,260 @@
+#include "discard.h"
+#include "common.h"
+
+static inline uint64_t discard_end(const blk_discard_range_t* r) {
+  return r->lba + r->count;
+}
+
+static void discard_pending_remove(discard_queue_t* dq, uint32_t at, uint32_t n) {
+  for (uint32_t i = at; i + n < dq->pending_count; i++) dq->pending[i] = dq->pending[i + n];
+  dq->pending_count -= n;
+}
+
+static uint8_t discard_pending_make_room(discard_queue_t* dq, uint32_t at) {
+  if (dq->pending_count == DISCARD_MAX_EXTENTS) return 0;
+  for (uint32_t i = dq->pending_count; i > at; i--) dq->pending[i] = dq->pending[i - 1];
+  dq->pending_count++;
+  return 1;
+}
+
+// adds lba..end to the pending set, joined with every extent it overlaps or touches.
+// returns 0 if it needs a slot and there is none, or the union gets too big for one range
+static uint8_t discard_extent_insert(discard_queue_t* dq, uint64_t lba, uint64_t end) {
+  blk_discard_range_t* p = dq->pending;
+
+  // first extent reaching lba, then every one up to end
+  uint32_t first = 0;
+  while (first < dq->pending_count && discard_end(&p[first]) < lba) first++;
+  uint32_t last = first;
+  uint64_t absorbed = 0;
+  uint64_t start = lba;
+  uint64_t stop = end;
+  while (last < dq->pending_count && p[last].lba <= end) {
+    if (p[last].lba < start) start = p[last].lba;
+    if (discard_end(&p[last]) > stop) stop = discard_end(&p[last]);
+    absorbed += p[last].count;
+    last++;
+  }
+  if (stop - start > UINT32_MAX) return 0;
+
+  if (last == first) {
+    if (!discard_pending_make_room(dq, first)) return 0;
+  } else {
+    discard_pending_remove(dq, first + 1, last - first - 1);
+    dq->merged++;
+  }
+
+  if (dq->pending_count == 1 && last == first) dq->pending_since = rdtsc();
+  p[first].lba = start;
+  p[first].count = (uint32_t)(stop - start);
+  dq->pending_sectors += p[first].count - absorbed;
+  return 1;
+}
+
+// lba..end is in use again: take it off the pending extents
+static void discard_extent_cancel(discard_queue_t* dq, uint64_t lba, uint64_t end) {
+  blk_discard_range_t* p = dq->pending;
+
+  uint32_t i = 0;
+  while (i < dq->pending_count && p[i].lba < end) {
+    uint64_t e_end = discard_end(&p[i]);
+    if (e_end <= lba) { i++; continue; }
+
+    uint64_t cut_lo = p[i].lba > lba ? p[i].lba : lba;
+    uint64_t cut_hi = e_end < end ? e_end : end;
+    dq->cancelled += cut_hi - cut_lo;
+    dq->pending_sectors -= cut_hi - cut_lo;
+
+    if (p[i].lba < lba && e_end > end) {
+      // hole in the middle: the tail needs its own slot, without one it is lost
+      if (discard_pending_make_room(dq, i + 1)) {
+        p[i + 1].lba = end;
+        p[i + 1].count = (uint32_t)(e_end - end);
+      } else {
+        dq->dropped += e_end - end;
+        dq->pending_sectors -= e_end - end;
+      }
+      p[i].count = (uint32_t)(lba - p[i].lba);
+      return;
+    }
+    if (p[i].lba < lba) {
+      p[i].count = (uint32_t)(lba - p[i].lba);
+      i++;
+    } else if (e_end > end) {
+      p[i].lba = end;
+      p[i].count = (uint32_t)(e_end - end);
+      i++;
+    } else {
+      discard_pending_remove(dq, i, 1);
+    }
+  }
+}
+
+static uint8_t discard_inflight_overlaps(const discard_queue_t* dq, uint64_t lba, uint64_t end) {
+  if (!dq->busy || lba >= dq->req.lba + dq->req.count || end <= dq->req.lba) return 0;
+  for (uint32_t i = 0; i < dq->list.count; i++) {
+    const blk_discard_range_t* r = &dq->inflight[i];
+    if (lba < discard_end(r) && r->lba < end) return 1;
+  }
+  return 0;
+}
+
+static uint8_t discard_is_due(const discard_queue_t* dq) {
+  return dq->flushing || dq->pending_count >= DISCARD_BATCH_EXTENTS ||
+         dq->pending_sectors >= DISCARD_BATCH_SECTORS ||
+         (int64_t)(rdtsc() - dq->pending_since) >= (int64_t)dq->delay;
+}
+
+static void discard_done(blk_request_t* req);
+
+// sends the pending extents as one DISCARD once they are due and none is in flight
+static void discard_kick(discard_queue_t* dq) {
+  if (dq->kicking) return;
+  dq->kicking = 1;
+
+  while (!dq->busy && dq->pending_count && discard_is_due(dq)) {
+    // as many extents as one request's count can span
+    uint64_t first = dq->pending[0].lba;
+    uint32_t n = 0;
+    uint64_t sectors = 0;
+    while (n < dq->pending_count && discard_end(&dq->pending[n]) - first <= UINT32_MAX) {
+      dq->inflight[n] = dq->pending[n];
+      sectors += dq->pending[n].count;
+      n++;
+    }
+
+    // unlinked first, the lower device may complete it before submit returns
+    discard_pending_remove(dq, 0, n);
+    dq->pending_sectors -= sectors;
+    dq->pending_since = rdtsc();
+
+    dq->list.ranges = dq->inflight;
+    dq->list.count = n;
+    dq->req.op = BLK_OP_DISCARD;
+    dq->req.lba = first;
+    dq->req.count = (uint32_t)(discard_end(&dq->inflight[n - 1]) - first);
+    dq->req.addr = &dq->list;
+    dq->req.flags = 0;
+    dq->req.status = BLK_REQ_PENDING;
+    dq->req.done = discard_done;
+    dq->req.priv = dq;
+    dq->busy = 1;
+
+    if (!dq->dev->submit(dq->dev, &dq->req)) {
+      // lower device is full: back on the list (the slots just freed are enough)
+      dq->busy = 0;
+      for (uint32_t i = 0; i < n; i++) {
+        discard_extent_insert(dq, dq->inflight[i].lba, discard_end(&dq->inflight[i]));
+      }
+      break;
+    }
+
+    dq->issued++;
+    dq->issued_sectors += sectors;
+  }
+
+  if (!dq->busy && dq->pending_count == 0) dq->flushing = 0;
+  dq->kicking = 0;
+}
+
+static void discard_done(blk_request_t* req) {
+  discard_queue_t* dq = (discard_queue_t*)req->priv;
+
+  // only a hint: nothing to retry
+  if (req->status != BLK_REQ_DONE) dq->errors++;
+  dq->busy = 0;
+  discard_kick(dq);
+}
+
+void discard_queue_add(discard_queue_t* dq, uint64_t lba, uint64_t count) {
+  uint64_t sectors = dq->dev->sectors;
+  if (count == 0 || lba >= sectors) return;
+  if (count > sectors - lba) count = sectors - lba;
+
+  dq->added++;
+  if (!discard_extent_insert(dq, lba, lba + count)) {
+    // full: send what is there and try once more, otherwise let this one go
+    dq->flushing = 1;
+    discard_kick(dq);
+    if (!discard_extent_insert(dq, lba, lba + count)) dq->dropped += count;
+  }
+  discard_kick(dq);
+}
+
+static uint8_t discard_submit(blk_device_t* dev, blk_request_t* req) {
+  discard_queue_t* dq = (discard_queue_t*)dev->ctx;
+
+  // absorbed: the extents go out with the next batch
+  if (req->op == BLK_OP_DISCARD) {
+    const blk_discard_list_t* list = (const blk_discard_list_t*)req->addr;
+    if (!list || req->lba + req->count > dev->sectors) {
+      blk_request_complete(req, 0);
+      return 1;
+    }
+    for (uint32_t i = 0; i < list->count; i++) discard_queue_add(dq, list->ranges[i].lba, list->ranges[i].count);
+    blk_request_complete(req, 1);
+    return 1;
+  }
+
+  if (req->op == BLK_OP_WRITE) {
+    uint64_t end = req->lba + req->count;
+    if (discard_inflight_overlaps(dq, req->lba, end)) return 0;
+    discard_extent_cancel(dq, req->lba, end);
+  } else if (req->op == BLK_OP_FLUSH) {
+    dq->flushing = dq->pending_count != 0;
+    discard_kick(dq);
+  }
+  return dq->dev->submit(dq->dev, req);
+}
+
+static void discard_tick(blk_device_t* dev) {
+  discard_queue_t* dq = (discard_queue_t*)dev->ctx;
+  dq->dev->tick(dq->dev);
+  discard_kick(dq);
+}
+
+static void discard_idle(blk_device_t* dev) {
+  discard_queue_t* dq = (discard_queue_t*)dev->ctx;
+  blk_device_idle(dq->dev);
+}
+
+void discard_init(discard_queue_t* dq, blk_device_t* lower) {
+  dq->dev = lower;
+  dq->pending_count = 0;
+  dq->pending_sectors = 0;
+  dq->pending_since = 0;
+  dq->delay = blk_us_to_tsc(DISCARD_DELAY_US);
+  dq->list.ranges = dq->inflight;
+  dq->list.count = 0;
+  dq->busy = 0;
+  dq->flushing = 0;
+  dq->kicking = 0;
+  dq->added = 0;
+  dq->merged = 0;
+  dq->cancelled = 0;
+  dq->dropped = 0;
+  dq->issued = 0;
+  dq->issued_sectors = 0;
+  dq->errors = 0;
+
+  blk_name_derive(dq->name, sizeof(dq->name), "d", lower);
+  dq->blk.name = dq->name;
+  dq->blk.sectors = lower->sectors;
+  dq->blk.max_sectors = lower->max_sectors;
+  dq->blk.queue_depth = lower->queue_depth;
+  dq->blk.submit = discard_submit;
+  dq->blk.tick = discard_tick;
+  dq->blk.idle = discard_idle;
+  dq->blk.map = NULL;
+  dq->blk.ctx = dq;
+}
+
+blk_device_t* discard_device_get(discard_queue_t* dq) {
+  return &dq->blk;
+}
+
+uint32_t discard_flush(discard_queue_t* dq) {
+  dq->flushing = dq->pending_count != 0;
+  discard_kick(dq);
+  return dq->pending_count + dq->busy;
+}
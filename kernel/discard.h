@@ -0,0 +1,62 @@
+#pragma once
+#include "common.h"
+#include "blk.h"
+
+#define DISCARD_MAX_EXTENTS   256       // pending freed extents, after coalescing
+#define DISCARD_BATCH_EXTENTS 64        // issue once this many extents are pending,
+#define DISCARD_BATCH_SECTORS 65536     // or this many sectors (32 MiB),
+#define DISCARD_DELAY_US      2000000   // or the oldest is this old
+
+typedef struct discard_queue_t {
+  blk_device_t* dev;                    // lower device
+  blk_device_t blk;                     // the discard queue itself
+  char name[12];
+
+  // freed, not sent yet: sorted by lba, neither overlapping nor touching
+  blk_discard_range_t pending[DISCARD_MAX_EXTENTS];
+  uint32_t pending_count;
+  uint64_t pending_sectors;
+  uint64_t pending_since;               // rdtsc() when the first of the current set was added
+  uint64_t delay;                       // DISCARD_DELAY_US in TSC cycles
+
+  // the one DISCARD at the lower device
+  blk_discard_range_t inflight[DISCARD_MAX_EXTENTS];
+  blk_discard_list_t list;
+  blk_request_t req;
+  uint8_t busy;
+
+  uint8_t flushing;                     // send what is pending regardless of the batch size
+  uint8_t kicking;
+
+  // stats
+  uint64_t added;                       // extents handed in
+  uint64_t merged;                      // ... that joined a pending one
+  uint64_t cancelled;                   // sectors written again before their discard went out
+  uint64_t dropped;                     // sectors never sent (no room)
+  uint64_t issued;                      // DISCARD requests sent
+  uint64_t issued_sectors;
+  uint64_t errors;
+} discard_queue_t;
+
+// discard queue usage:
+// 1) discard_init(&dq, lower), lower is usually the buffer cache (which drops
+//    cached copies of discarded blocks) over a blk_queue over the disk
+// 2) blk_device_register(discard_device_get(&dq)), submit requests to it
+// 3) whoever frees blocks calls discard_queue_add(&dq, lba, count), or submits
+//    a DISCARD, which completes at once. freed extents are coalesced and sent
+//    as one DISCARD with a range list once enough of them piled up or the
+//    oldest waited DISCARD_DELAY_US; the device packs the list into as few
+//    TRIM commands as it can
+// 4) a write to a pending extent takes it (or that part of it) off the list;
+//    a write to the extents in flight is refused (retry) until they are done
+// 5) discard_flush(&dq) (or a FLUSH through the layer) sends everything
+//    pending now; tick until it returns 0
+void discard_init(discard_queue_t* dq, blk_device_t* lower);
+
+blk_device_t* discard_device_get(discard_queue_t* dq);
+
+// lba..lba+count is no longer in use. clipped to the device, ignored if empty
+void discard_queue_add(discard_queue_t* dq, uint64_t lba, uint64_t count);
+
+// starts sending every pending extent, returns how many are pending or in flight
+uint32_t discard_flush(discard_queue_t* dq);
@@ -0,0 +1,257 @@
+#include "hibernate.h"
+#include "common.h"
+#include "lz4_compress.h"
+#include "manifest.h"
+#include "mem.h"
+#include "pmm.h"
+
+// hibernate_entry.asm
+extern uint8_t hibernate_context_save(hib_context_t* ctx);
+extern void hibernate_resume_entry(void);
+
+#define HIB_BUFFER_BYTES  (HIB_BUFFER_FRAMES * PAGE_SIZE)
+#define HIB_CHUNK_BYTES   (HIB_CHUNK_FRAMES * PAGE_SIZE)
+#define HIB_STREAM_BYTES  (HIB_BUFFER_BYTES - HIB_CHUNK_BYTES)   // the rest holds the chunk being saved
+#define HIB_WRITE_SECTORS 2048          // per request (1 MiB), fewer if the device takes less
+
+typedef struct hib_state_t {
+  // set before the snapshot and left alone afterwards: the resumed kernel sees them as they were
+  hib_context_t ctx;
+  blk_device_t* dev;
+  const boot_info_t* bi;
+  phys_addr_t buffer;
+  uint8_t* buf;                 // HHDM view of buffer
+  manifest_entry_t area;
+  uint32_t boot2_sum;
+  uint32_t loader_sum;
+  uint32_t kernel_sum;
+  hib_run_t runs[HIB_RUNS_MAX];
+  uint32_t run_count;
+  uint64_t frames;
+  uint64_t irq_flags;
+
+  // the writer's, changing while frames are saved
+  uint64_t fill;                // bytes in buf
+  uint64_t lba;                 // where buf's first sector goes
+  uint64_t data_bytes;
+} hib_state_t;
+
+static hib_state_t g_hib;
+
+static inline uint8_t* hib_virt(phys_addr_t phys) {
+  return (uint8_t*)(phys + HHDM_OFFSET);
+}
+
+static uint8_t hib_io(blk_op_t op, uint64_t lba, uint32_t sectors, uint8_t* buf) {
+  blk_device_t* dev = g_hib.dev;
+  blk_request_t req;
+  while (sectors) {
+    uint32_t chunk = sectors < dev->max_sectors ? sectors : dev->max_sectors;
+    if (chunk > HIB_WRITE_SECTORS) chunk = HIB_WRITE_SECTORS;
+
+    req.op = op;
+    req.lba = lba;
+    req.count = chunk;
+    req.addr = buf;
+    req.flags = BLK_REQ_F_POLL;
+    req.done = NULL;
+    req.priv = NULL;
+    if (!blk_request_wait(dev, &req)) return 0;
+
+    lba += chunk;
+    buf += (uint64_t)chunk * BLK_SECTOR_SIZE;
+    sectors -= chunk;
+  }
+  return 1;
+}
+
+static uint8_t hib_flush(void) {
+  blk_request_t req;
+  req.op = BLK_OP_FLUSH;
+  req.lba = 0;
+  req.count = 0;
+  req.addr = NULL;
+  req.flags = BLK_REQ_F_POLL;
+  req.done = NULL;
+  req.priv = NULL;
+  return blk_request_wait(g_hib.dev, &req);
+}
+
+// the boot chain's manifest entries (checksums, and the area we may write)
+static uint8_t hib_manifest_read(void) {
+  if (!hib_io(BLK_OP_READ, MANIFEST_LBA, 1, g_hib.buf)) return 0;
+
+  const manifest_t* m = (const manifest_t*)g_hib.buf;
+  const manifest_entry_t* area = manifest_entry_find(m, MANIFEST_ID_HIBERNATE);
+  const manifest_entry_t* boot2 = manifest_entry_find(m, MANIFEST_ID_BOOT2);
+  const manifest_entry_t* loader = manifest_entry_find(m, MANIFEST_ID_LOADER);
+  const manifest_entry_t* kernel = manifest_entry_find(m, MANIFEST_ID_KERNEL);
+  if (!area || !boot2 || !loader || !kernel) return 0;
+
+  g_hib.area = *area;
+  g_hib.boot2_sum = boot2->checksum;
+  g_hib.loader_sum = loader->checksum;
+  g_hib.kernel_sum = kernel->checksum;
+  return 1;
+}
+
+static uint8_t hib_frame_is_saved(uint64_t frame) {
+  uint64_t first = g_hib.buffer >> PAGE_SHIFT;
+  if (frame >= first && frame < first + HIB_BUFFER_FRAMES) return 0;
+  return pmm_frame_is_used(frame);
+}
+
+// runs of frames that are RAM, in use and above 1 MiB (the PMM marks holes
+// used too, so E820 decides what is RAM)
+static uint8_t hib_runs_build(void) {
+  const boot_info_t* bi = g_hib.bi;
+  g_hib.run_count = 0;
+  g_hib.frames = 0;
+
+  for (uint32_t i = 0; i < bi->e820_count; i++) {
+    const e820_entry_t* e = &bi->e820_map[i];
+    if (e->type != 1) continue;
+
+    uint64_t start = (e->base + PAGE_MASK) >> PAGE_SHIFT;
+    uint64_t end = (e->base + e->length) >> PAGE_SHIFT;
+    if (start < HIB_LOW_FRAMES) start = HIB_LOW_FRAMES;
+    if (end > MAX_FRAMES) end = MAX_FRAMES;
+
+    hib_run_t* run = NULL;
+    for (uint64_t f = start; f < end; f++) {
+      if (!hib_frame_is_saved(f)) {
+        run = NULL;
+        continue;
+      }
+      if (!run) {
+        if (g_hib.run_count == HIB_RUNS_MAX) return 0;
+        run = &g_hib.runs[g_hib.run_count++];
+        run->frame = f;
+        run->count = 0;
+      }
+      run->count++;
+      g_hib.frames++;
+    }
+  }
+  return g_hib.run_count != 0;
+}
+
+// writes buf's whole sectors, keeps the partial one at the front
+static uint8_t hib_buf_drain(void) {
+  uint64_t sectors = g_hib.fill / BLK_SECTOR_SIZE;
+  uint64_t area_end = g_hib.area.lba + g_hib.area.sectors;
+  if (sectors == 0) return 1;
+  if (g_hib.lba + sectors > area_end) return 0;
+  if (!hib_io(BLK_OP_WRITE, g_hib.lba, (uint32_t)sectors, g_hib.buf)) return 0;
+
+  uint64_t done = sectors * BLK_SECTOR_SIZE;
+  mem_copy(g_hib.buf, g_hib.buf + done, g_hib.fill - done);
+  g_hib.fill -= done;
+  g_hib.lba += sectors;
+  return 1;
+}
+
+// one chunk of frames into buf: zero, LZ4 or stored. copied aside first, so sum
+// and payload agree even for the page our own stack is on
+static void hib_chunk_put(const uint8_t* src, uint32_t bytes) {
+  uint8_t* data = g_hib.buf + HIB_STREAM_BYTES;
+  mem_copy(data, src, bytes);
+  const uint64_t* q = (const uint64_t*)data;
+  uint64_t any = 0;
+  for (uint32_t i = 0; i < bytes / 8; i++) any |= q[i];
+
+  hib_chunk_t* c = (hib_chunk_t*)(g_hib.buf + g_hib.fill);
+  uint8_t* payload = (uint8_t*)(c + 1);
+  c->sum = mem_sum32(data, bytes);
+  if (!any) {
+    c->size = 0;
+  } else {
+    c->size = lz4_block_compress(data, bytes, payload, bytes - 1);
+    if (c->size == 0) {
+      mem_copy(payload, data, bytes);
+      c->size = bytes;
+    }
+  }
+  g_hib.fill += sizeof(hib_chunk_t) + c->size;
+  g_hib.data_bytes += sizeof(hib_chunk_t) + c->size;
+}
+
+// the chunk stream, then index and header. runs with interrupts masked: every
+// request busy-polls the disk (hib_io, hib_flush), nothing waits for an IRQ
+static uint8_t hib_write(void) {
+  uint32_t index_sectors = (uint32_t)((g_hib.run_count * sizeof(hib_run_t) + BLK_SECTOR_SIZE - 1) / BLK_SECTOR_SIZE);
+  g_hib.fill = 0;
+  g_hib.lba = g_hib.area.lba + 1 + index_sectors;
+  g_hib.data_bytes = 0;
+
+  for (uint32_t r = 0; r < g_hib.run_count; r++) {
+    const hib_run_t* run = &g_hib.runs[r];
+    for (uint64_t off = 0; off < run->count; off += HIB_CHUNK_FRAMES) {
+      uint64_t frames = run->count - off < HIB_CHUNK_FRAMES ? run->count - off : HIB_CHUNK_FRAMES;
+
+      // room for a stored chunk, the worst case
+      if (HIB_STREAM_BYTES - g_hib.fill < sizeof(hib_chunk_t) + HIB_CHUNK_BYTES && !hib_buf_drain()) return 0;
+      hib_chunk_put(hib_virt((run->frame + off) << PAGE_SHIFT), (uint32_t)(frames * PAGE_SIZE));
+    }
+  }
+
+  // last partial sector, zero padded
+  while (g_hib.fill % BLK_SECTOR_SIZE) g_hib.buf[g_hib.fill++] = 0;
+  if (!hib_buf_drain()) return 0;
+
+  uint8_t* index = g_hib.buf;
+  uint64_t index_bytes = g_hib.run_count * sizeof(hib_run_t);
+  mem_zero(index, (uint64_t)index_sectors * BLK_SECTOR_SIZE);
+  mem_copy(index, g_hib.runs, index_bytes);
+  if (!hib_io(BLK_OP_WRITE, g_hib.area.lba + 1, index_sectors, index)) return 0;
+
+  // everything the header points at is on stable media before the header is
+  if (!hib_flush()) return 0;
+
+  mem_zero(g_hib.buf, BLK_SECTOR_SIZE);
+  hib_header_t* h = (hib_header_t*)g_hib.buf;
+  h->magic = HIB_MAGIC;
+  h->version = HIB_VERSION;
+  h->run_count = g_hib.run_count;
+  h->index_sectors = index_sectors;
+  h->index_sum = mem_sum32(g_hib.runs, index_bytes);
+  h->boot2_sum = g_hib.boot2_sum;
+  h->loader_sum = g_hib.loader_sum;
+  h->kernel_sum = g_hib.kernel_sum;
+  h->frames = g_hib.frames;
+  h->data_bytes = g_hib.data_bytes;
+  h->ram_top = pmm_highest_address_get();
+  h->buffer = g_hib.buffer;
+  h->resume_entry = (uint64_t)(uintptr_t)hibernate_resume_entry;
+  h->context = (uint64_t)(uintptr_t)&g_hib.ctx;
+  h->header_sum = mem_sum32(h, __builtin_offsetof(hib_header_t, header_sum));
+  if (!hib_io(BLK_OP_WRITE, g_hib.area.lba, 1, g_hib.buf)) return 0;
+  return hib_flush();
+}
+
+hib_result_t hibernate_save(blk_device_t* dev, const boot_info_t* bi) {
+  g_hib.buffer = pmm_range_alloc(HIB_BUFFER_FRAMES);
+  if (g_hib.buffer == PMM_INVALID_FRAME) return HIB_FAILED;
+  g_hib.buf = hib_virt(g_hib.buffer);
+  g_hib.dev = dev;
+  g_hib.bi = bi;
+
+  if (!hib_manifest_read() || g_hib.area.sectors == 0 || !hib_runs_build()) {
+    pmm_range_free(g_hib.buffer, HIB_BUFFER_FRAMES);
+    return HIB_FAILED;
+  }
+
+  g_hib.irq_flags = irq_save();
+  if (hibernate_context_save(&g_hib.ctx)) {
+    // back from the image: the buffer was the loader's, the PMM still has it
+    // from the snapshot. only the fields set above are to be trusted here
+    pmm_range_free(g_hib.buffer, HIB_BUFFER_FRAMES);
+    irq_restore(g_hib.irq_flags);
+    return HIB_RESUMED;
+  }
+
+  uint8_t ok = hib_write();
+  irq_restore(g_hib.irq_flags);
+  pmm_range_free(g_hib.buffer, HIB_BUFFER_FRAMES);
+  return ok ? HIB_SAVED : HIB_FAILED;
+}
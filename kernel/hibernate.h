@@ -0,0 +1,89 @@
+#pragma once
+#include "common.h"
+#include "blk.h"
+
+// on-disk image, restored by kernelLoader/hibernate.c (same layout there)
+#define HIB_MAGIC           0x52424948u   // "HIBR"
+#define HIB_VERSION         1
+#define HIB_RUNS_MAX        1024          // runs of saved frames the index holds
+#define HIB_CHUNK_FRAMES    16            // frames per chunk (64 KiB)
+#define HIB_BUFFER_FRAMES   256           // 1 MiB: the writer's staging, the loader's read buffer on resume
+#define HIB_LOW_FRAMES      256           // below 1 MiB belongs to the boot chain, never saved
+
+// sector 0 of the area. the index (hib_run_t[run_count]) follows from sector 1,
+// then the chunk stream: for every HIB_CHUNK_FRAMES frames of a run (fewer at the
+// run's end) a hib_chunk_t and size bytes of payload
+typedef struct hib_header_t {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t rsvd;
+  uint32_t run_count;
+  uint32_t index_sectors;
+  uint32_t index_sum;           // sum32 of the index entries
+  uint32_t boot2_sum;           // manifest checksums of the boot chain and kernel that
+  uint32_t loader_sum;          // took the image (GDT / IDT / code addresses): with
+  uint32_t kernel_sum;          // anything else on disk the machine boots cold
+  uint64_t frames;              // saved
+  uint64_t data_bytes;          // chunk stream
+  uint64_t ram_top;             // highest RAM address, the loader identity maps up to it
+  uint64_t buffer;              // HIB_BUFFER_FRAMES not in the image, free for the loader
+  uint64_t resume_entry;        // hibernate_resume_entry (kernel text is identity mapped)
+  uint64_t context;             // its hib_context_t, physical
+  uint32_t header_sum;          // sum32 of everything above
+  uint32_t rsvd3;
+} __attribute__((packed)) hib_header_t;
+
+typedef struct hib_run_t {
+  uint64_t frame;
+  uint64_t count;
+} __attribute__((packed)) hib_run_t;
+
+// size 0: the frames are all zero, no payload. size == the frames' bytes: stored
+// as they are. anything else: one LZ4 block
+typedef struct hib_chunk_t {
+  uint32_t size;
+  uint32_t sum;                 // sum32 of the frames' contents
+} __attribute__((packed)) hib_chunk_t;
+
+// CPU state at the snapshot, hibernate_entry.asm uses the same offsets
+typedef struct hib_context_t {
+  uint64_t rbx;
+  uint64_t rbp;
+  uint64_t r12;
+  uint64_t r13;
+  uint64_t r14;
+  uint64_t r15;
+  uint64_t rsp;
+  uint64_t rip;
+  uint64_t rflags;
+  uint64_t cr0;
+  uint64_t cr3;
+  uint64_t cr4;
+  uint64_t efer;
+  uint8_t gdtr[16];             // sgdt / sidt images (limit, base)
+  uint8_t idtr[16];
+} __attribute__((packed)) hib_context_t;
+
+typedef enum hib_result_t {
+  HIB_FAILED = 0,               // nothing usable was written, the kernel runs on
+  HIB_SAVED,                    // image on disk: power off (the next boot resumes it)
+  HIB_RESUMED                   // returning a second time, out of the restored image
+} hib_result_t;
+
+// hibernation usage:
+// 1) bring everything to a quiet point: devices idle, no requests in flight
+// 2) r = hibernate_save(dev, bi) with dev the boot disk (the ATA driver's, or a
+//    stack over it) and bi the HHDM boot_info_t. its requests are polled
+//    (BLK_REQ_F_POLL), interrupts stay masked. every frame the PMM has in use
+//    (RAM only, above 1 MiB) goes into the area the manifest reserves (id 5):
+//    all-zero chunks as a header only, the rest LZ4-compressed into 1 MiB
+//    sequential writes, then the run index, then the header that commits it
+// 3) HIB_SAVED: halt / power off. on the next boot the kernelLoader finds the
+//    image, restores it with the disk streaming and jumps back into this call,
+//    which then returns HIB_RESUMED: re-initialise the devices (they come out of
+//    firmware reset); bi->stamps hold the resume's boot timeline
+// the snapshot is taken live, frame by frame: only the writer itself (this file,
+// the disk driver, the stack below this call) changes meanwhile, and those are
+// rebuilt after a resume. an image is used once; a changed boot2, loader or kernel
+// on disk makes the loader ignore it
+hib_result_t hibernate_save(blk_device_t* dev, const boot_info_t* bi);
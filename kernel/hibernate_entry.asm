@@ -0,0 +1,90 @@
+bits 64
+
+section .text
+  global hibernate_context_save
+  global hibernate_resume_entry
+
+; hib_context_t (kernel/hibernate.h)
+CTX_RBX    equ 0
+CTX_RBP    equ 8
+CTX_R12    equ 16
+CTX_R13    equ 24
+CTX_R14    equ 32
+CTX_R15    equ 40
+CTX_RSP    equ 48
+CTX_RIP    equ 56
+CTX_RFLAGS equ 64
+CTX_CR0    equ 72
+CTX_CR3    equ 80
+CTX_CR4    equ 88
+CTX_EFER   equ 96
+CTX_GDTR   equ 104
+CTX_IDTR   equ 120
+
+MSR_EFER   equ 0xC0000080
+
+; uint8_t hibernate_context_save(hib_context_t* ctx)
+; like setjmp: returns 0 now, and 1 once the loader resumes an image taken after it
+hibernate_context_save:
+  mov [rdi + CTX_RBX], rbx
+  mov [rdi + CTX_RBP], rbp
+  mov [rdi + CTX_R12], r12
+  mov [rdi + CTX_R13], r13
+  mov [rdi + CTX_R14], r14
+  mov [rdi + CTX_R15], r15
+  lea rax, [rsp + 8]              ; rsp once we have returned
+  mov [rdi + CTX_RSP], rax
+  mov rax, [rsp]
+  mov [rdi + CTX_RIP], rax
+  pushfq
+  pop qword [rdi + CTX_RFLAGS]
+
+  mov rax, cr0
+  mov [rdi + CTX_CR0], rax
+  mov rax, cr3
+  mov [rdi + CTX_CR3], rax
+  mov rax, cr4
+  mov [rdi + CTX_CR4], rax
+  mov ecx, MSR_EFER
+  rdmsr
+  shl rdx, 32
+  or rax, rdx
+  mov [rdi + CTX_EFER], rax
+  sgdt [rdi + CTX_GDTR]
+  sidt [rdi + CTX_IDTR]
+
+  xor eax, eax
+  ret
+
+; the loader jumps here (link address = physical, identity mapped under both its
+; tables and ours) with rdi = the context, once every frame is back
+hibernate_resume_entry:
+  cli
+  mov ecx, MSR_EFER
+  mov rax, [rdi + CTX_EFER]
+  mov rdx, rax
+  shr rdx, 32
+  wrmsr
+  mov rax, [rdi + CTX_CR4]
+  mov cr4, rax
+  mov rax, [rdi + CTX_CR3]
+  mov cr3, rax
+  mov rax, [rdi + CTX_CR0]
+  mov cr0, rax
+  lgdt [rdi + CTX_GDTR]
+  lidt [rdi + CTX_IDTR]
+
+  mov rbx, [rdi + CTX_RBX]
+  mov rbp, [rdi + CTX_RBP]
+  mov r12, [rdi + CTX_R12]
+  mov r13, [rdi + CTX_R13]
+  mov r14, [rdi + CTX_R14]
+  mov r15, [rdi + CTX_R15]
+  mov rsp, [rdi + CTX_RSP]
+  push qword [rdi + CTX_RFLAGS]
+  popfq
+
+  mov eax, 1
+  jmp [rdi + CTX_RIP]
+
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -0,0 +1,87 @@
+#include "idt.h"
+
+__attribute__((aligned(16)))
+static idt_entry_t idt[256] = {0};
+
+// boot2's GDT (same selectors, KERNEL_CS = 0x18). its copy sits in low memory the
+// kernel's page tables no longer map, and every interrupt reads the CS descriptor
+__attribute__((aligned(16)))
+static uint64_t gdt[4] = {
+    0,
+    0x00CF9A000000FFFFULL,      // code 32bit
+    0x00CF92000000FFFFULL,      // data
+    0x00AF9A000000FFFFULL       // code 64bit
+};
+
+// the identity map of the VGA buffer is gone once vmm_init ran
+#define IDT_VGA ((volatile uint16_t*)(0xB8000ULL + HHDM_OFFSET))
+
+static inline void lidt(void* base, uint16_t size_minus_1) {
+    volatile idtr_t idtr = { .limit = size_minus_1, .base = (uint64_t)base };
+    __asm__ __volatile__("lidt %0" : : "m"(idtr));
+}
+
+static inline void lgdt(void* base, uint16_t size_minus_1) {
+    volatile idtr_t gdtr = { .limit = size_minus_1, .base = (uint64_t)base };
+    __asm__ __volatile__("lgdt %0" : : "m"(gdtr));
+}
+
+__attribute__((no_caller_saved_registers))
+static void vga_hex_draw(volatile uint16_t* v, uint64_t value, int row) {
+    const char* hex_chars = "0123456789ABCDEF";
+    int offset = row * 80;
+
+    v[offset++] = (uint16_t)'0' | (0x07 << 8);
+    v[offset++] = (uint16_t)'x' | (0x07 << 8);
+    for (int i = 60; i >= 0; i -= 4) {
+        uint8_t nibble = (value >> i) & 0xF;
+        v[offset++] = (uint16_t)hex_chars[nibble] | (0x07 << 8);
+    }
+}
+
+__attribute__((no_caller_saved_registers))
+static void isr_general_exception(const char* msg, interrupt_frame_t* frame, uint64_t error_code) {
+    volatile uint16_t* v = IDT_VGA;
+    for (int i = 0; i < 80 * 25; i++) v[i] = (uint16_t)' ' | (0x07 << 8);
+    for (uint32_t i = 0; msg[i] != '\0'; i++) v[i] = (uint16_t)msg[i] | (0x07 << 8);
+
+    uint64_t cr2;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+    vga_hex_draw(v, error_code, 1);
+    vga_hex_draw(v, cr2, 2);
+    vga_hex_draw(v, frame->ip, 3);
+    vga_hex_draw(v, frame->sp, 4);
+    vga_hex_draw(v, frame->flags, 5);
+
+    for (;;) { __asm__ __volatile__("cli; hlt"); }
+}
+
+__attribute__((interrupt)) static void isr0_divide_error(interrupt_frame_t* f) { isr_general_exception("#DE Divide Error", f, 0); }
+__attribute__((interrupt)) static void isr2_nmi(interrupt_frame_t* f)          { isr_general_exception("Non-Maskable Interrupt", f, 0); }
+__attribute__((interrupt)) static void isr6_invalid_opcode(interrupt_frame_t* f){ isr_general_exception("#UD Invalid Opcode", f, 0); }
+__attribute__((interrupt)) static void isr8_double_fault(interrupt_frame_t* f, uint64_t ec) { isr_general_exception("#DF Double Fault", f, ec); }
+__attribute__((interrupt)) static void isr13_gp(interrupt_frame_t* f, uint64_t ec)         { isr_general_exception("#GP General Protection", f, ec); }
+__attribute__((interrupt)) static void isr14_page_fault(interrupt_frame_t* f, uint64_t ec) { isr_general_exception("#PF Page Fault", f, ec); }
+
+void idt_gate_set(uint8_t vec, uint64_t addr) {
+    idt[vec].handler_offset_low  = (uint16_t)(addr & 0xFFFFu);
+    idt[vec].segment_selector    = KERNEL_CS;
+    idt[vec].ist                 = 0;
+    idt[vec].type                = IDT_ATTR_INTGATE;
+    idt[vec].handler_offset_mid  = (uint16_t)((addr >> 16) & 0xFFFFu);
+    idt[vec].handler_offset_high = (uint32_t)((addr >> 32) & 0xFFFFFFFFu);
+    idt[vec].reserved            = 0;
+}
+
+void idt_init(void) {
+    lgdt(gdt, sizeof(gdt) - 1);
+
+    idt_gate_set(0,  (uint64_t)isr0_divide_error);
+    idt_gate_set(2,  (uint64_t)isr2_nmi);
+    idt_gate_set(6,  (uint64_t)isr6_invalid_opcode);
+    idt_gate_set(8,  (uint64_t)isr8_double_fault);
+    idt_gate_set(13, (uint64_t)isr13_gp);
+    idt_gate_set(14, (uint64_t)isr14_page_fault);
+
+    lidt(idt, sizeof(idt) - 1);
+}
@@ -4,6 +4,14 @@
 // interrupt gate: present=1, dpl=0, type=0xe (64-bit interrupt gate)
 #define IDT_ATTR_INTGATE 0x8E
 
+// IRQ entry points, reached through an IDT gate. a host build (KERNEL_HOST) has
+// no IDT: its device model calls them like any function
+#ifdef KERNEL_HOST
+#define IRQ_HANDLER __attribute__((no_caller_saved_registers))
+#else
+#define IRQ_HANDLER __attribute__((interrupt, no_caller_saved_registers))
+#endif
+
 typedef struct interrupt_frame_t {
     uint64_t ip;
     uint64_t cs;
@@ -28,3 +36,11 @@ typedef struct idt_entry_t {
     uint32_t handler_offset_high;
     uint32_t reserved;
 } __attribute__((packed)) idt_entry_t;
+
+// kernel IDT usage (after vmm_init: the tables live in the kernel image):
+// 1) idt_init(): loads the kernel's own GDT copy and an IDT with the fatal
+//    exceptions (they print on the VGA screen and halt)
+// 2) idt_gate_set(vector, (uint64_t)handler) for each IRQ_HANDLER, before the
+//    PIC routes anything to that vector and before sti
+void idt_init(void);
+void idt_gate_set(uint8_t vec, uint64_t addr);
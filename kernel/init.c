@@ -0,0 +1,140 @@
+#include "init.h"
+#include "serial.h"
+
+static uint32_t init_mask(const init_step_t* steps, uint32_t count, init_state_t state) {
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (steps[i].state == state) mask |= INIT_DEP(i);
+  }
+  return mask;
+}
+
+// the dependency that finished last, INIT_NONE without any
+static uint8_t init_last_dep(const init_step_t* steps, uint32_t count, uint32_t deps) {
+  uint8_t last = INIT_NONE;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!(deps & INIT_DEP(i))) continue;
+    if (last == INIT_NONE || steps[i].end_tsc > steps[last].end_tsc) last = (uint8_t)i;
+  }
+  return last;
+}
+
+static void init_finish(init_step_t* s, init_result_t r) {
+  s->end_tsc = rdtsc();
+  s->state = (r == INIT_OK) ? INIT_STATE_DONE : INIT_STATE_FAILED;
+}
+
+static void init_start(init_step_t* steps, uint32_t count, init_step_t* s) {
+  s->after = init_last_dep(steps, count, s->deps);
+  s->start_tsc = rdtsc();
+
+  init_result_t r = s->start(s->ctx);
+  if (r == INIT_AGAIN && s->poll) {
+    s->state = INIT_STATE_RUNNING;
+    return;
+  }
+  // nothing to poll it with
+  init_finish(s, r == INIT_AGAIN ? INIT_ERROR : r);
+}
+
+uint8_t init_run(init_step_t* steps, uint32_t count) {
+  if (count > INIT_STEPS_MAX) return 0;
+
+  uint32_t all = (count == 32) ? ~0u : INIT_DEP(count) - 1;
+  for (uint32_t i = 0; i < count; i++) {
+    steps[i].state = INIT_STATE_WAITING;
+    steps[i].after = INIT_NONE;
+    steps[i].start_tsc = 0;
+    steps[i].end_tsc = 0;
+  }
+
+  for (;;) {
+    uint8_t progress = 0;
+    uint8_t running = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+      init_step_t* s = &steps[i];
+      if (s->state == INIT_STATE_RUNNING) {
+        init_result_t r = s->poll(s->ctx);
+        if (r == INIT_AGAIN) {
+          running = 1;
+        } else {
+          init_finish(s, r);
+          progress = 1;
+        }
+        continue;
+      }
+      if (s->state != INIT_STATE_WAITING) continue;
+
+      uint32_t lost = init_mask(steps, count, INIT_STATE_FAILED) | init_mask(steps, count, INIT_STATE_SKIPPED) | ~all;
+      if (s->deps & lost) {
+        s->state = INIT_STATE_SKIPPED;
+        progress = 1;
+        continue;
+      }
+      if ((s->deps & init_mask(steps, count, INIT_STATE_DONE)) != s->deps) continue;
+
+      init_start(steps, count, s);
+      progress = 1;
+      if (s->state == INIT_STATE_RUNNING) running = 1;
+    }
+
+    // everything settled, or what is left waits on itself
+    if (!progress && !running) break;
+    if (!progress) cpu_relax();
+  }
+
+  // a dependency cycle never starts
+  for (uint32_t i = 0; i < count; i++) {
+    if (steps[i].state == INIT_STATE_WAITING) steps[i].state = INIT_STATE_SKIPPED;
+  }
+  return init_mask(steps, count, INIT_STATE_DONE) == all;
+}
+
+static uint64_t init_us(uint64_t cycles, uint64_t tsc_hz) {
+  // split so cycles * 1000000 can't overflow
+  return cycles / tsc_hz * 1000000 + cycles % tsc_hz * 1000000 / tsc_hz;
+}
+
+void init_report(const init_step_t* steps, uint32_t count, uint64_t t0, uint64_t tsc_hz) {
+  if (tsc_hz == 0 || count > INIT_STEPS_MAX) return;
+
+  serial_write("init (us since kmain: started, ready):\n");
+  uint8_t last = INIT_NONE;
+  for (uint32_t i = 0; i < count; i++) {
+    const init_step_t* s = &steps[i];
+    serial_write("  ");
+    if (s->state == INIT_STATE_SKIPPED) {
+      serial_write("skipped  ");
+      serial_write(s->name);
+      serial_write("\n");
+      continue;
+    }
+
+    serial_write_dec(init_us(s->start_tsc - t0, tsc_hz));
+    serial_write(" ");
+    serial_write_dec(init_us(s->end_tsc - t0, tsc_hz));
+    serial_write("  ");
+    serial_write(s->name);
+    if (s->after != INIT_NONE) {
+      serial_write(" after ");
+      serial_write(steps[s->after].name);
+    }
+    if (s->state == INIT_STATE_FAILED) serial_write(" FAILED");
+    serial_write("\n");
+
+    if (last == INIT_NONE || s->end_tsc > steps[last].end_tsc) last = (uint8_t)i;
+  }
+  if (last == INIT_NONE) return;
+
+  // back from the step that finished last, through what each one waited for
+  uint8_t path[INIT_STEPS_MAX];
+  uint32_t n = 0;
+  for (uint8_t i = last; i != INIT_NONE && n < INIT_STEPS_MAX; i = steps[i].after) path[n++] = i;
+
+  serial_write("  critical path: ");
+  while (n--) {
+    serial_write(steps[path[n]].name);
+    serial_write(n ? " > " : "\n");
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "common.h"
+
+#define INIT_STEPS_MAX   32
+#define INIT_DEP(id)     (1u << (id))    // deps mask bit of the step at index id
+#define INIT_NONE        0xFF            // init_step_t.after: started without waiting on anything
+
+typedef enum init_result_t {
+  INIT_AGAIN = 0,               // still working (waiting on a device): poll again
+  INIT_OK,
+  INIT_ERROR
+} init_result_t;
+
+typedef enum init_state_t {
+  INIT_STATE_WAITING = 0,       // dependencies not done yet
+  INIT_STATE_RUNNING,           // started, being polled
+  INIT_STATE_DONE,
+  INIT_STATE_FAILED,
+  INIT_STATE_SKIPPED            // a dependency failed (or can never finish)
+} init_state_t;
+
+// one subsystem's bring-up. start does the work, or kicks it off and returns
+// INIT_AGAIN; poll then advances it between other steps and says when it is over
+typedef struct init_step_t {
+  const char* name;
+  uint32_t deps;                // INIT_DEP() of every step that must be done first
+  init_result_t (*start)(void* ctx);
+  init_result_t (*poll)(void* ctx);   // NULL if start never returns INIT_AGAIN
+  void* ctx;
+
+  // init_run's
+  init_state_t state;
+  uint8_t after;                // the dependency that finished last: the critical path
+  uint64_t start_tsc;
+  uint64_t end_tsc;
+} init_step_t;
+
+// init usage:
+// 1) an array of steps, deps by index. list device probes first: every pass
+//    starts the steps that became ready in array order, so a probe put ahead
+//    of memory setup has its command out while the CPU does the rest
+// 2) init_run(steps, n): returns once every step is done, failed or skipped.
+//    synchronous steps run as soon as their deps are done, asynchronous ones
+//    are polled on every pass over the array; with only those left the CPU
+//    spins on them. dependents of a failed step are skipped, so optional
+//    hardware is a step the others do not need. returns 1 if all are done
+// 3) init_report(steps, n, t0, tsc_hz) once the serial port is up: per step
+//    when it started and was ready (us since t0) and which dependency it
+//    waited for last, then the critical path that decided the ready time
+uint8_t init_run(init_step_t* steps, uint32_t count);
+
+void init_report(const init_step_t* steps, uint32_t count, uint64_t t0, uint64_t tsc_hz);
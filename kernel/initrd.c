@@ -0,0 +1,78 @@
+#include "initrd.h"
+#include "common.h"
+
+static uint8_t initrd_submit(blk_device_t* dev, blk_request_t* req) {
+  initrd_t* rd = (initrd_t*)dev->ctx;
+  req->status = BLK_REQ_PENDING;
+
+  uint8_t bad = req->op == BLK_OP_FLUSH ? req->count != 0
+              : req->lba + req->count > dev->sectors ||
+                (req->op != BLK_OP_DISCARD && (req->count == 0 || req->count > dev->max_sectors)) ||
+                !blk_request_sg_is_valid(req);
+  if (bad) {
+    blk_request_complete(req, 0);
+    return 1;
+  }
+
+  // RAM has no cache to flush, and discarded sectors may read back anything
+  if (req->op == BLK_OP_FLUSH || req->op == BLK_OP_DISCARD) {
+    blk_request_complete(req, 1);
+    return 1;
+  }
+
+  uint8_t* mem = rd->data + req->lba * BLK_SECTOR_SIZE;
+  uint64_t bytes = (uint64_t)req->count * BLK_SECTOR_SIZE;
+  if (req->op == BLK_OP_READ) {
+    blk_buf_copy(req, 0, mem, bytes, 1);
+    rd->reads += req->count;
+  } else {
+    blk_buf_copy(req, 0, mem, bytes, 0);
+    rd->writes += req->count;
+  }
+  blk_request_complete(req, 1);
+  return 1;
+}
+
+// everything completes in submit
+static void initrd_tick(blk_device_t* dev) {
+  (void)dev;
+}
+
+static const void* initrd_map(blk_device_t* dev, uint64_t lba, uint32_t count) {
+  initrd_t* rd = (initrd_t*)dev->ctx;
+  (void)count;
+  rd->maps++;
+  return rd->data + lba * BLK_SECTOR_SIZE;
+}
+
+uint8_t initrd_init(initrd_t* rd, const boot_info_t* bi) {
+  if (bi->initrd_phys == 0 || bi->initrd_size == 0) return 0;
+
+  rd->phys = bi->initrd_phys;
+  rd->size = bi->initrd_size;
+  rd->data = (uint8_t*)(bi->initrd_phys + HHDM_OFFSET);
+  rd->reads = 0;
+  rd->writes = 0;
+  rd->maps = 0;
+
+  rd->name[0] = 'r';
+  rd->name[1] = 'd';
+  rd->name[2] = '0';
+  rd->name[3] = 0;
+
+  // the loader read whole sectors, so a short last one is there in full
+  rd->blk.name = rd->name;
+  rd->blk.sectors = (rd->size + BLK_SECTOR_SIZE - 1) / BLK_SECTOR_SIZE;
+  rd->blk.max_sectors = UINT32_MAX;
+  rd->blk.queue_depth = 1;
+  rd->blk.submit = initrd_submit;
+  rd->blk.tick = initrd_tick;
+  rd->blk.idle = NULL;
+  rd->blk.map = initrd_map;
+  rd->blk.ctx = rd;
+  return 1;
+}
+
+blk_device_t* initrd_device_get(initrd_t* rd) {
+  return &rd->blk;
+}
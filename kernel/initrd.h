@@ -0,0 +1,30 @@
+#pragma once
+#include "common.h"
+#include "blk.h"
+
+// the initial ramdisk the kernelLoader put in RAM (manifest component 4)
+typedef struct initrd_t {
+  uint8_t* data;                        // HHDM view
+  phys_addr_t phys;
+  uint64_t size;                        // bytes; the last sector may be short on disk, zero padded here
+
+  blk_device_t blk;
+  char name[8];
+
+  // stats
+  uint64_t reads;                       // sectors copied out by READ requests
+  uint64_t writes;
+  uint64_t maps;                        // blk_device_map calls served in place
+} initrd_t;
+
+// initrd usage:
+// 1) after pmm_init: pmm_range_reserve(bi->initrd_phys, bi->initrd_size) so its
+//    frames are never handed out (the kernel does it before anything allocates)
+// 2) initrd_init(&rd, bi) after vmm_init, then blk_device_register(initrd_device_get(&rd))
+// 3) use it like any disk, or read without a copy: p = blk_device_map(dev, lba, n)
+//    points straight into the image (valid for as long as the initrd lives).
+//    requests complete inside submit; writes land in RAM only
+// returns 0 if the loader found no (valid) initrd
+uint8_t initrd_init(initrd_t* rd, const boot_info_t* bi);
+
+blk_device_t* initrd_device_get(initrd_t* rd);
@@ -0,0 +1,219 @@
+#include "kexec.h"
+#include "common.h"
+#include "elf64.h"
+#include "lz4.h"
+#include "manifest.h"
+#include "mem.h"
+#include "pmm.h"
+#include "vmm.h"
+
+// kexec_trampoline.asm
+extern const uint8_t kexec_trampoline[];
+extern const uint8_t kexec_trampoline_end[];
+extern void kexec_jump(phys_addr_t pml4, phys_addr_t trampoline, phys_addr_t params) __attribute__((noreturn));
+
+static inline uint8_t* kexec_virt(phys_addr_t phys) {
+  return (uint8_t*)(phys + HHDM_OFFSET);
+}
+
+static inline uint64_t kexec_frames(uint64_t bytes) {
+  return (bytes + PAGE_SIZE - 1) >> PAGE_SHIFT;
+}
+
+// sectors from dev into buf, in requests the device takes
+static uint8_t kexec_read(blk_device_t* dev, uint64_t lba, uint32_t sectors, uint8_t* buf) {
+  blk_request_t req;
+  while (sectors) {
+    uint32_t chunk = sectors < dev->max_sectors ? sectors : dev->max_sectors;
+    if (chunk > KEXEC_READ_SECTORS) chunk = KEXEC_READ_SECTORS;
+
+    req.op = BLK_OP_READ;
+    req.lba = lba;
+    req.count = chunk;
+    req.addr = buf;
+    req.flags = BLK_REQ_F_POLL;   // callers may have interrupts masked
+    req.done = NULL;
+    req.priv = NULL;
+    if (!blk_request_wait(dev, &req)) return 0;
+
+    lba += chunk;
+    buf += (uint64_t)chunk * BLK_SECTOR_SIZE;
+    sectors -= chunk;
+  }
+  return 1;
+}
+
+// the manifest's kernel entry, copied to e. 0 if the disk has none
+static uint8_t kexec_manifest_read(blk_device_t* dev, manifest_entry_t* e) {
+  phys_addr_t frame = pmm_frame_alloc();
+  if (frame == PMM_INVALID_FRAME) return 0;
+
+  const manifest_entry_t* found = NULL;
+  if (kexec_read(dev, MANIFEST_LBA, 1, kexec_virt(frame))) {
+    found = manifest_entry_find((const manifest_t*)kexec_virt(frame), MANIFEST_ID_KERNEL);
+    if (found) *e = *found;
+  }
+  pmm_frame_free(frame >> PAGE_SHIFT);
+  return found != NULL;
+}
+
+// decompresses a KLZ4 image into new frames. PMM_INVALID_FRAME if it is damaged
+static phys_addr_t kexec_lz4_decode(const uint8_t* file, uint64_t file_bytes, uint64_t* size) {
+  const elf_lz4_header_t* hdr = (const elf_lz4_header_t*)file;
+  if (hdr->original_size == 0 || hdr->original_size > KEXEC_IMAGE_MAX) return PMM_INVALID_FRAME;
+  if (hdr->compressed_size == 0 || hdr->compressed_size > file_bytes - BLK_SECTOR_SIZE) return PMM_INVALID_FRAME;
+
+  uint64_t frames = kexec_frames(hdr->original_size);
+  phys_addr_t elf = pmm_range_alloc(frames);
+  if (elf == PMM_INVALID_FRAME) return PMM_INVALID_FRAME;
+
+  lz4_stream_t lz;
+  lz4_stream_init(&lz, file + BLK_SECTOR_SIZE, hdr->compressed_size, kexec_virt(elf), hdr->original_size);
+  if (lz4_stream_run(&lz, hdr->compressed_size) != LZ4_DONE || lz.out_pos != hdr->original_size ||
+      elf_cksum_final(elf_cksum_update(0, kexec_virt(elf), lz.out_pos), lz.out_pos) != hdr->checksum) {
+    pmm_range_free(elf, frames);
+    return PMM_INVALID_FRAME;
+  }
+  *size = lz.out_pos;
+  return elf;
+}
+
+// lays the PT_LOAD segments out in new frames exactly as they will sit in memory
+// (bss zeroed), so the trampoline only has one copy to do
+static uint8_t kexec_stage(kexec_t* k, const uint8_t* elf, uint64_t size) {
+  const elf64_ehdr_t* eh = (const elf64_ehdr_t*)elf;
+  if (!elf_header_is_valid(eh, size)) return 0;
+
+  const elf64_phdr_t* phdrs = (const elf64_phdr_t*)(elf + eh->phoff);
+  uint64_t lo = UINT64_MAX;
+  uint64_t hi = 0;
+  for (uint16_t i = 0; i < eh->phnum; i++) {
+    const elf64_phdr_t* ph = &phdrs[i];
+    if (ph->type != ELF_PT_LOAD || ph->memsz == 0) continue;
+    if (ph->filesz > ph->memsz || ph->offset > size || ph->filesz > size - ph->offset) return 0;
+    if (ph->paddr < KEXEC_LOAD_MIN || ph->paddr >= KEXEC_LOAD_LIMIT || ph->memsz > KEXEC_LOAD_LIMIT - ph->paddr) return 0;
+    if (ph->paddr < lo) lo = ph->paddr;
+    if (ph->paddr + ph->memsz > hi) hi = ph->paddr + ph->memsz;
+  }
+  if (hi == 0) return 0;
+  lo &= ~PAGE_MASK;
+  hi = (hi + PAGE_MASK) & ~PAGE_MASK;
+  if (eh->entry < lo || eh->entry >= hi) return 0;
+
+  uint64_t frames = (hi - lo) >> PAGE_SHIFT;
+  phys_addr_t image = pmm_range_alloc(frames);
+  if (image == PMM_INVALID_FRAME) return 0;
+
+  uint8_t* dst = kexec_virt(image);
+  mem_zero(dst, hi - lo);
+  for (uint16_t i = 0; i < eh->phnum; i++) {
+    const elf64_phdr_t* ph = &phdrs[i];
+    if (ph->type != ELF_PT_LOAD || ph->memsz == 0) continue;
+    mem_copy(dst + (ph->paddr - lo), elf + ph->offset, ph->filesz);
+  }
+
+  k->image = image;
+  k->image_frames = frames;
+  k->dst = lo;
+  k->bytes = hi - lo;
+  k->entry = eh->entry;
+  return 1;
+}
+
+// identity map of all RAM in 1 GiB pages for the trampoline: it copies over the
+// kernel (page tables included) and may not rely on anything in it
+static uint8_t kexec_control_build(kexec_t* k) {
+  phys_addr_t control = pmm_range_alloc(KEXEC_CONTROL_FRAMES);
+  if (control == PMM_INVALID_FRAME) return 0;
+
+  uint64_t* pml4 = (uint64_t*)kexec_virt(control);
+  uint64_t* pdpt = (uint64_t*)kexec_virt(control + PAGE_SIZE);
+  mem_zero((uint8_t*)pml4, PAGE_SIZE);
+  mem_zero((uint8_t*)pdpt, PAGE_SIZE);
+  pml4[0] = (control + PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITABLE;
+
+  uint64_t gib = (pmm_highest_address_get() + GIB_SIZE - 1) / GIB_SIZE;
+  if (gib == 0) gib = 1;
+  if (gib > 512) gib = 512;
+  for (uint64_t i = 0; i < gib; i++) pdpt[i] = (i * GIB_SIZE) | PAGE_PRESENT | PAGE_WRITABLE | PS_BIT;
+
+  uint8_t* tramp = kexec_virt(control + 2 * PAGE_SIZE);
+  mem_copy(tramp, kexec_trampoline, (uint64_t)(kexec_trampoline_end - kexec_trampoline));
+
+  kexec_params_t* params = (kexec_params_t*)(tramp + KEXEC_PARAMS_OFFSET);
+  params->dst = k->dst;
+  params->src = k->image;
+  params->bytes = k->bytes;
+  params->entry = k->entry;
+  params->boot_info = 0;        // kexec_exec fills it in
+
+  k->control = control;
+  return 1;
+}
+
+uint8_t kexec_load(kexec_t* k, blk_device_t* dev) {
+  if (k->loaded) kexec_unload(k);
+  k->start = rdtsc();
+
+  manifest_entry_t e;
+  if (!kexec_manifest_read(dev, &e)) return 0;
+  uint64_t file_bytes = (uint64_t)e.sectors * BLK_SECTOR_SIZE;
+  if (e.sectors == 0 || file_bytes > KEXEC_IMAGE_MAX || e.bytes > file_bytes) return 0;
+
+  uint64_t file_frames = kexec_frames(file_bytes);
+  phys_addr_t file = pmm_range_alloc(file_frames);
+  if (file == PMM_INVALID_FRAME) return 0;
+  if (!kexec_read(dev, e.lba, e.sectors, kexec_virt(file)) || mem_sum32(kexec_virt(file), file_bytes) != e.checksum) {
+    pmm_range_free(file, file_frames);
+    return 0;
+  }
+
+  // plain ELF, or compressed like the loader reads it
+  uint8_t ok = 0;
+  const elf_lz4_header_t* hdr = (const elf_lz4_header_t*)kexec_virt(file);
+  if (hdr->magic == ELF_LZ4_MAGIC) {
+    uint64_t size = 0;
+    phys_addr_t elf = kexec_lz4_decode(kexec_virt(file), file_bytes, &size);
+    if (elf != PMM_INVALID_FRAME) {
+      ok = kexec_stage(k, kexec_virt(elf), size);
+      pmm_range_free(elf, kexec_frames(size));
+    }
+  } else {
+    ok = kexec_stage(k, kexec_virt(file), e.bytes);
+  }
+  pmm_range_free(file, file_frames);
+  if (!ok) return 0;
+
+  if (!kexec_control_build(k)) {
+    pmm_range_free(k->image, k->image_frames);
+    return 0;
+  }
+  k->staged = rdtsc();
+  k->loaded = 1;
+  return 1;
+}
+
+void kexec_unload(kexec_t* k) {
+  if (!k->loaded) return;
+  pmm_range_free(k->image, k->image_frames);
+  pmm_range_free(k->control, KEXEC_CONTROL_FRAMES);
+  k->loaded = 0;
+}
+
+void kexec_exec(kexec_t* k, phys_addr_t boot_info) {
+  if (!k->loaded) return;
+
+  // the boot info stays where boot2 put it (below the frames the PMM hands out, so
+  // the new kernel can't overwrite it before reading it). E820, VBE, TSC rate and
+  // initrd are still true; only the timeline starts over
+  boot_info_t* bi = (boot_info_t*)kexec_virt(boot_info);
+  for (uint32_t i = 0; i < BOOT_STAMP_MAX; i++) bi->stamps[i] = 0;
+  bi->stamps[BOOT_STAMP_KEXEC] = k->start;
+  bi->stamps[BOOT_STAMP_KERNEL_READ] = k->staged;
+
+  phys_addr_t tramp = k->control + 2 * PAGE_SIZE;
+  kexec_params_t* params = (kexec_params_t*)kexec_virt(tramp + KEXEC_PARAMS_OFFSET);
+  params->boot_info = boot_info;
+
+  kexec_jump(k->control, tramp, tramp + KEXEC_PARAMS_OFFSET);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "common.h"
+#include "blk.h"
+
+#define KEXEC_LOAD_MIN        0x00100000u   // segments go where the kernelLoader would put them
+#define KEXEC_LOAD_LIMIT      0x00800000u
+#define KEXEC_IMAGE_MAX       0x00800000u   // kernel image on disk, and the ELF decompressed from it
+#define KEXEC_READ_SECTORS    2048          // per request (1 MiB), fewer if the device takes less
+
+// control frames: PML4, PDPT, trampoline code with its parameters
+#define KEXEC_CONTROL_FRAMES  3
+#define KEXEC_PARAMS_OFFSET   2048          // into the trampoline frame
+
+// read by kexec_trampoline.asm, keep the layout
+typedef struct kexec_params_t {
+  uint64_t dst;                 // lowest page of the new kernel's segments
+  uint64_t src;                 // the staged image (physical, contiguous)
+  uint64_t bytes;               // whole pages
+  uint64_t entry;
+  uint64_t boot_info;           // physical, handed over in rdi like the loader does
+} kexec_params_t;
+
+typedef struct kexec_t {
+  phys_addr_t image;            // segments laid out as they will be in memory, bss zeroed
+  uint64_t image_frames;
+  phys_addr_t control;
+  uint64_t dst;
+  uint64_t bytes;
+  uint64_t entry;
+  uint8_t loaded;
+
+  // TSC
+  uint64_t start;               // kexec_load called, becomes BOOT_STAMP_KEXEC
+  uint64_t staged;              // image ready, becomes BOOT_STAMP_KERNEL_READ
+} kexec_t;
+
+// warm reload usage:
+// 1) kexec_load(&k, dev), k static or zeroed, dev a disk holding the boot manifest
+//    (the ATA driver's, or any stack over it): reads the kernel image the manifest names
+//    with polled requests (interrupts may be masked),
+//    decompresses it if it is LZ4, checks it and stages it in free frames. the
+//    running kernel is untouched and may go on, or kexec_unload(&k) to drop it
+// 2) stop the devices (no requests in flight, IRQs quiet), then kexec_exec(&k, bi_phys)
+//    with the physical address of the boot_info_t this kernel was started with.
+//    its E820, VBE, TSC and initrd data are kept, the timeline restarts at
+//    BOOT_STAMP_KEXEC. the jump goes through an identity-mapped trampoline that
+//    copies the image over the old kernel and enters it the way the loader does
+// no BIOS, boot1, boot2 or loader on the way: the restart costs the disk read
+// and a memcpy. returns 0 if the image is missing, damaged or won't fit
+uint8_t kexec_load(kexec_t* k, blk_device_t* dev);
+
+void kexec_unload(kexec_t* k);
+
+// does not return (returns at once if nothing is loaded)
+void kexec_exec(kexec_t* k, phys_addr_t boot_info);
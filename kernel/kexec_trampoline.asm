@@ -0,0 +1,35 @@
+bits 64
+
+section .text
+  global kexec_jump
+  global kexec_trampoline
+  global kexec_trampoline_end
+
+; kexec_jump(pml4, trampoline, params), all physical
+; rdi = PML4 of the identity map, rsi = trampoline copy, rdx = its kexec_params_t.
+; the kernel text and stack are identity mapped too, so the switch is harmless
+kexec_jump:
+  cli
+  mov cr3, rdi
+  mov rdi, rdx
+  jmp rsi
+
+; copied into its own frame by kexec.c and run from there: position independent,
+; no stack. overwrites the old kernel with the staged image, then enters the new
+; one like the kernelLoader's entry.asm does (boot info in rdi)
+; rdi -> kexec_params_t { dst, src, bytes, entry, boot_info }
+kexec_trampoline:
+  mov r8, rdi
+  mov rdi, [r8]
+  mov rsi, [r8 + 8]
+  mov rcx, [r8 + 16]
+  shr rcx, 3
+  cld
+  rep movsq
+
+  mov rax, [r8 + 24]
+  mov rdi, [r8 + 32]
+  jmp rax
+kexec_trampoline_end:
+
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -0,0 +1,75 @@
+#include "lz4_compress.h"
+#include "common.h"
+
+static uint32_t g_lz4_hash[1u << LZ4_HASH_BITS];   // position + 1, 0 = empty
+
+static inline uint32_t lz4_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// 15 in the token's nibble, the rest in 255-steps
+static inline uint32_t lz4_length_write(uint8_t* op, uint32_t len) {
+  uint32_t n = 0;
+  for (len -= 15; len >= 255; len -= 255) op[n++] = 255;
+  op[n++] = (uint8_t)len;
+  return n;
+}
+
+// one sequence: literals src[anchor..ip), then a match (mlen 0: the block's last literals)
+static uint32_t lz4_sequence_write(uint8_t* dst, uint32_t op, uint32_t cap, const uint8_t* lit, uint32_t lit_len,
+                                   uint32_t offset, uint32_t mlen) {
+  uint32_t worst = 1 + lit_len / 255 + 1 + lit_len + 2 + (mlen ? (mlen - LZ4_MIN_MATCH) / 255 + 1 : 0);
+  if (op + worst > cap) return 0;
+
+  uint32_t ml = mlen ? mlen - LZ4_MIN_MATCH : 0;
+  uint8_t* token = &dst[op++];
+  *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+  if (lit_len >= 15) op += lz4_length_write(&dst[op], lit_len);
+  for (uint32_t i = 0; i < lit_len; i++) dst[op++] = lit[i];
+  if (!mlen) return op;
+
+  *token |= (uint8_t)(ml < 15 ? ml : 15);
+  dst[op++] = (uint8_t)offset;
+  dst[op++] = (uint8_t)(offset >> 8);
+  if (ml >= 15) op += lz4_length_write(&dst[op], ml);
+  return op;
+}
+
+uint32_t lz4_block_compress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t cap) {
+  for (uint32_t i = 0; i < (1u << LZ4_HASH_BITS); i++) g_lz4_hash[i] = 0;
+
+  uint32_t ip = 0;
+  uint32_t anchor = 0;
+  uint32_t op = 0;
+  if (len > LZ4_MF_LIMIT) {
+    uint32_t limit = len - LZ4_MF_LIMIT;
+    uint32_t match_limit = len - LZ4_LAST_LITERALS;
+
+    while (ip < limit) {
+      uint32_t v = lz4_le32(src + ip);
+      uint32_t h = lz4_hash(v);
+      uint32_t ref = g_lz4_hash[h];
+      g_lz4_hash[h] = ip + 1;
+      if (ref == 0 || ip - (ref - 1) > LZ4_MAX_OFFSET || lz4_le32(src + ref - 1) != v) {
+        ip++;
+        continue;
+      }
+      ref--;
+
+      // grow the match backwards into the pending literals, then forwards
+      while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+        ip--;
+        ref--;
+      }
+      uint32_t mlen = LZ4_MIN_MATCH;
+      while (ip + mlen < match_limit && src[ip + mlen] == src[ref + mlen]) mlen++;
+
+      op = lz4_sequence_write(dst, op, cap, src + anchor, ip - anchor, ip - ref, mlen);
+      if (op == 0) return 0;
+      ip += mlen;
+      anchor = ip;
+    }
+  }
+
+  return lz4_sequence_write(dst, op, cap, src + anchor, len - anchor, 0, 0);
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "common.h"
+#include "lz4.h"
+
+#define LZ4_MF_LIMIT       12        // the last match starts at least this far before the block's end
+#define LZ4_MAX_OFFSET     65535
+#define LZ4_HASH_BITS      12
+
+// one independent LZ4 block (no framing), greedy single pass with a small hash
+// table: fast rather than tight. returns the compressed size, 0 if it would not
+// fit in cap (store the data raw then). the loader decodes it with lz4_block_decode
+uint32_t lz4_block_compress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t cap);
@@ -1,22 +1,430 @@
 #include "common.h"
+#include "idt.h"
 #include "pmm.h"
 #include "vmm.h"
+#include "pit.h"
+#include "serial.h"
+#include "boot_timeline.h"
+#include "blk.h"
+#include "blk_queue.h"
+#include "raid0.h"
+#include "discard.h"
+#include "blk_ring.h"
+#include "initrd.h"
+#include "ata_driver_irq.h"
+#include "ahci.h"
+#include "virtio_blk.h"
+#include "init.h"
+#include "kexec.h"
+#include "hibernate.h"
+
+extern boot_info_t* bootinfo_ptr;
+
+static initrd_t g_initrd;
+static boot_info_t* g_bi;       // HHDM view, set once vmm_init has run
+static uint64_t g_tsc_hz;
+
+// md0: the primary and secondary slaves striped, each behind a request queue
+#define MD0_CHECK_SECTORS 8192                          // read by the BENCH=1 throughput check (4 MiB)
+#define MD0_CHECK_REQ     (RAID0_DEFAULT_CHUNK * 2)     // one chunk on each member
+
+static blkq_queue_t g_md0_queues[2];
+static raid0_t g_md0;
+
+#ifdef SCRATCH_TRIM_TEST
+// ata2 is scratch (IDE_SECOND_DISK, which alone sets SCRATCH_TRIM_TEST): build.sh fills
+// its first SCRATCH_TRIM_SECTORS, kmain hands them back to the host with TRIM (the
+// image shrinks under discard=unmap). any other disk there keeps its data
+#define SCRATCH_TRIM_SECTORS 16384     // 8 MiB
+
+static discard_queue_t g_ata2_discard;
+#endif
+
+#ifdef BLK_BENCH
+// ring0: the start of the boot disk read back through a ring, one batch, one doorbell
+#define RING_CHECK_ENTRIES 16
+#define RING_CHECK_SECTORS 8            // per entry
+
+static blk_ring_t g_ring0;
+#endif
+
+// init steps by index, the order each pass looks at them: the drive probes come
+// first so IDENTIFY is out on both channels while the CPU builds the PMM bitmap
+enum {
+    STEP_ATA0,
+    STEP_ATA2,
+    STEP_ATA1,
+    STEP_ATA3,
+    STEP_PMM,
+    STEP_VMM,
+    STEP_SERIAL,
+    STEP_CLOCK,
+    STEP_IRQ,
+    STEP_ATA_DMA,
+    STEP_ATA0_BLK,
+    STEP_ATA2_BLK,
+#ifdef SCRATCH_TRIM_TEST
+    STEP_ATA2_TRIM,
+#endif
+#ifdef BLK_BENCH
+    STEP_RING0,
+#endif
+    STEP_INITRD,
+    STEP_MD0,
+    STEP_AHCI,
+    STEP_VIRTIO,
+    STEP_COUNT
+};
+
+static init_result_t pmm_step(void* ctx) {
+    (void)ctx;
+    pmm_init(bootinfo_ptr->e820_map, bootinfo_ptr->e820_count);
+    // the initrd sits in usable RAM, keep it out of the allocator
+    pmm_range_reserve(bootinfo_ptr->initrd_phys, bootinfo_ptr->initrd_size);
+    boot_stamp(bootinfo_ptr, BOOT_STAMP_PMM);
+    return INIT_OK;
+}
+
+static init_result_t vmm_step(void* ctx) {
+    (void)ctx;
+    vmm_init();
+    // the low identity map is gone, boot info is reached through the HHDM now
+    g_bi = (boot_info_t*)((uintptr_t)bootinfo_ptr + HHDM_OFFSET);
+    boot_stamp(g_bi, BOOT_STAMP_VMM);
+    return INIT_OK;
+}
+
+static init_result_t serial_step(void* ctx) {
+    (void)ctx;
+    serial_init();
+    return INIT_OK;
+}
+
+// the loader calibrated the TSC already; measuring again is 10ms of busy wait.
+// runs before the irq step, interrupts are still off
+static init_result_t clock_step(void* ctx) {
+    (void)ctx;
+    g_tsc_hz = g_bi->tsc_hz ? g_bi->tsc_hz : pit_tsc_calibrate(PIT_CALIBRATE_COUNT);
+    blk_clock_init(g_tsc_hz);
+    return INIT_OK;
+}
+
+// the kernel's own IDT, the ATA and PIT vectors and the PIC. the keyboard stays
+// masked, and pit_init replaces the BIOS periodic tick with the one-shot that
+// wakes hybrid ATA waits. without the PIT those waits sleep until the drive's IRQ
+static init_result_t irq_step(void* ctx) {
+    (void)ctx;
+    idt_init();
+    idt_gate_set(PIC_REMAP_MASTER + PIC_IRQ_PIT, (uint64_t)irq0_pit);
+    idt_gate_set(PIC_REMAP_MASTER + PIC_IRQ_ATA_PRIMARY, (uint64_t)irq14_ata);
+    idt_gate_set(PIC_REMAP_MASTER + PIC_IRQ_ATA_SECONDARY, (uint64_t)irq15_ata);
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+    setup_ata_irq();
+    pit_init(g_tsc_hz);
+    irq_enable();
+    // drives registered from here on may wait for their IRQ
+    ata_irq_routed_set(1);
+    return INIT_OK;
+}
+
+// runs the drive's init up to its next wait on the drive, so the command is out
+// before the other steps take the CPU. a slave's probe starts once its master's
+// is off the channel
+static init_result_t ata_probe_poll(void* ctx) {
+    ata_context_t* ata = (ata_context_t*)ctx;
+    if (ata->step == ATA_STEP_IDLE && !begin_init_ata_48_irq(ata)) return INIT_AGAIN;
+    tick_ata(ata);
+    while (is_ata_irq_busy(ata) && !is_ata_irq_waiting(ata)) tick_ata(ata);
+
+    if (is_ata_init_done(ata)) return INIT_OK;
+    if (is_ata_init_failed(ata)) return INIT_ERROR;
+    return INIT_AGAIN;
+}
+
+static init_result_t ata_probe_start(void* ctx) {
+    ata_context_t* ata = (ata_context_t*)ctx;
+    // the probe may start before the irq step: the drive's IRQ stays off, it is polled
+    ata_wait_mode_set(ata, ATA_WAIT_POLL);
+    return ata_probe_poll(ctx);
+}
+
+// without a bus master the drives stay on PIO, not a failure
+static init_result_t ata_dma_step(void* ctx) {
+    (void)ctx;
+    ata_dma_init();
+    return INIT_OK;
+}
+
+static init_result_t ata_blk_step(void* ctx) {
+    return blk_device_register(ata_blk_device_get((ata_context_t*)ctx)) ? INIT_OK : INIT_ERROR;
+}
+
+#ifdef SCRATCH_TRIM_TEST
+static init_result_t ata2_trim_poll(void* ctx) {
+    (void)ctx;
+    blk_device_t* dev = discard_device_get(&g_ata2_discard);
+    dev->tick(dev);
+    if (discard_flush(&g_ata2_discard)) return INIT_AGAIN;
+
+    serial_write("ata2: ");
+    serial_write_dec(g_ata2_discard.issued_sectors);
+    serial_write(" scratch sectors discarded in ");
+    serial_write_dec(g_ata2_discard.issued);
+    serial_write(" requests\n");
+    return g_ata2_discard.errors ? INIT_ERROR : INIT_OK;
+}
+
+// a drive without TRIM completes the DISCARD without doing anything
+static init_result_t ata2_trim_start(void* ctx) {
+    discard_init(&g_ata2_discard, ata_blk_device_get(ata_context_get(1, 0)));
+    discard_queue_add(&g_ata2_discard, 0, SCRATCH_TRIM_SECTORS);
+    return ata2_trim_poll(ctx);
+}
+#endif
+
+#ifdef BLK_BENCH
+// the client only sees the shared frame and the buffer's index: the entries say
+// where in the buffer, never an address
+static init_result_t ring0_step(void* ctx) {
+    (void)ctx;
+    if (!blk_ring_init(&g_ring0, ata_blk_device_get(ata_context_get(0, 0)))) return INIT_ERROR;
+    uint64_t frames = RING_CHECK_ENTRIES * RING_CHECK_SECTORS * BLK_SECTOR_SIZE / PAGE_SIZE;
+    phys_addr_t buf = pmm_range_alloc(frames);
+    if (buf == PMM_INVALID_FRAME) return INIT_ERROR;
+    uint16_t idx = blk_ring_buffer_register(&g_ring0, buf, frames * PAGE_SIZE);
+
+    blk_ring_shared_t* sh = g_ring0.shared;
+    for (uint32_t i = 0; i < RING_CHECK_ENTRIES; i++) {
+        blk_ring_sqe_t* sqe = blk_ring_sqe_at(sh, i);
+        sqe->op = BLK_OP_READ;
+        sqe->buf = idx;
+        sqe->buf_offset = i * RING_CHECK_SECTORS * BLK_SECTOR_SIZE;
+        sqe->lba = (uint64_t)i * RING_CHECK_SECTORS;
+        sqe->count = RING_CHECK_SECTORS;
+        sqe->flags = 0;
+        sqe->user_data = i;
+    }
+    blk_ring_sq_publish(sh, RING_CHECK_ENTRIES);
+
+    uint64_t t0 = rdtsc();
+    blk_ring_enter(&g_ring0, RING_CHECK_ENTRIES);
+    uint64_t cycles = rdtsc() - t0;
+
+    blk_ring_cqe_t cqes[RING_CHECK_ENTRIES];
+    uint32_t n = blk_ring_reap(sh, cqes, RING_CHECK_ENTRIES);
+    uint32_t ok = 0;
+    for (uint32_t i = 0; i < n; i++) ok += cqes[i].res == BLK_RING_RES_OK;
+
+    // the boot sector came back where entry 0 pointed
+    const uint8_t* mbr = (const uint8_t*)(buf + HHDM_OFFSET);
+    uint8_t signed_mbr = mbr[510] == 0x55 && mbr[511] == 0xAA;
+    blk_ring_buffer_unregister(&g_ring0, idx);
+    pmm_range_free(buf, frames);
+
+    serial_write("ring0: ");
+    serial_write_dec(ok);
+    serial_write(" of ");
+    serial_write_dec(RING_CHECK_ENTRIES);
+    serial_write(" reads in ");
+    serial_write_dec(g_ring0.doorbells);
+    serial_write(" doorbell, ");
+    serial_write_dec(g_tsc_hz ? cycles * 1000000 / g_tsc_hz : 0);
+    serial_write(" us\n");
+    return ok == RING_CHECK_ENTRIES && signed_mbr ? INIT_OK : INIT_ERROR;
+}
+#endif
+
+// no initrd from the loader is the usual case
+static init_result_t initrd_step(void* ctx) {
+    (void)ctx;
+    if (!initrd_init(&g_initrd, g_bi)) return INIT_OK;
+    return blk_device_register(initrd_device_get(&g_initrd)) ? INIT_OK : INIT_ERROR;
+}
+
+// the data disk of DISK_IF=ahci; without a controller or a disk on it the step
+// fails and nothing depends on it
+static init_result_t ahci_step(void* ctx) {
+    (void)ctx;
+    if (!ahci_init()) return INIT_ERROR;
+    idt_gate_set(PIC_REMAP_MASTER + ahci_irq_line_get(), (uint64_t)irq_ahci);
+    setup_ahci_irq();
+    return blk_device_register(ahci_blk_device_get()) ? INIT_OK : INIT_ERROR;
+}
+
+// the data disk of DISK_IF=virtio. one CPU, so one queue whatever the device offers
+static init_result_t virtio_step(void* ctx) {
+    (void)ctx;
+    if (!virtio_blk_init(1)) return INIT_ERROR;
+    idt_gate_set(PIC_REMAP_MASTER + virtio_blk_irq_line_get(), (uint64_t)irq_virtio_blk);
+    setup_virtio_blk_irq();
+    for (uint8_t i = 0; i < virtio_blk_queue_count(); i++) {
+        if (!blk_device_register(virtio_blk_device_get(i))) return INIT_ERROR;
+    }
+    return INIT_OK;
+}
+
+#ifdef BLK_BENCH
+// reads the first MD0_CHECK_SECTORS of dev, MD0_CHECK_REQ at a time. KiB/s, 0 if a read failed
+static uint64_t md0_read_rate(blk_device_t* dev, void* buf) {
+    uint64_t t0 = rdtsc();
+    for (uint64_t lba = 0; lba < MD0_CHECK_SECTORS; lba += MD0_CHECK_REQ) {
+        blk_request_t req = { .op = BLK_OP_READ, .lba = lba, .count = MD0_CHECK_REQ, .addr = buf };
+        if (!blk_request_wait(dev, &req)) return 0;
+    }
+    uint64_t cycles = rdtsc() - t0;
+    return (uint64_t)MD0_CHECK_SECTORS * BLK_SECTOR_SIZE / 1024 * g_tsc_hz / cycles;
+}
+
+// what a request split over both channels gains over the same request on one drive
+static void md0_bench(blk_device_t* md0, blk_device_t* member) {
+    if (member->sectors < MD0_CHECK_SECTORS || g_tsc_hz == 0) return;
+    uint64_t frames = MD0_CHECK_REQ * BLK_SECTOR_SIZE / PAGE_SIZE;
+    phys_addr_t buf = pmm_range_alloc(frames);
+    if (buf == PMM_INVALID_FRAME) return;
+
+    uint64_t single = md0_read_rate(member, (void*)(buf + HHDM_OFFSET));
+    uint64_t striped = md0_read_rate(md0, (void*)(buf + HHDM_OFFSET));
+    pmm_range_free(buf, frames);
+
+    serial_write("md0: ");
+    serial_write_dec(striped);
+    serial_write(" KiB/s reading ");
+    serial_write_dec(MD0_CHECK_REQ);
+    serial_write("-sector requests, ata1 alone ");
+    serial_write_dec(single);
+    serial_write(" KiB/s\n");
+}
+#endif
+
+// the two slaves (RAID0_MB in build.sh) striped as md0, benchmarked with BENCH=1
+static init_result_t md0_step(void* ctx) {
+    (void)ctx;
+    blk_device_t* members[2];
+    for (uint8_t i = 0; i < 2; i++) {
+        blkq_init(&g_md0_queues[i], ata_blk_device_get(ata_context_get(i, 1)));
+        members[i] = blkq_device_get(&g_md0_queues[i]);
+    }
+    if (!raid0_init(&g_md0, members, 2, RAID0_DEFAULT_CHUNK)) return INIT_ERROR;
+    blk_device_t* md0 = raid0_device_get(&g_md0);
+    if (!blk_device_register(md0)) return INIT_ERROR;
+#ifdef BLK_BENCH
+    md0_bench(md0, members[0]);
+#endif
+    return INIT_OK;
+}
+
+#ifdef KEXEC_TEST
+// KEXEC=1 (build.sh): a kernel the loader started reloads itself from ata0 once,
+// the second one prints the restart time with its timeline
+static kexec_t g_kexec;
+
+static void kexec_test(void) {
+    if (g_bi->stamps[BOOT_STAMP_KEXEC]) return;
+    if (!kexec_load(&g_kexec, ata_blk_device_get(ata_context_get(0, 0)))) {
+        serial_write("kexec: no kernel image to load from ata0\n");
+        return;
+    }
+    serial_write("kexec: restarting\n");
+    irq_save();
+    kexec_exec(&g_kexec, (phys_addr_t)(uintptr_t)bootinfo_ptr);
+}
+#endif
+
+#ifdef HIBERNATE_TEST
+// HIBERNATE=1 (build.sh): the first boot saves the system to ata0's hibernation
+// area and powers off, the next one resumes it. the token is only set before the
+// save, so the resumed kernel printing the same one is the round trip
+#define ACPI_PM1A_CNT   0x604   // QEMU's i440fx PM base (SeaBIOS) + PM1a control
+#define ACPI_SLP_S5     0x2000  // SLP_EN, SLP_TYP 0: soft off
+
+static uint64_t g_hib_token;
+
+static void hibernate_test(void) {
+    g_hib_token = rdtsc();
+    // masked across the round trip: a resumed kernel finds the PIC as the BIOS left it
+    uint64_t flags = irq_save();
+    hib_result_t r = hibernate_save(ata_blk_device_get(ata_context_get(0, 0)), g_bi);
+    if (r == HIB_FAILED) {
+        irq_restore(flags);
+        serial_write("hibernate: nothing saved\n");
+        return;
+    }
+    if (r == HIB_SAVED) {
+        serial_write("hibernate: image saved, token ");
+        serial_write_dec(g_hib_token);
+        serial_write(", powering off\n");
+        outw(ACPI_PM1A_CNT, ACPI_SLP_S5);
+        return;
+    }
+
+    serial_write("hibernate: resumed, token ");
+    serial_write_dec(g_hib_token);
+    serial_write("\n");
+    boot_timeline_print(g_bi, g_tsc_hz);
+    if (g_tsc_hz >= 1000000) {
+        serial_write("hibernate: back in the kernel ");
+        serial_write_dec((rdtsc() - g_bi->stamps[BOOT_STAMP_BOOT1]) / (g_tsc_hz / 1000000));
+        serial_write(" us after boot1\n");
+    }
+}
+#endif
 
 void kmain(void) {
+    boot_stamp(bootinfo_ptr, BOOT_STAMP_KERNEL);
+
     // zero bss
     for (char *p = __bss_start; p < __bss_end; p++)
         *p = 0;
-    
-    extern boot_info_t* bootinfo_ptr;
-    
+    boot_stamp(bootinfo_ptr, BOOT_STAMP_BSS);
+
     char* msg = "HELLO WORLD!";
 
     volatile uint16_t* v = (uint16_t*)VGA_ADDR; //VGA
     for (uint32_t i = 0; msg[i] != '\0'; i++) {
         v[i] = (uint16_t)msg[i] | (uint16_t)(0x07 << 8);
     }
-    pmm_init(bootinfo_ptr->e820_map, bootinfo_ptr->e820_count);
-    vmm_init();
+
+    // ata2 is the secondary master (IDE_SECOND_DISK), ata1 and ata3 the slaves
+    // md0 stripes (RAID0_MB); a missing drive fails its probe and only the steps
+    // that need it are skipped
+    init_step_t steps[STEP_COUNT] = {
+        [STEP_ATA0]     = { .name = "ata0 probe", .start = ata_probe_start, .poll = ata_probe_poll, .ctx = ata_context_get(0, 0) },
+        [STEP_ATA2]     = { .name = "ata2 probe", .start = ata_probe_start, .poll = ata_probe_poll, .ctx = ata_context_get(1, 0) },
+        [STEP_ATA1]     = { .name = "ata1 probe", .start = ata_probe_start, .poll = ata_probe_poll, .ctx = ata_context_get(0, 1) },
+        [STEP_ATA3]     = { .name = "ata3 probe", .start = ata_probe_start, .poll = ata_probe_poll, .ctx = ata_context_get(1, 1) },
+        [STEP_PMM]      = { .name = "pmm", .start = pmm_step },
+        [STEP_VMM]      = { .name = "vmm", .deps = INIT_DEP(STEP_PMM), .start = vmm_step },
+        [STEP_SERIAL]   = { .name = "serial", .start = serial_step },
+        [STEP_CLOCK]    = { .name = "tsc", .deps = INIT_DEP(STEP_VMM), .start = clock_step },
+        [STEP_IRQ]      = { .name = "irq", .deps = INIT_DEP(STEP_CLOCK), .start = irq_step },
+        [STEP_ATA_DMA]  = { .name = "ata dma", .deps = INIT_DEP(STEP_PMM) | INIT_DEP(STEP_VMM), .start = ata_dma_step },
+        [STEP_ATA0_BLK] = { .name = "ata0", .deps = INIT_DEP(STEP_ATA0) | INIT_DEP(STEP_ATA_DMA) | INIT_DEP(STEP_IRQ), .start = ata_blk_step, .ctx = ata_context_get(0, 0) },
+        [STEP_ATA2_BLK] = { .name = "ata2", .deps = INIT_DEP(STEP_ATA2) | INIT_DEP(STEP_ATA_DMA) | INIT_DEP(STEP_IRQ), .start = ata_blk_step, .ctx = ata_context_get(1, 0) },
+#ifdef SCRATCH_TRIM_TEST
+        [STEP_ATA2_TRIM] = { .name = "ata2 trim", .deps = INIT_DEP(STEP_ATA2_BLK) | INIT_DEP(STEP_SERIAL),
+                             .start = ata2_trim_start, .poll = ata2_trim_poll },
+#endif
+#ifdef BLK_BENCH
+        [STEP_RING0]    = { .name = "ring0", .deps = INIT_DEP(STEP_ATA0_BLK) | INIT_DEP(STEP_SERIAL), .start = ring0_step },
+#endif
+        [STEP_INITRD]   = { .name = "rd0", .deps = INIT_DEP(STEP_PMM) | INIT_DEP(STEP_VMM), .start = initrd_step },
+        [STEP_MD0]      = { .name = "md0", .deps = INIT_DEP(STEP_ATA1) | INIT_DEP(STEP_ATA3) | INIT_DEP(STEP_ATA_DMA) |
+                                                   INIT_DEP(STEP_IRQ) | INIT_DEP(STEP_SERIAL), .start = md0_step },
+        [STEP_AHCI]     = { .name = "ahci0", .deps = INIT_DEP(STEP_PMM) | INIT_DEP(STEP_VMM) | INIT_DEP(STEP_IRQ), .start = ahci_step },
+        [STEP_VIRTIO]   = { .name = "virtio-blk", .deps = INIT_DEP(STEP_PMM) | INIT_DEP(STEP_VMM) | INIT_DEP(STEP_IRQ), .start = virtio_step },
+    };
+    init_run(steps, STEP_COUNT);
+    boot_stamp(g_bi, BOOT_STAMP_READY);
+
+    boot_timeline_print(g_bi, g_tsc_hz);
+    init_report(steps, STEP_COUNT, g_bi->stamps[BOOT_STAMP_KERNEL], g_tsc_hz);
+#ifdef KEXEC_TEST
+    if (steps[STEP_ATA0_BLK].state == INIT_STATE_DONE) kexec_test();
+#endif
+#ifdef HIBERNATE_TEST
+    if (steps[STEP_ATA0_BLK].state == INIT_STATE_DONE) hibernate_test();
+#endif
 
     for (;;) {
         __asm__ __volatile__("hlt");
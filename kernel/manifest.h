@@ -0,0 +1,42 @@
+#pragma once
+#include "common.h"
+
+// boot manifest, the sector build.sh writes at LBA 1 (see kernelLoader/manifest.h).
+// the kernel reads it from disk itself: the copy boot1 left at 0x7E00 may be stale
+#define MANIFEST_LBA         1
+#define MANIFEST_MAGIC       0x4E414D42u   // "BMAN"
+#define MANIFEST_MAX_ENTRIES 15
+
+#define MANIFEST_ID_BOOT2    1
+#define MANIFEST_ID_LOADER   2
+#define MANIFEST_ID_KERNEL   3
+#define MANIFEST_ID_INITRD   4
+#define MANIFEST_ID_HIBERNATE 5     // reserved area for the hibernation image (no contents to check)
+
+typedef struct manifest_entry_t {
+  uint32_t id;
+  uint32_t load_addr;           // 0: loaded by a later stage
+  uint64_t lba;
+  uint32_t sectors;
+  uint32_t bytes;
+  uint32_t checksum;            // 32-bit sum of the dwords over whole sectors
+  uint32_t flags;
+} __attribute__((packed)) manifest_entry_t;
+
+typedef struct manifest_t {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  uint32_t rsvd[2];
+  manifest_entry_t entries[MANIFEST_MAX_ENTRIES];
+} __attribute__((packed)) manifest_t;
+
+// NULL if m is not a manifest or has no such component
+static inline const manifest_entry_t* manifest_entry_find(const manifest_t* m, uint32_t id) {
+  if (m->magic != MANIFEST_MAGIC) return NULL;
+
+  for (uint16_t i = 0; i < m->count && i < MANIFEST_MAX_ENTRIES; i++) {
+    if (m->entries[i].id == id) return &m->entries[i];
+  }
+  return NULL;
+}
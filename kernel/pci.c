@@ -0,0 +1,125 @@
+#include "pci.h"
+#include "common.h"
+
+static inline uint32_t pci_config_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    return PCI_CONFIG_ENABLE |
+           ((uint32_t)bus << 16) |
+           ((uint32_t)(slot & 0x1F) << 11) |
+           ((uint32_t)(func & 0x07) << 8) |
+           (uint32_t)(offset & 0xFC);
+}
+
+uint32_t pci_config_read_32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(bus, slot, func, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+uint16_t pci_config_read_16(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    uint32_t v = pci_config_read_32(bus, slot, func, offset);
+    return (uint16_t)(v >> ((offset & 2) * 8));
+}
+
+uint8_t pci_config_read_8(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    uint32_t v = pci_config_read_32(bus, slot, func, offset);
+    return (uint8_t)(v >> ((offset & 3) * 8));
+}
+
+void pci_config_write_32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(bus, slot, func, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+void pci_config_write_16(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t value) {
+    // read-modify-write the dword, config space is only dword addressable here
+    uint32_t shift = (offset & 2) * 8;
+    uint32_t v = pci_config_read_32(bus, slot, func, offset);
+    v = (v & ~(0xFFFFu << shift)) | ((uint32_t)value << shift);
+    pci_config_write_32(bus, slot, func, offset, v);
+}
+
+static void pci_device_fill(uint8_t bus, uint8_t slot, uint8_t func, pci_device_t* out) {
+    out->bus = bus;
+    out->slot = slot;
+    out->func = func;
+    out->vendor_id = pci_config_read_16(bus, slot, func, PCI_REG_VENDOR_ID);
+    out->device_id = pci_config_read_16(bus, slot, func, PCI_REG_DEVICE_ID);
+    out->class_code = pci_config_read_8(bus, slot, func, PCI_REG_CLASS);
+    out->subclass = pci_config_read_8(bus, slot, func, PCI_REG_SUBCLASS);
+    out->prog_if = pci_config_read_8(bus, slot, func, PCI_REG_PROG_IF);
+    out->irq_line = pci_config_read_8(bus, slot, func, PCI_REG_IRQ_LINE);
+}
+
+typedef uint8_t (*pci_match_fn)(uint8_t bus, uint8_t slot, uint8_t func, uint32_t a, uint32_t b);
+
+static uint8_t pci_match_class(uint8_t bus, uint8_t slot, uint8_t func, uint32_t class_code, uint32_t subclass) {
+    return pci_config_read_8(bus, slot, func, PCI_REG_CLASS) == class_code &&
+           pci_config_read_8(bus, slot, func, PCI_REG_SUBCLASS) == subclass;
+}
+
+static uint8_t pci_match_id(uint8_t bus, uint8_t slot, uint8_t func, uint32_t vendor_id, uint32_t device_id) {
+    return pci_config_read_16(bus, slot, func, PCI_REG_VENDOR_ID) == vendor_id &&
+           pci_config_read_16(bus, slot, func, PCI_REG_DEVICE_ID) == device_id;
+}
+
+static uint8_t pci_device_scan(pci_match_fn match, uint32_t a, uint32_t b, uint8_t index, pci_device_t* out) {
+    for (uint32_t bus = 0; bus < PCI_MAX_BUS; bus++) {
+        for (uint8_t slot = 0; slot < PCI_MAX_SLOT; slot++) {
+            if (pci_config_read_16((uint8_t)bus, slot, 0, PCI_REG_VENDOR_ID) == PCI_VENDOR_NONE) continue;
+
+            uint8_t funcs = (pci_config_read_8((uint8_t)bus, slot, 0, PCI_REG_HEADER_TYPE) & PCI_HEADER_MULTIFN) ? PCI_MAX_FUNC : 1;
+            for (uint8_t func = 0; func < funcs; func++) {
+                if (pci_config_read_16((uint8_t)bus, slot, func, PCI_REG_VENDOR_ID) == PCI_VENDOR_NONE) continue;
+                if (!match((uint8_t)bus, slot, func, a, b)) continue;
+                if (index--) continue;
+
+                pci_device_fill((uint8_t)bus, slot, func, out);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+uint8_t pci_device_find_by_class(uint8_t class_code, uint8_t subclass, uint8_t index, pci_device_t* out) {
+    return pci_device_scan(pci_match_class, class_code, subclass, index, out);
+}
+
+uint8_t pci_device_find(uint16_t vendor_id, uint16_t device_id, uint8_t index, pci_device_t* out) {
+    return pci_device_scan(pci_match_id, vendor_id, device_id, index, out);
+}
+
+uint32_t pci_bar_get(const pci_device_t* dev, uint8_t bar) {
+    return pci_config_read_32(dev->bus, dev->slot, dev->func, (uint8_t)(PCI_REG_BAR0 + bar * 4));
+}
+
+phys_addr_t pci_bar_address_get(const pci_device_t* dev, uint8_t bar) {
+    uint32_t low = pci_bar_get(dev, bar);
+    if (low & PCI_BAR_IO) return 0;
+
+    phys_addr_t addr = low & PCI_BAR_MEM_MASK;
+    if ((low & 0x06) == PCI_BAR_MEM_TYPE_64) {
+        addr |= (phys_addr_t)pci_bar_get(dev, (uint8_t)(bar + 1)) << 32;
+    }
+    return addr;
+}
+
+uint8_t pci_capability_find(const pci_device_t* dev, uint8_t cap_id, uint8_t after) {
+    if (!(pci_config_read_16(dev->bus, dev->slot, dev->func, PCI_REG_STATUS) & PCI_STATUS_CAP_LIST)) return 0;
+
+    uint8_t off = after ? pci_config_read_8(dev->bus, dev->slot, dev->func, (uint8_t)(after + 1))
+                        : pci_config_read_8(dev->bus, dev->slot, dev->func, PCI_REG_CAP_PTR);
+
+    // bounded walk, a broken list must not hang us
+    for (int guard = 0; off != 0 && guard < 48; guard++) {
+        off &= 0xFC;
+        if (pci_config_read_8(dev->bus, dev->slot, dev->func, off) == cap_id) return off;
+        off = pci_config_read_8(dev->bus, dev->slot, dev->func, (uint8_t)(off + 1));
+    }
+    return 0;
+}
+
+void pci_bus_master_enable(const pci_device_t* dev) {
+    uint16_t cmd = pci_config_read_16(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND);
+    cmd |= PCI_CMD_IO_SPACE | PCI_CMD_MEM_SPACE | PCI_CMD_BUS_MASTER;
+    pci_config_write_16(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND, cmd);
+}
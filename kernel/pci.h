@@ -0,0 +1,85 @@
+#pragma once
+#include "common.h"
+
+// legacy configuration mechanism #1
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+#define PCI_CONFIG_ENABLE  0x80000000u
+
+#define PCI_MAX_BUS   256
+#define PCI_MAX_SLOT  32
+#define PCI_MAX_FUNC  8
+
+// config space offsets (type 0 header)
+#define PCI_REG_VENDOR_ID   0x00
+#define PCI_REG_DEVICE_ID   0x02
+#define PCI_REG_COMMAND     0x04
+#define PCI_REG_STATUS      0x06
+#define PCI_REG_PROG_IF     0x09
+#define PCI_REG_SUBCLASS    0x0A
+#define PCI_REG_CLASS       0x0B
+#define PCI_REG_HEADER_TYPE 0x0E
+#define PCI_REG_BAR0        0x10
+#define PCI_REG_CAP_PTR     0x34
+#define PCI_REG_IRQ_LINE    0x3C
+
+#define PCI_VENDOR_NONE     0xFFFF
+#define PCI_HEADER_MULTIFN  0x80
+#define PCI_STATUS_CAP_LIST (1u << 4)
+
+// capability IDs
+#define PCI_CAP_ID_VENDOR   0x09
+
+// command register bits
+#define PCI_CMD_IO_SPACE    (1u << 0)
+#define PCI_CMD_MEM_SPACE   (1u << 1)
+#define PCI_CMD_BUS_MASTER  (1u << 2)
+#define PCI_CMD_INTX_OFF    (1u << 10)
+
+// BAR bits
+#define PCI_BAR_IO          0x01
+#define PCI_BAR_IO_MASK     0xFFFFFFFCu
+#define PCI_BAR_MEM_MASK    0xFFFFFFF0u
+#define PCI_BAR_MEM_TYPE_64 0x04
+
+// class codes we care about
+#define PCI_CLASS_STORAGE   0x01
+#define PCI_SUBCLASS_IDE    0x01
+#define PCI_SUBCLASS_SATA   0x06
+#define PCI_PROG_IF_AHCI    0x01
+
+typedef struct pci_device_t {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq_line;
+} pci_device_t;
+
+uint32_t pci_config_read_32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+uint16_t pci_config_read_16(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+uint8_t pci_config_read_8(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+void pci_config_write_32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
+void pci_config_write_16(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t value);
+
+// finds the index-th function matching class/subclass; returns 0 if none
+uint8_t pci_device_find_by_class(uint8_t class_code, uint8_t subclass, uint8_t index, pci_device_t* out);
+
+// finds the index-th function with this vendor/device id; returns 0 if none
+uint8_t pci_device_find(uint16_t vendor_id, uint16_t device_id, uint8_t index, pci_device_t* out);
+
+// raw BAR value (caller masks I/O vs memory bits)
+uint32_t pci_bar_get(const pci_device_t* dev, uint8_t bar);
+
+// decoded memory BAR address, 64-bit BARs included; 0 for I/O BARs
+phys_addr_t pci_bar_address_get(const pci_device_t* dev, uint8_t bar);
+
+// config offset of the next capability with this id after `after` (0 = from the start), 0 if none
+uint8_t pci_capability_find(const pci_device_t* dev, uint8_t cap_id, uint8_t after);
+
+// sets bus master (+ I/O and memory decode) in the command register
+void pci_bus_master_enable(const pci_device_t* dev);
@@ -0,0 +1,46 @@
+#include "pit.h"
+#include "common.h"
+#include "ata_driver_irq.h"
+
+static uint64_t g_pit_tsc_hz = 0;
+static uint64_t g_pit_max_cycles = 0;   // TSC cycles in one full channel 0 count
+static uint8_t g_pit_ready = 0;
+
+uint8_t pit_init(uint64_t tsc_hz) {
+    if (tsc_hz == 0) {
+        uint64_t flags = irq_save();
+        tsc_hz = pit_tsc_calibrate(PIT_CALIBRATE_COUNT);
+        irq_restore(flags);
+    }
+    g_pit_tsc_hz = tsc_hz;
+    if (g_pit_tsc_hz == 0) return 0;
+    g_pit_max_cycles = g_pit_tsc_hz * PIT_COUNT_MAX / PIT_HZ;
+
+    // the control word alone stops channel 0 (replaces the BIOS periodic tick)
+    outb(PIT_CMD, PIT_CMD_CH0_ONESHOT);
+    unmask_irq(PIC_IRQ_PIT);
+    g_pit_ready = 1;
+    return 1;
+}
+
+uint8_t pit_is_ready(void) { return g_pit_ready; }
+
+uint64_t pit_tsc_hz_get(void) { return g_pit_tsc_hz; }
+
+void pit_oneshot_arm(uint64_t tsc_cycles) {
+    uint32_t count = PIT_COUNT_MAX;
+    if (tsc_cycles < g_pit_max_cycles) count = (uint32_t)(tsc_cycles * PIT_HZ / g_pit_tsc_hz);
+    if (count == 0) count = 1;
+
+    // mode 0: a new count restarts the channel, OUT rises (IRQ0) when it reaches zero
+    outb(PIT_CMD, PIT_CMD_CH0_ONESHOT);
+    outb(PIT_CH0_DATA, (uint8_t)count);
+    outb(PIT_CH0_DATA, (uint8_t)(count >> 8));
+}
+
+// only there to end a hlt, whoever armed it re-checks its own state
+IRQ_HANDLER
+void irq0_pit(interrupt_frame_t* f) {
+    (void)f;
+    send_eoi(PIC_IRQ_PIT);
+}
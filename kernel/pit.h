@@ -0,0 +1,34 @@
+#pragma once
+#include "common.h"
+#include "idt.h"
+#include "pit_calibrate.h"
+
+// 8254 PIT channel 0 (channel 2 and the ports they share: shared/pit_calibrate.h)
+#define PIT_CH0_DATA   0x40
+#define PIT_COUNT_MAX  0xFFFF
+
+// channel 0, lobyte/hibyte access, mode 0 (interrupt on terminal count), binary
+#define PIT_CMD_CH0_ONESHOT 0x30
+
+// calibration window: 10ms, pit_tsc_calibrate(PIT_CALIBRATE_COUNT)
+#define PIT_CALIBRATE_COUNT (PIT_HZ / 100)
+
+#define PIC_IRQ_PIT 0
+
+// PIT usage:
+// 1) remap the PIC first (setup_ata_irq() does)
+// 2) IDT vector 32 -> irq0_pit
+// 3) pit_init(tsc_hz): takes the TSC frequency (0: measures it against
+//    channel 2), then leaves channel 0 stopped in one-shot mode and unmasks IRQ0
+// 4) pit_oneshot_arm(cycles): IRQ0 fires once, about that many TSC cycles later
+//    (at most ~55ms, longer waits are clamped)
+// used to wake a hlt early, e.g. the ATA hybrid wait. returns 0 if the TSC
+// could not be calibrated
+uint8_t pit_init(uint64_t tsc_hz);
+
+uint8_t pit_is_ready(void);
+uint64_t pit_tsc_hz_get(void);
+
+void pit_oneshot_arm(uint64_t tsc_cycles);
+
+IRQ_HANDLER void irq0_pit(interrupt_frame_t* f);
@@ -1,6 +1,9 @@
 #include "pmm.h"
 #include "common.h"
 
+// one bit per frame, set = used. bss, so it costs nothing on disk
+static uint64_t g_frame_bitmap[BITMAP_WORDS];
+
 static phys_addr_t g_phys_ceiling = 0;
 
 static inline void frame_bitmap_set(uint64_t frame_idx) {
@@ -27,13 +30,13 @@ static inline uint64_t align_up(uint64_t addr) {
 
 /**
  * Parses E820 map to initialize the physical frame allocator.
- * Initially marks all frames as used (0xFF) to handle holes/reserved memory,
+ * Initially marks all frames as used to handle holes/reserved memory,
  * then clears bits for available RAM (Type 1).
  */
 void pmm_init_from_map(e820_entry_t* map, uint32_t count) {
     // Pessimistic initialization: assume everything is reserved
-    for (uint64_t i = 0; i < BITMAP_BYTES; i++) {
-        g_frame_bitmap[i] = 0xFF;
+    for (uint64_t i = 0; i < BITMAP_WORDS; i++) {
+        g_frame_bitmap[i] = ~0ULL;
     }
 
     for (uint32_t i = 0; i < count; i++) {
@@ -75,7 +78,7 @@ phys_addr_t pmm_highest_address_get(void) {
 }
 
 phys_addr_t pmm_frame_alloc(void) {
-  for (uint64_t frame_block_idx = 0; frame_block_idx < MAX_FRAMES; frame_block_idx++) {
+  for (uint64_t frame_block_idx = 0; frame_block_idx < BITMAP_WORDS; frame_block_idx++) {
     uint64_t frame_block = g_frame_bitmap[frame_block_idx];
 
     if (frame_block == ~0ULL) continue;
@@ -106,3 +109,46 @@ void pmm_init(e820_entry_t* map, uint32_t count) {
   for (uint64_t i = frame_start_idx; i < frame_end_idx; i++) frame_bitmap_set(i);
 }
 
+uint8_t pmm_frame_is_used(uint64_t frame_idx) {
+  if (frame_idx >= MAX_FRAMES) return 1;
+  return (uint8_t)frame_bitmap_test(frame_idx);
+}
+
+phys_addr_t pmm_range_alloc(uint64_t frames) {
+  uint64_t limit = g_phys_ceiling >> PAGE_SHIFT;
+  if (limit > MAX_FRAMES) limit = MAX_FRAMES;
+  if (frames == 0) return PMM_INVALID_FRAME;
+
+  uint64_t run = 0;
+  for (uint64_t i = 0; i < limit; i++) {
+    // whole words in use end the run at once
+    if ((i & 63) == 0 && g_frame_bitmap[i >> 6] == ~0ULL) {
+      run = 0;
+      i += 63;
+      continue;
+    }
+    if (frame_bitmap_test(i)) {
+      run = 0;
+      continue;
+    }
+    if (++run < frames) continue;
+
+    uint64_t first = i + 1 - frames;
+    for (uint64_t j = first; j <= i; j++) frame_bitmap_set(j);
+    return (phys_addr_t)(first << PAGE_SHIFT);
+  }
+  return PMM_INVALID_FRAME;
+}
+
+void pmm_range_free(phys_addr_t base, uint64_t frames) {
+  for (uint64_t i = 0; i < frames; i++) pmm_frame_free((base >> PAGE_SHIFT) + i);
+}
+
+void pmm_range_reserve(phys_addr_t base, uint64_t size) {
+  uint64_t start_idx = align_down(base) >> PAGE_SHIFT;
+  uint64_t end_idx = align_up(base + size) >> PAGE_SHIFT;
+  if (end_idx > MAX_FRAMES) end_idx = MAX_FRAMES;
+
+  for (uint64_t i = start_idx; i < end_idx; i++) frame_bitmap_set(i);
+}
+
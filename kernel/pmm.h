@@ -3,17 +3,19 @@
 
 #define MAX_RAM_BYTES (64ULL * 1024 * 1024 * 1024)
 #define MAX_FRAMES (MAX_RAM_BYTES / PAGE_SIZE)
-#define BITMAP_BYTES ((MAX_FRAMES + 7) / 8)
+#define BITMAP_WORDS ((MAX_FRAMES + 63) / 64)
 #define PMM_INVALID_FRAME UINT64_MAX
 #define PMM_RESERVED_FRAMES ((64 * 1024 * 1024) >> PAGE_SHIFT)
 
-static uint64_t g_frame_bitmap[BITMAP_BYTES];
-
-static uint64_t g_frame_count;  // actual frames present from E820
-
 void pmm_init_from_map(e820_entry_t* map, uint32_t count); 
 phys_addr_t pmm_frame_alloc(void);
 void pmm_frame_free(uint64_t frame_idx); 
+uint8_t pmm_frame_is_used(uint64_t frame_idx);
 phys_addr_t pmm_highest_address_get(void);
 void pmm_init(e820_entry_t* map, uint32_t count);
+// marks the frames under base..base+size used (boot data the kernel keeps, e.g. the initrd)
+void pmm_range_reserve(phys_addr_t base, uint64_t size);
+// physically contiguous frames, first fit. PMM_INVALID_FRAME if no run is long enough
+phys_addr_t pmm_range_alloc(uint64_t frames);
+void pmm_range_free(phys_addr_t base, uint64_t frames);
  
@@ -0,0 +1,250 @@
+#include "raid0.h"
+#include "common.h"
+
+static raid0_child_t* raid0_child_alloc(raid0_t* r) {
+  raid0_child_t* child = r->free_children;
+  r->free_children = child->next;
+  r->free_child_count--;
+  child->next = NULL;
+  return child;
+}
+
+static void raid0_child_free(raid0_t* r, raid0_child_t* child) {
+  child->next = r->free_children;
+  r->free_children = child;
+  r->free_child_count++;
+}
+
+static void raid0_backlog_push(raid0_t* r, raid0_child_t* child) {
+  uint8_t m = child->member;
+  child->next = NULL;
+  if (r->backlog_tail[m]) r->backlog_tail[m]->next = child;
+  else r->backlog[m] = child;
+  r->backlog_tail[m] = child;
+}
+
+// hands queued pieces to every member until each one refuses
+static void raid0_kick(raid0_t* r) {
+  if (r->kicking) return;
+  r->kicking = 1;
+
+  for (uint8_t m = 0; m < r->member_count; m++) {
+    blk_device_t* dev = r->members[m];
+    while (r->backlog[m]) {
+      raid0_child_t* child = r->backlog[m];
+
+      // unlinked first, the member may complete (and free) it before submit returns
+      r->backlog[m] = child->next;
+      if (!r->backlog[m]) r->backlog_tail[m] = NULL;
+
+      if (!dev->submit(dev, &child->req)) {
+        child->next = r->backlog[m];
+        r->backlog[m] = child;
+        if (!r->backlog_tail[m]) r->backlog_tail[m] = child;
+        break;
+      }
+    }
+  }
+
+  r->kicking = 0;
+}
+
+static void raid0_child_done(blk_request_t* req) {
+  raid0_child_t* child = (raid0_child_t*)req->priv;
+  raid0_t* r = child->raid;
+  raid0_parent_t* parent = child->parent;
+
+  if (req->status != BLK_REQ_DONE) parent->failed = 1;
+  raid0_child_free(r, child);
+
+  // keep the members busy before running the caller's callback
+  raid0_kick(r);
+
+  if (--parent->pending != 0) return;
+
+  blk_request_t* preq = parent->req;
+  uint8_t success = !parent->failed;
+  parent->next = r->free_parents;
+  r->free_parents = parent;
+  blk_request_complete(preq, success);
+}
+
+static raid0_child_t* raid0_child_queue(raid0_t* r, raid0_parent_t* parent, uint8_t member,
+                                        blk_op_t op, uint64_t lba, uint32_t count, void* addr, uint32_t flags) {
+  raid0_child_t* child = raid0_child_alloc(r);
+  child->parent = parent;
+  child->member = member;
+  child->req.op = op;
+  child->req.lba = lba;
+  child->req.count = count;
+  child->req.addr = addr;
+  child->req.flags = flags;
+  child->req.status = BLK_REQ_PENDING;
+  child->req.done = raid0_child_done;
+  child->req.priv = child;
+  raid0_backlog_push(r, child);
+  return child;
+}
+
+// the next bytes of a segment list as a list of their own in out (NULL: just count).
+// returns the segments that takes
+static uint32_t raid0_sg_slice(const blk_sg_list_t* sg, blk_buf_cursor_t* cur, uint64_t bytes, blk_segment_t* out) {
+  uint32_t n = 0;
+  while (bytes && cur->seg < sg->count) {
+    const blk_segment_t* s = &sg->segs[cur->seg];
+    uint64_t len = s->len - cur->seg_off;
+    if (len > bytes) len = bytes;
+
+    if (out) {
+      phys_addr_t p = s->frame + s->offset + cur->seg_off;
+      out[n].frame = p & ~PAGE_MASK;
+      out[n].offset = (uint32_t)(p & PAGE_MASK);
+      out[n].len = (uint32_t)len;
+    }
+    n++;
+    blk_sg_skip(sg, cur, len);
+    bytes -= len;
+  }
+  return n;
+}
+
+// every piece's share of a segment list fits in a child
+static uint8_t raid0_sg_fits(const raid0_t* r, const blk_request_t* req) {
+  const blk_sg_list_t* sg = (const blk_sg_list_t*)req->addr;
+  blk_buf_cursor_t cur = { 0, 0, 0 };
+  uint64_t lba = req->lba;
+  uint32_t left = req->count;
+  while (left) {
+    uint32_t n = r->chunk_sectors - (uint32_t)(lba % r->chunk_sectors);
+    if (n > left) n = left;
+    if (raid0_sg_slice(sg, &cur, (uint64_t)n * BLK_SECTOR_SIZE, NULL) > RAID0_CHILD_SEGS) return 0;
+    lba += n;
+    left -= n;
+  }
+  return 1;
+}
+
+static uint8_t raid0_submit(blk_device_t* dev, blk_request_t* req) {
+  raid0_t* r = (raid0_t*)dev->ctx;
+  uint32_t cs = r->chunk_sectors;
+
+  uint8_t bad = req->op == BLK_OP_FLUSH ? req->count != 0
+                                        : req->count == 0 || req->lba + req->count > dev->sectors ||
+                                          (req->op != BLK_OP_DISCARD && req->count > dev->max_sectors) ||
+                                          !blk_request_sg_is_valid(req);
+  uint8_t sg = (req->flags & BLK_REQ_F_SG) && req->count && !bad;
+  if (bad || (sg && !raid0_sg_fits(r, req))) {
+    blk_request_complete(req, 0);
+    return 1;
+  }
+
+  // would need a range list per member; discards are only a hint
+  if (req->op == BLK_OP_DISCARD) {
+    blk_request_complete(req, 1);
+    return 1;
+  }
+
+  // a barrier has to reach every member, not just the ones holding its data:
+  // one FLUSH each, queued ahead of the data pieces (which drop PREFLUSH)
+  uint8_t barrier = blk_request_is_barrier(req);
+  uint32_t pieces = req->count ? (uint32_t)(((req->lba % cs) + req->count + cs - 1) / cs) : 0;
+  if (barrier) pieces += r->member_count;
+  if (!r->free_parents || r->free_child_count < pieces) return 0;
+
+  raid0_parent_t* parent = r->free_parents;
+  r->free_parents = parent->next;
+  parent->req = req;
+  parent->pending = pieces;
+  parent->failed = 0;
+  req->status = BLK_REQ_PENDING;
+
+  if (barrier) {
+    for (uint8_t m = 0; m < r->member_count; m++) raid0_child_queue(r, parent, m, BLK_OP_FLUSH, 0, 0, NULL, 0);
+  }
+
+  uint32_t flags = req->flags & ~BLK_REQ_F_PREFLUSH;
+  uint64_t lba = req->lba;
+  uint32_t left = req->count;
+  uint8_t* p = (uint8_t*)req->addr;
+  blk_buf_cursor_t cur = { 0, 0, 0 };
+  while (left) {
+    uint64_t chunk = lba / cs;
+    uint32_t off = (uint32_t)(lba % cs);
+    uint32_t n = cs - off;
+    if (n > left) n = left;
+
+    raid0_child_t* child = raid0_child_queue(r, parent, (uint8_t)(chunk % r->member_count), req->op,
+                                             (chunk / r->member_count) * cs + off, n, p, flags);
+    if (sg) {
+      child->sg.segs = child->segs;
+      child->sg.count = raid0_sg_slice((const blk_sg_list_t*)req->addr, &cur, (uint64_t)n * BLK_SECTOR_SIZE, child->segs);
+      child->req.addr = &child->sg;
+    }
+
+    lba += n;
+    left -= n;
+    p += (uint64_t)n * BLK_SECTOR_SIZE;
+  }
+
+  raid0_kick(r);
+  return 1;
+}
+
+static void raid0_tick(blk_device_t* dev) {
+  raid0_t* r = (raid0_t*)dev->ctx;
+  for (uint8_t m = 0; m < r->member_count; m++) r->members[m]->tick(r->members[m]);
+  raid0_kick(r);
+}
+
+// volumes set up so far, names them md0, md1, ...
+static uint8_t g_raid0_count = 0;
+
+uint8_t raid0_init(raid0_t* r, blk_device_t** members, uint8_t count, uint32_t chunk_sectors) {
+  if (count < 2 || count > RAID0_MAX_MEMBERS || chunk_sectors == 0 || g_raid0_count >= 10) return 0;
+
+  uint64_t smallest = UINT64_MAX;
+  for (uint8_t m = 0; m < count; m++) {
+    if (members[m]->max_sectors < chunk_sectors) return 0;
+    if (members[m]->sectors < smallest) smallest = members[m]->sectors;
+    r->members[m] = members[m];
+    r->backlog[m] = NULL;
+    r->backlog_tail[m] = NULL;
+  }
+  r->member_count = count;
+  r->chunk_sectors = chunk_sectors;
+  r->kicking = 0;
+
+  r->free_children = NULL;
+  r->free_child_count = 0;
+  for (uint32_t i = 0; i < RAID0_CHILD_MAX; i++) {
+    r->children[i].raid = r;
+    raid0_child_free(r, &r->children[i]);
+  }
+
+  r->free_parents = NULL;
+  for (uint32_t i = 0; i < RAID0_PARENT_MAX; i++) {
+    r->parents[i].next = r->free_parents;
+    r->free_parents = &r->parents[i];
+  }
+
+  r->name[0] = 'm';
+  r->name[1] = 'd';
+  r->name[2] = (char)('0' + g_raid0_count++);
+  r->name[3] = 0;
+
+  r->blk.name = r->name;
+  r->blk.sectors = (smallest / chunk_sectors) * chunk_sectors * count;
+  // a request may use at most a quarter of the pieces, so it can always be admitted
+  r->blk.max_sectors = chunk_sectors * (RAID0_CHILD_MAX / 4);
+  r->blk.queue_depth = RAID0_PARENT_MAX;
+  r->blk.submit = raid0_submit;
+  r->blk.tick = raid0_tick;
+  r->blk.idle = NULL;      // members may sleep differently, just spin
+  r->blk.map = NULL;
+  r->blk.ctx = r;
+  return 1;
+}
+
+blk_device_t* raid0_device_get(raid0_t* r) {
+  return &r->blk;
+}
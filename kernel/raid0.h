@@ -0,0 +1,67 @@
+#pragma once
+#include "common.h"
+#include "blk.h"
+
+#define RAID0_MAX_MEMBERS     4
+#define RAID0_DEFAULT_CHUNK   128       // sectors (64 KiB)
+#define RAID0_CHILD_MAX       128       // per-member pieces in flight or queued
+#define RAID0_PARENT_MAX      32        // caller requests in flight
+#define RAID0_CHILD_SEGS      32        // segments a piece of a segment-list request may have
+
+typedef struct raid0_parent_t {
+  blk_request_t* req;                   // caller request
+  uint32_t pending;                     // pieces not completed yet
+  uint8_t failed;
+  struct raid0_parent_t* next;          // free list
+} raid0_parent_t;
+
+// one chunk-sized (or smaller) piece of a caller request, for one member
+typedef struct raid0_child_t {
+  blk_request_t req;                    // what the member sees
+  raid0_parent_t* parent;
+  struct raid0_t* raid;
+  uint8_t member;
+  struct raid0_child_t* next;           // free list / member backlog
+
+  // the piece's share of a segment-list (BLK_REQ_F_SG) request
+  blk_segment_t segs[RAID0_CHILD_SEGS];
+  blk_sg_list_t sg;
+} raid0_child_t;
+
+typedef struct raid0_t {
+  blk_device_t* members[RAID0_MAX_MEMBERS];
+  uint8_t member_count;
+  uint32_t chunk_sectors;
+
+  blk_device_t blk;                     // the striped volume
+  char name[8];
+
+  raid0_child_t children[RAID0_CHILD_MAX];
+  raid0_child_t* free_children;
+  uint32_t free_child_count;
+
+  raid0_parent_t parents[RAID0_PARENT_MAX];
+  raid0_parent_t* free_parents;
+
+  // pieces the member refused (busy), FIFO per member
+  raid0_child_t* backlog[RAID0_MAX_MEMBERS];
+  raid0_child_t* backlog_tail[RAID0_MAX_MEMBERS];
+  uint8_t kicking;
+} raid0_t;
+
+// RAID-0 usage:
+// 1) bring up the members, ideally on different channels / controllers
+//    (e.g. ata0 = primary master and ata2 = secondary master), each behind a
+//    blk_queue so pieces queue up instead of waiting here
+// 2) raid0_init(&r, members, 2, RAID0_DEFAULT_CHUNK)
+// 3) blk_device_register(raid0_device_get(&r)) and submit to it
+// chunk i of the volume lives on member i % n at member chunk i / n. a request
+// is cut at chunk boundaries and the pieces go to all members at once; it
+// completes when the last piece does. capacity is n times the smallest
+// member, rounded down to whole chunks. a segment list is cut into one list per
+// piece; a piece needing more than RAID0_CHILD_SEGS segments fails the request.
+// volumes are named md0, md1, ... in the order they are set up (at most 10).
+// returns 0 for fewer than 2 members or a chunk a member can't take in one request
+uint8_t raid0_init(raid0_t* r, blk_device_t** members, uint8_t count, uint32_t chunk_sectors);
+
+blk_device_t* raid0_device_get(raid0_t* r);
@@ -0,0 +1,128 @@
+#include "readahead.h"
+#include "common.h"
+
+static readahead_stream_t* readahead_stream_find(readahead_t* ra, uint64_t lba) {
+  for (uint32_t i = 0; i < READAHEAD_MAX_STREAMS; i++) {
+    readahead_stream_t* s = &ra->streams[i];
+    if (s->used && s->next_lba == lba) return s;
+  }
+  return NULL;
+}
+
+// a read near a stream (just behind it or inside its prefetched range) that does not continue it
+static readahead_stream_t* readahead_stream_find_inside(readahead_t* ra, uint64_t lba) {
+  for (uint32_t i = 0; i < READAHEAD_MAX_STREAMS; i++) {
+    readahead_stream_t* s = &ra->streams[i];
+    if (s->used && lba + s->window >= s->next_lba && lba < s->ra_end) return s;
+  }
+  return NULL;
+}
+
+static readahead_stream_t* readahead_stream_replace(readahead_t* ra) {
+  readahead_stream_t* victim = &ra->streams[0];
+  for (uint32_t i = 0; i < READAHEAD_MAX_STREAMS; i++) {
+    readahead_stream_t* s = &ra->streams[i];
+    if (!s->used) return s;
+    if (s->last_used < victim->last_used) victim = s;
+  }
+  return victim;
+}
+
+static void readahead_observe(readahead_t* ra, const blk_request_t* req) {
+  readahead_stream_t* s = readahead_stream_find(ra, req->lba);
+
+  if (s) {
+    ra->seq_hits++;
+    s->seq++;
+  } else {
+    ra->seq_misses++;
+    s = readahead_stream_find_inside(ra, req->lba);
+    if (s) {
+      // random access inside the window: prefetching that far was wasted
+      s->window /= 2;
+      if (s->window < READAHEAD_MIN_WINDOW) s->window = READAHEAD_MIN_WINDOW;
+    } else {
+      s = readahead_stream_replace(ra);
+      s->used = 1;
+      s->window = READAHEAD_MIN_WINDOW;
+      s->ra_end = 0;
+    }
+    s->seq = 0;
+  }
+
+  s->next_lba = req->lba + req->count;
+  s->last_used = rdtsc();
+
+  // reader overtook the prefetch (or a fresh stream): restart right behind it
+  if (s->ra_end < s->next_lba) {
+    s->ra_end = s->next_lba;
+    s->trigger = s->next_lba;
+  }
+
+  if (s->seq == 0 || s->next_lba < s->trigger || s->ra_end >= ra->cache->dev->sectors) return;
+
+  // the stream kept going since the last window: let the next one be bigger
+  if (s->seq > 1 && s->window < ra->max_window) {
+    s->window *= 2;
+    if (s->window > ra->max_window) s->window = ra->max_window;
+  }
+
+  bcache_prefetch(ra->cache, s->ra_end, s->window);
+  ra->windows++;
+  s->trigger = s->ra_end;
+  s->ra_end += s->window;
+}
+
+static uint8_t readahead_submit(blk_device_t* dev, blk_request_t* req) {
+  readahead_t* ra = (readahead_t*)dev->ctx;
+  blk_device_t* lower = bcache_device_get(ra->cache);
+
+  // prefetch is issued first, the cache may complete req (and run its callback) inside submit
+  if (req->op == BLK_OP_READ && req->count) readahead_observe(ra, req);
+  return lower->submit(lower, req);
+}
+
+static void readahead_tick(blk_device_t* dev) {
+  readahead_t* ra = (readahead_t*)dev->ctx;
+  blk_device_t* lower = bcache_device_get(ra->cache);
+  lower->tick(lower);
+}
+
+static void readahead_idle(blk_device_t* dev) {
+  readahead_t* ra = (readahead_t*)dev->ctx;
+  blk_device_idle(bcache_device_get(ra->cache));
+}
+
+void readahead_init(readahead_t* ra, bcache_t* cache) {
+  blk_device_t* lower = bcache_device_get(cache);
+
+  ra->cache = cache;
+  ra->seq_hits = 0;
+  ra->seq_misses = 0;
+  ra->windows = 0;
+
+  // a window may not evict the one before it
+  ra->max_window = READAHEAD_MAX_WINDOW;
+  if (ra->max_window > lower->max_sectors) ra->max_window = lower->max_sectors;
+  if (ra->max_window < READAHEAD_MIN_WINDOW) ra->max_window = READAHEAD_MIN_WINDOW;
+
+  for (uint32_t i = 0; i < READAHEAD_MAX_STREAMS; i++) {
+    ra->streams[i].used = 0;
+    ra->streams[i].last_used = 0;
+  }
+
+  blk_name_derive(ra->name, sizeof(ra->name), "r", lower);
+  ra->blk.name = ra->name;
+  ra->blk.sectors = lower->sectors;
+  ra->blk.max_sectors = lower->max_sectors;
+  ra->blk.queue_depth = lower->queue_depth;
+  ra->blk.submit = readahead_submit;
+  ra->blk.tick = readahead_tick;
+  ra->blk.idle = readahead_idle;
+  ra->blk.map = NULL;
+  ra->blk.ctx = ra;
+}
+
+blk_device_t* readahead_device_get(readahead_t* ra) {
+  return &ra->blk;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "common.h"
+#include "blk.h"
+#include "bcache.h"
+
+#define READAHEAD_MAX_STREAMS  8
+#define READAHEAD_MIN_WINDOW   32       // sectors (16 KiB)
+#define READAHEAD_MAX_WINDOW   2048     // sectors (1 MiB), also capped to the cache's max_sectors
+
+typedef struct readahead_stream_t {
+  uint64_t next_lba;          // where a sequential reader continues
+  uint64_t ra_end;            // end of what was prefetched
+  uint64_t trigger;           // start of the newest prefetched window; reaching it issues the next
+  uint32_t window;            // sectors per prefetch
+  uint32_t seq;               // sequential reads in a row
+  uint64_t last_used;         // rdtsc(), for replacing the stalest stream
+  uint8_t used;
+} readahead_stream_t;
+
+typedef struct readahead_t {
+  bcache_t* cache;
+  blk_device_t blk;           // the readahead layer itself
+  char name[12];
+
+  uint32_t max_window;
+  readahead_stream_t streams[READAHEAD_MAX_STREAMS];
+
+  // stats
+  uint64_t seq_hits;          // reads that continued a stream
+  uint64_t seq_misses;        // reads that broke or started one
+  uint64_t windows;           // prefetch windows issued
+} readahead_t;
+
+// readahead usage:
+// 1) readahead_init(&ra, &cache) over an initialised bcache
+// 2) blk_device_register(readahead_device_get(&ra)), submit requests to it
+// every read is matched against the tracked streams. the second read in a row
+// that continues a stream starts prefetching a window ahead of it into the
+// cache; once the reader enters that window the next one is issued, so the
+// device works on window k+1 while the reader consumes window k. the window
+// doubles each time a stream keeps going and halves when a reader jumps around
+// inside it. writes pass straight through.
+void readahead_init(readahead_t* ra, bcache_t* cache);
+
+blk_device_t* readahead_device_get(readahead_t* ra);
@@ -0,0 +1,333 @@
+#include "virtio_blk.h"
+#include "ata_driver_irq.h"
+#include "common.h"
+#include "mem.h"
+#include "pci.h"
+#include "pmm.h"
+#include "vmm.h"
+
+static virtio_blk_context_t g_vblk_ctx = {
+    .queue_count = 0
+};
+
+static inline void* virtio_phys_to_virt(phys_addr_t phys) {
+    return (void*)(phys + HHDM_OFFSET);
+}
+
+// store -> load ordering: publish avail idx before reading avail_event
+static inline void virtio_mb(void) {
+    __asm__ __volatile__("mfence" ::: "memory");
+}
+
+// standard event-index test: did new_idx step over event since old_idx?
+static inline uint8_t virtio_need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+static volatile void* virtio_cap_map(const pci_device_t* dev, uint8_t cap) {
+    uint8_t bar = pci_config_read_8(dev->bus, dev->slot, dev->func, (uint8_t)(cap + VIRTIO_PCI_CAP_BAR));
+    uint32_t offset = pci_config_read_32(dev->bus, dev->slot, dev->func, (uint8_t)(cap + VIRTIO_PCI_CAP_OFFSET));
+    uint32_t length = pci_config_read_32(dev->bus, dev->slot, dev->func, (uint8_t)(cap + VIRTIO_PCI_CAP_LENGTH));
+
+    phys_addr_t base = pci_bar_address_get(dev, bar);
+    if (base == 0 || length == 0) return NULL;
+    return vmm_mmio_map(base + offset, length);
+}
+
+static uint8_t virtio_caps_map(const pci_device_t* dev) {
+    for (uint8_t cap = pci_capability_find(dev, PCI_CAP_ID_VENDOR, 0); cap != 0;
+         cap = pci_capability_find(dev, PCI_CAP_ID_VENDOR, cap)) {
+        uint8_t type = pci_config_read_8(dev->bus, dev->slot, dev->func, (uint8_t)(cap + VIRTIO_PCI_CAP_CFG_TYPE));
+
+        switch (type) {
+            case VIRTIO_PCI_CAP_COMMON_CFG:
+                if (!g_vblk_ctx.common) g_vblk_ctx.common = (volatile virtio_pci_common_cfg_t*)virtio_cap_map(dev, cap);
+                break;
+            case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                if (!g_vblk_ctx.notify_base) {
+                    g_vblk_ctx.notify_base = (volatile uint8_t*)virtio_cap_map(dev, cap);
+                    g_vblk_ctx.notify_mult = pci_config_read_32(dev->bus, dev->slot, dev->func, (uint8_t)(cap + VIRTIO_PCI_CAP_NOTIFY_MULT));
+                }
+                break;
+            case VIRTIO_PCI_CAP_ISR_CFG:
+                if (!g_vblk_ctx.isr) g_vblk_ctx.isr = (volatile uint8_t*)virtio_cap_map(dev, cap);
+                break;
+            case VIRTIO_PCI_CAP_DEVICE_CFG:
+                if (!g_vblk_ctx.config) g_vblk_ctx.config = (volatile virtio_blk_config_t*)virtio_cap_map(dev, cap);
+                break;
+            default:
+                break;
+        }
+    }
+    return g_vblk_ctx.common && g_vblk_ctx.notify_base && g_vblk_ctx.isr && g_vblk_ctx.config;
+}
+
+static uint8_t virtio_features_negotiate(void) {
+    volatile virtio_pci_common_cfg_t* common = g_vblk_ctx.common;
+
+    common->device_feature_select = 0;
+    uint64_t offered = common->device_feature;
+    common->device_feature_select = 1;
+    offered |= (uint64_t)common->device_feature << 32;
+
+    // modern layout and indirect tables are what the request path is built on
+    if (!(offered & VIRTIO_F_VERSION_1) || !(offered & VIRTIO_F_INDIRECT_DESC)) return 0;
+
+    uint64_t features = offered & VIRTIO_BLK_FEATURES_WANTED;
+    common->driver_feature_select = 0;
+    common->driver_feature = (uint32_t)features;
+    common->driver_feature_select = 1;
+    common->driver_feature = (uint32_t)(features >> 32);
+
+    common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK)) return 0;
+
+    g_vblk_ctx.features = features;
+    g_vblk_ctx.event_idx = (features & VIRTIO_F_EVENT_IDX) ? 1 : 0;
+    g_vblk_ctx.read_only = (features & VIRTIO_BLK_F_RO) ? 1 : 0;
+    return 1;
+}
+
+static uint8_t virtio_queue_setup(virtio_blk_queue_t* q, uint16_t index) {
+    volatile virtio_pci_common_cfg_t* common = g_vblk_ctx.common;
+    common->queue_select = index;
+    if (common->queue_size < VIRTIO_QUEUE_SIZE) return 0;
+    common->queue_size = VIRTIO_QUEUE_SIZE;
+
+    // desc table, avail ring and used ring all fit one frame at 64 entries
+    phys_addr_t ring = pmm_frame_alloc();
+    if (ring == PMM_INVALID_FRAME) return 0;
+    mem_zero(virtio_phys_to_virt(ring), PAGE_SIZE);
+
+    phys_addr_t desc_phys = ring;
+    phys_addr_t avail_phys = desc_phys + sizeof(virtq_desc_t) * VIRTIO_QUEUE_SIZE;
+    phys_addr_t used_phys = (avail_phys + sizeof(virtq_avail_t) + 3) & ~3ULL;
+
+    q->index = index;
+    q->desc = (virtq_desc_t*)virtio_phys_to_virt(desc_phys);
+    q->avail = (volatile virtq_avail_t*)virtio_phys_to_virt(avail_phys);
+    q->used = (volatile virtq_used_t*)virtio_phys_to_virt(used_phys);
+    q->avail_idx = 0;
+    q->last_used = 0;
+
+    phys_addr_t frame = 0;
+    for (uint8_t s = 0; s < VIRTIO_BLK_SLOTS; s++) {
+        if ((s % VIRTIO_SLOTS_PER_FRAME) == 0) {
+            frame = pmm_frame_alloc();
+            if (frame == PMM_INVALID_FRAME) return 0;
+            mem_zero(virtio_phys_to_virt(frame), PAGE_SIZE);
+        }
+        q->slots_phys[s] = frame + (s % VIRTIO_SLOTS_PER_FRAME) * VIRTIO_SLOT_SIZE;
+        q->slots[s] = (virtio_blk_slot_t*)virtio_phys_to_virt(q->slots_phys[s]);
+        q->reqs[s] = NULL;
+    }
+    q->free_slots = 0xFFFFFFFFu;
+
+    common->queue_desc = desc_phys;
+    common->queue_driver = avail_phys;
+    common->queue_device = used_phys;
+    q->notify = (volatile uint16_t*)(g_vblk_ctx.notify_base + (uint32_t)common->queue_notify_off * g_vblk_ctx.notify_mult);
+    common->queue_enable = 1;
+    return 1;
+}
+
+static uint8_t virtio_blk_submit(blk_device_t* dev, blk_request_t* req);
+static void virtio_blk_tick(blk_device_t* dev);
+
+static void virtio_blk_queue_device_init(virtio_blk_queue_t* q, uint32_t max_sectors) {
+    q->name[0] = 'v'; q->name[1] = 'b'; q->name[2] = 'l'; q->name[3] = 'k';
+    q->name[4] = 'q'; q->name[5] = (char)('0' + q->index); q->name[6] = 0;
+
+    q->blk.name = q->name;
+    q->blk.sectors = g_vblk_ctx.capacity;
+    q->blk.max_sectors = max_sectors;
+    q->blk.queue_depth = VIRTIO_BLK_SLOTS;
+    q->blk.submit = virtio_blk_submit;
+    q->blk.tick = virtio_blk_tick;
+    q->blk.idle = NULL;
+    q->blk.map = NULL;
+    q->blk.ctx = q;
+}
+
+uint8_t virtio_blk_init(uint8_t cpu_count) {
+    pci_device_t dev;
+    if (!pci_device_find(VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE_BLK, 0, &dev) &&
+        !pci_device_find(VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE_BLK_TRANS, 0, &dev)) return 0;
+
+    pci_bus_master_enable(&dev);
+    if (!virtio_caps_map(&dev)) return 0;
+    g_vblk_ctx.irq = dev.irq_line;
+
+    volatile virtio_pci_common_cfg_t* common = g_vblk_ctx.common;
+    common->device_status = 0;
+    while (common->device_status != 0) continue;
+    common->device_status = VIRTIO_STATUS_ACKNOWLEDGE;
+    common->device_status |= VIRTIO_STATUS_DRIVER;
+
+    if (!virtio_features_negotiate()) { common->device_status |= VIRTIO_STATUS_FAILED; return 0; }
+
+    g_vblk_ctx.capacity = g_vblk_ctx.config->capacity;
+    g_vblk_ctx.seg_max = (g_vblk_ctx.features & VIRTIO_BLK_F_SEG_MAX) ? g_vblk_ctx.config->seg_max : 0;
+
+    uint8_t queues = 1;
+    if (g_vblk_ctx.features & VIRTIO_BLK_F_MQ) {
+        uint16_t dev_queues = g_vblk_ctx.config->num_queues;
+        queues = (dev_queues < cpu_count) ? (uint8_t)dev_queues : cpu_count;
+    }
+    if (queues == 0) queues = 1;
+    if (queues > VIRTIO_BLK_MAX_QUEUES) queues = VIRTIO_BLK_MAX_QUEUES;
+
+    // a device with a smaller seg_max takes fewer pages per request
+    uint32_t max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    if (g_vblk_ctx.seg_max != 0 && g_vblk_ctx.seg_max < VIRTIO_INDIRECT_MAX - 2) {
+        if (g_vblk_ctx.seg_max < 2) { common->device_status |= VIRTIO_STATUS_FAILED; return 0; }
+        max_sectors = ((g_vblk_ctx.seg_max - 1) * PAGE_SIZE) / BLK_SECTOR_SIZE;
+    }
+
+    for (uint8_t i = 0; i < queues; i++) {
+        if (!virtio_queue_setup(&g_vblk_ctx.queues[i], i)) { common->device_status |= VIRTIO_STATUS_FAILED; return 0; }
+        virtio_blk_queue_device_init(&g_vblk_ctx.queues[i], max_sectors);
+    }
+    g_vblk_ctx.queue_count = queues;
+
+    common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+    return 1;
+}
+
+uint8_t virtio_blk_irq_line_get(void) { return g_vblk_ctx.irq; }
+
+void setup_virtio_blk_irq(void) {
+    unmask_irq(g_vblk_ctx.irq);
+}
+
+__attribute__((interrupt, no_caller_saved_registers))
+void irq_virtio_blk(interrupt_frame_t* f) {
+    (void)f;
+    // reading ISR acks the (level triggered) INTx; completions are reaped by tick
+    (void)*g_vblk_ctx.isr;
+    send_eoi(g_vblk_ctx.irq);
+}
+
+uint8_t virtio_blk_queue_count(void) { return g_vblk_ctx.queue_count; }
+
+blk_device_t* virtio_blk_device_get(uint8_t queue) {
+    if (queue >= g_vblk_ctx.queue_count) return NULL;
+    return &g_vblk_ctx.queues[queue].blk;
+}
+
+// indirect table: header, one descriptor per physically contiguous run (flat buffer
+// or segment list), status
+static uint16_t virtio_blk_table_build(virtio_blk_slot_t* slot, phys_addr_t slot_phys, blk_request_t* req, uint32_t max_segs) {
+    virtq_desc_t* t = slot->table;
+    uint16_t n = 0;
+
+    t[n].addr = slot_phys + __builtin_offsetof(virtio_blk_slot_t, hdr);
+    t[n].len = sizeof(virtio_blk_req_hdr_t);
+    t[n].flags = VIRTQ_DESC_F_NEXT;
+    n++;
+
+    uint16_t data_flags = VIRTQ_DESC_F_NEXT | ((req->op == BLK_OP_READ) ? VIRTQ_DESC_F_WRITE : 0);
+    blk_buf_cursor_t cur = { 0, 0, 0 };
+    uint32_t bytes = req->count * BLK_SECTOR_SIZE;
+    while (bytes != 0) {
+        phys_addr_t p;
+        uint32_t chunk = blk_buf_next(req, &cur, bytes, &p);
+        if (chunk == 0) return 0;
+
+        if (n > 1 && t[n - 1].addr + t[n - 1].len == p) {
+            t[n - 1].len += chunk;
+        } else {
+            if ((uint32_t)(n - 1) == max_segs) return 0;
+            t[n].addr = p;
+            t[n].len = chunk;
+            t[n].flags = data_flags;
+            n++;
+        }
+        bytes -= chunk;
+    }
+
+    t[n].addr = slot_phys + __builtin_offsetof(virtio_blk_slot_t, status);
+    t[n].len = 1;
+    t[n].flags = VIRTQ_DESC_F_WRITE;
+    t[n].next = 0;
+    n++;
+
+    for (uint16_t i = 0; i + 1 < n; i++) t[i].next = (uint16_t)(i + 1);
+    return n;
+}
+
+static uint8_t virtio_blk_submit(blk_device_t* dev, blk_request_t* req) {
+    virtio_blk_queue_t* q = (virtio_blk_queue_t*)dev->ctx;
+    req->status = BLK_REQ_PENDING;
+
+    // VIRTIO_BLK_F_FLUSH is not negotiated, so the device is write-through:
+    // nothing to flush, and PREFLUSH / FUA need no extra work.
+    // VIRTIO_BLK_F_DISCARD isn't either, and a discard is only a hint
+    if (req->op == BLK_OP_FLUSH || req->op == BLK_OP_DISCARD) {
+        blk_request_complete(req, req->op == BLK_OP_DISCARD || req->count == 0);
+        return 1;
+    }
+
+    if (req->count == 0 || req->count > dev->max_sectors || req->lba + req->count > g_vblk_ctx.capacity ||
+        (req->op == BLK_OP_WRITE && g_vblk_ctx.read_only) || !blk_request_sg_is_valid(req)) {
+        blk_request_complete(req, 0);
+        return 1;
+    }
+    if (!q->free_slots) return 0;
+
+    uint8_t s = (uint8_t)__builtin_ctz(q->free_slots);
+    virtio_blk_slot_t* slot = q->slots[s];
+
+    slot->hdr.type = (req->op == BLK_OP_READ) ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT;
+    slot->hdr.reserved = 0;
+    slot->hdr.sector = req->lba;
+    slot->status = 0xFF;
+
+    uint32_t max_segs = VIRTIO_INDIRECT_MAX - 2;
+    if (g_vblk_ctx.seg_max != 0 && g_vblk_ctx.seg_max < max_segs) max_segs = g_vblk_ctx.seg_max;
+    uint16_t n = virtio_blk_table_build(slot, q->slots_phys[s], req, max_segs);
+    if (n == 0) { blk_request_complete(req, 0); return 1; }
+
+    // the ring descriptor index doubles as the slot number
+    q->desc[s].addr = q->slots_phys[s];
+    q->desc[s].len = (uint32_t)n * sizeof(virtq_desc_t);
+    q->desc[s].flags = VIRTQ_DESC_F_INDIRECT;
+    q->desc[s].next = 0;
+
+    q->free_slots &= ~(1u << s);
+    q->reqs[s] = req;
+
+    uint16_t old_idx = q->avail_idx;
+    q->avail->ring[old_idx % VIRTIO_QUEUE_SIZE] = s;
+    compiler_barrier();
+    q->avail_idx = (uint16_t)(old_idx + 1);
+    q->avail->idx = q->avail_idx;
+
+    virtio_mb();
+    uint8_t kick = g_vblk_ctx.event_idx ? virtio_need_event(q->used->avail_event, q->avail_idx, old_idx)
+                                        : !(q->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    if (kick) *q->notify = q->index;
+    return 1;
+}
+
+static void virtio_blk_tick(blk_device_t* dev) {
+    virtio_blk_queue_t* q = (virtio_blk_queue_t*)dev->ctx;
+
+    while (q->last_used != q->used->idx) {
+        compiler_barrier();
+        virtq_used_elem_t e = q->used->ring[q->last_used % VIRTIO_QUEUE_SIZE];
+        q->last_used++;
+
+        uint8_t s = (uint8_t)e.id;
+        if (s >= VIRTIO_BLK_SLOTS || !q->reqs[s]) continue;
+
+        blk_request_t* req = q->reqs[s];
+        uint8_t ok = (q->slots[s]->status == VIRTIO_BLK_S_OK);
+        q->reqs[s] = NULL;
+        q->free_slots |= 1u << s;
+        blk_request_complete(req, ok);
+    }
+
+    // suppress interrupts until the device moves past what we have already reaped
+    if (g_vblk_ctx.event_idx) q->avail->used_event = q->last_used;
+}
@@ -0,0 +1,188 @@
+#pragma once
+#include "common.h"
+#include "idt.h"
+#include "blk.h"
+
+#define VIRTIO_PCI_VENDOR          0x1AF4
+#define VIRTIO_PCI_DEVICE_BLK      0x1042   // modern (non-transitional) virtio-blk
+#define VIRTIO_PCI_DEVICE_BLK_TRANS 0x1001  // transitional, still has the modern caps
+
+// virtio_pci_cap cfg_type
+#define VIRTIO_PCI_CAP_COMMON_CFG  1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG  2
+#define VIRTIO_PCI_CAP_ISR_CFG     3
+#define VIRTIO_PCI_CAP_DEVICE_CFG  4
+
+// virtio_pci_cap field offsets (from the capability start in config space)
+#define VIRTIO_PCI_CAP_CFG_TYPE    3
+#define VIRTIO_PCI_CAP_BAR         4
+#define VIRTIO_PCI_CAP_OFFSET      8
+#define VIRTIO_PCI_CAP_LENGTH      12
+#define VIRTIO_PCI_CAP_NOTIFY_MULT 16
+
+// device status
+#define VIRTIO_STATUS_ACKNOWLEDGE  0x01
+#define VIRTIO_STATUS_DRIVER       0x02
+#define VIRTIO_STATUS_DRIVER_OK    0x04
+#define VIRTIO_STATUS_FEATURES_OK  0x08
+#define VIRTIO_STATUS_FAILED       0x80
+
+// feature bits
+#define VIRTIO_BLK_F_SEG_MAX       (1ULL << 2)
+#define VIRTIO_BLK_F_RO            (1ULL << 5)
+#define VIRTIO_BLK_F_MQ            (1ULL << 12)
+#define VIRTIO_F_INDIRECT_DESC     (1ULL << 28)
+#define VIRTIO_F_EVENT_IDX         (1ULL << 29)
+#define VIRTIO_F_VERSION_1         (1ULL << 32)
+
+#define VIRTIO_BLK_FEATURES_WANTED (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_MQ | \
+                                    VIRTIO_F_INDIRECT_DESC | VIRTIO_F_EVENT_IDX | VIRTIO_F_VERSION_1)
+
+// split ring descriptor flags
+#define VIRTQ_DESC_F_NEXT          1
+#define VIRTQ_DESC_F_WRITE         2   // device writes this buffer
+#define VIRTQ_DESC_F_INDIRECT      4
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY     1
+
+// virtio-blk request types / status
+#define VIRTIO_BLK_T_IN            0
+#define VIRTIO_BLK_T_OUT           1
+#define VIRTIO_BLK_S_OK            0
+
+// limits chosen so each queue fits one frame and each slot a quarter frame
+#define VIRTIO_BLK_MAX_QUEUES      8
+#define VIRTIO_QUEUE_SIZE          64          // ring entries (power of two)
+#define VIRTIO_BLK_SLOTS           32          // in-flight requests per queue
+#define VIRTIO_SLOT_SIZE           1024
+#define VIRTIO_SLOTS_PER_FRAME     (PAGE_SIZE / VIRTIO_SLOT_SIZE)
+#define VIRTIO_INDIRECT_MAX        60          // header + data segments + status
+#define VIRTIO_BLK_MAX_SECTORS     (((VIRTIO_INDIRECT_MAX - 3) * PAGE_SIZE) / BLK_SECTOR_SIZE)
+
+typedef struct virtio_pci_common_cfg_t {
+  uint32_t device_feature_select;
+  uint32_t device_feature;
+  uint32_t driver_feature_select;
+  uint32_t driver_feature;
+  uint16_t msix_config;
+  uint16_t num_queues;
+  uint8_t  device_status;
+  uint8_t  config_generation;
+  uint16_t queue_select;
+  uint16_t queue_size;
+  uint16_t queue_msix_vector;
+  uint16_t queue_enable;
+  uint16_t queue_notify_off;
+  uint64_t queue_desc;
+  uint64_t queue_driver;
+  uint64_t queue_device;
+} __attribute__((packed)) virtio_pci_common_cfg_t;
+
+typedef struct virtio_blk_config_t {
+  uint64_t capacity;          // in 512-byte sectors
+  uint32_t size_max;
+  uint32_t seg_max;
+  uint16_t cylinders;
+  uint8_t  heads;
+  uint8_t  sectors;
+  uint32_t blk_size;
+  uint8_t  physical_block_exp;
+  uint8_t  alignment_offset;
+  uint16_t min_io_size;
+  uint32_t opt_io_size;
+  uint8_t  writeback;
+  uint8_t  unused0;
+  uint16_t num_queues;
+} __attribute__((packed)) virtio_blk_config_t;
+
+typedef struct virtq_desc_t {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct virtq_avail_t {
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[VIRTIO_QUEUE_SIZE];
+  uint16_t used_event;        // EVENT_IDX: interrupt me once used idx passes this
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct virtq_used_elem_t {
+  uint32_t id;
+  uint32_t len;
+} __attribute__((packed)) virtq_used_elem_t;
+
+typedef struct virtq_used_t {
+  uint16_t flags;
+  uint16_t idx;
+  virtq_used_elem_t ring[VIRTIO_QUEUE_SIZE];
+  uint16_t avail_event;       // EVENT_IDX: notify me once avail idx passes this
+} __attribute__((packed)) virtq_used_t;
+
+typedef struct virtio_blk_req_hdr_t {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t sector;
+} __attribute__((packed)) virtio_blk_req_hdr_t;
+
+// per in-flight request memory: indirect table, header, status byte
+typedef struct virtio_blk_slot_t {
+  virtq_desc_t table[VIRTIO_INDIRECT_MAX];
+  virtio_blk_req_hdr_t hdr;
+  volatile uint8_t status;
+} __attribute__((packed)) virtio_blk_slot_t;
+
+typedef struct virtio_blk_queue_t {
+  uint16_t index;
+  volatile uint16_t* notify;
+
+  virtq_desc_t* desc;
+  volatile virtq_avail_t* avail;
+  volatile virtq_used_t* used;
+  uint16_t avail_idx;         // next avail idx we publish
+  uint16_t last_used;         // used idx we have reaped up to
+
+  uint32_t free_slots;        // bitmap of VIRTIO_BLK_SLOTS
+  virtio_blk_slot_t* slots[VIRTIO_BLK_SLOTS];
+  phys_addr_t slots_phys[VIRTIO_BLK_SLOTS];
+  blk_request_t* reqs[VIRTIO_BLK_SLOTS];
+
+  blk_device_t blk;           // one block device per queue
+  char name[8];
+} virtio_blk_queue_t;
+
+typedef struct virtio_blk_context_t {
+  volatile virtio_pci_common_cfg_t* common;
+  volatile uint8_t* isr;
+  volatile virtio_blk_config_t* config;
+  volatile uint8_t* notify_base;
+  uint32_t notify_mult;
+  uint8_t irq;
+
+  uint64_t features;
+  uint64_t capacity;
+  uint32_t seg_max;
+  uint8_t read_only;
+  uint8_t event_idx;
+
+  uint8_t queue_count;
+  virtio_blk_queue_t queues[VIRTIO_BLK_MAX_QUEUES];
+} virtio_blk_context_t;
+
+// virtio-blk usage:
+// 1) virtio_blk_init(cpu_count) after pmm/vmm: negotiates features and sets up
+//    min(cpu_count, device queues) virtqueues
+// 2) setup_virtio_blk_irq(), IDT vector PIC_REMAP_MASTER + virtio_blk_irq_line_get() -> irq_virtio_blk
+// 3) each CPU registers / uses its own queue: virtio_blk_device_get(cpu)
+//    (no locking between queues, each has its own ring and slots)
+uint8_t virtio_blk_init(uint8_t cpu_count);
+
+uint8_t virtio_blk_irq_line_get(void);
+void setup_virtio_blk_irq(void);
+__attribute__((interrupt, no_caller_saved_registers)) void irq_virtio_blk(interrupt_frame_t* f);
+
+uint8_t virtio_blk_queue_count(void);
+blk_device_t* virtio_blk_device_get(uint8_t queue);
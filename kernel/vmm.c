@@ -1,6 +1,8 @@
 #include "vmm.h"
 #include "pmm.h"
 
+static virt_addr_t g_mmio_next = VMM_MMIO_BASE;
+
 static inline uint64_t read_rsp(void) {
     uint64_t rsp;
     __asm__ volatile("mov %%rsp, %0" : "=r"(rsp));
@@ -121,6 +123,40 @@ void* vmm_page_alloc(virt_addr_t vaddr, uint64_t flags) {
   return (void*)vaddr;
 }
 
+// walks the live tables, stopping early at 1 GiB / 2 MiB leaves (HHDM uses 1 GiB pages)
+phys_addr_t vmm_virt_to_phys(virt_addr_t vaddr) {
+  uint8_t levels_shift[] = {39, 30, 21, 12};
+  phys_addr_t current_table_phys = vmm_pml4_get();
+
+  for (uint8_t i = 0; i < 4; i++) {
+    uint64_t idx = (vaddr >> levels_shift[i]) & 0x1FF;
+    uint64_t entry = ((uint64_t*)vmm_phys_to_virt(current_table_phys))[idx];
+    if (!(entry & PAGE_PRESENT)) return VMM_INVALID;
+
+    uint64_t span_mask = (1ULL << levels_shift[i]) - 1;
+    if (i == 3 || (i != 0 && (entry & PS_BIT))) {
+      return ((entry & PAGE_ADDR_MASK) & ~span_mask) | (vaddr & span_mask);
+    }
+    current_table_phys = entry & PAGE_ADDR_MASK;
+  }
+  return VMM_INVALID;
+}
+
+// maps a register window uncached (PCD|PWT); windows are never unmapped
+void* vmm_mmio_map(phys_addr_t paddr, uint64_t size) {
+  uint64_t offset = paddr & PAGE_MASK;
+  phys_addr_t p_start = align_down(paddr);
+  uint64_t span = align_up(offset + size);
+  virt_addr_t v_start = g_mmio_next;
+
+  for (uint64_t i = 0; i < span; i += PAGE_SIZE) {
+    if (!vmm_page_map(vmm_pml4_get(), v_start + i, p_start + i, PAGE_WRITABLE | PAGE_NX | PTE_PCD | PTE_PWT)) return NULL;
+  }
+
+  g_mmio_next += span;
+  return (void*)(v_start + offset);
+}
+
 void vmm_page_free(virt_addr_t vaddr, uint64_t flags) {
   phys_addr_t addr_phys_ptr;
   if (vmm_page_unmap(vmm_pml4_get(), vaddr, &addr_phys_ptr)) 
@@ -1,3 +1,4 @@
+#pragma once
 #include "common.h"
 
 typedef uint64_t pte_t;
@@ -76,7 +77,12 @@ typedef struct vmm_page_info_t{
 
 #define VMM_INVALID_PAGE UINT64_MAX
 
+// device registers get their own uncached window, away from the (write-back) HHDM
+#define VMM_MMIO_BASE 0xFFFFC00000000000ULL
+
 uint8_t vmm_init(void);
 void* vmm_page_alloc(virt_addr_t vaddr, uint64_t flags); 
 void vmm_page_free(virt_addr_t vaddr, uint64_t flags); 
+phys_addr_t vmm_virt_to_phys(virt_addr_t vaddr);
+void* vmm_mmio_map(phys_addr_t paddr, uint64_t size);
 
@@ -44,8 +44,48 @@
 #define ATA_CMD_READ_SECTORS_EXT    0x24
 #define ATA_CMD_WRITE_SECTORS_EXT   0x34
 #define ATA_CMD_SET_MULTIPLE        0xC6
+#define ATA_CMD_IDENTIFY            0xEC
 
-// initializes ata controller and sets multiple mode
+// sectors per DRQ block for READ / WRITE MULTIPLE we ask for; ata_init settles for
+// less if IDENTIFY word 47 says so
+#define ATA_MULTIPLE_SECTORS        16
+
+// IDENTIFY DEVICE word offsets
+#define ATA_ID_MAX_MULTIPLE   47  // bits 0-7: max sectors per DRQ block, 0: no READ MULTIPLE
+#define ATA_ID_CMDSET_2       83  // bit 10: LBA48
+#define ATA_ID_LBA48          (1u << 10)
+
+#define ATA_CMD_READ_DMA_EXT        0x25
+#define ATA_CMD_WRITE_DMA_EXT       0x35
+
+// PIIX bus master IDE registers (offsets from BAR4)
+#define ATA_BM_REG_COMMAND  0x00
+#define ATA_BM_REG_STATUS   0x02
+#define ATA_BM_REG_PRDT     0x04
+
+#define ATA_BM_CMD_START    0x01
+#define ATA_BM_CMD_READ     0x08  // bus master writes to memory (device -> RAM)
+
+#define ATA_BM_SR_ACTIVE    0x01
+#define ATA_BM_SR_ERR       0x02  // write 1 to clear
+#define ATA_BM_SR_IRQ       0x04  // write 1 to clear
+
+#define ATA_PRD_EOT         0x8000
+#define ATA_PRD_MAX         512
+#define ATA_PRD_BOUNDARY    0x10000u
+
+// largest DMA command we build: 16 MiB, fits the PRD table even when unaligned
+#define ATA_DMA_MAX_SECTORS 32768
+
+// physical region descriptor: one contiguous chunk, must not cross a 64 KiB boundary
+typedef struct ata_prd_t {
+  uint32_t phys;
+  uint16_t byte_count;        // 0 means 64 KiB
+  uint16_t flags;             // bit 15: end of table
+} __attribute__((packed)) ata_prd_t;
+
+// selects the primary master, IDENTIFYs it and sets multiple mode if it has one.
+// 0 if there is no drive, it stays busy, or it can't take LBA48 commands
 uint8_t ata_init(void);
 
 // reads sectors from disk using lba28
@@ -57,10 +97,31 @@ uint8_t ata_disk_write_28_poll(uint32_t lba, const void* addr, uint32_t sector_c
 // reads sectors from disk using lba48
 uint8_t ata_disk_read_48_poll(uint64_t lba, void* addr, uint32_t sector_count);
 
+// reads sectors with READ MULTIPLE EXT: large commands, one DRQ per block of the
+// size ata_init set. READ SECTORS EXT (one DRQ per sector) if the drive has no
+// multiple mode
+uint8_t ata_disk_read_48_multiple(uint64_t lba, void* addr, uint32_t sector_count);
 
 // writes sectors to disk using lba48
 uint8_t ata_disk_write_48_poll(uint64_t lba, const void* addr, uint32_t sector_count);
 
+// finds the IDE controller on PCI and enables bus mastering; 0 if unavailable
+uint8_t ata_dma_init(void);
+
+// reads sectors with bus-master DMA (loader is identity mapped, addr is physical)
+uint8_t ata_disk_read_48_dma(uint64_t lba, void* addr, uint32_t sector_count);
+
+// writes sectors with bus-master DMA
+uint8_t ata_disk_write_48_dma(uint64_t lba, const void* addr, uint32_t sector_count);
+
+// starts a DMA read of up to ATA_DMA_MAX_SECTORS and returns while the engine
+// runs; the CPU may do other work until ata_dma_wait. 0 if it could not start
+// (no bus master, odd address, above 4 GiB) and nothing was sent to the disk
+uint8_t ata_disk_read_48_dma_begin(uint64_t lba, void* addr, uint32_t sector_count);
+
+// finishes the command started by ata_disk_read_48_dma_begin
+uint8_t ata_dma_wait(void);
+
 // waits for bsy to clear
 uint8_t ata_wait_idle(void);
 
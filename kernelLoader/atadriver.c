@@ -1,5 +1,13 @@
 #include "ata_driver.h"
 #include "common.h"
+#include "pci.h"
+
+static uint16_t g_bm_base = 0;
+static uint16_t g_identify[256];
+static uint8_t g_multiple = 0;      // sectors per DRQ block set by ata_init, 0: single sectors
+
+__attribute__((aligned(4096)))
+static ata_prd_t g_prd[ATA_PRD_MAX];
 
 static inline uint8_t ata_status_get(void) {
     return inb(ATA_REG_STATUS);
@@ -35,29 +43,36 @@ uint8_t ata_init(void) {
   outb(ATA_REG_DRIVE_SEL, 0xE0); // master, LBA
   for (int i = 0; i < 4; i++) inb(ATA_REG_CONTROL);
 
-  uint32_t timeout = 10000000;
-  while (timeout--) {
-    uint8_t status = ata_status_get();
-    if (status == 0xFF) return 0;
+  // no drive, a fault, or still busy when the timeout runs out
+  if (!ata_wait_idle()) return 0;
 
-    if (status & ATA_SR_BSY) continue;
-    if (status & ATA_SR_DF || status & ATA_SR_ERR) return 0;
+  outb(ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+  for (int i = 0; i < 4; i++) inb(ATA_REG_CONTROL);
+  if (!ata_wait_drq()) return 0;
+  insw(ATA_REG_DATA, g_identify, 256);
+  if (!ata_wait_idle()) return 0;
 
-    if (!(status & ATA_SR_DRDY)) continue;
-    else break;
-  }
+  // every read the loader makes is a 48-bit command
+  if (!(g_identify[ATA_ID_CMDSET_2] & ATA_ID_LBA48)) return 0;
 
-  for (int i = 0; i < 4; i++) inb(ATA_REG_CONTROL);
+  // the largest power of two up to ATA_MULTIPLE_SECTORS the drive takes
+  uint8_t max = (uint8_t)g_identify[ATA_ID_MAX_MULTIPLE];
+  uint8_t multiple = ATA_MULTIPLE_SECTORS;
+  while (multiple > max) multiple >>= 1;
+
+  g_multiple = 0;
+  if (multiple == 0) return 1;
 
+  outb(ATA_REG_SECCOUNT, multiple);
   outb(ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
   for (int i = 0; i < 4; i++) inb(ATA_REG_CONTROL);
 
-  if (!ata_wait_idle()) return 0;
-
+  // aborted (ERR): multiple mode stays off, READ SECTORS EXT still works
+  uint8_t ok = ata_wait_idle();
   uint8_t status = ata_status_get();
-  if (status & (ATA_SR_ERR | ATA_SR_DF)) return 0;
-  if (status & ATA_SR_DRQ) return 0;
+  if (status == 0xFF || (status & (ATA_SR_BSY | ATA_SR_DRQ))) return 0;
 
+  g_multiple = ok ? multiple : 0;
   return 1;
 }
 
@@ -197,3 +212,130 @@ uint8_t ata_disk_read_48_poll(uint64_t lba, void* addr, uint32_t sector_count) {
   if (!ata_wait_idle()) return 0;
   return 1;
 }
+
+// one command per 65536 sectors, one DRQ wait per g_multiple block (per sector
+// with READ SECTORS EXT when multiple mode is off)
+uint8_t ata_disk_read_48_multiple(uint64_t lba, void* addr, uint32_t sector_count) {
+  uint16_t* ptr = (uint16_t*)addr;
+  uint32_t per_drq = g_multiple ? g_multiple : 1;
+  uint8_t cmd = g_multiple ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_SECTORS_EXT;
+
+  while (sector_count) {
+    uint32_t chunk = sector_count;
+    if (chunk > 65536) chunk = 65536;
+
+    if (!ata_wait_idle()) return 0;
+    ata_lba48_set(lba, chunk);
+    outb(ATA_REG_COMMAND, cmd);
+    for (int i = 0; i < 4; i++) inb(ATA_REG_CONTROL);
+
+    uint32_t left = chunk;
+    while (left) {
+      uint32_t block = left < per_drq ? left : per_drq;
+      if (!ata_wait_drq()) return 0;
+      insw(ATA_REG_DATA, ptr, block * 256);
+      ptr += block * 256;
+      left -= block;
+    }
+
+    lba += chunk;
+    sector_count -= chunk;
+  }
+
+  if (!ata_wait_idle()) return 0;
+  return 1;
+}
+
+uint8_t ata_dma_init(void) {
+  pci_device_t ide;
+  if (!pci_device_find_by_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, 0, &ide)) return 0;
+
+  uint32_t bar4 = pci_bar_get(&ide, 4);
+  if (!(bar4 & PCI_BAR_IO)) return 0;
+
+  g_bm_base = (uint16_t)(bar4 & PCI_BAR_IO_MASK);
+  if (g_bm_base == 0) return 0;
+
+  pci_bus_master_enable(&ide);
+  return 1;
+}
+
+// identity mapped: the buffer is physically contiguous, only 64 KiB boundaries split it
+static uint32_t ata_prd_build(uint32_t phys, uint32_t bytes) {
+  uint32_t n = 0;
+  while (bytes && n < ATA_PRD_MAX) {
+    uint32_t chunk = ATA_PRD_BOUNDARY - (phys & (ATA_PRD_BOUNDARY - 1));
+    if (chunk > bytes) chunk = bytes;
+
+    g_prd[n].phys = phys;
+    g_prd[n].byte_count = (uint16_t)chunk;
+    g_prd[n].flags = 0;
+    n++;
+
+    phys += chunk;
+    bytes -= chunk;
+  }
+  if (n) g_prd[n - 1].flags = ATA_PRD_EOT;
+  return n;
+}
+
+// starts one DMA command of up to ATA_DMA_MAX_SECTORS, ata_dma_wait finishes it
+static uint8_t ata_dma_48_begin(uint64_t lba, uintptr_t addr, uint32_t sector_count, uint8_t read) {
+  if (g_bm_base == 0 || (addr & 1) || sector_count == 0 || sector_count > ATA_DMA_MAX_SECTORS) return 0;
+  if (addr + (uintptr_t)sector_count * 512 > 0x100000000ull) return 0;
+
+  uint8_t dir = read ? ATA_BM_CMD_READ : 0;
+
+  if (!ata_wait_idle()) return 0;
+  if (!ata_prd_build((uint32_t)addr, sector_count * 512)) return 0;
+
+  outb(g_bm_base + ATA_BM_REG_COMMAND, dir);
+  outl(g_bm_base + ATA_BM_REG_PRDT, (uint32_t)(uintptr_t)g_prd);
+  outb(g_bm_base + ATA_BM_REG_STATUS, (uint8_t)(inb(g_bm_base + ATA_BM_REG_STATUS) | ATA_BM_SR_ERR | ATA_BM_SR_IRQ));
+
+  ata_lba48_set(lba, sector_count);
+  outb(ATA_REG_COMMAND, read ? ATA_CMD_READ_DMA_EXT : ATA_CMD_WRITE_DMA_EXT);
+  outb(g_bm_base + ATA_BM_REG_COMMAND, (uint8_t)(dir | ATA_BM_CMD_START));
+  return 1;
+}
+
+uint8_t ata_dma_wait(void) {
+  // interrupts are masked (nIEN), so wait for the engine to go inactive instead
+  uint32_t timeout = 100000000;
+  uint8_t bm_status;
+  do {
+    bm_status = inb(g_bm_base + ATA_BM_REG_STATUS);
+  } while ((bm_status & ATA_BM_SR_ACTIVE) && !(bm_status & ATA_BM_SR_ERR) && --timeout);
+
+  outb(g_bm_base + ATA_BM_REG_COMMAND, 0);
+  outb(g_bm_base + ATA_BM_REG_STATUS, (uint8_t)(bm_status | ATA_BM_SR_ERR | ATA_BM_SR_IRQ));
+  if (!timeout || (bm_status & ATA_BM_SR_ERR)) return 0;
+  return ata_wait_idle();
+}
+
+static uint8_t ata_disk_dma_48_poll(uint64_t lba, uintptr_t addr, uint32_t sector_count, uint8_t read) {
+  while (sector_count) {
+    uint32_t chunk = sector_count;
+    if (chunk > ATA_DMA_MAX_SECTORS) chunk = ATA_DMA_MAX_SECTORS;
+
+    if (!ata_dma_48_begin(lba, addr, chunk, read)) return 0;
+    if (!ata_dma_wait()) return 0;
+
+    addr += (uintptr_t)chunk * 512;
+    lba += chunk;
+    sector_count -= chunk;
+  }
+  return 1;
+}
+
+uint8_t ata_disk_read_48_dma(uint64_t lba, void* addr, uint32_t sector_count) {
+  return ata_disk_dma_48_poll(lba, (uintptr_t)addr, sector_count, 1);
+}
+
+uint8_t ata_disk_write_48_dma(uint64_t lba, const void* addr, uint32_t sector_count) {
+  return ata_disk_dma_48_poll(lba, (uintptr_t)addr, sector_count, 0);
+}
+
+uint8_t ata_disk_read_48_dma_begin(uint64_t lba, void* addr, uint32_t sector_count) {
+  return ata_dma_48_begin(lba, (uintptr_t)addr, sector_count, 1);
+}
@@ -19,6 +19,31 @@ typedef struct e820_entry_t {
 
 #define E820_MAX 64
 
+// boot timeline: rdtsc() at each step, indexed by id, 0 = never reached.
+// boot2.asm has the same ids (BOOT_STAMP_*)
+typedef enum boot_stamp_t {
+    BOOT_STAMP_BOOT1 = 0,       // boot1 entry (parked at BOOT1_STAMP_ADDR for boot2)
+    BOOT_STAMP_BOOT2,           // boot2 entry
+    BOOT_STAMP_LOADER_READ,     // kernelLoader read from disk
+    BOOT_STAMP_E820,
+    BOOT_STAMP_VBE,
+    BOOT_STAMP_LONG_MODE,       // boot2 in long mode, jumping to the loader
+    BOOT_STAMP_KEXEC,           // warm reload: the previous kernel started loading this one
+    BOOT_STAMP_LOADER,          // kernelLoader kmain
+    BOOT_STAMP_KERNEL_READ,     // kernel image loaded
+    BOOT_STAMP_INITRD_READ,     // initrd loaded (if the manifest has one)
+    BOOT_STAMP_RESUME,          // hibernation image restored, jumping back into the kernel
+    BOOT_STAMP_KERNEL,          // kernel kmain
+    BOOT_STAMP_BSS,
+    BOOT_STAMP_PMM,
+    BOOT_STAMP_VMM,
+    BOOT_STAMP_READY,           // every kmain init step settled
+    BOOT_STAMP_COUNT
+} boot_stamp_t;
+
+#define BOOT_STAMP_MAX   16
+#define BOOT1_STAMP_ADDR 0x500
+
 typedef struct boot_info_t {
     uint16_t   e820_count;
     e820_entry_t e820_map[E820_MAX];
@@ -30,6 +55,12 @@ typedef struct boot_info_t {
     uint8_t  vbe_bpp;
     uint8_t  _pad;        // implicit alignment fix (matches ASM align 4)
     uint32_t vbe_fb;
+
+    uint64_t tsc_hz;      // kernelLoader's TSC calibration, 0 if it had none
+    uint64_t stamps[BOOT_STAMP_MAX];  // boot timeline, see boot_stamp_t
+
+    uint64_t initrd_phys; // set by the kernelLoader, 0 = no initrd
+    uint64_t initrd_size; // bytes
 } __attribute__((packed)) boot_info_t;
 
 // arg 1 goes to rdi, arg 2 to rsi, arg 3 to rdx
@@ -37,6 +68,8 @@ extern void outb(uint16_t port, uint8_t value);
 extern uint8_t inb(uint16_t port);
 extern void outw(uint16_t port, uint16_t value);
 extern uint16_t inw(uint16_t port);
+extern void outl(uint16_t port, uint32_t value);
+extern uint32_t inl(uint16_t port);
 extern void outsw(uint16_t port, const void* addr, uint32_t count);
 extern void insw(uint16_t port, void* addr, uint32_t count);
 
@@ -45,5 +78,15 @@ __attribute__((no_caller_saved_registers)) void outb_irq(uint16_t port, uint8_t
 __attribute__((no_caller_saved_registers)) void insw_irq(uint16_t port, void* addr, uint32_t count);
 __attribute__((no_caller_saved_registers)) void outsw_irq(uint16_t port, const void* addr, uint32_t count);
 
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void boot_stamp(boot_info_t* bi, boot_stamp_t id) {
+    bi->stamps[id] = rdtsc();
+}
+
 #define KERNEL_CS 0x18
 #define NULL ((void*)0)
@@ -0,0 +1,176 @@
+#include "elf.h"
+#include "common.h"
+#include "ata_driver.h"
+#include "lz4.h"
+#include "mem.h"
+
+elf_load_stats_t g_elf_stats;
+
+static uint8_t g_elf_headers[ELF_HEADER_SECTORS * 512];
+static uint8_t g_elf_bounce[512];
+
+// a partial sector of the image (skip..skip+bytes of it) through the bounce buffer
+static uint8_t elf_sector_part_read(uint64_t sector, uint32_t skip, uint8_t* dst, uint32_t bytes) {
+  if (!ata_disk_read_48_poll(sector, g_elf_bounce, 1)) return 0;
+  mem_copy(dst, g_elf_bounce + skip, bytes);
+  return 1;
+}
+
+// loads one segment: file bytes to dst, zero up to memsz. whole sectors go
+// straight to dst, a partial first / last sector through the bounce buffer, so
+// nothing outside dst..dst+memsz is written. the whole sectors go out as DMA
+// commands when the controller has a bus master; while the first one runs the
+// CPU zeroes the bss part, which is disjoint from anything being read. that is
+// the only overlap here: the plain image has no per-chunk work to hide behind
+// the next command (one channel takes one at a time), so chunks go out back to
+// back. the pipelined load is the LZ4 one (KERNEL_LZ4=1, build.sh's default)
+static uint8_t elf_segment_load(uint64_t lba, uint64_t offset, uint8_t* dst, uint64_t filesz, uint64_t memsz) {
+  uint32_t skip = (uint32_t)(offset % 512);
+  if (skip && filesz) {
+    uint32_t chunk = 512 - skip;
+    if (chunk > filesz) chunk = (uint32_t)filesz;
+    if (!elf_sector_part_read(lba + offset / 512, skip, dst, chunk)) return 0;
+    dst += chunk;
+    offset += chunk;
+    filesz -= chunk;
+    memsz -= chunk;
+  }
+
+  // from here on offset is sector aligned (or filesz is 0)
+  uint64_t sector = lba + offset / 512;
+  uint64_t whole = filesz / 512;
+  uint64_t done = 0;
+  uint8_t zeroed = 0;
+
+  while (done < whole) {
+    uint64_t left = whole - done;
+    uint32_t chunk = left > ATA_DMA_MAX_SECTORS ? ATA_DMA_MAX_SECTORS : (uint32_t)left;
+    uint8_t* buf = dst + done * 512;
+
+    if (ata_disk_read_48_dma_begin(sector + done, buf, chunk)) {
+      if (!zeroed) {
+        mem_zero(dst + filesz, memsz - filesz);
+        zeroed = 1;
+      }
+      if (!ata_dma_wait()) return 0;
+    } else if (!ata_disk_read_48_multiple(sector + done, buf, chunk)) {
+      return 0;
+    }
+    done += chunk;
+  }
+
+  uint32_t tail = (uint32_t)(filesz % 512);
+  if (tail && !elf_sector_part_read(sector + whole, 0, dst + whole * 512, tail)) return 0;
+  if (!zeroed) mem_zero(dst + filesz, memsz - filesz);
+  return 1;
+}
+
+static uint8_t elf_segment_is_valid(const elf64_phdr_t* ph) {
+  if (ph->filesz > ph->memsz) return 0;
+  return ph->paddr < ELF_LOAD_LIMIT && ph->memsz <= ELF_LOAD_LIMIT - ph->paddr;
+}
+
+// the ELF already in memory (a decompressed image): segments are copied out of it
+static uint64_t elf_load_mem(const uint8_t* image, uint64_t size) {
+  const elf64_ehdr_t* eh = (const elf64_ehdr_t*)image;
+  if (!elf_header_is_valid(eh, size)) return 0;
+
+  const elf64_phdr_t* phdrs = (const elf64_phdr_t*)(image + eh->phoff);
+  for (uint16_t i = 0; i < eh->phnum; i++) {
+    const elf64_phdr_t* ph = &phdrs[i];
+    if (ph->type != ELF_PT_LOAD || ph->memsz == 0) continue;
+    if (!elf_segment_is_valid(ph)) return 0;
+    if (ph->offset > size || ph->filesz > size - ph->offset) return 0;
+
+    uint8_t* dst = (uint8_t*)(uintptr_t)ph->paddr;
+    mem_copy(dst, image + ph->offset, ph->filesz);
+    mem_zero(dst + ph->filesz, ph->memsz - ph->filesz);
+  }
+  return eh->entry;
+}
+
+static uint64_t elf_load_disk(uint64_t lba) {
+  const elf64_ehdr_t* eh = (const elf64_ehdr_t*)g_elf_headers;
+  if (!elf_header_is_valid(eh, sizeof(g_elf_headers))) return 0;
+
+  const elf64_phdr_t* phdrs = (const elf64_phdr_t*)(g_elf_headers + eh->phoff);
+  for (uint16_t i = 0; i < eh->phnum; i++) {
+    const elf64_phdr_t* ph = &phdrs[i];
+    if (ph->type != ELF_PT_LOAD || ph->memsz == 0) continue;
+    if (!elf_segment_is_valid(ph)) return 0;
+
+    uint8_t* dst = (uint8_t*)(uintptr_t)ph->paddr;
+    if (!elf_segment_load(lba, ph->offset, dst, ph->filesz, ph->memsz)) return 0;
+  }
+  return eh->entry;
+}
+
+// the compressed payload is read in chunks. while one chunk is on its way (DMA)
+// the CPU decodes what already arrived and checksums what that produced
+static uint64_t elf_load_lz4(uint64_t lba, const elf_lz4_header_t* hdr) {
+  if (hdr->compressed_size == 0 || hdr->compressed_size > ELF_LZ4_IN_MAX) return 0;
+  if (hdr->original_size == 0 || hdr->original_size > ELF_STAGE_MAX) return 0;
+
+  uint8_t* in = (uint8_t*)ELF_LZ4_IN_ADDR;
+  uint8_t* stage = (uint8_t*)ELF_STAGE_ADDR;
+  lz4_stream_t lz;
+  lz4_stream_init(&lz, in, hdr->compressed_size, stage, hdr->original_size);
+
+  uint64_t sectors = (hdr->compressed_size + 511) / 512;
+  uint64_t issued = 0;
+  uint64_t avail = 0;
+  uint64_t summed = 0;
+  uint32_t crc = 0;
+  lz4_result_t r = LZ4_MORE;
+
+  g_elf_stats.compressed = hdr->compressed_size;
+  g_elf_stats.original = hdr->original_size;
+  g_elf_stats.decode_cycles = 0;
+  g_elf_stats.wait_cycles = 0;
+
+  while (r == LZ4_MORE) {
+    uint8_t dma = 0;
+    if (issued < sectors) {
+      uint64_t left = sectors - issued;
+      uint32_t chunk = left > ELF_LZ4_CHUNK_SECTORS ? ELF_LZ4_CHUNK_SECTORS : (uint32_t)left;
+      uint8_t* buf = in + issued * 512;
+
+      uint64_t t = rdtsc();
+      dma = ata_disk_read_48_dma_begin(lba + 1 + issued, buf, chunk);
+      if (!dma && !ata_disk_read_48_multiple(lba + 1 + issued, buf, chunk)) return 0;
+      if (!dma) g_elf_stats.wait_cycles += rdtsc() - t;
+      issued += chunk;
+    }
+
+    // what was there before this chunk (all of it when the read was synchronous)
+    uint64_t t = rdtsc();
+    r = lz4_stream_run(&lz, avail);
+    crc = elf_cksum_update(crc, stage + summed, lz.out_pos - summed);
+    summed = lz.out_pos;
+    g_elf_stats.decode_cycles += rdtsc() - t;
+
+    if (dma) {
+      t = rdtsc();
+      if (!ata_dma_wait()) return 0;
+      g_elf_stats.wait_cycles += rdtsc() - t;
+    }
+
+    uint64_t got = issued * 512;
+    uint64_t next = got < hdr->compressed_size ? got : hdr->compressed_size;
+    // nothing new arrived and the decoder still wants more: the stream is short
+    if (r == LZ4_MORE && next == avail) return 0;
+    avail = next;
+  }
+
+  if (r != LZ4_DONE || lz.out_pos != hdr->original_size) return 0;
+  if (elf_cksum_final(crc, lz.out_pos) != hdr->checksum) return 0;
+  return elf_load_mem(stage, lz.out_pos);
+}
+
+uint64_t elf_load(uint64_t lba) {
+  if (!ata_disk_read_48_multiple(lba, g_elf_headers, ELF_HEADER_SECTORS)) return 0;
+
+  const elf_lz4_header_t* hdr = (const elf_lz4_header_t*)g_elf_headers;
+  if (hdr->magic == ELF_LZ4_MAGIC) return elf_load_lz4(lba, hdr);
+  return elf_load_disk(lba);
+}
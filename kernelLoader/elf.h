@@ -0,0 +1,33 @@
+#pragma once
+#include "common.h"
+#include "elf64.h"
+
+// headers we accept must sit in the first sectors of the image
+#define ELF_HEADER_SECTORS 8
+// the loader runs on boot2's identity map (0 - 16 MiB). segments go below 8 MiB,
+// a compressed image is staged above that
+#define ELF_LOAD_LIMIT    0x00800000u
+#define ELF_STAGE_ADDR    0x00800000u   // decompressed ELF
+#define ELF_STAGE_MAX     0x00400000u
+#define ELF_LZ4_IN_ADDR   0x00C00000u   // compressed payload as read from disk
+#define ELF_LZ4_IN_MAX    0x00400000u
+
+// compressed payload read per disk command, decoded while the next one runs
+#define ELF_LZ4_CHUNK_SECTORS 256
+
+// filled by the last elf_load of a compressed image, TSC cycles
+typedef struct elf_load_stats_t {
+  uint64_t compressed;
+  uint64_t original;
+  uint64_t decode_cycles;       // decompressing and checksumming
+  uint64_t wait_cycles;         // waiting for the disk beyond that
+} elf_load_stats_t;
+
+extern elf_load_stats_t g_elf_stats;
+
+// reads the ELF image starting at lba: every PT_LOAD segment gets its file
+// bytes copied to p_paddr and the rest of p_memsz zeroed (bss never touches
+// the disk). a compressed image (elf_lz4_header_t) is decompressed into the
+// staging area and checked first. returns e_entry, 0 if the image is not a
+// loadable kernel
+uint64_t elf_load(uint64_t lba);
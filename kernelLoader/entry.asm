@@ -10,11 +10,10 @@ _start:
   mov [bootinfo_ptr], rdi
   mov rsp, 0x00020000
   sub rsp, 8
-  call kmain
+  call kmain                      ; returns the kernel's e_entry
   add rsp, 8
   
   mov rdi, [bootinfo_ptr]
-  mov rax, 0x00400000
   jmp rax
 
 .halt:
@@ -23,6 +22,6 @@ _start:
 
 section .data
   global bootinfo_ptr
-bootinfo_ptr db 0
+bootinfo_ptr dq 0
 
 section .note.GNU-stack noalloc noexec nowrite progbits
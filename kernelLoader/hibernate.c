@@ -0,0 +1,209 @@
+#include "hibernate.h"
+#include "ata_driver.h"
+#include "lz4.h"
+#include "mem.h"
+#include "serial.h"
+
+#define HIB_BUFFER_BYTES  (HIB_BUFFER_FRAMES * HIB_FRAME_SIZE)
+#define HIB_READ_SECTORS  256           // 128 KiB per read, decoded while the next one runs
+#define HIB_LOW_LIMIT     ((uint64_t)HIB_LOW_FRAMES * HIB_FRAME_SIZE)
+
+static uint8_t g_hib_sector[512];
+static hib_run_t g_hib_runs[HIB_RUNS_MAX];
+
+// the chunk stream going through the image's free 1 MiB: reads land at have,
+// chunks are taken from pos
+typedef struct hib_stream_t {
+  uint8_t* buf;
+  uint64_t have;                // bytes read into buf (whole sectors)
+  uint64_t pos;                 // bytes consumed
+  uint64_t lba;                 // next sector to read
+  uint64_t left;                // sectors not read yet
+  uint32_t pending;             // sectors of the DMA read in flight, 0 = none
+} hib_stream_t;
+
+// an image this boot chain can resume, on this machine
+static uint8_t hib_header_check(const hib_header_t* h, const manifest_entry_t* area, const boot_info_t* bi) {
+  if (h->magic != HIB_MAGIC || h->version != HIB_VERSION) return 0;
+  if (h->header_sum != mem_sum32(h, __builtin_offsetof(hib_header_t, header_sum))) return 0;
+
+  const manifest_entry_t* boot2 = manifest_find(MANIFEST_ID_BOOT2);
+  const manifest_entry_t* loader = manifest_find(MANIFEST_ID_LOADER);
+  const manifest_entry_t* kernel = manifest_find(MANIFEST_ID_KERNEL);
+  if (!boot2 || !loader || !kernel) return 0;
+  if (h->boot2_sum != boot2->checksum || h->loader_sum != loader->checksum || h->kernel_sum != kernel->checksum) return 0;
+
+  uint64_t index_bytes = (uint64_t)h->run_count * sizeof(hib_run_t);
+  if (h->run_count == 0 || h->run_count > HIB_RUNS_MAX) return 0;
+  if (h->index_sectors != (index_bytes + 511) / 512) return 0;
+  if (1 + h->index_sectors + (h->data_bytes + 511) / 512 > area->sectors) return 0;
+
+  // the memory map the kernel's PMM was built from must be the same
+  uint64_t top = 0;
+  for (uint16_t i = 0; i < bi->e820_count && i < E820_MAX; i++) {
+    uint64_t end = bi->e820_map[i].base + bi->e820_map[i].length;
+    if (end > top) top = end;
+  }
+  if (h->ram_top != top || h->ram_top > HIB_RAM_LIMIT) return 0;
+
+  if (h->buffer % HIB_FRAME_SIZE || h->buffer < HIB_LOW_LIMIT || h->buffer + HIB_BUFFER_BYTES > h->ram_top) return 0;
+  if (h->resume_entry < HIB_LOW_LIMIT || h->resume_entry >= h->ram_top) return 0;
+  if (h->context < HIB_LOW_LIMIT || h->context >= h->ram_top) return 0;
+  return 1;
+}
+
+// boot2 maps the first 16 MiB: the rest of the first GiB in 2 MiB pages, then
+// 1 GiB pages up to top (the kernel's HHDM uses them as well)
+static void hib_identity_map(uint64_t top) {
+  uint64_t cr3;
+  __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+  uint64_t* pml4 = (uint64_t*)(uintptr_t)(cr3 & 0x000FFFFFFFFFF000ULL);
+  uint64_t* pdpt = (uint64_t*)(uintptr_t)(pml4[0] & 0x000FFFFFFFFFF000ULL);
+  uint64_t* pd = (uint64_t*)(uintptr_t)(pdpt[0] & 0x000FFFFFFFFFF000ULL);
+
+  for (uint64_t i = 8; i < 512; i++) pd[i] = (i << 21) | 0x83;
+  uint64_t gib = (top + (1ULL << 30) - 1) >> 30;
+  for (uint64_t i = 1; i < gib; i++) pdpt[i] = (i << 30) | 0x83;
+  __asm__ __volatile__("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+// runs must be RAM above 1 MiB and leave the read buffer alone
+static uint8_t hib_index_read(const hib_header_t* h, const manifest_entry_t* area) {
+  if (!ata_disk_read_48_multiple(area->lba + 1, g_hib_runs, h->index_sectors)) return 0;
+  if (mem_sum32(g_hib_runs, (uint64_t)h->run_count * sizeof(hib_run_t)) != h->index_sum) return 0;
+
+  uint64_t buf_first = h->buffer / HIB_FRAME_SIZE;
+  uint64_t buf_end = buf_first + HIB_BUFFER_FRAMES;
+  uint64_t ram_frames = h->ram_top / HIB_FRAME_SIZE;
+  uint64_t frames = 0;
+  for (uint32_t r = 0; r < h->run_count; r++) {
+    const hib_run_t* run = &g_hib_runs[r];
+    if (run->count == 0 || run->frame < HIB_LOW_FRAMES || run->frame >= ram_frames) return 0;
+    if (run->count > ram_frames - run->frame) return 0;
+    if (run->frame < buf_end && run->frame + run->count > buf_first) return 0;
+    frames += run->count;
+  }
+  return frames == h->frames;
+}
+
+// keeps one read going: into buf's free tail, the consumed front dropped first
+// when the tail is short. reads in place when there is no bus master
+static uint8_t hib_stream_fill(hib_stream_t* s) {
+  if (s->pending || s->left == 0) return 1;
+
+  if (HIB_BUFFER_BYTES - s->have < HIB_READ_SECTORS * 512) {
+    uint64_t skip = s->pos & ~511ULL;    // whole sectors, so reads stay aligned
+    mem_copy(s->buf, s->buf + skip, s->have - skip);
+    s->have -= skip;
+    s->pos -= skip;
+  }
+
+  uint64_t n = (HIB_BUFFER_BYTES - s->have) / 512;
+  if (n > HIB_READ_SECTORS) n = HIB_READ_SECTORS;
+  if (n > s->left) n = s->left;
+  if (n == 0) return 0;
+
+  uint8_t* dst = s->buf + s->have;
+  if (ata_disk_read_48_dma_begin(s->lba, dst, (uint32_t)n)) {
+    s->pending = (uint32_t)n;
+  } else {
+    if (!ata_disk_read_48_multiple(s->lba, dst, (uint32_t)n)) return 0;
+    s->have += n * 512;
+  }
+  s->lba += n;
+  s->left -= n;
+  return 1;
+}
+
+// the next chunk, once it is whole in buf. NULL if the stream is damaged or short
+static const hib_chunk_t* hib_stream_chunk(hib_stream_t* s, uint32_t bytes) {
+  for (;;) {
+    if (!hib_stream_fill(s)) return NULL;
+
+    uint64_t avail = s->have - s->pos;
+    if (avail >= sizeof(hib_chunk_t)) {
+      const hib_chunk_t* c = (const hib_chunk_t*)(s->buf + s->pos);
+      if (c->size > bytes) return NULL;
+      if (avail >= sizeof(hib_chunk_t) + c->size) return c;
+    }
+
+    if (!s->pending || !ata_dma_wait()) return NULL;
+    s->have += (uint64_t)s->pending * 512;
+    s->pending = 0;
+  }
+}
+
+static uint8_t hib_chunk_restore(const hib_chunk_t* c, uint8_t* dst, uint32_t bytes) {
+  const uint8_t* payload = (const uint8_t*)(c + 1);
+  if (c->size == 0) {
+    mem_zero(dst, bytes);
+  } else if (c->size == bytes) {
+    mem_copy(dst, payload, bytes);
+  } else if (lz4_block_decode(payload, c->size, dst, bytes) != bytes) {
+    return 0;
+  }
+  return mem_sum32(dst, bytes) == c->sum;
+}
+
+static uint8_t hib_stream_run(hib_stream_t* s, uint32_t run_count) {
+  for (uint32_t r = 0; r < run_count; r++) {
+    const hib_run_t* run = &g_hib_runs[r];
+    for (uint64_t off = 0; off < run->count; off += HIB_CHUNK_FRAMES) {
+      uint64_t frames = run->count - off < HIB_CHUNK_FRAMES ? run->count - off : HIB_CHUNK_FRAMES;
+      uint32_t bytes = (uint32_t)(frames * HIB_FRAME_SIZE);
+      uint8_t* dst = (uint8_t*)(uintptr_t)((run->frame + off) * HIB_FRAME_SIZE);
+
+      const hib_chunk_t* c = hib_stream_chunk(s, bytes);
+      if (!c || !hib_chunk_restore(c, dst, bytes)) return 0;
+      s->pos += sizeof(hib_chunk_t) + c->size;
+    }
+  }
+  return 1;
+}
+
+static void hib_report(const hib_header_t* h, uint64_t tsc_hz, uint64_t cycles) {
+  if (tsc_hz == 0) return;
+
+  serial_write("loader: resumed ");
+  serial_write_dec(h->frames * HIB_FRAME_SIZE / 1024);
+  serial_write(" KiB from ");
+  serial_write_dec(h->data_bytes / 1024);
+  serial_write(" KiB in ");
+  serial_write_dec(cycles * 1000000 / tsc_hz);
+  serial_write(" us\n");
+}
+
+void hib_resume(const manifest_entry_t* area, boot_info_t* bi) {
+  if (area->sectors == 0 || !ata_disk_read_48_poll(area->lba, g_hib_sector, 1)) return;
+
+  hib_header_t h = *(const hib_header_t*)g_hib_sector;
+  if (!hib_header_check(&h, area, bi)) return;
+
+  // wiped before anything is restored: a bad image boots cold once, not every time
+  mem_zero(g_hib_sector, sizeof(g_hib_sector));
+  if (!ata_disk_write_48_poll(area->lba, g_hib_sector, 1)) return;
+
+  uint64_t start = rdtsc();
+  hib_identity_map(h.ram_top);
+
+  uint8_t ok = hib_index_read(&h, area);
+  if (ok) {
+    hib_stream_t s;
+    s.buf = (uint8_t*)(uintptr_t)h.buffer;
+    s.have = 0;
+    s.pos = 0;
+    s.lba = area->lba + 1 + h.index_sectors;
+    s.left = (h.data_bytes + 511) / 512;
+    s.pending = 0;
+    ok = hib_stream_run(&s, h.run_count);
+    if (s.pending && !ata_dma_wait()) ok = 0;
+  }
+  if (!ok) {
+    serial_write("loader: hibernation image damaged, booting cold\n");
+    return;
+  }
+
+  boot_stamp(bi, BOOT_STAMP_RESUME);
+  hib_report(&h, bi->tsc_hz, rdtsc() - start);
+  ((void (*)(uint64_t))(uintptr_t)h.resume_entry)(h.context);
+}
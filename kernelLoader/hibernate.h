@@ -0,0 +1,54 @@
+#pragma once
+#include "common.h"
+#include "manifest.h"
+
+// hibernation image, written by kernel/hibernate.c (same layout there)
+#define HIB_MAGIC           0x52424948u   // "HIBR"
+#define HIB_VERSION         1
+#define HIB_RUNS_MAX        1024
+#define HIB_CHUNK_FRAMES    16            // frames per chunk (64 KiB)
+#define HIB_BUFFER_FRAMES   256           // 1 MiB the image leaves free: our read buffer
+#define HIB_LOW_FRAMES      256           // below 1 MiB is ours, never in an image
+
+#define HIB_FRAME_SIZE      4096
+#define HIB_RAM_LIMIT       (512ULL << 30)   // what one PDPT of 1 GiB pages maps
+
+typedef struct hib_header_t {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t rsvd;
+  uint32_t run_count;
+  uint32_t index_sectors;
+  uint32_t index_sum;
+  uint32_t boot2_sum;
+  uint32_t loader_sum;
+  uint32_t kernel_sum;
+  uint64_t frames;
+  uint64_t data_bytes;
+  uint64_t ram_top;
+  uint64_t buffer;
+  uint64_t resume_entry;
+  uint64_t context;
+  uint32_t header_sum;          // sum32 of everything above
+  uint32_t rsvd3;
+} __attribute__((packed)) hib_header_t;
+
+typedef struct hib_run_t {
+  uint64_t frame;
+  uint64_t count;
+} __attribute__((packed)) hib_run_t;
+
+// size 0: all zero. size == the frames' bytes: stored. otherwise one LZ4 block
+typedef struct hib_chunk_t {
+  uint32_t size;
+  uint32_t sum;
+} __attribute__((packed)) hib_chunk_t;
+
+// hibernation usage:
+// call with the manifest's hibernate area (id 5) after ata_init / ata_dma_init and
+// before the kernel is loaded. with a valid image taken by this same boot2, loader
+// and kernel it puts every saved frame back and jumps into the kernel, never
+// returning. it returns (the boot goes on cold) when there is no image, when it
+// does not match, or when restoring fails. the header is wiped before anything is
+// restored, so an image is resumed at most once
+void hib_resume(const manifest_entry_t* area, boot_info_t* bi);
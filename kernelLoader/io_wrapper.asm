@@ -32,6 +32,21 @@ inw:
   movzx eax, ax
   ret
 
+global outl
+outl:
+    ; RDI = port, RSI = val
+    mov dx, di
+    mov eax, esi
+    out dx, eax
+    ret
+
+global inl
+inl:
+    ; RDI = port, returns EAX
+    mov dx, di
+    in  eax, dx
+    ret
+
 global insw
 insw:
   ; RDI = port, RSI = dst, RDX = count_words
@@ -1,24 +1,99 @@
 #include "common.h"
 #include "idt.h"
 #include "ata_driver.h"
+#include "elf.h"
+#include "hibernate.h"
+#include "manifest.h"
+#include "mem.h"
+#include "pit_calibrate.h"
+#include "serial.h"
 extern char __bss_start[];
 extern char __bss_end[];
+extern boot_info_t* bootinfo_ptr;
+
+#define ATA_INIT_ATTEMPTS 3
+// TSC calibration window: 2ms, enough for a throughput figure and cheap at boot
+#define TSC_CALIBRATE_COUNT (PIT_HZ / 500)
+
+// decompressor throughput and time spent on the kernel image, on COM1
+static void kernel_load_report(uint64_t tsc_hz, uint64_t cycles) {
+    if (tsc_hz == 0) return;
+
+    serial_write("loader: kernel ");
+    serial_write_dec(g_elf_stats.compressed / 1024);
+    serial_write(" KiB -> ");
+    serial_write_dec(g_elf_stats.original / 1024);
+    serial_write(" KiB in ");
+    serial_write_dec(cycles * 1000000 / tsc_hz);
+    serial_write(" us, lz4 ");
+    if (g_elf_stats.decode_cycles) serial_write_dec(g_elf_stats.original * tsc_hz / g_elf_stats.decode_cycles / 1000000);
+    serial_write(" MB/s, disk wait ");
+    serial_write_dec(g_elf_stats.wait_cycles * 1000000 / tsc_hz);
+    serial_write(" us\n");
+}
+
+// reads the initrd to its manifest load address (above the kernel's segments) and
+// hands it to the kernel in boot_info. a missing or damaged one is left out, not fatal
+static void initrd_load(const manifest_entry_t* e) {
+    uint64_t base = e->load_addr;
+    uint64_t end = base + (uint64_t)e->sectors * 512;
+    if (e->sectors == 0 || base < ELF_LOAD_LIMIT || end > MANIFEST_LOAD_LIMIT) return;
+
+    void* dst = (void*)(uintptr_t)base;
+    if (!ata_disk_read_48_dma(e->lba, dst, e->sectors) &&
+        !ata_disk_read_48_multiple(e->lba, dst, e->sectors)) return;
+
+    if (mem_sum32(dst, (uint64_t)e->sectors * 512) != e->checksum) {
+        serial_write("loader: initrd checksum mismatch, skipped\n");
+        return;
+    }
+
+    bootinfo_ptr->initrd_phys = base;
+    bootinfo_ptr->initrd_size = e->bytes;
+    boot_stamp(bootinfo_ptr, BOOT_STAMP_INITRD_READ);
+}
+
+// returns the kernel entry point, entry.asm jumps there
+uint64_t kmain(void) {
+    boot_stamp(bootinfo_ptr, BOOT_STAMP_LOADER);
 
-void kmain(void) {
     // zero bss
     for (char *p = __bss_start; p < __bss_end; p++)
         *p = 0;
     
     idt_init();
+    serial_init();
+    // the loader runs with interrupts off
+    uint64_t tsc_hz = pit_tsc_calibrate(TSC_CALIBRATE_COUNT);
+    bootinfo_ptr->tsc_hz = tsc_hz;
 
-    for (uint8_t* p = (uint8_t*)0x00400000; p < (uint8_t*)0x00400000 + 256*512; p++) *p = 0xCC;
-    
-    while (!ata_init()) continue;
-    uint8_t success = ata_disk_write_48_poll(2048, (void*)0x00400000, 256);  
-      
-    while (!success) {
+    // each attempt gives up once BSY outlasts its timeout
+    uint32_t attempts = 0;
+    while (!ata_init()) {
+        if (++attempts < ATA_INIT_ATTEMPTS) continue;
+        serial_write("loader: no LBA48 ATA boot disk on the primary master\n");
+        for (;;) __asm__ __volatile__("hlt");
+    }
+    ata_dma_init();   // without a bus master the kernel is read with READ MULTIPLE
+
+    // a hibernated kernel is put back and resumed, this does not return then
+    const manifest_entry_t* hib = manifest_find(MANIFEST_ID_HIBERNATE);
+    if (hib) hib_resume(hib, bootinfo_ptr);
+
+    // where build.sh put the kernel image
+    const manifest_entry_t* kernel = manifest_find(MANIFEST_ID_KERNEL);
+
+    uint64_t start = rdtsc();
+    uint64_t entry = kernel ? elf_load(kernel->lba) : 0;
+    while (!entry) {
         __asm__ __volatile__("hlt");
     }
+    boot_stamp(bootinfo_ptr, BOOT_STAMP_KERNEL_READ);
+    if (g_elf_stats.original) kernel_load_report(tsc_hz, rdtsc() - start);
+
+    // the kernel is in place, the staging area above it is free again
+    const manifest_entry_t* initrd = manifest_find(MANIFEST_ID_INITRD);
+    if (initrd) initrd_load(initrd);
 
-    return;
+    return entry;
 }
@@ -0,0 +1,45 @@
+#pragma once
+#include "common.h"
+
+// boot manifest: written by build.sh at LBA 1, boot1 leaves it here
+#define MANIFEST_ADDR        0x7E00
+#define MANIFEST_MAGIC       0x4E414D42u   // "BMAN"
+#define MANIFEST_MAX_ENTRIES 15
+
+#define MANIFEST_ID_BOOT2    1
+#define MANIFEST_ID_LOADER   2
+#define MANIFEST_ID_KERNEL   3
+#define MANIFEST_ID_INITRD   4      // optional; load_addr is where we put it
+#define MANIFEST_ID_HIBERNATE 5     // reserved area for the hibernation image (no contents to check)
+
+// components we load must fit boot2's identity map
+#define MANIFEST_LOAD_LIMIT  0x01000000u
+
+typedef struct manifest_entry_t {
+  uint32_t id;
+  uint32_t load_addr;           // 0: loaded by a later stage (the kernel, by us)
+  uint64_t lba;
+  uint32_t sectors;
+  uint32_t bytes;
+  uint32_t checksum;            // 32-bit sum of the dwords over whole sectors
+  uint32_t flags;
+} __attribute__((packed)) manifest_entry_t;
+
+typedef struct manifest_t {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  uint32_t rsvd[2];
+  manifest_entry_t entries[MANIFEST_MAX_ENTRIES];
+} __attribute__((packed)) manifest_t;
+
+// NULL if there is no manifest or it has no such component
+static inline const manifest_entry_t* manifest_find(uint32_t id) {
+  const manifest_t* m = (const manifest_t*)MANIFEST_ADDR;
+  if (m->magic != MANIFEST_MAGIC) return NULL;
+
+  for (uint16_t i = 0; i < m->count && i < MANIFEST_MAX_ENTRIES; i++) {
+    if (m->entries[i].id == id) return &m->entries[i];
+  }
+  return NULL;
+}
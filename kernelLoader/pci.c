@@ -0,0 +1,80 @@
+#include "pci.h"
+#include "common.h"
+
+static inline uint32_t pci_config_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    return PCI_CONFIG_ENABLE |
+           ((uint32_t)bus << 16) |
+           ((uint32_t)(slot & 0x1F) << 11) |
+           ((uint32_t)(func & 0x07) << 8) |
+           (uint32_t)(offset & 0xFC);
+}
+
+uint32_t pci_config_read_32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(bus, slot, func, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+uint16_t pci_config_read_16(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    uint32_t v = pci_config_read_32(bus, slot, func, offset);
+    return (uint16_t)(v >> ((offset & 2) * 8));
+}
+
+uint8_t pci_config_read_8(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    uint32_t v = pci_config_read_32(bus, slot, func, offset);
+    return (uint8_t)(v >> ((offset & 3) * 8));
+}
+
+void pci_config_write_32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(bus, slot, func, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+void pci_config_write_16(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t value) {
+    // read-modify-write the dword, config space is only dword addressable here
+    uint32_t shift = (offset & 2) * 8;
+    uint32_t v = pci_config_read_32(bus, slot, func, offset);
+    v = (v & ~(0xFFFFu << shift)) | ((uint32_t)value << shift);
+    pci_config_write_32(bus, slot, func, offset, v);
+}
+
+static void pci_device_fill(uint8_t bus, uint8_t slot, uint8_t func, pci_device_t* out) {
+    out->bus = bus;
+    out->slot = slot;
+    out->func = func;
+    out->vendor_id = pci_config_read_16(bus, slot, func, PCI_REG_VENDOR_ID);
+    out->device_id = pci_config_read_16(bus, slot, func, PCI_REG_DEVICE_ID);
+    out->class_code = pci_config_read_8(bus, slot, func, PCI_REG_CLASS);
+    out->subclass = pci_config_read_8(bus, slot, func, PCI_REG_SUBCLASS);
+    out->prog_if = pci_config_read_8(bus, slot, func, PCI_REG_PROG_IF);
+    out->irq_line = pci_config_read_8(bus, slot, func, PCI_REG_IRQ_LINE);
+}
+
+uint8_t pci_device_find_by_class(uint8_t class_code, uint8_t subclass, uint8_t index, pci_device_t* out) {
+    for (uint32_t bus = 0; bus < PCI_MAX_BUS; bus++) {
+        for (uint8_t slot = 0; slot < PCI_MAX_SLOT; slot++) {
+            if (pci_config_read_16((uint8_t)bus, slot, 0, PCI_REG_VENDOR_ID) == PCI_VENDOR_NONE) continue;
+
+            uint8_t funcs = (pci_config_read_8((uint8_t)bus, slot, 0, PCI_REG_HEADER_TYPE) & PCI_HEADER_MULTIFN) ? PCI_MAX_FUNC : 1;
+            for (uint8_t func = 0; func < funcs; func++) {
+                if (pci_config_read_16((uint8_t)bus, slot, func, PCI_REG_VENDOR_ID) == PCI_VENDOR_NONE) continue;
+                if (pci_config_read_8((uint8_t)bus, slot, func, PCI_REG_CLASS) != class_code) continue;
+                if (pci_config_read_8((uint8_t)bus, slot, func, PCI_REG_SUBCLASS) != subclass) continue;
+                if (index--) continue;
+
+                pci_device_fill((uint8_t)bus, slot, func, out);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+uint32_t pci_bar_get(const pci_device_t* dev, uint8_t bar) {
+    return pci_config_read_32(dev->bus, dev->slot, dev->func, (uint8_t)(PCI_REG_BAR0 + bar * 4));
+}
+
+void pci_bus_master_enable(const pci_device_t* dev) {
+    uint16_t cmd = pci_config_read_16(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND);
+    cmd |= PCI_CMD_IO_SPACE | PCI_CMD_MEM_SPACE | PCI_CMD_BUS_MASTER;
+    pci_config_write_16(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND, cmd);
+}
@@ -0,0 +1,26 @@
+#include "elf64.h"
+#include "common.h"
+
+uint8_t elf_header_is_valid(const elf64_ehdr_t* eh, uint64_t size) {
+  if (size < sizeof(elf64_ehdr_t)) return 0;
+  if (eh->magic != ELF_MAGIC || eh->class != ELF_CLASS_64 || eh->data != ELF_DATA_LSB) return 0;
+  if (eh->type != ELF_TYPE_EXEC || eh->machine != ELF_MACHINE_X86_64) return 0;
+  if (eh->phentsize != sizeof(elf64_phdr_t) || eh->phnum == 0) return 0;
+  return eh->phoff + (uint64_t)eh->phnum * sizeof(elf64_phdr_t) <= size;
+}
+
+uint32_t elf_cksum_update(uint32_t crc, const uint8_t* p, uint64_t bytes) {
+  while (bytes--) {
+    crc ^= (uint32_t)*p++ << 24;
+    for (int i = 0; i < 8; i++) crc = (crc & 0x80000000u) ? (crc << 1) ^ ELF_CKSUM_POLY : crc << 1;
+  }
+  return crc;
+}
+
+uint32_t elf_cksum_final(uint32_t crc, uint64_t length) {
+  for (; length; length >>= 8) {
+    uint8_t b = (uint8_t)length;
+    crc = elf_cksum_update(crc, &b, 1);
+  }
+  return ~crc;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "common.h"
+
+// just enough ELF64 to load a statically linked x86-64 executable. the
+// kernelLoader loads the kernel with it at boot, kexec the kernel's successor
+#define ELF_MAGIC         0x464C457Fu   // "\x7FELF", little endian
+#define ELF_CLASS_64      2
+#define ELF_DATA_LSB      1
+#define ELF_TYPE_EXEC     2
+#define ELF_MACHINE_X86_64 0x3E
+
+#define ELF_PT_LOAD       1
+
+// compressed image: this header in the image's first sector, the LZ4 legacy
+// stream (lz4 -l) from the next sector on. written by build.sh
+#define ELF_LZ4_MAGIC     0x345A4C4Bu   // "KLZ4"
+#define ELF_CKSUM_POLY    0x04C11DB7u
+
+typedef struct elf_lz4_header_t {
+  uint32_t magic;
+  uint32_t original_size;       // the ELF, bytes
+  uint32_t compressed_size;     // the LZ4 stream, bytes
+  uint32_t checksum;            // POSIX cksum of the ELF (what `cksum` prints first)
+} __attribute__((packed)) elf_lz4_header_t;
+
+typedef struct elf64_ehdr_t {
+  uint32_t magic;
+  uint8_t  class;
+  uint8_t  data;
+  uint8_t  version;
+  uint8_t  osabi;
+  uint8_t  pad[8];
+  uint16_t type;
+  uint16_t machine;
+  uint32_t version2;
+  uint64_t entry;
+  uint64_t phoff;
+  uint64_t shoff;
+  uint32_t flags;
+  uint16_t ehsize;
+  uint16_t phentsize;
+  uint16_t phnum;
+  uint16_t shentsize;
+  uint16_t shnum;
+  uint16_t shstrndx;
+} __attribute__((packed)) elf64_ehdr_t;
+
+typedef struct elf64_phdr_t {
+  uint32_t type;
+  uint32_t flags;
+  uint64_t offset;
+  uint64_t vaddr;
+  uint64_t paddr;
+  uint64_t filesz;
+  uint64_t memsz;
+  uint64_t align;
+} __attribute__((packed)) elf64_phdr_t;
+
+// an x86-64 executable whose headers (and program headers) are within the
+// first size bytes of the image
+uint8_t elf_header_is_valid(const elf64_ehdr_t* eh, uint64_t size);
+
+// POSIX cksum: CRC-32 (ELF_CKSUM_POLY, MSB first) over the data, then over its
+// length. start at 0, feed the data in any pieces, finish with the total length
+uint32_t elf_cksum_update(uint32_t crc, const uint8_t* p, uint64_t bytes);
+uint32_t elf_cksum_final(uint32_t crc, uint64_t length);
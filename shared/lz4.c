@@ -0,0 +1,111 @@
+#include "lz4.h"
+#include "common.h"
+
+// a length nibble of 15 continues in the following bytes (255 = keep going).
+// returns 0 if the bytes run past avail
+static uint8_t lz4_length_read(const uint8_t* in, uint64_t* pos, uint64_t avail, uint64_t* len) {
+  if (*len != 15) return 1;
+  for (;;) {
+    if (*pos >= avail) return 0;
+    uint8_t b = in[(*pos)++];
+    *len += b;
+    if (b != 255) return 1;
+  }
+}
+
+// one sequence: literals, then (unless the block ends there) a match
+static lz4_result_t lz4_sequence_run(lz4_stream_t* s, uint64_t avail) {
+  const uint8_t* in = s->in;
+  uint64_t pos = s->in_pos;
+  uint64_t end = avail < s->block_end ? avail : s->block_end;
+
+  if (pos >= end) return LZ4_MORE;
+  uint8_t token = in[pos++];
+
+  uint64_t lit = token >> 4;
+  if (!lz4_length_read(in, &pos, end, &lit)) return s->block_end <= avail ? LZ4_ERROR : LZ4_MORE;
+  if (pos + lit > s->block_end) return LZ4_ERROR;
+  if (pos + lit > avail) return LZ4_MORE;
+
+  uint8_t last = pos + lit == s->block_end;
+  uint64_t offset = 0;
+  uint64_t match = 0;
+  uint64_t mpos = pos + lit;
+  if (!last) {
+    if (mpos + 2 > end) return s->block_end <= avail ? LZ4_ERROR : LZ4_MORE;
+    offset = (uint64_t)in[mpos] | ((uint64_t)in[mpos + 1] << 8);
+    mpos += 2;
+    match = token & 15;
+    if (!lz4_length_read(in, &mpos, end, &match)) return s->block_end <= avail ? LZ4_ERROR : LZ4_MORE;
+    match += LZ4_MIN_MATCH;
+    if (offset == 0 || offset > s->out_pos + lit - s->block_out) return LZ4_ERROR;
+  }
+  if (s->out_pos + lit + match > s->out_cap) return LZ4_ERROR;
+
+  // the whole sequence is here: commit it
+  uint8_t* op = s->out + s->out_pos;
+  for (uint64_t i = 0; i < lit; i++) op[i] = in[pos + i];
+  op += lit;
+
+  // byte by byte: a match may overlap the bytes it produces (offset < length)
+  const uint8_t* ref = op - offset;
+  for (uint64_t i = 0; i < match; i++) op[i] = ref[i];
+
+  s->out_pos += lit + match;
+  s->in_pos = last ? s->block_end : mpos;
+  if (last) s->block_end = 0;
+  return LZ4_DONE;
+}
+
+void lz4_stream_init(lz4_stream_t* s, const uint8_t* in, uint64_t in_len, uint8_t* out, uint64_t out_cap) {
+  s->in = in;
+  s->in_len = in_len;
+  s->in_pos = 0;
+  s->out = out;
+  s->out_cap = out_cap;
+  s->out_pos = 0;
+  s->block_end = 0;
+  s->block_out = 0;
+  s->started = 0;
+}
+
+lz4_result_t lz4_stream_run(lz4_stream_t* s, uint64_t avail) {
+  if (avail > s->in_len) avail = s->in_len;
+
+  for (;;) {
+    if (!s->started) {
+      if (s->in_pos + 4 > avail) return LZ4_MORE;
+      if (lz4_le32(s->in) != LZ4_LEGACY_MAGIC) return LZ4_ERROR;
+      s->in_pos = 4;
+      s->started = 1;
+    }
+
+    if (s->block_end == 0) {
+      if (s->in_pos == s->in_len) return LZ4_DONE;
+      if (s->in_pos + 4 > avail) return LZ4_MORE;
+
+      uint32_t size = lz4_le32(s->in + s->in_pos);
+      // another legacy frame appended to this one
+      if (size == LZ4_LEGACY_MAGIC) {
+        s->in_pos += 4;
+        continue;
+      }
+      if (size == 0 || s->in_pos + 4 + size > s->in_len) return LZ4_ERROR;
+      s->in_pos += 4;
+      s->block_end = s->in_pos + size;
+      s->block_out = s->out_pos;
+    }
+
+    lz4_result_t r = lz4_sequence_run(s, avail);
+    if (r != LZ4_DONE) return r;
+  }
+}
+
+uint64_t lz4_block_decode(const uint8_t* in, uint64_t in_len, uint8_t* out, uint64_t out_cap) {
+  lz4_stream_t s;
+  lz4_stream_init(&s, in, in_len, out, out_cap);
+  s.started = 1;
+  s.block_end = in_len;
+  if (in_len == 0 || lz4_stream_run(&s, in_len) != LZ4_DONE) return 0;
+  return s.out_pos;
+}
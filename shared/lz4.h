@@ -0,0 +1,46 @@
+#pragma once
+#include "common.h"
+
+// the decoder the kernelLoader reads the kernel and the hibernation image with,
+// and kexec the next kernel. the kernel's compressor is in kernel/lz4_compress.h
+
+// LZ4 legacy stream (lz4 -l): magic, then blocks of [u32 compressed size][LZ4 block]
+#define LZ4_LEGACY_MAGIC   0x184C2102u
+#define LZ4_MIN_MATCH      4
+#define LZ4_LAST_LITERALS  5         // a block always ends in at least this many literals
+
+typedef enum lz4_result_t {
+  LZ4_MORE = 0,                      // decoded all it could, wants more input
+  LZ4_DONE,                          // the stream ended exactly at in_len
+  LZ4_ERROR
+} lz4_result_t;
+
+// decoder over one contiguous input buffer that fills up from the front (e.g. a
+// disk read in progress). it only ever consumes whole sequences, so it can stop
+// wherever the data runs out and pick up from there on the next call
+typedef struct lz4_stream_t {
+  const uint8_t* in;
+  uint64_t in_len;                   // whole stream
+  uint64_t in_pos;
+
+  uint8_t* out;
+  uint64_t out_cap;
+  uint64_t out_pos;
+
+  uint64_t block_end;                // in_pos where the current block ends, 0 = between blocks
+  uint64_t block_out;                // out_pos at the start of the block (matches stay inside it)
+  uint8_t started;                   // magic seen
+} lz4_stream_t;
+
+static inline uint32_t lz4_le32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void lz4_stream_init(lz4_stream_t* s, const uint8_t* in, uint64_t in_len, uint8_t* out, uint64_t out_cap);
+
+// decodes from in[in_pos] up to in[avail] (avail <= in_len)
+lz4_result_t lz4_stream_run(lz4_stream_t* s, uint64_t avail);
+
+// one LZ4 block without stream framing (hibernation chunks), all input at hand.
+// returns the decoded size, 0 if the block is damaged or does not fit out_cap
+uint64_t lz4_block_decode(const uint8_t* in, uint64_t in_len, uint8_t* out, uint64_t out_cap);
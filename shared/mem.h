@@ -0,0 +1,26 @@
+#pragma once
+#include "common.h"
+
+// byte loops for code built into both the kernelLoader and the kernel (no libc,
+// -fno-builtin). common.h is the including tree's own
+
+// forward copy: dst may overlap src as long as it starts below it
+static inline void mem_copy(void* dst, const void* src, uint64_t bytes) {
+  uint8_t* d = (uint8_t*)dst;
+  const uint8_t* s = (const uint8_t*)src;
+  while (bytes--) *d++ = *s++;
+}
+
+static inline void mem_zero(void* dst, uint64_t bytes) {
+  uint8_t* d = (uint8_t*)dst;
+  while (bytes--) *d++ = 0;
+}
+
+// 32-bit sum of the dwords in bytes (a multiple of 4): the manifest's component
+// checksums and the hibernation image's
+static inline uint32_t mem_sum32(const void* p, uint64_t bytes) {
+  const uint32_t* d = (const uint32_t*)p;
+  uint32_t sum = 0;
+  for (uint64_t i = 0; i < bytes / 4; i++) sum += d[i];
+  return sum;
+}
@@ -0,0 +1,23 @@
+#include "pit_calibrate.h"
+#include "common.h"
+
+// channel 2 counts down once with the speaker off; OUT goes high at zero
+uint64_t pit_tsc_calibrate(uint16_t count) {
+    uint8_t gate = inb(PIT_GATE_PORT);
+    outb(PIT_GATE_PORT, (uint8_t)(gate & ~(PIT_GATE_SPEAKER | PIT_GATE_CH2)));
+
+    outb(PIT_CMD, PIT_CMD_CH2_ONESHOT);
+    outb(PIT_CH2_DATA, (uint8_t)count);
+    outb(PIT_CH2_DATA, (uint8_t)(count >> 8));
+
+    // rising gate starts the count
+    outb(PIT_GATE_PORT, (uint8_t)((gate & ~PIT_GATE_SPEAKER) | PIT_GATE_CH2));
+    uint64_t start = rdtsc();
+    uint32_t timeout = 100000000;
+    while (!(inb(PIT_GATE_PORT) & PIT_OUT_CH2) && --timeout) {}
+    uint64_t end = rdtsc();
+
+    outb(PIT_GATE_PORT, gate);
+    if (!timeout) return 0;
+    return (end - start) * PIT_HZ / count;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "common.h"
+
+// 8254 PIT channel 2 as a time base for the TSC, in the kernelLoader and the
+// kernel (which drives channel 0 itself, see kernel/pit.h)
+#define PIT_CH2_DATA   0x42
+#define PIT_CMD        0x43
+#define PIT_GATE_PORT  0x61   // bit 0: channel 2 gate, bit 1: speaker, bit 5: channel 2 OUT
+
+#define PIT_HZ         1193182ULL
+
+// channel 2, lobyte/hibyte access, mode 0 (interrupt on terminal count), binary
+#define PIT_CMD_CH2_ONESHOT 0xB0
+
+#define PIT_GATE_CH2     0x01
+#define PIT_GATE_SPEAKER 0x02
+#define PIT_OUT_CH2      0x20
+
+// TSC ticks per second, counting count PIT ticks on channel 2 (speaker off,
+// channel 0 and IRQs untouched). 0 if channel 2's OUT never rises. call with
+// interrupts masked: an IRQ inside the window inflates the result
+uint64_t pit_tsc_calibrate(uint16_t count);
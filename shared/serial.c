@@ -0,0 +1,36 @@
+#include "serial.h"
+#include "common.h"
+
+void serial_init(void) {
+    outb(SERIAL_COM1 + SERIAL_REG_IER, 0);
+    outb(SERIAL_COM1 + SERIAL_REG_LCR, SERIAL_LCR_DLAB);
+    outb(SERIAL_COM1 + SERIAL_REG_DIV_LO, 1);   // 115200 / 1
+    outb(SERIAL_COM1 + SERIAL_REG_DIV_HI, 0);
+    outb(SERIAL_COM1 + SERIAL_REG_LCR, SERIAL_LCR_8N1);
+    outb(SERIAL_COM1 + SERIAL_REG_FCR, SERIAL_FCR_ENABLE);
+    outb(SERIAL_COM1 + SERIAL_REG_MCR, SERIAL_MCR_DTR_RTS);
+}
+
+static void serial_put(char c) {
+    uint32_t timeout = 100000;
+    while (!(inb(SERIAL_COM1 + SERIAL_REG_LSR) & SERIAL_LSR_THRE) && --timeout) {}
+    outb(SERIAL_COM1 + SERIAL_REG_DATA, (uint8_t)c);
+}
+
+void serial_write(const char* s) {
+    for (; *s; s++) {
+        if (*s == '\n') serial_put('\r');
+        serial_put(*s);
+    }
+}
+
+void serial_write_dec(uint64_t value) {
+    char buf[21];
+    uint32_t n = sizeof(buf) - 1;
+    buf[n] = 0;
+    do {
+        buf[--n] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    serial_write(&buf[n]);
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "common.h"
+
+// COM1, polled, for the kernelLoader and the kernel. build.sh runs QEMU with
+// -serial mon:stdio
+#define SERIAL_COM1        0x3F8
+#define SERIAL_REG_DATA    0     // DLAB=0
+#define SERIAL_REG_IER     1
+#define SERIAL_REG_DIV_LO  0     // DLAB=1
+#define SERIAL_REG_DIV_HI  1
+#define SERIAL_REG_FCR     2
+#define SERIAL_REG_LCR     3
+#define SERIAL_REG_MCR     4
+#define SERIAL_REG_LSR     5
+
+#define SERIAL_LCR_8N1     0x03
+#define SERIAL_LCR_DLAB    0x80
+#define SERIAL_FCR_ENABLE  0xC7  // enable + clear FIFOs, 14 byte threshold
+#define SERIAL_MCR_DTR_RTS 0x03
+#define SERIAL_LSR_THRE    0x20  // transmit holding register empty
+
+// 115200 8N1, no interrupts
+void serial_init(void);
+
+void serial_write(const char* s);
+void serial_write_dec(uint64_t value);